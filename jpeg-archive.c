@@ -0,0 +1,810 @@
+/*
+    Recompress every JPEG in a directory tree into a mirror of the tree,
+    using all CPU cores. Files are read with mapFile and recompressed in
+    process by jpegarchive_recompress_batch, whose workers steal files from
+    each other, so a tree of small images is not dominated by process
+    startup. Files that can't be made smaller are copied as they are.
+
+    RAW files (CR2, NEF, DNG) are developed with dcraw into a JPEG of the
+    same name, and their metadata is copied over with exiftool when it is
+    installed.
+*/
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE  // lstat() and clock_gettime() under -std=c99
+#endif
+
+#include <dirent.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <io.h>
+#define popen _popen
+#define pclose _pclose
+#define POPEN_READ "rb"
+#define DEVNULL "NUL"
+#else
+#define POPEN_READ "r"
+#define DEVNULL "/dev/null"
+#endif
+
+#include "jpegarchive.h"
+#include "src/util.h"
+
+// Files mapped and handed to the pool at once. Mappings are cheap, but
+// the number a process may hold is limited, so large trees are processed
+// in chunks.
+#define BATCH_FILES 1024
+
+// Recompression settings
+jpegarchive_quality_t preset = JPEGARCHIVE_QUALITY_HIGH;
+float target = 0;
+int jpegMin = 40;
+int jpegMax = 95;
+int attempts = 6;
+jpegarchive_search_t searchMethod = JPEGARCHIVE_SEARCH_BISECT;
+jpegarchive_subsample_t subsample = JPEGARCHIVE_SUBSAMPLE_420;
+
+// Whether to copy files that cannot be compressed
+int copyFiles = 1;
+
+// Quiet mode (less output)
+int quiet = 0;
+
+// Number of workers (0 = one per CPU)
+int threads = 0;
+
+// Result cache directory, and whether it keeps the outputs too
+char *cachePath = NULL;
+int cacheOutputs = 0;
+
+// Whether exiftool can copy the metadata of RAW files
+int haveExiftool = 0;
+
+// A JPEG or RAW file found in the input tree and where its result goes
+struct job {
+    char *input;
+    char *output;
+    int raw;  // developed with dcraw before recompression
+};
+
+// Everything the workers share while the tree is processed
+struct archive {
+    struct job *jobs;
+    int count;
+    int capacity;
+
+    // Current chunk
+    struct job *chunk;
+    struct inputFile *files;
+    int chunkCount;
+    int next;  // next file of the chunk to develop if it is RAW
+
+    pthread_mutex_t mutex;  // guards the counters and the log
+    int done;
+    int copied;
+    int failed;
+    long long bytesIn;
+    long long bytesOut;
+};
+
+static jpegarchive_quality_t parseQuality(const char *s) {
+    if (!strcmp("low", s))
+        return JPEGARCHIVE_QUALITY_LOW;
+    if (!strcmp("medium", s))
+        return JPEGARCHIVE_QUALITY_MEDIUM;
+    if (!strcmp("high", s))
+        return JPEGARCHIVE_QUALITY_HIGH;
+    if (!strcmp("veryhigh", s))
+        return JPEGARCHIVE_QUALITY_VERYHIGH;
+
+    error("unknown quality preset: %s", s);
+    return JPEGARCHIVE_QUALITY_HIGH;
+}
+
+static jpegarchive_search_t parseSearch(const char *s) {
+    if (!strcmp("bisect", s))
+        return JPEGARCHIVE_SEARCH_BISECT;
+    if (!strcmp("interpolate", s))
+        return JPEGARCHIVE_SEARCH_INTERPOLATE;
+
+    error("unknown search method: %s", s);
+    return JPEGARCHIVE_SEARCH_BISECT;
+}
+
+static jpegarchive_subsample_t parseSubsampling(const char *s) {
+    if (!strcmp("default", s))
+        return JPEGARCHIVE_SUBSAMPLE_420;
+    if (!strcmp("disable", s))
+        return JPEGARCHIVE_SUBSAMPLE_444;
+    if (!strcmp("keep", s))
+        return JPEGARCHIVE_SUBSAMPLE_KEEP;
+
+    error("unknown sampling method: %s", s);
+    return JPEGARCHIVE_SUBSAMPLE_420;
+}
+
+static const char *errorString(jpegarchive_error_code_t code) {
+    switch (code) {
+        case JPEGARCHIVE_INVALID_INPUT:
+            return "invalid input";
+        case JPEGARCHIVE_NOT_JPEG:
+            return "not a JPEG file";
+        case JPEGARCHIVE_UNSUPPORTED:
+            return "unsupported JPEG format";
+        case JPEGARCHIVE_NOT_SUITABLE:
+            return "not suitable for recompression";
+        case JPEGARCHIVE_MEMORY_ERROR:
+            return "memory allocation error";
+        case JPEGARCHIVE_IO_ERROR:
+            return "read or write error";
+        default:
+            return "unknown error";
+    }
+}
+
+// Logs an informational message, taking quiet mode into account
+void info(const char *format, ...) {
+    va_list argptr;
+
+    if (!quiet) {
+        va_start(argptr, format);
+        vfprintf(stderr, format, argptr);
+        va_end(argptr);
+    }
+}
+
+void usage(void) {
+    printf("usage: %s [options] [input-dir [output-dir]]\n\n", progname);
+    printf("Recompresses the JPEG files below input-dir [.] into the same layout\n");
+    printf("below output-dir [Comp]. RAW files (CR2, NEF, DNG) are developed with\n");
+    printf("dcraw and saved as JPEG, with their metadata copied by exiftool.\n\n");
+    printf("options:\n\n");
+    printf("  -V, --version                output program version\n");
+    printf("  -h, --help                   output program help\n");
+    printf("  -t, --target [arg]           set target quality [0.9999]\n");
+    printf("  -q, --quality [arg]          set a quality preset: low, medium, high, veryhigh [high]\n");
+    printf("  -n, --min [arg]              minimum JPEG quality [40]\n");
+    printf("  -x, --max [arg]              maximum JPEG quality [95]\n");
+    printf("  -l, --loops [arg]            set the maximum number of runs to attempt [6]\n");
+    printf("  -e, --search [arg]           set quality search to one of 'bisect', 'interpolate' [bisect]\n");
+    printf("  -c, --no-copy                disable copying files that will not be compressed\n");
+    printf("  -S, --subsample [arg]        set subsampling method to one of 'default', 'disable', 'keep' [default]\n");
+    printf("  -j, --threads [arg]          recompress this many files at once [number of CPUs]\n");
+    printf("  -C, --cache [arg]            skip files seen before, using a result cache in this directory\n");
+    printf("  -O, --cache-outputs          keep the outputs in the cache too, so hits need no encode\n");
+    printf("  -Q, --quiet                  only print out errors\n");
+}
+
+static char *joinPath(const char *dir, const char *name) {
+    size_t length = strlen(dir);
+    char *path = malloc(length + strlen(name) + 2);
+
+    if (path) {
+        strcpy(path, dir);
+        if (length && dir[length - 1] != '/')
+            strcat(path, "/");
+        strcat(path, name);
+    }
+    return path;
+}
+
+static int makeDirectory(const char *path) {
+    struct stat info;
+    int ret;
+
+    if (stat(path, &info) == 0)
+        return S_ISDIR(info.st_mode) ? 0 : -1;
+
+#ifdef _WIN32
+    ret = mkdir(path);
+#else
+    ret = mkdir(path, 0777);
+#endif
+    if (ret != 0)
+        error("unable to create directory: %s", path);
+    return ret;
+}
+
+// Create a directory and any missing parents
+static int makeDirectories(const char *path) {
+    char *copy = malloc(strlen(path) + 1);
+    int ret = 0;
+
+    if (!copy)
+        return -1;
+    strcpy(copy, path);
+    for (char *p = copy + 1; *p && !ret; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            ret = makeDirectory(copy);
+            *p = '/';
+        }
+    }
+    if (!ret)
+        ret = makeDirectory(copy);
+    free(copy);
+    return ret;
+}
+
+// Copy the extension of 'name' in lower case, or an empty string if it
+// has none or a long one
+static void lowerExtension(const char *name, char lower[6]) {
+    const char *ext = strrchr(name, '.');
+    int i;
+
+    lower[0] = '\0';
+    if (!ext || strlen(ext) >= 6)
+        return;
+    for (i = 0; ext[i]; i++)
+        lower[i] = (ext[i] >= 'A' && ext[i] <= 'Z') ? ext[i] - 'A' + 'a' : ext[i];
+    lower[i] = '\0';
+}
+
+static int isJpegName(const char *name) {
+    char lower[6];
+
+    lowerExtension(name, lower);
+    return !strcmp(".jpg", lower) || !strcmp(".jpeg", lower);
+}
+
+static int isRawName(const char *name) {
+    char lower[6];
+
+    lowerExtension(name, lower);
+    return !strcmp(".cr2", lower) || !strcmp(".nef", lower) || !strcmp(".dng", lower);
+}
+
+// The output name of a RAW file: its name with the extension replaced
+static char *rawOutputName(const char *name) {
+    size_t length = strrchr(name, '.') - name;
+    char *output = malloc(length + sizeof ".jpg");
+
+    if (output) {
+        memcpy(output, name, length);
+        strcpy(output + length, ".jpg");
+    }
+    return output;
+}
+
+static int isLink(const char *path) {
+#ifdef _WIN32
+    return 0;
+#else
+    struct stat info;
+    return lstat(path, &info) == 0 && S_ISLNK(info.st_mode);
+#endif
+}
+
+static int addJob(struct archive *archive, char *input, char *output, int raw) {
+    if (archive->count == archive->capacity) {
+        int capacity = archive->capacity ? archive->capacity * 2 : 256;
+        struct job *jobs = realloc(archive->jobs, capacity * sizeof(*jobs));
+
+        if (!jobs)
+            return -1;
+        archive->jobs = jobs;
+        archive->capacity = capacity;
+    }
+
+    archive->jobs[archive->count].input = input;
+    archive->jobs[archive->count].output = output;
+    archive->jobs[archive->count].raw = raw;
+    archive->count++;
+    return 0;
+}
+
+// Collect the JPEG and RAW files below 'dir' and create their output
+// directories. The output tree itself is skipped when it lies inside the
+// input tree.
+static int walk(struct archive *archive, const char *dir, const char *outputDir, const char *outputRoot) {
+    DIR *handle = opendir(dir);
+    struct dirent *entry;
+    int created = 0;
+    int ret = 0;
+
+    if (!handle) {
+        error("unable to open directory: %s", dir);
+        return -1;
+    }
+
+    while (!ret && (entry = readdir(handle))) {
+        struct stat info;
+        char *input;
+        char *output;
+        int raw;
+
+        if (!strcmp(".", entry->d_name) || !strcmp("..", entry->d_name))
+            continue;
+
+        raw = isRawName(entry->d_name);
+        input = joinPath(dir, entry->d_name);
+        if (raw) {
+            char *name = rawOutputName(entry->d_name);
+
+            output = name ? joinPath(outputDir, name) : NULL;
+            free(name);
+        } else {
+            output = joinPath(outputDir, entry->d_name);
+        }
+        if (!input || !output) {
+            free(input);
+            free(output);
+            ret = -1;
+            break;
+        }
+
+        if (stat(input, &info) != 0) {
+            error("unable to read: %s", input);
+        } else if (S_ISDIR(info.st_mode)) {
+            // Symlinked directories are not followed, as they may form loops
+            if (!isLink(input) && !isSameFile(input, outputRoot))
+                ret = walk(archive, input, output, outputRoot);
+        } else if (S_ISREG(info.st_mode) && (raw || isJpegName(entry->d_name))) {
+            // Output directories are only created for trees with images
+            if (!created && makeDirectories(outputDir) != 0) {
+                ret = -1;
+            } else if (addJob(archive, input, output, raw) != 0) {
+                ret = -1;
+            } else {
+                created = 1;
+                continue;
+            }
+        }
+
+        free(input);
+        free(output);
+    }
+
+    closedir(handle);
+    return ret;
+}
+
+static int writeFile(const char *path, const unsigned char *data, long long size) {
+    FILE *file = fopen(path, "wb");
+    int ret;
+
+    if (!file)
+        return -1;
+    ret = (fwrite(data, 1, size, file) == (size_t) size) ? 0 : -1;
+    if (fclose(file) != 0)
+        ret = -1;
+    return ret;
+}
+
+// Quote a path for use in a shell command
+static char *shellQuote(const char *path) {
+    char *quoted = malloc(strlen(path) * 4 + 3);
+    char *q = quoted;
+
+    if (!quoted)
+        return NULL;
+#ifdef _WIN32
+    *q++ = '"';
+    strcpy(q, path);
+    q += strlen(path);
+    *q++ = '"';
+#else
+    *q++ = '\'';
+    for (const char *p = path; *p; p++) {
+        if (*p == '\'') {
+            memcpy(q, "'\\''", 4);
+            q += 4;
+        } else {
+            *q++ = *p;
+        }
+    }
+    *q++ = '\'';
+#endif
+    *q = '\0';
+    return quoted;
+}
+
+// Run a command and read all of its output into 'file'
+static int readCommand(const char *command, struct inputFile *file) {
+    FILE *pipe = popen(command, POPEN_READ);
+    unsigned char *data = NULL;
+    long size = 0;
+    long capacity = 0;
+    size_t read;
+
+    if (!pipe)
+        return -1;
+    do {
+        if (size == capacity) {
+            unsigned char *grown;
+
+            capacity = capacity ? capacity * 2 : 1 << 20;
+            grown = realloc(data, capacity);
+            if (!grown) {
+                free(data);
+                pclose(pipe);
+                return -1;
+            }
+            data = grown;
+        }
+        read = fread(data + size, 1, capacity - size, pipe);
+        size += read;
+    } while (read);
+
+    if (pclose(pipe) != 0 || !size) {
+        free(data);
+        return -1;
+    }
+    file->data = data;
+    file->size = size;
+    file->mapped = 0;
+    return 0;
+}
+
+// Develop a RAW file with dcraw into a lossless-quality JPEG, which is
+// then recompressed like any other input
+static int developRaw(const char *path, struct inputFile *file) {
+    char *quoted = shellQuote(path);
+    char *command = quoted ? malloc(strlen(quoted) + 32) : NULL;
+    struct inputFile ppm;
+    unsigned char *image = NULL;
+    unsigned char *jpeg = NULL;
+    unsigned long size = 0;
+    int width, height;
+
+    if (command) {
+        sprintf(command, "dcraw -w -q 3 -c %s", quoted);
+        if (readCommand(command, &ppm) == 0) {
+            if (decodePpm(ppm.data, ppm.size, &image, &width, &height))
+                size = encodeJpeg(&jpeg, image, width, height, JCS_RGB, 100, 0, 1, SUBSAMPLE_444);
+            free(image);
+            unmapFile(&ppm);
+        }
+    }
+    free(quoted);
+    free(command);
+
+    if (!size) {
+        free(jpeg);
+        return -1;
+    }
+    file->data = jpeg;
+    file->size = size;
+    file->mapped = 0;
+    return 0;
+}
+
+// Runs on the develop threads; failed files are left without data
+static void *developWorker(void *user) {
+    struct archive *archive = user;
+
+    for (;;) {
+        int i;
+
+        pthread_mutex_lock(&archive->mutex);
+        i = archive->next++;
+        pthread_mutex_unlock(&archive->mutex);
+
+        if (i >= archive->chunkCount)
+            break;
+        if (archive->chunk[i].raw)
+            developRaw(archive->chunk[i].input, &archive->files[i]);
+    }
+    return NULL;
+}
+
+// Develop the RAW files of the current chunk, as many at once as files
+// are recompressed
+static void developRaws(struct archive *archive) {
+    int workers = threads > 0 ? threads : jpegarchive_cpu_count();
+    pthread_t *ids = malloc(workers * sizeof(*ids));
+    int started = 0;
+
+    archive->next = 0;
+    while (ids && started < workers - 1 && pthread_create(&ids[started], NULL, developWorker, archive) == 0)
+        started++;
+
+    developWorker(archive);
+    for (int i = 0; i < started; i++)
+        pthread_join(ids[i], NULL);
+    free(ids);
+}
+
+// Copy the metadata of a RAW file onto its JPEG, as dcraw drops it
+static int copyRawMetadata(const char *raw, const char *jpeg) {
+    char *quotedRaw = shellQuote(raw);
+    char *quotedJpeg = shellQuote(jpeg);
+    char *command = NULL;
+    int ret = -1;
+
+    if (quotedRaw && quotedJpeg)
+        command = malloc(strlen(quotedRaw) + strlen(quotedJpeg) + 80);
+    if (command) {
+        sprintf(command, "exiftool -q -overwrite_original -TagsFromFile %s -all:all %s > " DEVNULL,
+                quotedRaw, quotedJpeg);
+        ret = system(command) == 0 ? 0 : -1;
+    }
+    free(quotedRaw);
+    free(quotedJpeg);
+    free(command);
+    return ret;
+}
+
+// Runs on the pool's workers, possibly several at once
+static void storeResult(int index, jpegarchive_recompress_output_t *output, void *user) {
+    struct archive *archive = user;
+    const struct job *job = &archive->chunk[index];
+    const struct inputFile *file = &archive->files[index];
+    const unsigned char *data = output->jpeg;
+    long long size = output->length;
+    int copy = 0;
+
+    if (output->error_code == JPEGARCHIVE_NOT_SUITABLE && copyFiles) {
+        data = file->data;
+        size = file->size;
+        copy = 1;
+    }
+
+    int written = (data && writeFile(job->output, data, size) == 0);
+
+    if (written && job->raw && haveExiftool && copyRawMetadata(job->input, job->output) != 0)
+        error("unable to copy metadata: %s", job->input);
+
+    pthread_mutex_lock(&archive->mutex);
+    archive->done++;
+    if (!data) {
+        archive->failed++;
+        error("%s: %s", job->input, errorString(output->error_code));
+    } else if (!written) {
+        archive->failed++;
+        error("unable to write file: %s", job->output);
+    } else {
+        archive->bytesIn += file->size;
+        archive->bytesOut += size;
+        if (copy) {
+            archive->copied++;
+            info("[%d/%d] %s: copied\n", archive->done, archive->count, job->input);
+        } else {
+            info("[%d/%d] %s: q=%d ssim=%f, %lld%% of original\n", archive->done, archive->count, job->input,
+                 output->quality, output->metric, size * 100 / file->size);
+        }
+    }
+    pthread_mutex_unlock(&archive->mutex);
+
+    jpegarchive_free_recompress_output(output);
+}
+
+static double seconds(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+int main (int argc, char **argv) {
+    const char *optstring = "Vht:q:n:x:l:e:cS:j:C:OQ";
+    static const struct option opts[] = {
+        { "version", no_argument, 0, 'V' },
+        { "help", no_argument, 0, 'h' },
+        { "target", required_argument, 0, 't' },
+        { "quality", required_argument, 0, 'q' },
+        { "min", required_argument, 0, 'n' },
+        { "max", required_argument, 0, 'x' },
+        { "loops", required_argument, 0, 'l' },
+        { "search", required_argument, 0, 'e' },
+        { "no-copy", no_argument, 0, 'c' },
+        { "subsample", required_argument, 0, 'S' },
+        { "threads", required_argument, 0, 'j' },
+        { "cache", required_argument, 0, 'C' },
+        { "cache-outputs", no_argument, 0, 'O' },
+        { "quiet", no_argument, 0, 'Q' },
+        { 0, 0, 0, 0 }
+    };
+    int opt, longind = 0;
+
+    progname = "jpeg-archive";
+
+    while ((opt = getopt_long(argc, argv, optstring, opts, &longind)) != -1) {
+        switch (opt) {
+        case 'V':
+            version();
+            return 0;
+        case 'h':
+            usage();
+            return 0;
+        case 't':
+            target = atof(optarg);
+            break;
+        case 'q':
+            preset = parseQuality(optarg);
+            break;
+        case 'n':
+            jpegMin = atoi(optarg);
+            break;
+        case 'x':
+            jpegMax = atoi(optarg);
+            break;
+        case 'l':
+            attempts = atoi(optarg);
+            break;
+        case 'e':
+            searchMethod = parseSearch(optarg);
+            break;
+        case 'c':
+            copyFiles = 0;
+            break;
+        case 'S':
+            subsample = parseSubsampling(optarg);
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        case 'C':
+            cachePath = optarg;
+            break;
+        case 'O':
+            cacheOutputs = 1;
+            break;
+        case 'Q':
+            quiet = 1;
+            break;
+        };
+    }
+
+    if (argc - optind > 2) {
+        usage();
+        return 255;
+    }
+
+    if (jpegMin > jpegMax) {
+        error("maximum JPEG quality must not be smaller than minimum JPEG quality!");
+        return 1;
+    }
+
+    const char *inputRoot = (argc - optind > 0) ? argv[optind] : ".";
+    const char *outputRoot = (argc - optind > 1) ? argv[optind + 1] : "Comp";
+    struct archive archive;
+    double start = seconds();
+
+    memset(&archive, 0, sizeof(archive));
+    pthread_mutex_init(&archive.mutex, NULL);
+
+    jpegarchive_cache_t *cache = NULL;
+
+    if (makeDirectories(outputRoot) != 0)
+        return 1;
+
+    if (cachePath) {
+        cache = jpegarchive_cache_open(cachePath, cacheOutputs ? JPEGARCHIVE_CACHE_OUTPUTS : JPEGARCHIVE_CACHE_DEFAULT);
+        if (!cache) {
+            error("unable to open cache: %s", cachePath);
+            return 1;
+        }
+    }
+
+    // Results are written while other files are still mapped
+    if (isSameFile(inputRoot, outputRoot)) {
+        error("the output directory must differ from the input directory");
+        return 1;
+    }
+    if (walk(&archive, inputRoot, outputRoot, outputRoot) != 0) {
+        error("unable to scan directory: %s", inputRoot);
+        return 1;
+    }
+
+    int raws = 0;
+
+    for (int i = 0; i < archive.count; i++)
+        raws += archive.jobs[i].raw;
+    if (raws) {
+        haveExiftool = (system("exiftool -ver > " DEVNULL " 2>&1") == 0);
+        if (!haveExiftool)
+            info("exiftool not found, the metadata of RAW files will not be copied\n");
+    }
+
+    info("Found %d JPEG and %d RAW files, recompressing on %d threads\n", archive.count - raws, raws,
+         threads > 0 ? threads : jpegarchive_cpu_count());
+
+    jpegarchive_recompress_input_t *inputs = malloc(BATCH_FILES * sizeof(*inputs));
+    struct inputFile *files = malloc(BATCH_FILES * sizeof(*files));
+    struct job *chunk = malloc(BATCH_FILES * sizeof(*chunk));
+
+    if (!inputs || !files || !chunk) {
+        error("out of memory");
+        return 1;
+    }
+
+    for (int first = 0; first < archive.count; first += BATCH_FILES) {
+        int last = MIN(first + BATCH_FILES, archive.count);
+        int mapped = 0;
+        int developing = 0;
+        int count = 0;
+
+        // Unreadable files are reported and left out of the batch
+        for (int i = first; i < last; i++) {
+            memset(&files[mapped], 0, sizeof(files[mapped]));
+            if (archive.jobs[i].raw) {
+                developing = 1;
+            } else if (!mapFile(archive.jobs[i].input, &files[mapped])) {
+                error("failed to read file: %s", archive.jobs[i].input);
+                archive.failed++;
+                archive.done++;
+                continue;
+            }
+            chunk[mapped++] = archive.jobs[i];
+        }
+
+        archive.chunk = chunk;
+        archive.files = files;
+        archive.chunkCount = mapped;
+        if (developing)
+            developRaws(&archive);
+
+        // So are RAW files dcraw could not develop
+        for (int i = 0; i < mapped; i++) {
+            jpegarchive_recompress_input_t *input = &inputs[count];
+
+            if (!files[i].data) {
+                error("unable to develop RAW file: %s", chunk[i].input);
+                archive.failed++;
+                archive.done++;
+                continue;
+            }
+
+            files[count] = files[i];
+            memset(input, 0, sizeof(*input));
+            input->jpeg = files[count].data;
+            input->length = files[count].size;
+            input->min = jpegMin;
+            input->max = jpegMax;
+            input->loops = attempts;
+            input->quality = preset;
+            input->method = JPEGARCHIVE_METHOD_SSIM;
+            input->target = target;
+            input->subsample = subsample;
+            input->search = searchMethod;
+            input->cache = cache;
+            chunk[count++] = chunk[i];
+        }
+
+        if (count && jpegarchive_recompress_batch(inputs, count, threads, storeResult, &archive) != JPEGARCHIVE_OK) {
+            error("unable to start worker threads");
+            return 1;
+        }
+
+        for (int i = 0; i < count; i++)
+            unmapFile(&files[i]);
+    }
+
+    // Report throughput
+    double elapsed = seconds() - start;
+    int processed = archive.count - archive.failed;
+
+    info("Processed %d files (%.1f MB) in %.2f s: %.1f files/s, %.1f MB/s\n", processed,
+         archive.bytesIn / 1e6, elapsed, processed / elapsed, archive.bytesIn / 1e6 / elapsed);
+    if (archive.bytesIn) {
+        info("Output is %lld%% of the input (saved %lld kb), %d files copied, %d failed\n",
+             archive.bytesOut * 100 / archive.bytesIn, (archive.bytesIn - archive.bytesOut) / 1024,
+             archive.copied, archive.failed);
+    }
+    if (cache) {
+        info("%lld files answered from the cache\n", (long long) jpegarchive_cache_hits(cache));
+        jpegarchive_cache_close(cache);
+    }
+
+    for (int i = 0; i < archive.count; i++) {
+        free(archive.jobs[i].input);
+        free(archive.jobs[i].output);
+    }
+    free(archive.jobs);
+    free(inputs);
+    free(files);
+    free(chunk);
+    pthread_mutex_destroy(&archive.mutex);
+
+    return archive.failed ? 1 : 0;
+}
@@ -33,6 +33,7 @@ enum METHOD {
     FAST,
     PSNR,
     SSIM,
+    SSIM_INT,
     MS_SSIM,
     SMALLFRY
 };
@@ -60,6 +61,8 @@ static enum METHOD parseMethod(const char *s) {
         return PSNR;
     if (!strcmp("ssim", s))
         return SSIM;
+    if (!strcmp("ssim-int", s))
+        return SSIM_INT;
     if (!strcmp("ms-ssim", s))
         return MS_SSIM;
     if (!strcmp("smallfry", s))
@@ -113,7 +116,7 @@ int compareFromBuffer(unsigned char *imageBuf1, long bufSize1, unsigned char *im
             format = JCS_RGB;
             components = 3;
             break;
-        case SSIM: case MS_SSIM: default:
+        case SSIM: case SSIM_INT: case MS_SSIM: default:
             format = JCS_GRAYSCALE;
             components = 1;
             break;
@@ -168,6 +171,12 @@ int compareFromBuffer(unsigned char *imageBuf1, long bufSize1, unsigned char *im
                 printf("MS-SSIM: ");
             printf("%f\n", diff);
             break;
+        case SSIM_INT:
+            diff = iqa_ssim_u8(image1, image2, width1, height1, width1 * components, 0);
+            if (printPrefix)
+                printf("SSIM-INT: ");
+            printf("%f\n", diff);
+            break;
         case SSIM: default:
             diff = iqa_ssim(image1, image2, width1, height1, width1 * components, 0, 0);
             if (printPrefix)
@@ -189,7 +198,7 @@ void usage(void) {
     printf("  -V, --version                output program version\n");
     printf("  -h, --help                   output program help\n");
     printf("  -s, --size [arg]             set fast comparison image hash size\n");
-    printf("  -m, --method [arg]           set comparison method to one of 'fast', 'psnr', 'ssim', or 'ms-ssim' [fast]\n");
+    printf("  -m, --method [arg]           set comparison method to one of 'fast', 'psnr', 'ssim', 'ssim-int', or 'ms-ssim' [fast]\n");
     printf("  -r, --ppm                    parse first input as PPM instead of JPEG\n");
     printf("  -T, --input-filetype [arg]   set first input file type to one of 'auto', 'jpeg', 'ppm' [auto]\n");
     printf("  -U, --second-filetype [arg]  set second input file type to one of 'auto', 'jpeg', 'ppm' [auto]\n");
@@ -259,24 +268,27 @@ int main (int argc, char **argv) {
         return 255;
     }
 
-    // Read the images
+    // Map the images
+    struct inputFile file1, file2;
     unsigned char *imageBuf1, *imageBuf2;
     long bufSize1, bufSize2;
 
     char *fileName1 = argv[optind];
     char *fileName2 = argv[optind + 1];
 
-    bufSize1 = readFile(fileName1, (void **)&imageBuf1);
+    bufSize1 = mapFile(fileName1, &file1);
     if (!bufSize1) {
         error("failed to read file: %s", fileName1);
         return 1;
     }
+    imageBuf1 = file1.data;
 
-    bufSize2 = readFile(fileName2, (void **)&imageBuf2);
+    bufSize2 = mapFile(fileName2, &file2);
     if (!bufSize2) {
         error("failed to read file: %s", fileName2);
         return 1;
     }
+    imageBuf2 = file2.data;
 
     /* Detect input file types. */
     if (inputFiletype1 == FILETYPE_AUTO)
@@ -294,6 +306,7 @@ int main (int argc, char **argv) {
             return compareFastFromBuffer(imageBuf1, bufSize1, imageBuf2, bufSize2);
         case PSNR:
         case SSIM:
+        case SSIM_INT:
         case MS_SSIM:
         case SMALLFRY:
             return compareFromBuffer(imageBuf1, bufSize1, imageBuf2, bufSize2);
@@ -303,6 +316,6 @@ int main (int argc, char **argv) {
     }
 
     // Cleanup resources
-    free(imageBuf1);
-    free(imageBuf2);
+    unmapFile(&file1);
+    unmapFile(&file2);
 }
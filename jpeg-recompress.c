@@ -6,6 +6,7 @@
 */
 
 #include <getopt.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -14,6 +15,9 @@
 
 #include "src/edit.h"
 #include "src/iqa/include/iqa.h"
+#include "src/iqa/include/fast_ssim.h"
+#include "src/iqa/include/ms_ssim.h"
+#include "src/search.h"
 #include "src/smallfry.h"
 #include "src/util.h"
 
@@ -35,7 +39,10 @@ enum METHOD {
 
 int method = SSIM;
 
-// Number of binary search steps
+// Quality search strategy
+int searchMethod = SEARCH_BISECT;
+
+// Maximum number of search steps
 int attempts = 6;
 
 // Target quality (SSIM) value
@@ -78,6 +85,49 @@ int subsample = SUBSAMPLE_DEFAULT;
 // Quiet mode (less output)
 int quiet = 0;
 
+// Number of candidate qualities to encode at once
+int threads = 1;
+
+// Upper bound for the above
+#define MAX_THREADS 64
+
+// Largest factor to scale the image down by for the early bisection steps
+// (0 = measure every step at full resolution)
+int proxy = 0;
+
+// libjpeg objects reused by the candidates evaluated on each thread
+static struct codec codecs[MAX_THREADS];
+
+// Images shared by all candidates of the search
+struct search {
+    unsigned char *original;
+    unsigned char *originalGray;
+    int width;
+    int height;
+    fast_ssim_model *ssimModel;
+    int scale;  // 1, or the factor a reduced-resolution proxy is scaled down by
+    ms_ssim_model *msssimModel;
+    struct dctImage dct;  // luma DCT of the intermediate steps, no blocks if not cached
+};
+
+// A candidate quality of the binary search. It remembers the interval it
+// was reached with, so the candidates the next steps could pick can be
+// encoded ahead of time on other threads.
+struct candidate {
+    const struct search *search;
+    struct codec *codec;  // set when the candidate is evaluated
+    int min;
+    int max;
+    int attempt;
+    int quality;
+    int below;  // candidate searched next when metric < target, -1 if none
+    int above;  // candidate searched next otherwise, -1 if none
+    unsigned char *compressed;  // only kept for the final attempt
+    unsigned long compressedSize;
+    int decoded;
+    float metric;
+};
+
 static enum QUALITY_PRESET parseQuality(const char *s) {
     if (!strcmp("low", s))
         return LOW;
@@ -104,6 +154,16 @@ static enum METHOD parseMethod(const char *s) {
     return UNKNOWN;
 }
 
+static enum SEARCH_METHOD parseSearch(const char *s) {
+    if (!strcmp("bisect", s))
+        return SEARCH_BISECT;
+    else if (!strcmp("interpolate", s))
+        return SEARCH_INTERPOLATE;
+
+    error("unknown search method: %s", s);
+    return SEARCH_BISECT;
+}
+
 static enum filetype parseInputFiletype(const char *s) {
     if (!strcmp("auto", s))
         return FILETYPE_AUTO;
@@ -206,6 +266,25 @@ FILE *openOutput(char *name) {
     }
 }
 
+// Write the input unchanged to the output. A file is not copied onto
+// itself, as opening it for writing would truncate the mapped input.
+static int copyInput(const struct inputFile *input, char *inputPath, char *outputPath) {
+    FILE *file;
+
+    if (strcmp("-", outputPath) != 0 && isSameFile(inputPath, outputPath))
+        return 0;
+
+    file = openOutput(outputPath);
+    if (file == NULL) {
+        error("could not open output file: %s", outputPath);
+        return 1;
+    }
+
+    fwrite(input->data, input->size, 1, file);
+    fclose(file);
+    return 0;
+}
+
 // Logs an informational message, taking quiet mode into account
 void info(const char *format, ...) {
     va_list argptr;
@@ -226,7 +305,8 @@ void usage(void) {
     printf("  -q, --quality [arg]          set a quality preset: low, medium, high, veryhigh [medium]\n");
     printf("  -n, --min [arg]              minimum JPEG quality [40]\n");
     printf("  -x, --max [arg]              maximum JPEG quality [95]\n");
-    printf("  -l, --loops [arg]            set the number of runs to attempt [6]\n");
+    printf("  -l, --loops [arg]            set the maximum number of runs to attempt [6]\n");
+    printf("  -e, --search [arg]           set quality search to one of 'bisect', 'interpolate' [bisect]\n");
     printf("  -a, --accurate               favor accuracy over speed\n");
     printf("  -m, --method [arg]           set comparison method to one of 'mpe', 'ssim', 'ms-ssim', 'smallfry' [ssim]\n");
     printf("  -s, --strip                  strip metadata\n");
@@ -237,11 +317,220 @@ void usage(void) {
     printf("  -p, --no-progressive         disable progressive encoding\n");
     printf("  -S, --subsample [arg]        set subsampling method to one of 'default', 'disable' [default]\n");
     printf("  -T, --input-filetype [arg]   set input file type to one of 'auto', 'jpeg', 'ppm' [auto]\n");
+    printf("  -j, --threads [arg]          encode this many candidate qualities at once [1]\n");
+    printf("  -P, --proxy [arg]            measure early ssim bisection steps scaled down by 2, 4 or 8 [0]\n");
     printf("  -Q, --quiet                  only print out errors\n");
 }
 
+static void initCandidate(struct candidate *c, const struct search *search, int min, int max, int attempt) {
+    c->search = search;
+    c->codec = &codecs[0];
+    c->min = min;
+    c->max = max;
+    /* Terminate early once bisection interval is a singleton. */
+    c->attempt = (min == max) ? 0 : attempt;
+    c->quality = min + (max - min) / 2;
+    c->below = -1;
+    c->above = -1;
+    c->compressed = NULL;
+    c->compressedSize = 0;
+    c->decoded = 0;
+    c->metric = 0;
+}
+
+// Sets up the candidate that follows 'c' for the given comparison outcome
+static void nextCandidate(struct candidate *next, const struct candidate *c, int below) {
+    int min = c->min, max = c->max;
+
+    // MPE is an error, not a similarity: higher values need more quality
+    if (below != (method == MPE)) {
+        // Too distorted, increase quality
+        min = MIN(c->quality + 1, max);
+    } else {
+        // Higher than required, decrease quality
+        max = MAX(c->quality - 1, min);
+    }
+    initCandidate(next, c->search, min, max, c->attempt - 1);
+}
+
+// Encodes a candidate and measures it against the original (thread entry)
+static void *evaluateCandidate(void *arg) {
+    struct candidate *c = arg;
+    const struct search *search = c->search;
+    unsigned char *compressedGray;
+    int width, height;
+
+    int progressive = c->attempt ? 0 : !noProgressive;
+    int optimize = accurate ? 1 : (c->attempt ? 0 : 1);
+
+    // Recompress to a new quality level, without optimizations (for speed).
+    // Every metric only looks at luma, so until the final attempt only the
+    // luma plane is encoded, with the luma table of that quality. Its DCT
+    // is computed once, so those steps only quantize and entropy code.
+    if (c->attempt && search->dct.blocks)
+        c->compressedSize = codecEncodeDct(c->codec, &c->compressed, &search->dct, c->quality, progressive, optimize);
+    else if (c->attempt)
+        c->compressedSize = codecEncodeJpeg(c->codec, &c->compressed, search->originalGray, search->width, search->height, JCS_GRAYSCALE, c->quality, progressive, optimize, subsample);
+    else
+        c->compressedSize = codecEncodeJpeg(c->codec, &c->compressed, search->original, search->width, search->height, JCS_RGB, c->quality, progressive, optimize, subsample);
+
+    // Load compressed luma for quality comparison
+    c->decoded = codecDecodeJpeg(c->codec, c->compressed, c->compressedSize, &compressedGray, &width, &height, JCS_GRAYSCALE) != 0;
+    if (!c->decoded)
+        return NULL;
+
+    // Measure quality difference
+    switch (method) {
+        case MS_SSIM:
+            if (search->msssimModel)
+                c->metric = ms_ssim_compare(search->msssimModel, compressedGray, width);
+            else
+                c->metric = iqa_ms_ssim(search->originalGray, compressedGray, width, height, width, 0);
+            break;
+        case SMALLFRY:
+            c->metric = smallfry_metric(search->originalGray, compressedGray, width, height);
+            break;
+        case MPE:
+            c->metric = meanPixelError(search->originalGray, compressedGray, width, height, 1);
+            break;
+        case SSIM: default:
+            c->metric = fast_ssim_compare(search->ssimModel, compressedGray, width);
+            break;
+    }
+
+    if (c->attempt) {
+        free(c->compressed);
+        c->compressed = NULL;
+    }
+    return NULL;
+}
+
+// Expands candidates[0] breadth-first into the following search steps, up
+// to 'count' candidates, and evaluates them concurrently. Returns the
+// number of candidates evaluated.
+static int searchRound(struct candidate *candidates, int count) {
+    pthread_t workers[MAX_THREADS];
+    int started[MAX_THREADS];
+    int n = 1;
+
+    for (int i = 0; i < n && n < count; i++) {
+        if (!candidates[i].attempt)
+            continue;
+        candidates[i].below = n;
+        nextCandidate(&candidates[n++], &candidates[i], 1);
+        if (n < count) {
+            candidates[i].above = n;
+            nextCandidate(&candidates[n++], &candidates[i], 0);
+        }
+    }
+
+    for (int i = 0; i < n; i++)
+        candidates[i].codec = &codecs[i];
+
+    for (int i = 1; i < n; i++) {
+        started[i] = !pthread_create(&workers[i], NULL, evaluateCandidate, &candidates[i]);
+        if (!started[i])
+            evaluateCandidate(&candidates[i]);
+    }
+    evaluateCandidate(&candidates[0]);
+    for (int i = 1; i < n; i++) {
+        if (started[i])
+            pthread_join(workers[i], NULL);
+    }
+    return n;
+}
+
+// Logs a measured candidate. Returns -1 to go on with the search, or the
+// exit code once the candidate shows the output can't get smaller than the
+// input, after copying the original if requested.
+static int checkCandidate(const struct candidate *c, struct inputFile *input, char *inputPath, char *outputPath) {
+    int ret;
+
+    if (!c->decoded) {
+        error("unable to decode file that was just encoded!");
+        return 1;
+    }
+
+    if (!c->attempt) {
+        info("Final optimized ");
+    } else if (c->search->scale > 1) {
+        info("Proxy 1/%i ", c->search->scale);
+    }
+
+    switch (method) {
+        case MS_SSIM:
+            info("ms-ssim");
+            break;
+        case SMALLFRY:
+            info("smallfry");
+            break;
+        case MPE:
+            info("mpe");
+            break;
+        case SSIM: default:
+            info("ssim");
+            break;
+    }
+
+    if (c->attempt) {
+        info(" at q=%i (%i - %i): %f\n", c->quality, c->min, c->max, c->metric);
+    } else {
+        info(" at q=%i: %f\n", c->quality, c->metric);
+    }
+
+    // A luma-only candidate is smaller than its color encode, so this only
+    // gives up early when the output certainly can't get smaller
+    if (c->search->scale == 1 && c->metric < target && c->compressedSize >= input->size) {
+        if (copyFiles) {
+            info("Output file would be larger than input!\n");
+            ret = copyInput(input, inputPath, outputPath);
+            unmapFile(input);
+            return ret;
+        } else {
+            error("output file would be larger than input!");
+            unmapFile(input);
+            return 1;
+        }
+    }
+    return -1;
+}
+
+// Runs the early steps of a bisection that starts at 'c' on the proxy. The
+// first step is measured at both resolutions to calibrate the target of the
+// proxy steps (see proxyTarget in src/search.h). Leaves the first of the
+// last PROXY_FULL_STEPS steps in 'c'. Returns like checkCandidate.
+static int proxySteps(struct candidate *c, const struct search *proxySearch, struct inputFile *input, char *inputPath, char *outputPath) {
+    const struct search *search = c->search;
+    struct candidate p = *c;
+    int ret;
+
+    evaluateCandidate(c);
+    if ((ret = checkCandidate(c, input, inputPath, outputPath)) >= 0)
+        return ret;
+
+    p.search = proxySearch;
+    evaluateCandidate(&p);
+    if ((ret = checkCandidate(&p, input, inputPath, outputPath)) >= 0)
+        return ret;
+
+    float calibrated = proxyTarget(target, c->metric, p.metric);
+    nextCandidate(&p, c, c->metric < target);
+
+    while (p.attempt >= PROXY_FULL_STEPS) {
+        p.search = proxySearch;
+        evaluateCandidate(&p);
+        if ((ret = checkCandidate(&p, input, inputPath, outputPath)) >= 0)
+            return ret;
+        struct candidate last = p;
+        nextCandidate(&p, &last, last.metric < calibrated);
+    }
+
+    initCandidate(c, search, p.min, p.max, p.attempt);
+    return -1;
+}
+
 int main (int argc, char **argv) {
-    const char *optstring = "Vht:q:n:x:l:am:sd:z:rcpS:T:Q";
+    const char *optstring = "Vht:q:n:x:l:e:am:sd:z:rcpS:T:j:P:Q";
     static const struct option opts[] = {
         { "version", no_argument, 0, 'V' },
         { "help", no_argument, 0, 'h' },
@@ -250,6 +539,7 @@ int main (int argc, char **argv) {
         { "min", required_argument, 0, 'n' },
         { "max", required_argument, 0, 'x' },
         { "loops", required_argument, 0, 'l' },
+        { "search", required_argument, 0, 'e' },
         { "accurate", no_argument, 0, 'a' },
         { "method", required_argument, 0, 'm' },
         { "strip", no_argument, 0, 's' },
@@ -260,6 +550,8 @@ int main (int argc, char **argv) {
         { "no-progressive", no_argument, 0, 'p' },
         { "subsample", required_argument, 0, 'S' },
         { "input-filetype", required_argument, 0, 'T' },
+        { "threads", required_argument, 0, 'j' },
+        { "proxy", required_argument, 0, 'P' },
         { "quiet", no_argument, 0, 'Q' },
         { 0, 0, 0, 0 }
     };
@@ -290,6 +582,9 @@ int main (int argc, char **argv) {
         case 'l':
             attempts = atoi(optarg);
             break;
+        case 'e':
+            searchMethod = parseSearch(optarg);
+            break;
         case 'a':
             accurate = 1;
             break;
@@ -324,6 +619,12 @@ int main (int argc, char **argv) {
             }
             inputFiletype = parseInputFiletype(optarg);
             break;
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        case 'P':
+            proxy = atoi(optarg);
+            break;
         case 'Q':
             quiet = 1;
             break;
@@ -346,6 +647,7 @@ int main (int argc, char **argv) {
         setTargetFromPreset();
     }
 
+    struct inputFile input;
     unsigned char *buf;
     long bufSize = 0;
     unsigned char *original;
@@ -354,8 +656,6 @@ int main (int argc, char **argv) {
     long originalGraySize = 0;
     unsigned char *compressed = NULL;
     unsigned long compressedSize = 0;
-    unsigned char *compressedGray;
-    long compressedGraySize = 0;
     unsigned char *tmpImage;
     int width, height;
     unsigned char *metaBuf;
@@ -364,8 +664,9 @@ int main (int argc, char **argv) {
     char *inputPath = argv[optind];
     char *outputPath = argv[optind + 1];
 
-    /* Read the input into a buffer. */
-    bufSize = readFile(inputPath, (void **) &buf);
+    /* Map the input, or read it into a buffer if it is not a regular file. */
+    bufSize = mapFile(inputPath, &input);
+    buf = input.data;
 
     /* Detect input file type. */
     if (inputFiletype == FILETYPE_AUTO)
@@ -373,9 +674,15 @@ int main (int argc, char **argv) {
 
     /*
      * Read original image and decode. We need the raw buffer contents and its
-     * size to obtain meta data and the original file size later.
+     * size to obtain meta data and the original file size later. A JPEG that
+     * is not defished yields its luma in the same pass.
      */
-    originalSize = decodeFileFromBuffer(buf, bufSize, &original, inputFiletype, &width, &height, JCS_RGB);
+    if (inputFiletype == FILETYPE_JPEG && !defishStrength) {
+        originalSize = decodeJpegLuma(buf, bufSize, &original, &originalGray, &width, &height);
+        originalGraySize = originalSize ? (long) width * height : 0;
+    } else {
+        originalSize = decodeFileFromBuffer(buf, bufSize, &original, inputFiletype, &width, &height, JCS_RGB);
+    }
     if (!originalSize) {
         error("invalid input file: %s", inputPath);
         return 1;
@@ -390,28 +697,20 @@ int main (int argc, char **argv) {
     }
 
     // Convert RGB input into Y
-    originalGraySize = grayscale(original, &originalGray, width, height);
+    if (!originalGray)
+        originalGraySize = grayscale(original, &originalGray, width, height);
 
     if (inputFiletype == FILETYPE_JPEG) {
         // Read metadata (EXIF / IPTC / XMP tags)
         if (getMetadata(buf, bufSize, &metaBuf, &metaSize, COMMENT)) {
             if (copyFiles) {
                 info("File already processed by jpeg-recompress!\n");
-                file = openOutput(outputPath);
-                if (file == NULL) {
-                    error("could not open output file: %s", outputPath);
-                    return 1;
-                }
-
-                fwrite(buf, bufSize, 1, file);
-                fclose(file);
-
-                free(buf);
-
-                return 0;
+                int copied = copyInput(&input, inputPath, outputPath);
+                unmapFile(&input);
+                return copied;
             } else {
                 error("file already processed by jpeg-recompress!");
-                free(buf);
+                unmapFile(&input);
                 return 2;
             }
         }
@@ -431,118 +730,170 @@ int main (int argc, char **argv) {
         return 1;
     }
 
-    // Do a binary search to find the optimal encoding quality for the
-    // given target SSIM value.
-    int min = jpegMin, max = jpegMax;
-    for (int attempt = attempts - 1; attempt >= 0; --attempt) {
-        float metric;
-        int quality = min + (max - min) / 2;
-
-        /* Terminate early once bisection interval is a singleton. */
-        if (min == max)
-            attempt = 0;
-
-        int progressive = attempt ? 0 : !noProgressive;
-        int optimize = accurate ? 1 : (attempt ? 0 : 1);
-
-        // Recompress to a new quality level, without optimizations (for speed)
-        compressedSize = encodeJpeg(&compressed, original, width, height, JCS_RGB, quality, progressive, optimize, subsample);
+    // Qualities well above the one the source was saved at can't produce
+    // a smaller file. A defished image is no longer what its tables
+    // quantized, so it keeps the whole range.
+    if (inputFiletype == FILETYPE_JPEG && !defishStrength) {
+        struct jpegMarkers markers;
+        int sourceQuality = 0;
 
-        // Load compressed luma for quality comparison
-        compressedGraySize = decodeJpeg(compressed, compressedSize, &compressedGray, &width, &height, JCS_GRAYSCALE);
-
-        if (!compressedGraySize) {
-          error("unable to decode file that was just encoded!");
-          return 1;
+        if (indexMarkers(buf, bufSize, NULL, &markers)) {
+            sourceQuality = estimateQuality(&markers);
+            freeMarkers(&markers);
         }
 
-        if (!attempt) {
-            info("Final optimized ");
+        if (!clampToSource(jpegMin, &jpegMax, sourceQuality)) {
+            if (copyFiles) {
+                info("Source quality %i is below the minimum, output file would be larger than input!\n", sourceQuality);
+                int copied = copyInput(&input, inputPath, outputPath);
+                unmapFile(&input);
+                return copied;
+            } else {
+                error("source quality %i is below the minimum, output file would be larger than input!", sourceQuality);
+                unmapFile(&input);
+                return 1;
+            }
+        }
+        if (sourceQuality) {
+            info("Source quality is about %i, searching %i - %i\n", sourceQuality, jpegMin, jpegMax);
         }
+    }
 
-        // Measure quality difference
-        switch (method) {
-            case MS_SSIM:
-                metric = iqa_ms_ssim(originalGray, compressedGray, width, height, width, 0);
-                info("ms-ssim");
-                break;
-            case SMALLFRY:
-                metric = smallfry_metric(originalGray, compressedGray, width, height);
-                info("smallfry");
-                break;
-            case MPE:
-                metric = meanPixelError(originalGray, compressedGray, width, height, 1);
-                info("mpe");
-                break;
-            case SSIM: default:
-                metric = iqa_ssim(originalGray, compressedGray, width, height, width, 0, 0);
-                info("ssim");
-                break;
+    // The reference never changes during the search, so its SSIM
+    // statistics are computed once and reused for every candidate.
+    fast_ssim_model *ssimModel = NULL;
+    if (method == SSIM) {
+        ssimModel = fast_ssim_create_model(originalGray, width, height, width, 0, 0);
+        if (!ssimModel) {
+            error("unable to create SSIM model!");
+            return 1;
         }
+    }
 
-        if (attempt) {
-            info(" at q=%i (%i - %i): %f\n", quality, min, max, metric);
-        } else {
-            info(" at q=%i: %f\n", quality, metric);
+    // Likewise for every scale of the MS-SSIM reference. Images too small
+    // for all the scales get no model, and iqa_ms_ssim() reports them as
+    // it always has.
+    ms_ssim_model *msssimModel = NULL;
+    if (method == MS_SSIM)
+        msssimModel = ms_ssim_create_model(originalGray, width, height, width, 0);
+
+    if (threads < 1)
+        threads = 1;
+    if (threads > MAX_THREADS)
+        threads = MAX_THREADS;
+
+    for (int i = 0; i < threads; i++)
+        codecInit(&codecs[i]);
+
+    struct search search = { original, originalGray, width, height, ssimModel, 1, msssimModel };
+
+    // Trellis quantization needs the pixels, so the accurate search, which
+    // optimizes every step, encodes those. Without memory for the blocks
+    // the steps do too.
+    if (!accurate)
+        dctImageInit(&search.dct, originalGray, width, height);
+
+    // Luma scaled down for the early bisection steps
+    struct search proxySearch = { NULL, NULL, 0, 0, NULL, 1, NULL };
+    int factor = (searchMethod == SEARCH_BISECT && method == SSIM) ? proxyFactor(width, height, proxy, attempts) : 1;
+    if (factor > 1) {
+        proxySearch.width = (width + factor - 1) / factor;
+        proxySearch.height = (height + factor - 1) / factor;
+        proxySearch.originalGray = malloc(proxySearch.width * proxySearch.height);
+        if (!proxySearch.originalGray) {
+            error("unable to allocate proxy image!");
+            return 1;
+        }
+        downscale(originalGray, proxySearch.originalGray, width, height, factor);
+        proxySearch.scale = factor;
+
+        // Compare at the resolution the full image is compared at
+        struct iqa_ssim_args args = { 1.0f, 1.0f, 1.0f, 255, 0.01f, 0.03f, proxySsimScale(width, height, factor) };
+        proxySearch.ssimModel = fast_ssim_create_model(proxySearch.originalGray, proxySearch.width, proxySearch.height, proxySearch.width, 0, &args);
+        if (!proxySearch.ssimModel) {
+            error("unable to create SSIM model!");
+            return 1;
+        }
+        if (!accurate)
+            dctImageInit(&proxySearch.dct, proxySearch.originalGray, proxySearch.width, proxySearch.height);
+    }
+    struct candidate candidates[MAX_THREADS];
+    struct candidate *c;
+    int ret;
+
+    if (searchMethod == SEARCH_INTERPOLATE) {
+        // Fit the measured metrics to find the lowest quality that meets
+        // the target, then encode it optimized.
+        struct qualitySearch qs;
+        int quality;
+
+        c = &candidates[0];
+        qualitySearchInit(&qs, jpegMin, jpegMax, target, method == MPE);
+        for (int attempt = attempts - 1; attempt > 0 && (quality = qualitySearchNext(&qs)); --attempt) {
+            initCandidate(c, &search, qs.min, qs.max, attempt);
+            c->quality = quality;
+            evaluateCandidate(c);
+            if ((ret = checkCandidate(c, &input, inputPath, outputPath)) >= 0)
+                return ret;
+            qualitySearchUpdate(&qs, quality, c->metric);
         }
 
-        if (metric < target) {
-            if (compressedSize >= bufSize) {
-                free(compressed);
-                free(compressedGray);
-
-                if (copyFiles) {
-                    info("Output file would be larger than input!\n");
-                    file = openOutput(outputPath);
-                    if (file == NULL) {
-                        error("could not open output file: %s", outputPath);
-                        return 1;
-                    }
-
-                    fwrite(buf, bufSize, 1, file);
-                    fclose(file);
-
-                    free(buf);
-
-                    return 0;
-                } else {
-                    error("output file would be larger than input!");
-                    free(buf);
-                    return 1;
+        initCandidate(c, &search, qs.max, qs.max, 0);
+        evaluateCandidate(c);
+        if ((ret = checkCandidate(c, &input, inputPath, outputPath)) >= 0)
+            return ret;
+        compressed = c->compressed;
+        compressedSize = c->compressedSize;
+    } else {
+        // Do a binary search to find the optimal encoding quality for the
+        // given target SSIM value. With several threads, each round also encodes
+        // the candidates the next steps could pick; the search below then takes
+        // the same steps as a serial one, so the result is identical.
+        initCandidate(&candidates[0], &search, jpegMin, jpegMax, attempts - 1);
+        if (proxySearch.scale > 1 && candidates[0].attempt) {
+            if ((ret = proxySteps(&candidates[0], &proxySearch, &input, inputPath, outputPath)) >= 0)
+                return ret;
+        }
+        while (!compressed) {
+            int count = searchRound(candidates, threads);
+            int next = 0;
+
+            do {
+                c = &candidates[next];
+                if ((ret = checkCandidate(c, &input, inputPath, outputPath)) >= 0)
+                    return ret;
+
+                if (!c->attempt) {
+                    // Keep the final image data
+                    compressed = c->compressed;
+                    compressedSize = c->compressedSize;
+                    c->compressed = NULL;
+                    break;
                 }
-            }
 
-            switch (method) {
-                case SSIM: case MS_SSIM: case SMALLFRY:
-                    // Too distorted, increase quality
-                    min = MIN(quality + 1, max);
-                    break;
-                case MPE:
-                    // Higher than required, decrease quality
-                    max = MAX(quality - 1, min);
-                    break;
-            }
-        } else {
-            switch (method) {
-                case SSIM: case MS_SSIM: case SMALLFRY:
-                    // Higher than required, decrease quality
-                    max = MAX(quality - 1, min);
-                    break;
-                case MPE:
-                    // Too distorted, increase quality
-                    min = MIN(quality + 1, max);
-                    break;
-            }
-        }
+                next = (c->metric < target) ? c->below : c->above;
+            } while (next >= 0);
+
+            for (int i = 0; i < count; i++)
+                free(candidates[i].compressed);
 
-        // If we aren't done yet, then free the image data
-        if (attempt) {
-            free(compressed);
-            free(compressedGray);
+            if (!compressed) {
+                // Continue from the first step that was not encoded yet
+                struct candidate last = *c;
+                nextCandidate(&candidates[0], &last, last.metric < target);
+            }
         }
     }
 
-    free(buf);
+    fast_ssim_destroy_model(ssimModel);
+    fast_ssim_destroy_model(proxySearch.ssimModel);
+    ms_ssim_destroy_model(msssimModel);
+    free(proxySearch.originalGray);
+    dctImageFree(&search.dct);
+    dctImageFree(&proxySearch.dct);
+    for (int i = 0; i < threads; i++)
+        codecFree(&codecs[i]);
+    unmapFile(&input);
 
     // Calculate and show savings, if any
     int percent = (compressedSize + metaSize) * 100 / bufSize;
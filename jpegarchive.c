@@ -1,14 +1,38 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE  // MAP_ANONYMOUS, madvise() and sched_getaffinity() under -std=c99
+#endif
+
 #include "jpegarchive.h"
 #include "src/util.h"
 #include "src/edit.h"
+#include "src/search.h"
 #include "src/smallfry.h"
 #include "src/iqa/include/iqa.h"
+#include "src/iqa/include/fast_ssim.h"
+#include "src/iqa/include/simd.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <setjmp.h>
 #include <math.h>
+#include <pthread.h>
 #include <jpeglib.h>
+#include <jerror.h>
+#include <errno.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+// Comment that marks the output, so it is not processed again
+static const char *COMMENT = "Compressed by jpeg-recompress";
 
 // Custom error handler for libjpeg to prevent process termination
 struct jpegarchive_error_mgr {
@@ -23,246 +47,723 @@ static void jpegarchive_error_exit(j_common_ptr cinfo) {
     longjmp(myerr->setjmp_buffer, 1);
 }
 
-// Safe version of decodeJpeg that doesn't exit on errors
-static unsigned long safeDecodeJpeg(unsigned char *buf, unsigned long bufSize, unsigned char **image, int *width, int *height, int pixelFormat, jpegarchive_error_code_t *error) {
-    struct jpeg_decompress_struct cinfo;
-    struct jpegarchive_error_mgr jerr;
-    int row_stride;
-    JSAMPARRAY buffer;
+// Per-image working memory. Allocations are carved out of one block and
+// released together by arena_reset(). Whatever does not fit goes to
+// overflow blocks, and the next reset replaces all of them with a single
+// block of the size that image needed, so a worker that processes images
+// of similar size stops allocating after the first one.
+#define ARENA_ALIGN 64
+#define ARENA_HUGE_PAGE (2UL << 20)
+
+typedef struct arena_overflow {
+    struct arena_overflow *next;
+} arena_overflow_t;
+
+typedef struct {
+    unsigned char *base;
+    size_t size;
+    size_t used;
+    size_t wanted;               // bytes requested since the last reset
+    int mapped;                  // base was mapped for huge pages
+    int hugePages;
+    arena_overflow_t *overflow;
+} arena_t;
+
+// Maps blocks of at least a huge page with transparent huge pages
+// requested, which saves TLB misses when the float planes of the SSIM
+// model are walked. Falls back to malloc elsewhere.
+static void *arena_map(arena_t *arena, size_t *size) {
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    if (arena->hugePages && *size >= ARENA_HUGE_PAGE) {
+        size_t mapSize = (*size + ARENA_HUGE_PAGE - 1) & ~(ARENA_HUGE_PAGE - 1);
+        void *block = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (block != MAP_FAILED) {
+            madvise(block, mapSize, MADV_HUGEPAGE);
+            arena->mapped = 1;
+            *size = mapSize;
+            return block;
+        }
+    }
+#endif
+    arena->mapped = 0;
+    return malloc(*size);
+}
+
+static void arena_unmap(arena_t *arena) {
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    if (arena->mapped) {
+        munmap(arena->base, arena->size);
+    } else {
+        free(arena->base);
+    }
+#else
+    free(arena->base);
+#endif
+    arena->base = NULL;
+    arena->size = 0;
+}
+
+static void arena_init(arena_t *arena, int hugePages) {
+    memset(arena, 0, sizeof(*arena));
+    arena->hugePages = hugePages;
+}
+
+// Returns ARENA_ALIGN-aligned memory (relative to the block), or NULL
+static void *arena_alloc(arena_t *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    arena->wanted += size;
+    if (arena->used + size <= arena->size) {
+        void *ptr = arena->base + arena->used;
+        arena->used += size;
+        return ptr;
+    }
+
+    arena_overflow_t *block = malloc(ARENA_ALIGN + size);
+    if (!block) {
+        return NULL;
+    }
+    block->next = arena->overflow;
+    arena->overflow = block;
+    return (unsigned char *)block + ARENA_ALIGN;
+}
+
+static int arena_free_overflow(arena_t *arena) {
+    int overflowed = (arena->overflow != NULL);
+
+    while (arena->overflow) {
+        arena_overflow_t *next = arena->overflow->next;
+        free(arena->overflow);
+        arena->overflow = next;
+    }
+    return overflowed;
+}
+
+// Releases everything allocated since the last reset
+static void arena_reset(arena_t *arena) {
+    if (arena_free_overflow(arena)) {
+        size_t size = arena->wanted;
+        arena_unmap(arena);
+        arena->base = arena_map(arena, &size);
+        arena->size = arena->base ? size : 0;
+    }
+    arena->used = 0;
+    arena->wanted = 0;
+}
+
+static void arena_destroy(arena_t *arena) {
+    arena_free_overflow(arena);
+    arena_unmap(arena);
+}
+
+// Compressor, decompressor and buffers that one search worker keeps from
+// one candidate to the next, so a candidate only pays for encoding and
+// decoding and not for setting up and tearing down libjpeg objects. After
+// an error the objects are aborted, which leaves them ready for reuse.
+typedef struct {
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_decompress_struct dinfo;
+    struct jpegarchive_error_mgr jerr;  // shared, each call sets its own return point
+    unsigned char *gray;                // last decoded candidate
+    unsigned long grayCapacity;
+    unsigned long lastSize;             // size of the last encode
+    JHUFF_TBL huffman[4];               // standard DC and AC tables 0 and 1
+} codec_t;
+
+static void codec_destroy(codec_t *codec) {
+    jpeg_destroy_compress(&codec->cinfo);
+    jpeg_destroy_decompress(&codec->dinfo);
+    free(codec->gray);
+    codec->gray = NULL;
+}
+
+static int codec_init(codec_t *codec) {
+    memset(codec, 0, sizeof(*codec));
+    codec->cinfo.err = jpeg_std_error(&codec->jerr.pub);
+    codec->dinfo.err = &codec->jerr.pub;
+    codec->jerr.pub.error_exit = jpegarchive_error_exit;
+
+    if (setjmp(codec->jerr.setjmp_buffer)) {
+        // Creating the objects only fails when out of memory
+        codec_destroy(codec);
+        return 0;
+    }
+
+    jpeg_create_compress(&codec->cinfo);
+    jpeg_create_decompress(&codec->dinfo);
+
+    // jpeg_set_defaults keeps Huffman tables that already exist, so the
+    // optimized tables of a progressive encode would carry over to the next
+    // one. Keep the standard tables to restore them.
+    codec->cinfo.in_color_space = JCS_RGB;
+    codec->cinfo.input_components = 3;
+    jpeg_set_defaults(&codec->cinfo);
+    for (int i = 0; i < 2; i++) {
+        codec->huffman[2 * i] = *codec->cinfo.dc_huff_tbl_ptrs[i];
+        codec->huffman[2 * i + 1] = *codec->cinfo.ac_huff_tbl_ptrs[i];
+    }
+    return 1;
+}
+
+static void codec_reset_huffman(codec_t *codec) {
+    for (int i = 0; i < 2; i++) {
+        *codec->cinfo.dc_huff_tbl_ptrs[i] = codec->huffman[2 * i];
+        *codec->cinfo.ac_huff_tbl_ptrs[i] = codec->huffman[2 * i + 1];
+    }
+}
+
+// Points the compressor at a new output buffer sized after the previous
+// encode, so that jpeg_mem_dest rarely needs to grow it. Returns the
+// buffer, which codec_end_output frees if libjpeg outgrew it.
+static unsigned char *codec_start_output(codec_t *codec, unsigned char **jpeg, unsigned long *jpegSize) {
+    unsigned char *presized = NULL;
+
+    *jpegSize = codec->lastSize + codec->lastSize / 2;
+    if (*jpegSize) {
+        presized = malloc(*jpegSize);
+    }
+    if (!presized) {
+        *jpegSize = 0;
+    }
+    *jpeg = presized;
+    jpeg_mem_dest(&codec->cinfo, jpeg, jpegSize);
+    return presized;
+}
+
+static void codec_end_output(codec_t *codec, unsigned char *presized, unsigned char *jpeg, unsigned long jpegSize) {
+    if (presized != jpeg) {
+        free(presized);
+    }
+    codec->lastSize = jpegSize;
+}
+
+// Safe version of decodeJpeg that doesn't exit on errors. The image is
+// allocated from 'arena'. With 'buf' NULL the image is read from the source
+// manager already installed on codec->dinfo. With 'luma' set, an RGB decode
+// also yields its 8-bit luma, from the same pass over the scanlines.
+static unsigned long safeDecodeJpeg(codec_t *codec, arena_t *arena, unsigned char *buf, unsigned long bufSize, unsigned char **image, unsigned char **luma, int *width, int *height, int pixelFormat, jpegarchive_error_code_t *error) {
+    j_decompress_ptr cinfo = &codec->dinfo;
+    JSAMPROW row_pointer[1];
+    unsigned long row_stride;
+    unsigned char *row = NULL;
+    int ycc;
     
     *error = JPEGARCHIVE_OK;
     
-    // Set up error handling
-    cinfo.err = jpeg_std_error(&jerr.pub);
-    jerr.pub.error_exit = jpegarchive_error_exit;
-    
     // Establish the setjmp return context
-    if (setjmp(jerr.setjmp_buffer)) {
+    if (setjmp(codec->jerr.setjmp_buffer)) {
         // If we get here, libjpeg encountered an error
-        jpeg_destroy_decompress(&cinfo);
+        jpeg_abort_decompress(cinfo);
         *error = JPEGARCHIVE_UNSUPPORTED;
         return 0;
     }
     
-    jpeg_create_decompress(&cinfo);
-    jpeg_mem_src(&cinfo, buf, bufSize);
+    if (buf) {
+        jpeg_mem_src(cinfo, buf, bufSize);
+    }
     
     // Read header
-    jpeg_read_header(&cinfo, TRUE);
+    jpeg_read_header(cinfo, TRUE);
     
     // Check for unsupported color spaces
-    if (cinfo.jpeg_color_space == JCS_CMYK || cinfo.jpeg_color_space == JCS_YCCK) {
-        jpeg_destroy_decompress(&cinfo);
+    if (cinfo->jpeg_color_space == JCS_CMYK || cinfo->jpeg_color_space == JCS_YCCK) {
+        jpeg_abort_decompress(cinfo);
         *error = JPEGARCHIVE_UNSUPPORTED;
         return 0;
     }
 
     // Check if conversion is possible
-    if (pixelFormat == JCS_RGB && cinfo.jpeg_color_space != JCS_RGB &&
-        cinfo.jpeg_color_space != JCS_YCbCr && cinfo.jpeg_color_space != JCS_GRAYSCALE) {
-        jpeg_destroy_decompress(&cinfo);
+    if (pixelFormat == JCS_RGB && cinfo->jpeg_color_space != JCS_RGB &&
+        cinfo->jpeg_color_space != JCS_YCbCr && cinfo->jpeg_color_space != JCS_GRAYSCALE) {
+        jpeg_abort_decompress(cinfo);
         *error = JPEGARCHIVE_UNSUPPORTED;
         return 0;
     }
 
     // Check if grayscale conversion is possible
-    if (pixelFormat == JCS_GRAYSCALE && cinfo.jpeg_color_space != JCS_RGB &&
-        cinfo.jpeg_color_space != JCS_YCbCr && cinfo.jpeg_color_space != JCS_GRAYSCALE) {
-        jpeg_destroy_decompress(&cinfo);
+    if (pixelFormat == JCS_GRAYSCALE && cinfo->jpeg_color_space != JCS_RGB &&
+        cinfo->jpeg_color_space != JCS_YCbCr && cinfo->jpeg_color_space != JCS_GRAYSCALE) {
+        jpeg_abort_decompress(cinfo);
         *error = JPEGARCHIVE_UNSUPPORTED;
         return 0;
     }
 
-    cinfo.out_color_space = pixelFormat;
+    // A YCbCr image is decoded without color conversion, so its Y is the
+    // luma as stored, and each row is read into a scratch row and
+    // converted to RGB into the image
+    ycc = luma && pixelFormat == JCS_RGB && cinfo->jpeg_color_space == JCS_YCbCr;
+    cinfo->out_color_space = ycc ? JCS_YCbCr : pixelFormat;
     
     // Start decompression
-    jpeg_start_decompress(&cinfo);
+    jpeg_start_decompress(cinfo);
     
-    *width = cinfo.output_width;
-    *height = cinfo.output_height;
-    
-    // Allocate temporary row
-    row_stride = (*width) * cinfo.output_components;
-    buffer = (*cinfo.mem->alloc_sarray)((j_common_ptr) &cinfo, JPOOL_IMAGE, row_stride, 1);
+    *width = cinfo->output_width;
+    *height = cinfo->output_height;
     
     // Allocate image pixel buffer
-    *image = malloc(row_stride * (*height));
+    row_stride = (unsigned long)(*width) * cinfo->output_components;
+    *image = arena_alloc(arena, row_stride * (*height));
     if (!*image) {
-        jpeg_destroy_decompress(&cinfo);
+        jpeg_abort_decompress(cinfo);
         *error = JPEGARCHIVE_MEMORY_ERROR;
         return 0;
     }
     
-    // Read image row by row
-    int row = 0;
-    while (cinfo.output_scanline < cinfo.output_height) {
-        (void) jpeg_read_scanlines(&cinfo, buffer, 1);
-        memcpy((void *)((*image) + row_stride * row), buffer[0], row_stride);
-        row++;
+    if (luma) {
+        *luma = arena_alloc(arena, (size_t)(*width) * (*height));
+        row = ycc ? arena_alloc(arena, row_stride) : NULL;
+        if (!*luma || (ycc && !row)) {
+            jpeg_abort_decompress(cinfo);
+            *error = JPEGARCHIVE_MEMORY_ERROR;
+            return 0;
+        }
+    }
+    
+    // Decode straight into the image
+    while (cinfo->output_scanline < cinfo->output_height) {
+        JDIMENSION y = cinfo->output_scanline;
+        unsigned char *imageRow = *image + row_stride * y;
+        row_pointer[0] = ycc ? row : imageRow;
+        if (jpeg_read_scanlines(cinfo, row_pointer, 1) == 1 && ycc) {
+            yccToRgb(row, imageRow, *luma + (size_t)(*width) * y, *width);
+        }
+    }
+    
+    // Other images get their luma in one pass over the whole image
+    if (luma && !ycc) {
+        grayscaleInto(*image, *luma, *width, *height);
     }
     
-    jpeg_finish_decompress(&cinfo);
-    jpeg_destroy_decompress(&cinfo);
+    jpeg_finish_decompress(cinfo);
     
     return row_stride * (*height);
 }
 
 // Safe version of encodeJpeg that doesn't exit on errors
-static unsigned long safeEncodeJpeg(unsigned char **jpeg, unsigned char *buf, int width, int height, int pixelFormat, int quality, int progressive, int optimize, int subsample, jpegarchive_error_code_t *error) {
+static unsigned long safeEncodeJpeg(codec_t *codec, unsigned char **jpeg, unsigned char *buf, int width, int height, int pixelFormat, int quality, int progressive, int optimize, int subsample, jpegarchive_error_code_t *error) {
     long unsigned int jpegSize = 0;
-    struct jpeg_compress_struct cinfo;
-    struct jpegarchive_error_mgr jerr;
+    j_compress_ptr cinfo = &codec->cinfo;
+    unsigned char *presized = NULL;
     JSAMPROW row_pointer[1];
     int row_stride = width * (pixelFormat == JCS_RGB ? 3 : 1);
 
     *error = JPEGARCHIVE_OK;
 
-    // Set up error handling
-    cinfo.err = jpeg_std_error(&jerr.pub);
-    jerr.pub.error_exit = jpegarchive_error_exit;
-
     // Establish the setjmp return context
-    if (setjmp(jerr.setjmp_buffer)) {
+    if (setjmp(codec->jerr.setjmp_buffer)) {
         // If we get here, libjpeg encountered an error
-        jpeg_destroy_compress(&cinfo);
+        jpeg_abort_compress(cinfo);
         *error = JPEGARCHIVE_UNKNOWN_ERROR;
         return 0;
     }
 
-    jpeg_create_compress(&cinfo);
-
-    if (!optimize) {
-        if (jpeg_c_int_param_supported(&cinfo, JINT_COMPRESS_PROFILE)) {
-            jpeg_c_set_int_param(&cinfo, JINT_COMPRESS_PROFILE, JCP_FASTEST);
-        }
+    // The compressor is reused, so the profile of the previous encode
+    // must not carry over
+    if (jpeg_c_int_param_supported(cinfo, JINT_COMPRESS_PROFILE)) {
+        jpeg_c_set_int_param(cinfo, JINT_COMPRESS_PROFILE, optimize ? JCP_MAX_COMPRESSION : JCP_FASTEST);
     }
 
-    jpeg_mem_dest(&cinfo, jpeg, &jpegSize);
+    presized = codec_start_output(codec, jpeg, &jpegSize);
+    codec_reset_huffman(codec);
 
     // Set options
-    cinfo.image_width = width;
-    cinfo.image_height = height;
-    cinfo.input_components = pixelFormat == JCS_RGB ? 3 : 1;
-    cinfo.in_color_space = pixelFormat;
+    cinfo->image_width = width;
+    cinfo->image_height = height;
+    cinfo->input_components = pixelFormat == JCS_RGB ? 3 : 1;
+    cinfo->in_color_space = pixelFormat;
 
-    jpeg_set_defaults(&cinfo);
+    jpeg_set_defaults(cinfo);
 
     if (!optimize) {
-        if (jpeg_c_bool_param_supported(&cinfo, JBOOLEAN_TRELLIS_QUANT)) {
-            jpeg_c_set_bool_param(&cinfo, JBOOLEAN_TRELLIS_QUANT, FALSE);
+        if (jpeg_c_bool_param_supported(cinfo, JBOOLEAN_TRELLIS_QUANT)) {
+            jpeg_c_set_bool_param(cinfo, JBOOLEAN_TRELLIS_QUANT, FALSE);
         }
-        if (jpeg_c_bool_param_supported(&cinfo, JBOOLEAN_TRELLIS_QUANT_DC)) {
-            jpeg_c_set_bool_param(&cinfo, JBOOLEAN_TRELLIS_QUANT_DC, FALSE);
+        if (jpeg_c_bool_param_supported(cinfo, JBOOLEAN_TRELLIS_QUANT_DC)) {
+            jpeg_c_set_bool_param(cinfo, JBOOLEAN_TRELLIS_QUANT_DC, FALSE);
         }
     }
 
     if (optimize && !progressive) {
-        cinfo.scan_info = NULL;
-        cinfo.num_scans = 0;
-        if (jpeg_c_bool_param_supported(&cinfo, JBOOLEAN_OPTIMIZE_SCANS)) {
-            jpeg_c_set_bool_param(&cinfo, JBOOLEAN_OPTIMIZE_SCANS, FALSE);
+        cinfo->scan_info = NULL;
+        cinfo->num_scans = 0;
+        if (jpeg_c_bool_param_supported(cinfo, JBOOLEAN_OPTIMIZE_SCANS)) {
+            jpeg_c_set_bool_param(cinfo, JBOOLEAN_OPTIMIZE_SCANS, FALSE);
         }
     }
 
     if (!optimize && progressive) {
-        jpeg_simple_progression(&cinfo);
+        jpeg_simple_progression(cinfo);
     }
 
     // Handle subsampling
-    if (cinfo.input_components == 3 && cinfo.in_color_space == JCS_RGB) {
+    if (cinfo->input_components == 3 && cinfo->in_color_space == JCS_RGB) {
         // Set default sampling factors based on libjpeg's defaults
-        jpeg_set_colorspace(&cinfo, JCS_YCbCr);
+        jpeg_set_colorspace(cinfo, JCS_YCbCr);
 
         if (subsample == SUBSAMPLE_444) {
             // 4:4:4 - no subsampling
-            cinfo.comp_info[0].h_samp_factor = 1;
-            cinfo.comp_info[0].v_samp_factor = 1;
-            cinfo.comp_info[1].h_samp_factor = 1;
-            cinfo.comp_info[1].v_samp_factor = 1;
-            cinfo.comp_info[2].h_samp_factor = 1;
-            cinfo.comp_info[2].v_samp_factor = 1;
+            cinfo->comp_info[0].h_samp_factor = 1;
+            cinfo->comp_info[0].v_samp_factor = 1;
+            cinfo->comp_info[1].h_samp_factor = 1;
+            cinfo->comp_info[1].v_samp_factor = 1;
+            cinfo->comp_info[2].h_samp_factor = 1;
+            cinfo->comp_info[2].v_samp_factor = 1;
         } else if (subsample == SUBSAMPLE_422) {
             // 4:2:2 - horizontal subsampling
-            cinfo.comp_info[0].h_samp_factor = 2;
-            cinfo.comp_info[0].v_samp_factor = 1;
-            cinfo.comp_info[1].h_samp_factor = 1;
-            cinfo.comp_info[1].v_samp_factor = 1;
-            cinfo.comp_info[2].h_samp_factor = 1;
-            cinfo.comp_info[2].v_samp_factor = 1;
+            cinfo->comp_info[0].h_samp_factor = 2;
+            cinfo->comp_info[0].v_samp_factor = 1;
+            cinfo->comp_info[1].h_samp_factor = 1;
+            cinfo->comp_info[1].v_samp_factor = 1;
+            cinfo->comp_info[2].h_samp_factor = 1;
+            cinfo->comp_info[2].v_samp_factor = 1;
         }
         // else SUBSAMPLE_DEFAULT (4:2:0) - use libjpeg's defaults
     }
 
-    jpeg_set_quality(&cinfo, quality, TRUE);
+    jpeg_set_quality(cinfo, quality, TRUE);
 
-    jpeg_start_compress(&cinfo, TRUE);
+    jpeg_start_compress(cinfo, TRUE);
 
     // Write image
-    while (cinfo.next_scanline < cinfo.image_height) {
-        row_pointer[0] = &buf[cinfo.next_scanline * row_stride];
-        (void) jpeg_write_scanlines(&cinfo, row_pointer, 1);
+    while (cinfo->next_scanline < cinfo->image_height) {
+        row_pointer[0] = &buf[cinfo->next_scanline * row_stride];
+        (void) jpeg_write_scanlines(cinfo, row_pointer, 1);
+    }
+
+    jpeg_finish_compress(cinfo);
+    codec_end_output(codec, presized, *jpeg, jpegSize);
+
+    return jpegSize;
+}
+
+// Counterpart of safeEncodeJpeg for the luma of the intermediate steps,
+// whose DCT was computed once: only quantization and entropy coding are
+// left, and the output is the same as encoding the luma pixels
+static unsigned long safeEncodeDct(codec_t *codec, unsigned char **jpeg, const struct dctImage *dct, int quality, jpegarchive_error_code_t *error) {
+    long unsigned int jpegSize = 0;
+    j_compress_ptr cinfo = &codec->cinfo;
+    unsigned char *presized = NULL;
+
+    *error = JPEGARCHIVE_OK;
+
+    // Establish the setjmp return context
+    if (setjmp(codec->jerr.setjmp_buffer)) {
+        // If we get here, libjpeg encountered an error
+        jpeg_abort_compress(cinfo);
+        *error = JPEGARCHIVE_UNKNOWN_ERROR;
+        return 0;
+    }
+
+    if (jpeg_c_int_param_supported(cinfo, JINT_COMPRESS_PROFILE)) {
+        jpeg_c_set_int_param(cinfo, JINT_COMPRESS_PROFILE, JCP_FASTEST);
     }
 
-    jpeg_finish_compress(&cinfo);
-    jpeg_destroy_compress(&cinfo);
+    presized = codec_start_output(codec, jpeg, &jpegSize);
+    codec_reset_huffman(codec);
+
+    cinfo->image_width = dct->width;
+    cinfo->image_height = dct->height;
+    cinfo->input_components = 1;
+    cinfo->in_color_space = JCS_GRAYSCALE;
+
+    jpeg_set_defaults(cinfo);
+
+    if (jpeg_c_bool_param_supported(cinfo, JBOOLEAN_TRELLIS_QUANT)) {
+        jpeg_c_set_bool_param(cinfo, JBOOLEAN_TRELLIS_QUANT, FALSE);
+    }
+    if (jpeg_c_bool_param_supported(cinfo, JBOOLEAN_TRELLIS_QUANT_DC)) {
+        jpeg_c_set_bool_param(cinfo, JBOOLEAN_TRELLIS_QUANT_DC, FALSE);
+    }
+
+    jpeg_set_quality(cinfo, quality, TRUE);
+
+    dctCompress(cinfo, dct);
+    codec_end_output(codec, presized, *jpeg, jpegSize);
 
     return jpegSize;
 }
 
-// Helper function to detect original subsampling from JPEG buffer
-static int detect_original_subsampling(const unsigned char *buf, unsigned long bufSize) {
+// Decodes the luma of a candidate into the codec's buffer, which stays
+// valid until the next decode with the same codec
+static unsigned char *safeDecodeGray(codec_t *codec, unsigned char *buf, unsigned long bufSize, int *width, int *height, jpegarchive_error_code_t *error) {
+    j_decompress_ptr cinfo = &codec->dinfo;
+    JSAMPROW row_pointer[1];
+
+    *error = JPEGARCHIVE_OK;
+
+    if (setjmp(codec->jerr.setjmp_buffer)) {
+        jpeg_abort_decompress(cinfo);
+        *error = JPEGARCHIVE_UNSUPPORTED;
+        return NULL;
+    }
+
+    jpeg_mem_src(cinfo, buf, bufSize);
+    jpeg_read_header(cinfo, TRUE);
+    cinfo->out_color_space = JCS_GRAYSCALE;
+    jpeg_start_decompress(cinfo);
+
+    *width = cinfo->output_width;
+    *height = cinfo->output_height;
+
+    unsigned long size = (unsigned long)(*width) * (*height);
+    if (size > codec->grayCapacity) {
+        free(codec->gray);
+        codec->gray = malloc(size);
+        codec->grayCapacity = codec->gray ? size : 0;
+        if (!codec->gray) {
+            jpeg_abort_decompress(cinfo);
+            *error = JPEGARCHIVE_MEMORY_ERROR;
+            return NULL;
+        }
+    }
+
+    // Decode straight into the buffer
+    while (cinfo->output_scanline < cinfo->output_height) {
+        row_pointer[0] = codec->gray + (unsigned long)cinfo->output_scanline * (*width);
+        (void) jpeg_read_scanlines(cinfo, row_pointer, 1);
+    }
+
+    jpeg_finish_decompress(cinfo);
+    return codec->gray;
+}
+
+// Source DCT coefficients for JPEGARCHIVE_ENGINE_COEFFICIENTS. They are
+// read once; every candidate requantizes them to its own tables instead of
+// going through the IDCT, color conversion and FDCT again.
+typedef struct {
     struct jpeg_decompress_struct cinfo;
     struct jpegarchive_error_mgr jerr;
+    JBLOCKROW *rows[MAX_COMPONENTS];  // block rows of each component
+} coefficient_source_t;
+
+static void coefficient_source_close(coefficient_source_t *source) {
+    if (!source) {
+        return;
+    }
+    for (int c = 0; c < MAX_COMPONENTS; c++) {
+        free(source->rows[c]);
+    }
+    jpeg_destroy_decompress(&source->cinfo);
+    free(source);
+}
+
+// Reads the coefficients of a YCbCr or grayscale JPEG. 'subsample' is the
+// requested SUBSAMPLE_* layout, or -1 to keep the source's. Returns NULL if
+// the source can't be used this way (the pixel engine is used instead).
+static coefficient_source_t *coefficient_source_open(const unsigned char *buf, unsigned long bufSize, int subsample) {
+    coefficient_source_t *source = calloc(1, sizeof(*source));
+    if (!source) {
+        return NULL;
+    }
 
     // Set up error handling
-    cinfo.err = jpeg_std_error(&jerr.pub);
-    jerr.pub.error_exit = jpegarchive_error_exit;
+    source->cinfo.err = jpeg_std_error(&source->jerr.pub);
+    source->jerr.pub.error_exit = jpegarchive_error_exit;
+
+    if (setjmp(source->jerr.setjmp_buffer)) {
+        coefficient_source_close(source);
+        return NULL;
+    }
+
+    jpeg_create_decompress(&source->cinfo);
+    jpeg_mem_src(&source->cinfo, (unsigned char *)buf, bufSize);
+    jpeg_read_header(&source->cinfo, TRUE);
+
+    j_decompress_ptr cinfo = &source->cinfo;
+    int usable = 0;
+    if (cinfo->jpeg_color_space == JCS_GRAYSCALE && cinfo->num_components == 1) {
+        usable = 1;
+    } else if (cinfo->jpeg_color_space == JCS_YCbCr && cinfo->num_components == 3) {
+        int h = cinfo->comp_info[0].h_samp_factor;
+        int v = cinfo->comp_info[0].v_samp_factor;
+
+        // Requantizing can't change the chroma resolution
+        if (subsample < 0) {
+            usable = 1;
+        } else if (subsample == SUBSAMPLE_444) {
+            usable = (h == 1 && v == 1);
+        } else if (subsample == SUBSAMPLE_422) {
+            usable = (h == 2 && v == 1);
+        } else {
+            usable = (h == 2 && v == 2);
+        }
+        for (int c = 1; c < 3; c++) {
+            if (cinfo->comp_info[c].h_samp_factor != 1 || cinfo->comp_info[c].v_samp_factor != 1) {
+                usable = 0;
+            }
+        }
+    }
+    if (!usable) {
+        coefficient_source_close(source);
+        return NULL;
+    }
+
+    jvirt_barray_ptr *arrays = jpeg_read_coefficients(cinfo);
+
+    // Collect the block rows up front so candidates can read them from
+    // several threads without going through the memory manager.
+    for (int c = 0; c < cinfo->num_components; c++) {
+        jpeg_component_info *comp = &cinfo->comp_info[c];
+
+        source->rows[c] = malloc(comp->height_in_blocks * sizeof(JBLOCKROW));
+        if (!source->rows[c] || !comp->quant_table) {
+            coefficient_source_close(source);
+            return NULL;
+        }
+        for (JDIMENSION row = 0; row < comp->height_in_blocks; row++) {
+            source->rows[c][row] = (*cinfo->mem->access_virt_barray)((j_common_ptr)cinfo, arrays[c], row, 1, FALSE)[0];
+        }
+    }
+
+    return source;
+}
+
+// Counterpart of safeEncodeJpeg for the coefficient engine: writes the
+// source coefficients requantized to the tables of the given quality.
+// With lumaOnly set, only the first component is written, as grayscale.
+static unsigned long requantizeJpeg(codec_t *codec, unsigned char **jpeg, const coefficient_source_t *source, int quality, int progressive, int optimize, int lumaOnly, jpegarchive_error_code_t *error) {
+    long unsigned int jpegSize = 0;
+    j_compress_ptr cinfo = &codec->cinfo;
+    unsigned char *presized = NULL;
+    j_decompress_ptr srcinfo = (j_decompress_ptr)&source->cinfo;
+    jvirt_barray_ptr arrays[MAX_COMPONENTS];
+
+    *error = JPEGARCHIVE_OK;
 
     // Establish the setjmp return context
-    if (setjmp(jerr.setjmp_buffer)) {
+    if (setjmp(codec->jerr.setjmp_buffer)) {
         // If we get here, libjpeg encountered an error
-        jpeg_destroy_decompress(&cinfo);
-        return SUBSAMPLE_DEFAULT;  // Default on error
+        jpeg_abort_compress(cinfo);
+        *error = JPEGARCHIVE_UNKNOWN_ERROR;
+        return 0;
+    }
+
+    if (jpeg_c_int_param_supported(cinfo, JINT_COMPRESS_PROFILE)) {
+        jpeg_c_set_int_param(cinfo, JINT_COMPRESS_PROFILE, optimize ? JCP_MAX_COMPRESSION : JCP_FASTEST);
     }
 
-    jpeg_create_decompress(&cinfo);
-    jpeg_mem_src(&cinfo, (unsigned char *)buf, bufSize);
+    presized = codec_start_output(codec, jpeg, &jpegSize);
+    codec_reset_huffman(codec);
 
-    // Read header to get component info
-    jpeg_read_header(&cinfo, TRUE);
+    // Keep the source's size, color space and sampling; only the
+    // quantization tables change. Luma uses table 0, chroma table 1.
+    jpeg_copy_critical_parameters(srcinfo, cinfo);
+    if (lumaOnly) {
+        jpeg_set_colorspace(cinfo, JCS_GRAYSCALE);
+    }
+    jpeg_set_quality(cinfo, quality, TRUE);
+    for (int c = 0; c < cinfo->num_components; c++) {
+        cinfo->comp_info[c].quant_tbl_no = c ? 1 : 0;
+    }
 
-    // Detect subsampling from component info
-    int subsample = SUBSAMPLE_DEFAULT;
+    if (progressive) {
+        jpeg_simple_progression(cinfo);
+    } else {
+        cinfo->scan_info = NULL;
+        cinfo->num_scans = 0;
+        if (jpeg_c_bool_param_supported(cinfo, JBOOLEAN_OPTIMIZE_SCANS)) {
+            jpeg_c_set_bool_param(cinfo, JBOOLEAN_OPTIMIZE_SCANS, FALSE);
+        }
+    }
 
-    if (cinfo.num_components == 3 && cinfo.jpeg_color_space == JCS_YCbCr) {
-        int h0 = cinfo.comp_info[0].h_samp_factor;
-        int v0 = cinfo.comp_info[0].v_samp_factor;
-        int h1 = cinfo.comp_info[1].h_samp_factor;
-        int v1 = cinfo.comp_info[1].v_samp_factor;
-        int h2 = cinfo.comp_info[2].h_samp_factor;
-        int v2 = cinfo.comp_info[2].v_samp_factor;
+    for (int c = 0; c < cinfo->num_components; c++) {
+        jpeg_component_info *comp = &srcinfo->comp_info[c];
+        arrays[c] = (*cinfo->mem->request_virt_barray)((j_common_ptr)cinfo, JPOOL_IMAGE, FALSE,
+            comp->width_in_blocks, comp->height_in_blocks, cinfo->comp_info[c].v_samp_factor);
+    }
 
-        // Check for common subsampling patterns
-        if (h0 == 1 && v0 == 1 && h1 == 1 && v1 == 1 && h2 == 1 && v2 == 1) {
-            // 4:4:4 - no subsampling
-            subsample = SUBSAMPLE_444;
-        } else if (h0 == 2 && v0 == 1 && h1 == 1 && v1 == 1 && h2 == 1 && v2 == 1) {
-            // 4:2:2 - horizontal subsampling
-            subsample = SUBSAMPLE_422;
-        } else if (h0 == 2 && v0 == 2 && h1 == 1 && v1 == 1 && h2 == 1 && v2 == 1) {
-            // 4:2:0 - both horizontal and vertical subsampling
-            subsample = SUBSAMPLE_DEFAULT;  // This is the default
-        } else if (h0 == 4 && v0 == 1 && h1 == 1 && v1 == 1 && h2 == 1 && v2 == 1) {
-            // 4:1:1 - convert to 4:2:0 for better compatibility
-            subsample = SUBSAMPLE_DEFAULT;  // Use 4:2:0 instead of 4:1:1
-        } else {
-            // Unknown or uncommon pattern, use default
-            subsample = SUBSAMPLE_DEFAULT;
+    jpeg_write_coefficients(cinfo, arrays);
+
+    for (int c = 0; c < cinfo->num_components; c++) {
+        jpeg_component_info *comp = &srcinfo->comp_info[c];
+        const UINT16 *from = comp->quant_table->quantval;
+        const UINT16 *to = cinfo->quant_tbl_ptrs[cinfo->comp_info[c].quant_tbl_no]->quantval;
+        uint64_t reciprocal[DCTSIZE2];
+
+        // n / to[k] == (n * ceil(2^32 / to[k])) >> 32 for every n < 2^24
+        // (baseline tables are at most 255)
+        for (int k = 0; k < DCTSIZE2; k++) {
+            reciprocal[k] = ((1ULL << 32) + to[k] - 1) / to[k];
+        }
+
+        for (JDIMENSION row = 0; row < comp->height_in_blocks; row++) {
+            JBLOCKROW in = source->rows[c][row];
+            JBLOCKROW out = (*cinfo->mem->access_virt_barray)((j_common_ptr)cinfo, arrays[c], row, 1, TRUE)[0];
+
+            for (JDIMENSION block = 0; block < comp->width_in_blocks; block++) {
+                for (int k = 0; k < DCTSIZE2; k++) {
+                    // Round the dequantized value to the nearest step of the
+                    // new table; zeros stay zero because to[k] / 2 < to[k]
+                    int value = in[block][k] * from[k];
+                    uint32_t n = (uint32_t)abs(value) + to[k] / 2;
+                    JCOEF q = (JCOEF)((n < (1U << 24)) ? (n * reciprocal[k]) >> 32 : n / to[k]);
+                    out[block][k] = (value < 0) ? -q : q;
+                }
+            }
         }
     }
 
-    jpeg_destroy_decompress(&cinfo);
-    return subsample;
+    jpeg_finish_compress(cinfo);
+    codec_end_output(codec, presized, *jpeg, jpegSize);
+
+    return jpegSize;
+}
+
+// Chroma layout of an indexed JPEG, or JPEGARCHIVE_SAMPLING_NONE when it
+// is not YCbCr. Color spaces are told apart by libjpeg's rules.
+static jpegarchive_sampling_t marker_sampling(const struct jpegMarkers *markers) {
+    if (markers->components != 3) {
+        return JPEGARCHIVE_SAMPLING_NONE;
+    }
+
+    int rgbIds = markers->component[0].id == 'R' && markers->component[1].id == 'G' && markers->component[2].id == 'B';
+    int rgb = markers->jfif ? 0 : (markers->adobeTransform >= 0) ? markers->adobeTransform == 0 : rgbIds;
+    if (rgb) {
+        return JPEGARCHIVE_SAMPLING_NONE;
+    }
+
+    int h0 = markers->component[0].h;
+    int v0 = markers->component[0].v;
+    for (int i = 1; i < 3; i++) {
+        if (markers->component[i].h != 1 || markers->component[i].v != 1) {
+            return JPEGARCHIVE_SAMPLING_OTHER;
+        }
+    }
+
+    if (h0 == 1 && v0 == 1) {
+        return JPEGARCHIVE_SAMPLING_444;
+    } else if (h0 == 2 && v0 == 1) {
+        return JPEGARCHIVE_SAMPLING_422;
+    } else if (h0 == 2 && v0 == 2) {
+        return JPEGARCHIVE_SAMPLING_420;
+    } else if (h0 == 4 && v0 == 1) {
+        return JPEGARCHIVE_SAMPLING_411;
+    }
+    return JPEGARCHIVE_SAMPLING_OTHER;
+}
+
+// Subsampling method that keeps the original's chroma layout
+static int original_subsampling(const struct jpegMarkers *markers) {
+    switch (marker_sampling(markers)) {
+        case JPEGARCHIVE_SAMPLING_444:
+            return SUBSAMPLE_444;
+        case JPEGARCHIVE_SAMPLING_422:
+            return SUBSAMPLE_422;
+        default:
+            // 4:2:0 itself, and in place of 4:1:1 and uncommon layouts for
+            // better compatibility
+            return SUBSAMPLE_DEFAULT;
+    }
+}
+
+// Frames libjpeg decodes: 8-bit baseline, extended and progressive, with
+// Huffman or arithmetic coding
+static int frame_supported(const struct jpegMarkers *markers) {
+    switch (markers->frameMarker) {
+        case 0xc0: case 0xc1: case 0xc2: case 0xc9: case 0xca:
+            return markers->precision == 8 && markers->width > 0 && markers->height > 0;
+        default:
+            return 0;
+    }
 }
 
 // Helper function to convert quality preset to target value
@@ -284,258 +785,1126 @@ static float get_target_from_preset(jpegarchive_quality_t preset, jpegarchive_me
     return 0.9999;
 }
 
-jpegarchive_recompress_output_t jpegarchive_recompress(jpegarchive_recompress_input_t input) {
-    jpegarchive_recompress_output_t output;
-    memset(&output, 0, sizeof(output));
-    
-    // Validate input
-    if (!input.jpeg || input.length <= 0) {
-        output.error_code = JPEGARCHIVE_INVALID_INPUT;
-        return output;
-    }
-    
-    // Check if input is JPEG
-    if (!checkJpegMagic(input.jpeg, input.length)) {
-        output.error_code = JPEGARCHIVE_NOT_JPEG;
-        return output;
-    }
-    
-    // Set default values if not provided
-    int min = (input.min > 0) ? input.min : 40;
-    int max = (input.max > 0) ? input.max : 95;
-    int loops = (input.loops > 0) ? input.loops : 6;
-    
-    if (min > max) {
-        output.error_code = JPEGARCHIVE_INVALID_INPUT;
-        return output;
+// Upper bound on the candidates evaluated concurrently by one search round
+#define SEARCH_MAX_THREADS 64
+
+// State shared by all candidate evaluations of one recompression
+typedef struct {
+    unsigned char *original;
+    unsigned char *originalGray;
+    int width;
+    int height;
+    int subsample;
+    fast_ssim_model *model;
+    const coefficient_source_t *coefficients;  // NULL for the pixel engine
+    const struct dctImage *dct;  // luma DCT of the intermediate steps, NULL if not cached
+    codec_t *codecs;          // one per candidate a round may evaluate
+    unsigned char *scratch;   // SSIM scratch, scratchSize bytes per codec
+    size_t scratchSize;
+    int slots;                // number of codecs and scratch areas
+} search_context_t;
+
+// One candidate of the quality search. Each node carries the bisection
+// interval it was reached with, so the candidates a serial search could
+// visit next can be encoded ahead of time on other threads.
+typedef struct {
+    const search_context_t *context;
+    codec_t *codec;  // set when the node is evaluated
+    void *scratch;   // SSIM scratch that goes with the codec
+    int min;
+    int max;
+    int attempt;
+    int quality;
+    int below;  // node searched next when metric < target, -1 if none
+    int above;  // node searched next otherwise, -1 if none
+    unsigned char *compressed;  // only kept for the final attempt
+    unsigned long compressedSize;
+    float metric;
+    jpegarchive_error_code_t error;
+} search_node_t;
+
+static void search_node_init(search_node_t *node, const search_context_t *context, int min, int max, int attempt) {
+    node->context = context;
+    node->codec = NULL;
+    node->scratch = NULL;
+    node->min = min;
+    node->max = max;
+    // Terminate early once the bisection interval is a singleton
+    node->attempt = (min == max) ? 0 : attempt;
+    node->quality = min + (max - min) / 2;
+    node->below = -1;
+    node->above = -1;
+    node->compressed = NULL;
+    node->compressedSize = 0;
+    node->metric = 0;
+    node->error = JPEGARCHIVE_OK;
+}
+
+// Initializes 'child' with the interval that follows 'node' for the given
+// outcome of its comparison against the target
+static void search_node_next(search_node_t *child, const search_node_t *node, int below) {
+    int min = node->min;
+    int max = node->max;
+
+    if (below) {
+        min = (node->quality + 1 < max) ? node->quality + 1 : max;
+    } else {
+        max = (node->quality - 1 > min) ? node->quality - 1 : min;
     }
-    
-    // Use provided target value if non-zero, otherwise use preset
-    float target = (input.target > 0) ? input.target : get_target_from_preset(input.quality, input.method);
-    
-    // Decode original image
-    unsigned char *original = NULL;
-    unsigned char *originalGray = NULL;
+    search_node_init(child, node->context, min, max, node->attempt - 1);
+}
+
+// Gives the node the codec and scratch of the given slot
+static void search_node_bind(search_node_t *node, int slot) {
+    const search_context_t *context = node->context;
+
+    node->codec = &context->codecs[slot];
+    node->scratch = context->scratch + slot * context->scratchSize;
+}
+
+// Encodes, decodes and measures one candidate (thread entry point)
+static void *search_node_evaluate(void *arg) {
+    search_node_t *node = arg;
+    const search_context_t *context = node->context;
+    int final = (node->attempt == 0);
     int width, height;
-    jpegarchive_error_code_t decode_error;
-    
-    long originalSize = safeDecodeJpeg((unsigned char *)input.jpeg, input.length, &original, &width, &height, JCS_RGB, &decode_error);
-    if (!originalSize) {
-        output.error_code = decode_error;
-        return output;
-    }
-    
-    // Convert to grayscale for comparison
-    long originalGraySize = grayscale(original, &originalGray, width, height);
-    if (!originalGraySize) {
-        free(original);
-        output.error_code = JPEGARCHIVE_MEMORY_ERROR;
-        return output;
-    }
-    
-    // Check if already processed and get metadata
-    unsigned char *metaBuf = NULL;
-    unsigned int metaSize = 0;
-    
-    // First check if already processed
-    unsigned char *tempBuf = NULL;
-    unsigned int tempSize = 0;
-    if (getMetadata(input.jpeg, input.length, &tempBuf, &tempSize, "Compressed by jpeg-recompress")) {
-        // Comment found - file already processed
-        free(tempBuf);
-        free(original);
-        free(originalGray);
-        output.error_code = JPEGARCHIVE_NOT_SUITABLE;
-        return output;
+
+    // Only the final attempt is encoded in color, progressive and
+    // optimized. The metric only looks at luma, so the other attempts
+    // encode just that with the luma table of their quality.
+    if (context->coefficients) {
+        node->compressedSize = requantizeJpeg(node->codec, &node->compressed, context->coefficients, node->quality, final, final, !final, &node->error);
+    } else if (final) {
+        node->compressedSize = safeEncodeJpeg(node->codec, &node->compressed, context->original, context->width, context->height, JCS_RGB, node->quality, final, final, context->subsample, &node->error);
+    } else if (context->dct) {
+        node->compressedSize = safeEncodeDct(node->codec, &node->compressed, context->dct, node->quality, &node->error);
+    } else {
+        node->compressedSize = safeEncodeJpeg(node->codec, &node->compressed, context->originalGray, context->width, context->height, JCS_GRAYSCALE, node->quality, 0, 0, context->subsample, &node->error);
     }
-    // Free tempBuf if it was allocated (when comment not found)
-    if (tempBuf) {
-        free(tempBuf);
-        tempBuf = NULL;
+    if (!node->compressedSize) {
+        return NULL;
     }
-    
-    // Get metadata for preservation (without comment check)
-    int metaResult = getMetadata(input.jpeg, input.length, &metaBuf, &metaSize, NULL);
-    if (metaResult < 0) {
-        // Metadata allocation failed
-        free(original);
-        free(originalGray);
-        output.error_code = JPEGARCHIVE_MEMORY_ERROR;
-        return output;
+
+    // Decode compressed for comparison
+    unsigned char *compressedGray = safeDecodeGray(node->codec, node->compressed, node->compressedSize, &width, &height, &node->error);
+    if (!compressedGray) {
+        return NULL;
     }
 
-    // Determine subsampling method to use
-    int subsample_method = SUBSAMPLE_DEFAULT;  // Default to 4:2:0
+    if (context->model) {
+        node->metric = fast_ssim_compare_scratch(context->model, compressedGray, width, node->scratch);
+        // Check for SSIM calculation failure (returns INFINITY on error)
+        if (node->metric == INFINITY || node->metric != node->metric) {  // NaN check
+            node->error = JPEGARCHIVE_MEMORY_ERROR;
+        }
+    }
 
-    // Validate input.subsample value and use default if invalid
-    if (input.subsample == JPEGARCHIVE_SUBSAMPLE_420) {
-        subsample_method = SUBSAMPLE_DEFAULT;  // Force 4:2:0
-    } else if (input.subsample == JPEGARCHIVE_SUBSAMPLE_KEEP) {
-        // Keep original subsampling
-        subsample_method = detect_original_subsampling(input.jpeg, input.length);
-    } else if (input.subsample == JPEGARCHIVE_SUBSAMPLE_444) {
-        subsample_method = SUBSAMPLE_444;  // Force 4:4:4
-    } else {
-        // Invalid value, use default
-        subsample_method = SUBSAMPLE_DEFAULT;
+    if (!final) {
+        free(node->compressed);
+        node->compressed = NULL;
     }
+    return NULL;
+}
 
-    // Binary search for optimal quality
-    unsigned char *compressed = NULL;
-    unsigned long compressedSize = 0;
-    int finalQuality = min;
-    float finalMetric = 0;
-    
-    for (int attempt = loops - 1; attempt >= 0; --attempt) {
-        int quality = min + (max - min) / 2;
-        
-        if (min == max) {
-            attempt = 0;
-        }
-        
-        // Free previous compression if exists
-        if (compressed && attempt > 0) {
-            free(compressed);
-            compressed = NULL;
-        }
-        
-        // Compress with current quality
-        int progressive = (attempt == 0) ? 1 : 0;
-        int optimize = (attempt == 0) ? 1 : 0;
-        jpegarchive_error_code_t encode_error;
-        compressedSize = safeEncodeJpeg(&compressed, original, width, height, JCS_RGB, quality, progressive, optimize, subsample_method, &encode_error);
-        
-        if (!compressedSize) {
-            free(original);
-            free(originalGray);
-            if (compressed) free(compressed);
-            if (metaBuf) free(metaBuf);
-            output.error_code = encode_error;
-            return output;
-        }
-        
-        // Decode compressed for comparison
-        unsigned char *compressedGray = NULL;
-        jpegarchive_error_code_t decode_error2;
-        long compressedGraySize = safeDecodeJpeg(compressed, compressedSize, &compressedGray, &width, &height, JCS_GRAYSCALE, &decode_error2);
-        
-        if (!compressedGraySize) {
-            free(original);
-            free(originalGray);
-            free(compressed);
-            if (metaBuf) free(metaBuf);
-            output.error_code = decode_error2;
-            return output;
+// Expands nodes[0] breadth-first into the next levels of the bisection
+// tree, up to 'count' nodes, and evaluates them concurrently, node i in
+// slot i. Returns the number of nodes evaluated.
+static int search_round(search_node_t *nodes, int count) {
+    pthread_t threads[SEARCH_MAX_THREADS];
+    int started[SEARCH_MAX_THREADS];
+    int n = 1;
+
+    for (int i = 0; i < n && n < count; i++) {
+        if (nodes[i].attempt == 0) {
+            continue;
         }
-        
-        // Calculate metric
-        float metric = 0;
-        if (input.method == JPEGARCHIVE_METHOD_SSIM) {
-            metric = iqa_ssim(originalGray, compressedGray, width, height, width, 0, 0);
-            // Check for SSIM calculation failure (returns INFINITY on error)
-            if (metric == INFINITY || metric != metric) {  // NaN check
-                free(compressed);
-                free(compressedGray);
-                free(original);
-                free(originalGray);
-                if (metaBuf) free(metaBuf);
-                output.error_code = JPEGARCHIVE_MEMORY_ERROR;
-                return output;
-            }
+        nodes[i].below = n;
+        search_node_next(&nodes[n++], &nodes[i], 1);
+        if (n < count) {
+            nodes[i].above = n;
+            search_node_next(&nodes[n++], &nodes[i], 0);
         }
+    }
 
-        finalQuality = quality;
-        finalMetric = metric;
-        
-        // Adjust quality based on metric
-        if (metric < target) {
-            min = (quality + 1 < max) ? quality + 1 : max;
-        } else {
-            max = (quality - 1 > min) ? quality - 1 : min;
+    for (int i = 0; i < n; i++) {
+        search_node_bind(&nodes[i], i);
+    }
+
+    // The calling thread takes the first node; a node whose thread cannot
+    // be started is evaluated inline.
+    for (int i = 1; i < n; i++) {
+        started[i] = (pthread_create(&threads[i], NULL, search_node_evaluate, &nodes[i]) == 0);
+        if (!started[i]) {
+            search_node_evaluate(&nodes[i]);
         }
-        
-        free(compressedGray);
-        
-        // Keep compressed data on last iteration
-        if (attempt > 0) {
-            free(compressed);
-            compressed = NULL;
+    }
+    search_node_evaluate(&nodes[0]);
+    for (int i = 1; i < n; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
         }
     }
-    
-    // Check if output is larger than input
-    if (compressedSize >= (unsigned long)input.length) {
-        free(original);
-        free(originalGray);
-        free(compressed);
-        if (metaBuf) free(metaBuf);
-        output.error_code = JPEGARCHIVE_NOT_SUITABLE;
-        return output;
+    return n;
+}
+
+// Binary search over [min, max]. With several threads each round also
+// encodes the candidates the next bisection steps could pick, then follows
+// the same decisions as the serial search, so the result does not depend
+// on the thread count. Each round evaluates up to context->slots
+// candidates. On success 'result' holds the final encode.
+static jpegarchive_error_code_t search_bisect(const search_context_t *context, int min, int max, int loops, float target, search_node_t *result) {
+    search_node_t nodes[SEARCH_MAX_THREADS];
+    search_node_t *node = NULL;
+    jpegarchive_error_code_t error = JPEGARCHIVE_OK;
+    int done = 0;
+
+    search_node_init(&nodes[0], context, min, max, loops - 1);
+    while (!done && error == JPEGARCHIVE_OK) {
+        int count = search_round(nodes, context->slots);
+        int next = 0;
+
+        do {
+            node = &nodes[next];
+            if (node->error != JPEGARCHIVE_OK) {
+                error = node->error;
+                break;
+            }
+
+            if (node->attempt == 0) {
+                // Keep compressed data of the last iteration
+                *result = *node;
+                node->compressed = NULL;
+                done = 1;
+                break;
+            }
+
+            next = (node->metric < target) ? node->below : node->above;
+        } while (next >= 0);
+
+        for (int i = 0; i < count; i++) {
+            free(nodes[i].compressed);
+        }
+
+        if (!done && error == JPEGARCHIVE_OK) {
+            // Continue from the first step that was not evaluated yet
+            search_node_t last = *node;
+            search_node_next(&nodes[0], &last, last.metric < target);
+        }
+    }
+
+    return error;
+}
+
+// Bisection whose early steps are measured on 'proxy', a cheaper stand-in
+// for the luma: a scaled down copy (see proxyFactor in src/search.h) or a
+// mosaic of tiles (see tileSample). The first step is measured on both to
+// calibrate the proxy target, which is stored in 'calibrated'; the last
+// 'fullSteps' steps run on the full image through search_bisect.
+static jpegarchive_error_code_t search_proxy(const search_context_t *context, const search_context_t *proxy, int min, int max, int loops, float target, int fullSteps, float *calibrated, search_node_t *result) {
+    search_node_t full, node;
+
+    *calibrated = target;
+    search_node_init(&full, context, min, max, loops - 1);
+    if (full.attempt == 0) {
+        return search_bisect(context, min, max, loops, target, result);
+    }
+    search_node_bind(&full, 0);
+    search_node_evaluate(&full);
+    if (full.error != JPEGARCHIVE_OK) {
+        return full.error;
+    }
+
+    search_node_init(&node, proxy, min, max, loops - 1);
+    search_node_bind(&node, 0);
+    search_node_evaluate(&node);
+    if (node.error != JPEGARCHIVE_OK) {
+        return node.error;
+    }
+
+    *calibrated = proxyTarget(target, full.metric, node.metric);
+    search_node_next(&node, &full, full.metric < target);
+
+    while (node.attempt >= fullSteps) {
+        search_node_t step;
+        search_node_init(&step, proxy, node.min, node.max, node.attempt);
+        search_node_bind(&step, 0);
+        search_node_evaluate(&step);
+        if (step.error != JPEGARCHIVE_OK) {
+            return step.error;
+        }
+        search_node_next(&node, &step, step.metric < *calibrated);
+    }
+
+    return search_bisect(context, node.min, node.max, node.attempt + 1, target, result);
+}
+
+// Interpolating search (see qualitySearchNext in src/search.h). Measures
+// at most loops - 1 qualities, then encodes the answer into 'result'.
+static jpegarchive_error_code_t search_interpolate(const search_context_t *context, int min, int max, int loops, float target, search_node_t *result) {
+    struct qualitySearch search;
+    search_node_t node;
+    int quality;
+
+    qualitySearchInit(&search, min, max, target, 0);
+    for (int attempt = loops - 1; attempt > 0 && (quality = qualitySearchNext(&search)); --attempt) {
+        search_node_init(&node, context, search.min, search.max, attempt);
+        search_node_bind(&node, 0);
+        node.quality = quality;
+        search_node_evaluate(&node);
+        if (node.error != JPEGARCHIVE_OK) {
+            free(node.compressed);
+            return node.error;
+        }
+        qualitySearchUpdate(&search, quality, node.metric);
+    }
+
+    search_node_init(result, context, search.max, search.max, 0);
+    search_node_bind(result, 0);
+    search_node_evaluate(result);
+    if (result->error != JPEGARCHIVE_OK) {
+        free(result->compressed);
+        result->compressed = NULL;
+    }
+    return result->error;
+}
+
+// Everything a worker keeps from one image to the next
+struct jpegarchive_context {
+    arena_t arena;                        // per-image buffers, reset after each call
+    codec_t codecs[SEARCH_MAX_THREADS];
+    int codecCount;                       // codecs initialized so far
+    unsigned char *input;                 // streamed input, kept between images
+    size_t inputCapacity;
+};
+
+jpegarchive_context_t *jpegarchive_context_create(int flags) {
+    jpegarchive_context_t *ctx = calloc(1, sizeof(jpegarchive_context_t));
+    if (!ctx) {
+        return NULL;
+    }
+
+    arena_init(&ctx->arena, (flags & JPEGARCHIVE_CONTEXT_HUGE_PAGES) != 0);
+    if (!codec_init(&ctx->codecs[0])) {
+        free(ctx);
+        return NULL;
+    }
+    ctx->codecCount = 1;
+    return ctx;
+}
+
+void jpegarchive_context_destroy(jpegarchive_context_t *ctx) {
+    if (!ctx) {
+        return;
+    }
+    for (int i = 0; i < ctx->codecCount; i++) {
+        codec_destroy(&ctx->codecs[i]);
+    }
+    arena_destroy(&ctx->arena);
+    free(ctx->input);
+    free(ctx);
+}
+
+// Initializes codecs up to 'count'; they are kept for later images
+static int context_reserve_codecs(jpegarchive_context_t *ctx, int count) {
+    while (ctx->codecCount < count) {
+        if (!codec_init(&ctx->codecs[ctx->codecCount])) {
+            return 0;
+        }
+        ctx->codecCount++;
+    }
+    return 1;
+}
+
+// Streamed input: a libjpeg source manager that pulls the file through the
+// caller's read callback while the image decodes. Every byte is also kept
+// in the context's input buffer, because the metadata, the coefficient
+// engine and the final size check need the whole file afterwards.
+#define STREAM_CHUNK 65536
+
+typedef struct {
+    struct jpeg_source_mgr pub;
+    jpegarchive_source_t source;
+    jpegarchive_context_t *ctx;
+    size_t size;                     // bytes read so far
+    int ended;
+    jpegarchive_error_code_t error;  // set when reading failed
+} stream_source_t;
+
+// Appends the next chunk of input to the context's buffer. Returns the
+// number of bytes read, 0 at the end and -1 on error.
+static int64_t stream_read(stream_source_t *stream) {
+    jpegarchive_context_t *ctx = stream->ctx;
+
+    if (stream->ended) {
+        return 0;
+    }
+    if (ctx->inputCapacity - stream->size < STREAM_CHUNK) {
+        size_t capacity = ctx->inputCapacity ? ctx->inputCapacity : 4 * STREAM_CHUNK;
+        while (capacity - stream->size < STREAM_CHUNK) {
+            capacity *= 2;
+        }
+        unsigned char *grown = realloc(ctx->input, capacity);
+        if (!grown) {
+            stream->error = JPEGARCHIVE_MEMORY_ERROR;
+            return -1;
+        }
+        ctx->input = grown;
+        ctx->inputCapacity = capacity;
+    }
+
+    int64_t count = stream->source.read(stream->source.user, ctx->input + stream->size, STREAM_CHUNK);
+    if (count < 0 || count > STREAM_CHUNK) {
+        stream->error = JPEGARCHIVE_IO_ERROR;
+        return -1;
+    }
+    if (count == 0) {
+        stream->ended = 1;
+    }
+    stream->size += count;
+    return count;
+}
+
+static void stream_init_source(j_decompress_ptr cinfo) {
+    (void)cinfo;
+}
+
+static boolean stream_fill_input_buffer(j_decompress_ptr cinfo) {
+    static const JOCTET eoi[2] = { 0xff, JPEG_EOI };
+    stream_source_t *stream = (stream_source_t *)cinfo->src;
+    size_t start = stream->size;
+    int64_t count = stream_read(stream);
+
+    if (count < 0) {
+        ERREXIT(cinfo, JERR_FILE_READ);
+    }
+    if (count == 0) {
+        // Truncated file: end it like jpeg_mem_src does
+        WARNMS(cinfo, JWRN_JPEG_EOF);
+        stream->pub.next_input_byte = eoi;
+        stream->pub.bytes_in_buffer = 2;
+        return TRUE;
+    }
+    stream->pub.next_input_byte = stream->ctx->input + start;
+    stream->pub.bytes_in_buffer = count;
+    return TRUE;
+}
+
+static void stream_skip_input_data(j_decompress_ptr cinfo, long num_bytes) {
+    struct jpeg_source_mgr *src = cinfo->src;
+
+    if (num_bytes <= 0) {
+        return;
+    }
+    while (num_bytes > (long)src->bytes_in_buffer) {
+        num_bytes -= (long)src->bytes_in_buffer;
+        (void)(*src->fill_input_buffer)(cinfo);
+    }
+    src->next_input_byte += num_bytes;
+    src->bytes_in_buffer -= num_bytes;
+}
+
+static void stream_term_source(j_decompress_ptr cinfo) {
+    (void)cinfo;
+}
+
+// Reads enough of the stream to check that it is a JPEG
+static jpegarchive_error_code_t stream_open(stream_source_t *stream, jpegarchive_context_t *ctx, jpegarchive_source_t source) {
+    memset(stream, 0, sizeof(*stream));
+    stream->source = source;
+    stream->ctx = ctx;
+    stream->pub.init_source = stream_init_source;
+    stream->pub.fill_input_buffer = stream_fill_input_buffer;
+    stream->pub.skip_input_data = stream_skip_input_data;
+    stream->pub.resync_to_restart = jpeg_resync_to_restart;
+    stream->pub.term_source = stream_term_source;
+
+    while (stream->size < 2 && !stream->ended) {
+        if (stream_read(stream) < 0) {
+            return stream->error;
+        }
+    }
+    if (stream->size == 0) {
+        return JPEGARCHIVE_INVALID_INPUT;
+    }
+    if (!checkJpegMagic(ctx->input, stream->size)) {
+        return JPEGARCHIVE_NOT_JPEG;
+    }
+    stream->pub.next_input_byte = ctx->input;
+    stream->pub.bytes_in_buffer = stream->size;
+    return JPEGARCHIVE_OK;
+}
+
+// Reads the rest of the stream, past the end of the image
+static jpegarchive_error_code_t stream_drain(stream_source_t *stream) {
+    while (!stream->ended) {
+        if (stream_read(stream) < 0) {
+            return stream->error;
+        }
+    }
+    return JPEGARCHIVE_OK;
+}
+
+// Result cache: one file per input, named after a 128-bit hash of the
+// input bytes and every search parameter that affects the result. Entries
+// are written to a temporary file and renamed into place, so readers in
+// any thread or process only ever see complete entries.
+#define CACHE_VERSION 2  // bump when the search or the encoder changes results
+#define CACHE_MAGIC "JAC1"
+
+struct jpegarchive_cache {
+    char *path;
+    int flags;
+    pthread_mutex_t mutex;  // guards the fields below
+    unsigned int sequence;  // numbers temporary files
+    int64_t hits;
+};
+
+typedef struct {
+    char magic[4];
+    uint64_t key[2];
+    int32_t error_code;
+    int32_t quality;
+    double metric;
+    int64_t length;
+    int32_t stored;  // whether the output follows
+} cache_entry_t;
+
+static uint64_t hash_mix(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+static uint64_t hash_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+// MurmurHash3 x64_128, a few GB/s, which keeps hashing far below the cost
+// of even decoding the image
+static void content_hash(const unsigned char *data, size_t length, uint64_t seed, uint64_t hash[2]) {
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    uint64_t h1 = seed, h2 = seed, k1, k2;
+    size_t blocks = length / 16;
+
+    for (size_t i = 0; i < blocks; i++) {
+        memcpy(&k1, data + i * 16, 8);
+        memcpy(&k2, data + i * 16 + 8, 8);
+
+        h1 ^= hash_rotl(k1 * c1, 31) * c2;
+        h1 = (hash_rotl(h1, 27) + h2) * 5 + 0x52dce729;
+        h2 ^= hash_rotl(k2 * c2, 33) * c1;
+        h2 = (hash_rotl(h2, 31) + h1) * 5 + 0x38495ab5;
+    }
+
+    const unsigned char *tail = data + blocks * 16;
+    k1 = k2 = 0;
+    for (size_t i = length & 15; i > 8; i--) {
+        k2 ^= (uint64_t)tail[i - 1] << ((i - 9) * 8);
+    }
+    for (size_t i = MIN(length & 15, 8); i > 0; i--) {
+        k1 ^= (uint64_t)tail[i - 1] << ((i - 1) * 8);
+    }
+    h2 ^= hash_rotl(k2 * c2, 33) * c1;
+    h1 ^= hash_rotl(k1 * c1, 31) * c2;
+
+    h1 ^= length;
+    h2 ^= length;
+    h1 += h2;
+    h2 += h1;
+    h1 = hash_mix(h1);
+    h2 = hash_mix(h2);
+    h1 += h2;
+    h2 += h1;
+    hash[0] = h1;
+    hash[1] = h2;
+}
+
+// The thread count is left out: it doesn't change the result
+static void cache_key(const jpegarchive_recompress_input_t *input, uint64_t key[2]) {
+    int32_t params[12] = {
+        CACHE_VERSION, input->min, input->max, input->loops, input->quality, input->method,
+        input->subsample, input->search, input->engine, input->proxy, input->tiles, 0
+    };
+    uint64_t seed[2];
+
+    memcpy(&params[11], &input->target, sizeof(float));
+    content_hash((const unsigned char *)VERSION, strlen(VERSION), CACHE_VERSION, seed);
+    content_hash((const unsigned char *)params, sizeof(params), seed[0], seed);
+    content_hash(input->jpeg, input->length, seed[0] ^ seed[1], key);
+}
+
+// Path of the entry for 'key', or with 'suffix' of a file next to it
+static char *cache_path(const jpegarchive_cache_t *cache, const uint64_t key[2], const char *suffix) {
+    size_t length = strlen(cache->path) + 2 + 33 + strlen(suffix) + 1;
+    char *path = malloc(length);
+
+    if (path) {
+        snprintf(path, length, "%s/%02x/%014llx%016llx%s", cache->path, (unsigned int)(key[0] >> 56),
+                 (unsigned long long)(key[0] & 0xffffffffffffffULL), (unsigned long long)key[1], suffix);
+    }
+    return path;
+}
+
+static int make_directory(const char *path) {
+#ifdef _WIN32
+    return _mkdir(path) == 0 || errno == EEXIST;
+#else
+    return mkdir(path, 0777) == 0 || errno == EEXIST;
+#endif
+}
+
+// Returns 1 and fills 'output' when the entry holds the complete result,
+// 2 when it only holds the quality (in output->quality), 0 on a miss
+static int cache_lookup(jpegarchive_cache_t *cache, const uint64_t key[2], jpegarchive_recompress_output_t *output) {
+    char *path = cache_path(cache, key, "");
+    FILE *file = path ? fopen(path, "rb") : NULL;
+    cache_entry_t entry;
+    int found = 0;
+
+    free(path);
+    if (!file) {
+        return 0;
+    }
+
+    if (fread(&entry, sizeof(entry), 1, file) == 1 && !memcmp(entry.magic, CACHE_MAGIC, 4) &&
+        entry.key[0] == key[0] && entry.key[1] == key[1]) {
+        if (entry.error_code != JPEGARCHIVE_OK) {
+            output->error_code = entry.error_code;
+            found = 1;
+        } else if (entry.stored && entry.length > 0) {
+            unsigned char *jpeg = malloc(entry.length);
+            if (jpeg && fread(jpeg, 1, entry.length, file) == (size_t)entry.length) {
+                output->error_code = JPEGARCHIVE_OK;
+                output->jpeg = jpeg;
+                output->length = entry.length;
+                output->quality = entry.quality;
+                output->metric = entry.metric;
+                found = 1;
+            } else {
+                free(jpeg);
+            }
+        } else {
+            output->quality = entry.quality;
+            found = 2;
+        }
+    }
+    fclose(file);
+
+    if (found) {
+        pthread_mutex_lock(&cache->mutex);
+        cache->hits++;
+        pthread_mutex_unlock(&cache->mutex);
+    }
+    return found;
+}
+
+static void cache_store(jpegarchive_cache_t *cache, const uint64_t key[2], const jpegarchive_recompress_output_t *output) {
+    cache_entry_t entry;
+    char suffix[48];
+    unsigned int sequence;
+    char *path;
+    char *temp;
+    FILE *file;
+    int ok;
+
+    memset(&entry, 0, sizeof(entry));
+    memcpy(entry.magic, CACHE_MAGIC, 4);
+    entry.key[0] = key[0];
+    entry.key[1] = key[1];
+    entry.error_code = output->error_code;
+    entry.quality = output->quality;
+    entry.metric = output->metric;
+    entry.length = output->length;
+    entry.stored = (cache->flags & JPEGARCHIVE_CACHE_OUTPUTS) && output->jpeg;
+
+    pthread_mutex_lock(&cache->mutex);
+    sequence = cache->sequence++;
+    pthread_mutex_unlock(&cache->mutex);
+
+    // Unique among the threads and processes sharing the cache
+    snprintf(suffix, sizeof(suffix), ".%ld.%u.tmp", (long)getpid(), sequence);
+    path = cache_path(cache, key, "");
+    temp = cache_path(cache, key, suffix);
+    if (!path || !temp) {
+        free(path);
+        free(temp);
+        return;
+    }
+
+    // The fan-out directory is the first one in the path after the root
+    temp[strlen(cache->path) + 3] = '\0';
+    make_directory(temp);
+    temp[strlen(cache->path) + 3] = '/';
+
+    file = fopen(temp, "wb");
+    if (file) {
+        ok = fwrite(&entry, sizeof(entry), 1, file) == 1;
+        if (ok && entry.stored) {
+            ok = fwrite(output->jpeg, 1, output->length, file) == (size_t)output->length;
+        }
+        ok = (fclose(file) == 0) && ok;
+
+        // Another writer may have won the race, which is fine
+        if (!ok || rename(temp, path) != 0) {
+            remove(temp);
+        }
+    }
+    free(path);
+    free(temp);
+}
+
+jpegarchive_cache_t *jpegarchive_cache_open(const char *path, int flags) {
+    jpegarchive_cache_t *cache;
+
+    if (!path || !make_directory(path)) {
+        return NULL;
+    }
+
+    cache = calloc(1, sizeof(jpegarchive_cache_t));
+    if (!cache || !(cache->path = malloc(strlen(path) + 1))) {
+        free(cache);
+        return NULL;
+    }
+    strcpy(cache->path, path);
+    cache->flags = flags;
+    pthread_mutex_init(&cache->mutex, NULL);
+    return cache;
+}
+
+void jpegarchive_cache_close(jpegarchive_cache_t *cache) {
+    if (!cache) {
+        return;
+    }
+    pthread_mutex_destroy(&cache->mutex);
+    free(cache->path);
+    free(cache);
+}
+
+int64_t jpegarchive_cache_hits(jpegarchive_cache_t *cache) {
+    int64_t hits;
+
+    pthread_mutex_lock(&cache->mutex);
+    hits = cache->hits;
+    pthread_mutex_unlock(&cache->mutex);
+    return hits;
+}
+
+// Resources of one recompression that live outside the arena. They are
+// released in one place, whichever way the recompression ends.
+typedef struct {
+    coefficient_source_t *coefficients;
+    unsigned char *compressed;
+    struct jpegMarkers markers;
+    struct dctImage dct;
+} recompress_job_t;
+
+// Recompresses input->jpeg, or the image read from 'source' when it is not
+// NULL. The result goes to 'dest' when it is not NULL, else into a buffer
+// in output->jpeg.
+static jpegarchive_error_code_t recompress_run(jpegarchive_context_t *ctx, const jpegarchive_recompress_input_t *input, const jpegarchive_source_t *source, const jpegarchive_dest_t *dest, recompress_job_t *job, jpegarchive_recompress_output_t *output) {
+    codec_t *codec = &ctx->codecs[0];
+    arena_t *arena = &ctx->arena;
+    const unsigned char *jpeg = input->jpeg;
+    int64_t length = input->length;
+    unsigned char *original = NULL;
+    unsigned char *originalGray = NULL;
+    int width, height;
+    jpegarchive_error_code_t decode_error;
+
+    if (source) {
+        stream_source_t stream;
+        jpegarchive_error_code_t stream_error = stream_open(&stream, ctx, *source);
+        if (stream_error != JPEGARCHIVE_OK) {
+            return stream_error;
+        }
+
+        // The pixel engine decodes while the rest of the file arrives. The
+        // coefficient engine needs the whole file first.
+        if (input->engine != JPEGARCHIVE_ENGINE_COEFFICIENTS) {
+            struct jpeg_source_mgr *saved = codec->dinfo.src;
+            codec->dinfo.src = &stream.pub;
+            unsigned long decoded = safeDecodeJpeg(codec, arena, NULL, 0, &original, &originalGray, &width, &height, JCS_RGB, &decode_error);
+            codec->dinfo.src = saved;
+            if (!decoded) {
+                return (stream.error != JPEGARCHIVE_OK) ? stream.error : decode_error;
+            }
+        }
+
+        stream_error = stream_drain(&stream);
+        if (stream_error != JPEGARCHIVE_OK) {
+            return stream_error;
+        }
+        jpeg = ctx->input;
+        length = stream.size;
+    }
+
+    // Validate input
+    if (!jpeg || length <= 0) {
+        return JPEGARCHIVE_INVALID_INPUT;
     }
     
-    // Build complete JPEG with metadata and comment
-    const char *COMMENT = "Compressed by jpeg-recompress";
-    
-    // Check APP0 marker
-    if (compressed[2] != 0xff || compressed[3] != 0xe0) {
-        free(original);
-        free(originalGray);
-        free(compressed);
-        if (metaBuf) free(metaBuf);
-        output.error_code = JPEGARCHIVE_UNKNOWN_ERROR;
-        return output;
+    // Check if input is JPEG
+    if (!checkJpegMagic(jpeg, length)) {
+        return JPEGARCHIVE_NOT_JPEG;
+    }
+
+    // The header alone rejects files that were already processed or that
+    // libjpeg can't decode, before anything is decoded
+    if (!indexMarkers(jpeg, length, COMMENT, &job->markers)) {
+        return JPEGARCHIVE_MEMORY_ERROR;
+    }
+    if (job->markers.processed) {
+        return JPEGARCHIVE_NOT_SUITABLE;
+    }
+    if (!frame_supported(&job->markers)) {
+        return JPEGARCHIVE_UNSUPPORTED;
     }
     
-    int app0_len = (compressed[4] << 8) + compressed[5];
+    // Set default values if not provided
+    int min = (input->min > 0) ? input->min : 40;
+    int max = (input->max > 0) ? input->max : 95;
+    int loops = (input->loops > 0) ? input->loops : 6;
+    
+    if (min > max) {
+        return JPEGARCHIVE_INVALID_INPUT;
+    }
+
+    // Qualities well above the one the source was saved at can't produce
+    // a smaller file, and when all of them are, nothing is encoded
+    if (!clampToSource(min, &max, estimateQuality(&job->markers))) {
+        return JPEGARCHIVE_NOT_SUITABLE;
+    }
     
-    // Calculate total size: SOI+APP0 + COM + metadata + image data
-    unsigned long totalSize = 4 + app0_len + 4 + strlen(COMMENT) + metaSize + (compressedSize - 4 - app0_len);
+    // Use provided target value if non-zero, otherwise use preset
+    float target = (input->target > 0) ? input->target : get_target_from_preset(input->quality, input->method);
     
-    unsigned char *finalJpeg = malloc(totalSize);
-    if (!finalJpeg) {
-        free(original);
-        free(originalGray);
-        free(compressed);
-        if (metaBuf) free(metaBuf);
-        output.error_code = JPEGARCHIVE_MEMORY_ERROR;
-        return output;
+    // Determine subsampling method to use
+    int subsample_method = SUBSAMPLE_DEFAULT;  // Default to 4:2:0
+
+    // Validate input->subsample value and use default if invalid
+    if (input->subsample == JPEGARCHIVE_SUBSAMPLE_420) {
+        subsample_method = SUBSAMPLE_DEFAULT;  // Force 4:2:0
+    } else if (input->subsample == JPEGARCHIVE_SUBSAMPLE_KEEP) {
+        // Keep original subsampling
+        subsample_method = original_subsampling(&job->markers);
+    } else if (input->subsample == JPEGARCHIVE_SUBSAMPLE_444) {
+        subsample_method = SUBSAMPLE_444;  // Force 4:4:4
+    } else {
+        // Invalid value, use default
+        subsample_method = SUBSAMPLE_DEFAULT;
+    }
+
+    // Requantizing keeps the source's chroma layout, so the coefficient
+    // engine is only used when that is what was asked for
+    if (input->engine == JPEGARCHIVE_ENGINE_COEFFICIENTS) {
+        int layout = (input->subsample == JPEGARCHIVE_SUBSAMPLE_KEEP) ? -1 : subsample_method;
+        job->coefficients = coefficient_source_open(jpeg, length, layout);
+    }
+
+    // Decode the original image and its luma reference for comparison,
+    // unless that happened while streaming in
+    if (!original && job->coefficients) {
+        // Candidates don't need the pixels, only the luma reference
+        if (!safeDecodeJpeg(codec, arena, (unsigned char *)jpeg, length, &originalGray, NULL, &width, &height, JCS_GRAYSCALE, &decode_error)) {
+            return decode_error;
+        }
+    } else if (!original) {
+        if (!safeDecodeJpeg(codec, arena, (unsigned char *)jpeg, length, &original, &originalGray, &width, &height, JCS_RGB, &decode_error)) {
+            return decode_error;
+        }
     }
     
-    unsigned char *ptr = finalJpeg;
+    // Keep the metadata for the output
+    unsigned char *metaBuf = NULL;
+    unsigned long metaSize = copyMarkerMetadata(&job->markers, jpeg, NULL);
+    if (metaSize > 0) {
+        metaBuf = arena_alloc(arena, metaSize);
+        if (!metaBuf) {
+            return JPEGARCHIVE_MEMORY_ERROR;
+        }
+        copyMarkerMetadata(&job->markers, jpeg, metaBuf);
+    }
+
+    // Pre-compute the reference statistics once; every candidate in the
+    // search below is compared against this model.
+    fast_ssim_model *model = NULL;
+    if (input->method == JPEGARCHIVE_METHOD_SSIM) {
+        void *modelMem = arena_alloc(arena, fast_ssim_model_size(width, height, 0, 0));
+        model = fast_ssim_init_model(modelMem, originalGray, width, height, width, 0, 0);
+        if (!model) {
+            return JPEGARCHIVE_MEMORY_ERROR;
+        }
+    }
+
+    // One codec and SSIM scratch area per candidate evaluated at once
+    int slots = 1;
+    if (input->search != JPEGARCHIVE_SEARCH_INTERPOLATE && input->threads > 1) {
+        slots = (input->threads < SEARCH_MAX_THREADS) ? input->threads : SEARCH_MAX_THREADS;
+    }
+    if (!context_reserve_codecs(ctx, slots)) {
+        return JPEGARCHIVE_MEMORY_ERROR;
+    }
+    size_t scratchSize = (fast_ssim_scratch_size(model) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    unsigned char *scratch = NULL;
+    if (scratchSize) {
+        scratch = arena_alloc(arena, slots * scratchSize);
+        if (!scratch) {
+            return JPEGARCHIVE_MEMORY_ERROR;
+        }
+    }
+
+    // Luma scaled down for the early bisection steps, compared at the
+    // resolution the full image is compared at
+    search_context_t proxy = { NULL, NULL, 0, 0, subsample_method, NULL, NULL, NULL, ctx->codecs, NULL, 0, 1 };
+    int factor = 1;
+    if (input->search != JPEGARCHIVE_SEARCH_INTERPOLATE && model) {
+        factor = proxyFactor(width, height, input->proxy, loops);
+    }
+    if (factor > 1) {
+        struct iqa_ssim_args args = { 1.0f, 1.0f, 1.0f, 255, 0.01f, 0.03f, proxySsimScale(width, height, factor) };
+        proxy.width = (width + factor - 1) / factor;
+        proxy.height = (height + factor - 1) / factor;
+        proxy.originalGray = arena_alloc(arena, (size_t)proxy.width * proxy.height);
+        if (!proxy.originalGray) {
+            return JPEGARCHIVE_MEMORY_ERROR;
+        }
+        downscale(originalGray, proxy.originalGray, width, height, factor);
+
+        void *proxyMem = arena_alloc(arena, fast_ssim_model_size(proxy.width, proxy.height, 0, &args));
+        proxy.model = fast_ssim_init_model(proxyMem, proxy.originalGray, proxy.width, proxy.height, proxy.width, 0, &args);
+        if (!proxy.model) {
+            return JPEGARCHIVE_MEMORY_ERROR;
+        }
+        proxy.scratchSize = fast_ssim_scratch_size(proxy.model);
+        proxy.scratch = arena_alloc(arena, proxy.scratchSize);
+        if (!proxy.scratch) {
+            return JPEGARCHIVE_MEMORY_ERROR;
+        }
+    }
+
+    // Representative tiles stacked into a mosaic for the intermediate
+    // steps. Its luma encodes are block for block those of the full
+    // image, and it is compared at the same scale, so only the number of
+    // windows the metric averages differs.
+    search_context_t tiles = { NULL, NULL, tileSize(width, height), 0, subsample_method, NULL, NULL, NULL, ctx->codecs, NULL, 0, 1 };
+    int tileCount = 0;
+    if (input->search != JPEGARCHIVE_SEARCH_INTERPOLATE && model && factor == 1 && input->tiles > 0 && loops > 2 && min < max) {
+        int grid = (width / tiles.width) * (height / tiles.width);
+        // Not worth it unless the tiles are a small part of the image
+        if (grid >= 4 * input->tiles) {
+            struct tile *sample = arena_alloc(arena, grid * sizeof(struct tile));
+            if (!sample) {
+                return JPEGARCHIVE_MEMORY_ERROR;
+            }
+            tileCount = tileSample(originalGray, width, height, tiles.width, input->tiles, sample);
+            tiles.height = tileCount * tiles.width;
+            tiles.originalGray = arena_alloc(arena, (size_t)tiles.width * tiles.height);
+            if (!tiles.originalGray) {
+                return JPEGARCHIVE_MEMORY_ERROR;
+            }
+            tileMosaic(originalGray, width, sample, tileCount, tiles.width, tiles.originalGray);
+        }
+    }
+    if (tileCount > 0) {
+        struct iqa_ssim_args args = { 1.0f, 1.0f, 1.0f, 255, 0.01f, 0.03f, proxySsimScale(width, height, 1) };
+        void *tilesMem = arena_alloc(arena, fast_ssim_model_size(tiles.width, tiles.height, 0, &args));
+        tiles.model = fast_ssim_init_model(tilesMem, tiles.originalGray, tiles.width, tiles.height, tiles.width, 0, &args);
+        if (!tiles.model) {
+            return JPEGARCHIVE_MEMORY_ERROR;
+        }
+        tiles.scratchSize = fast_ssim_scratch_size(tiles.model);
+        tiles.scratch = arena_alloc(arena, tiles.scratchSize);
+        if (!tiles.scratch) {
+            return JPEGARCHIVE_MEMORY_ERROR;
+        }
+    }
+
+    // Search for the lowest quality that meets the target
+    search_context_t context = { original, originalGray, width, height, subsample_method, model, job->coefficients, NULL, ctx->codecs, scratch, scratchSize, slots };
+
+    // The pixel engine's intermediate steps encode luma only. Its DCT is
+    // computed once, for the image that takes most of those steps, so each
+    // of them only quantizes and entropy codes. Without memory for the
+    // blocks the steps encode pixels.
+    if (!job->coefficients) {
+        search_context_t *steps = tiles.model ? &tiles : ((factor > 1) ? &proxy : &context);
+        if (dctImageInit(&job->dct, steps->originalGray, steps->width, steps->height)) {
+            steps->dct = &job->dct;
+        }
+    }
+
+    search_node_t result;
+    jpegarchive_error_code_t search_error;
+    float calibrated;
+
+    if (input->search == JPEGARCHIVE_SEARCH_INTERPOLATE) {
+        search_error = search_interpolate(&context, min, max, loops, target, &result);
+    } else if (factor > 1) {
+        search_error = search_proxy(&context, &proxy, min, max, loops, target, PROXY_FULL_STEPS, &calibrated, &result);
+    } else if (tiles.model) {
+        search_error = search_proxy(&context, &tiles, min, max, loops, target, 1, &calibrated, &result);
+
+        // The tiles only predict the global metric. Like the full search,
+        // the last step may land below the target; if the tiles expected it
+        // to pass, they misjudged the image and the search is redone on the
+        // full image.
+        if (search_error == JPEGARCHIVE_OK && result.metric < target) {
+            search_node_t check;
+            search_node_init(&check, &tiles, min, max, 1);
+            search_node_bind(&check, 0);
+            check.quality = result.quality;
+            search_node_evaluate(&check);
+            search_error = check.error;
+            if (search_error == JPEGARCHIVE_OK && check.metric >= calibrated) {
+                free(result.compressed);
+                search_error = search_bisect(&context, min, max, loops, target, &result);
+            } else if (search_error != JPEGARCHIVE_OK) {
+                free(check.compressed);
+                free(result.compressed);
+            }
+        }
+    } else {
+        search_error = search_bisect(&context, min, max, loops, target, &result);
+    }
+
+    if (search_error != JPEGARCHIVE_OK) {
+        return search_error;
+    }
+
+    unsigned char *compressed = job->compressed = result.compressed;
+    unsigned long compressedSize = result.compressedSize;
     
-    // Copy SOI and APP0
-    memcpy(ptr, compressed, 4 + app0_len);
-    ptr += 4 + app0_len;
+    // Check if output is larger than input
+    if (compressedSize >= (unsigned long)length) {
+        return JPEGARCHIVE_NOT_SUITABLE;
+    }
     
-    // Add COM marker
-    *ptr++ = 0xff;
-    *ptr++ = 0xfe;
-    *ptr++ = 0x00;
-    *ptr++ = strlen(COMMENT) + 2;
-    memcpy(ptr, COMMENT, strlen(COMMENT));
-    ptr += strlen(COMMENT);
+    // Build complete JPEG with metadata and comment
     
-    // Add original metadata
-    if (metaSize > 0) {
-        memcpy(ptr, metaBuf, metaSize);
-        ptr += metaSize;
+    // Check APP0 marker
+    if (compressed[2] != 0xff || compressed[3] != 0xe0) {
+        return JPEGARCHIVE_UNKNOWN_ERROR;
     }
     
-    // Add remaining image data
-    memcpy(ptr, compressed + 4 + app0_len, compressedSize - 4 - app0_len);
+    int app0_len = (compressed[4] << 8) + compressed[5];
     
+    // SOI and APP0, COM marker, original metadata, remaining image data
+    unsigned char comment[4] = { 0xff, 0xfe, 0x00, strlen(COMMENT) + 2 };
+    const unsigned char *parts[5] = { compressed, comment, (const unsigned char *)COMMENT, metaBuf, compressed + 4 + app0_len };
+    unsigned long sizes[5] = { 4 + app0_len, 4, strlen(COMMENT), metaSize, compressedSize - 4 - app0_len };
+    unsigned long totalSize = 0;
+    for (int i = 0; i < 5; i++) {
+        totalSize += sizes[i];
+    }
+
+    if (dest) {
+        // Straight from the encoder's buffer to the caller
+        for (int i = 0; i < 5; i++) {
+            if (sizes[i] > 0 && dest->write(dest->user, parts[i], sizes[i]) != (int64_t)sizes[i]) {
+                return JPEGARCHIVE_IO_ERROR;
+            }
+        }
+    } else {
+        // The output belongs to the caller, so it does not come from the arena
+        unsigned char *finalJpeg = malloc(totalSize);
+        if (!finalJpeg) {
+            return JPEGARCHIVE_MEMORY_ERROR;
+        }
+
+        unsigned char *ptr = finalJpeg;
+        for (int i = 0; i < 5; i++) {
+            if (sizes[i] > 0) {
+                memcpy(ptr, parts[i], sizes[i]);
+                ptr += sizes[i];
+            }
+        }
+        output->jpeg = finalJpeg;
+    }
+
     // Prepare output
-    output.error_code = JPEGARCHIVE_OK;
-    output.jpeg = finalJpeg;
-    output.length = totalSize;
-    output.quality = finalQuality;
-    output.metric = finalMetric;
-    
-    free(compressed);
-    free(original);
-    free(originalGray);
-    if (metaBuf) free(metaBuf);
+    output->length = totalSize;
+    output->quality = result.quality;
+    output->metric = result.metric;
     
+    return JPEGARCHIVE_OK;
+}
+
+jpegarchive_recompress_output_t jpegarchive_recompress_ctx(jpegarchive_context_t *ctx, jpegarchive_recompress_input_t input) {
+    jpegarchive_recompress_output_t output;
+    recompress_job_t job = { NULL, NULL };
+    uint64_t key[2];
+    int cached = 0;
+    memset(&output, 0, sizeof(output));
+
+    if (!ctx) {
+        output.error_code = JPEGARCHIVE_INVALID_INPUT;
+        return output;
+    }
+
+    if (input.cache && input.jpeg && input.length > 0) {
+        cache_key(&input, key);
+        cached = cache_lookup(input.cache, key, &output);
+        if (cached == 1) {
+            return output;
+        }
+        if (cached == 2) {
+            // Only the quality is known, so encode it without searching
+            input.min = input.max = output.quality;
+        }
+    }
+
+    output.error_code = recompress_run(ctx, &input, NULL, NULL, &job, &output);
+
+    coefficient_source_close(job.coefficients);
+    dctImageFree(&job.dct);
+    freeMarkers(&job.markers);
+    free(job.compressed);
+    arena_reset(&ctx->arena);
+
+    // Only results that depend on nothing but the input are kept
+    if (input.cache && !cached && input.jpeg && input.length > 0 &&
+        (output.error_code == JPEGARCHIVE_OK || output.error_code == JPEGARCHIVE_NOT_SUITABLE ||
+         output.error_code == JPEGARCHIVE_NOT_JPEG || output.error_code == JPEGARCHIVE_UNSUPPORTED)) {
+        cache_store(input.cache, key, &output);
+    }
+    return output;
+}
+
+jpegarchive_recompress_output_t jpegarchive_recompress_stream(jpegarchive_context_t *ctx, jpegarchive_recompress_input_t input, jpegarchive_source_t source, jpegarchive_dest_t dest) {
+    jpegarchive_recompress_output_t output;
+    recompress_job_t job = { NULL, NULL };
+    memset(&output, 0, sizeof(output));
+
+    if (!ctx || !source.read || !dest.write) {
+        output.error_code = JPEGARCHIVE_INVALID_INPUT;
+        return output;
+    }
+
+    output.error_code = recompress_run(ctx, &input, &source, &dest, &job, &output);
+
+    coefficient_source_close(job.coefficients);
+    dctImageFree(&job.dct);
+    freeMarkers(&job.markers);
+    free(job.compressed);
+    arena_reset(&ctx->arena);
+    return output;
+}
+
+jpegarchive_recompress_output_t jpegarchive_recompress(jpegarchive_recompress_input_t input) {
+    jpegarchive_recompress_output_t output;
+    jpegarchive_context_t *ctx = jpegarchive_context_create(JPEGARCHIVE_CONTEXT_DEFAULT);
+
+    if (!ctx) {
+        memset(&output, 0, sizeof(output));
+        output.error_code = JPEGARCHIVE_MEMORY_ERROR;
+        return output;
+    }
+    output = jpegarchive_recompress_ctx(ctx, input);
+    jpegarchive_context_destroy(ctx);
     return output;
 }
 
@@ -547,72 +1916,352 @@ void jpegarchive_free_recompress_output(jpegarchive_recompress_output_t *output)
     }
 }
 
-jpegarchive_compare_output_t jpegarchive_compare(jpegarchive_compare_input_t input) {
-    jpegarchive_compare_output_t output;
+jpegarchive_probe_output_t jpegarchive_probe(const unsigned char *jpeg, int64_t length) {
+    jpegarchive_probe_output_t output;
+    struct jpegMarkers markers;
     memset(&output, 0, sizeof(output));
-    
-    // Validate input
-    if (!input.jpeg1 || !input.jpeg2 || input.length1 <= 0 || input.length2 <= 0) {
+
+    if (!jpeg || length <= 0) {
         output.error_code = JPEGARCHIVE_INVALID_INPUT;
         return output;
     }
-    
-    // Check if inputs are JPEG
-    if (!checkJpegMagic(input.jpeg1, input.length1) || !checkJpegMagic(input.jpeg2, input.length2)) {
+    if (!checkJpegMagic(jpeg, length)) {
         output.error_code = JPEGARCHIVE_NOT_JPEG;
         return output;
     }
+    if (!indexMarkers(jpeg, length, COMMENT, &markers)) {
+        output.error_code = JPEGARCHIVE_MEMORY_ERROR;
+        return output;
+    }
+
+    output.error_code = frame_supported(&markers) ? JPEGARCHIVE_OK : JPEGARCHIVE_UNSUPPORTED;
+    output.width = markers.width;
+    output.height = markers.height;
+    output.components = markers.components;
+    output.sampling = marker_sampling(&markers);
+    output.progressive = markers.frameMarker == 0xc2 || markers.frameMarker == 0xca;
+    output.processed = markers.processed;
+    output.quality = estimateQuality(&markers);
+
+    for (int i = 0; i < markers.count; i++) {
+        if (isMetadataSegment(&markers.segments[i])) {
+            output.metadata_count++;
+        }
+    }
+    if (output.metadata_count > 0) {
+        output.metadata = malloc(output.metadata_count * sizeof(jpegarchive_span_t));
+        if (!output.metadata) {
+            freeMarkers(&markers);
+            memset(&output, 0, sizeof(output));
+            output.error_code = JPEGARCHIVE_MEMORY_ERROR;
+            return output;
+        }
+
+        int count = 0;
+        for (int i = 0; i < markers.count; i++) {
+            const struct jpegSegment *segment = &markers.segments[i];
+            if (isMetadataSegment(segment)) {
+                output.metadata[count].offset = segment->offset;
+                output.metadata[count].length = segment->length;
+                output.metadata_size += segment->length;
+                count++;
+            }
+        }
+    }
+
+    freeMarkers(&markers);
+    return output;
+}
+
+void jpegarchive_free_probe_output(jpegarchive_probe_output_t *output) {
+    if (output && output->metadata) {
+        free(output->metadata);
+        output->metadata = NULL;
+        output->metadata_count = 0;
+    }
+}
+
+#ifdef __linux__
+// CPUs granted by the cgroup CPU quota (v2, then v1), rounded up, or 0
+// when there is no quota
+static int cgroup_cpu_limit(void) {
+    long long quota = -1, period = 0;
+    char max[32];
+    FILE *file = fopen("/sys/fs/cgroup/cpu.max", "r");
+
+    if (file) {
+        if (fscanf(file, "%31s %lld", max, &period) == 2 && strcmp(max, "max") != 0) {
+            quota = atoll(max);
+        }
+        fclose(file);
+    } else if ((file = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r"))) {
+        if (fscanf(file, "%lld", &quota) != 1) {
+            quota = -1;
+        }
+        fclose(file);
+        if ((file = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r"))) {
+            if (fscanf(file, "%lld", &period) != 1) {
+                period = 0;
+            }
+            fclose(file);
+        }
+    }
+
+    if (quota <= 0 || period <= 0) {
+        return 0;
+    }
+    return (int)((quota + period - 1) / period);
+}
+#endif
+
+int jpegarchive_cpu_count(void) {
+    int count = 1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    if (online > 0) {
+        count = (int)online;
+    }
+#endif
+#ifdef __linux__
+    // Containers usually limit the process by affinity or by quota
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0) {
+        count = CPU_COUNT(&set);
+    }
+    int limit = cgroup_cpu_limit();
+    if (limit > 0 && limit < count) {
+        count = limit;
+    }
+#endif
+    return count;
+}
+
+// Jobs [next, end) of one batch worker. The owner takes jobs from the
+// front; a worker that runs out steals the back half of another range.
+typedef struct {
+    pthread_mutex_t lock;
+    int next;
+    int end;
+} batch_queue_t;
+
+typedef struct {
+    const jpegarchive_recompress_input_t *inputs;
+    jpegarchive_batch_callback_t callback;
+    void *user;
+    batch_queue_t *queues;
+    int workers;
+} batch_t;
+
+typedef struct {
+    batch_t *batch;
+    jpegarchive_context_t *ctx;  // codecs and scratch reused between jobs
+    int id;
+} batch_worker_t;
+
+// Next job of the queue, or -1 if it is empty
+static int batch_take(batch_queue_t *queue) {
+    int index = -1;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->next < queue->end) {
+        index = queue->next++;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return index;
+}
+
+// Moves the back half of the first non-empty queue after the thief's own
+// into the thief's queue. Returns 0 once every queue was found empty; jobs
+// that were in transit between two queues are finished by their new owner.
+static int batch_steal(batch_t *batch, int thief) {
+    for (int i = 1; i < batch->workers; i++) {
+        batch_queue_t *victim = &batch->queues[(thief + i) % batch->workers];
+        int begin = 0, end = 0;
+
+        pthread_mutex_lock(&victim->lock);
+        int left = victim->end - victim->next;
+        if (left > 0) {
+            end = victim->end;
+            victim->end -= (left + 1) / 2;
+            begin = victim->end;
+        }
+        pthread_mutex_unlock(&victim->lock);
+
+        if (end > begin) {
+            batch_queue_t *own = &batch->queues[thief];
+            pthread_mutex_lock(&own->lock);
+            own->next = begin;
+            own->end = end;
+            pthread_mutex_unlock(&own->lock);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Worker loop (thread entry point)
+static void *batch_worker_run(void *arg) {
+    batch_worker_t *worker = arg;
+    batch_t *batch = worker->batch;
+
+    for (;;) {
+        int index = batch_take(&batch->queues[worker->id]);
+        if (index < 0) {
+            if (!batch_steal(batch, worker->id)) {
+                break;
+            }
+            continue;
+        }
+
+        jpegarchive_recompress_output_t output = jpegarchive_recompress_ctx(worker->ctx, batch->inputs[index]);
+        batch->callback(index, &output, batch->user);
+    }
+    return NULL;
+}
+
+jpegarchive_error_code_t jpegarchive_recompress_batch(const jpegarchive_recompress_input_t *inputs, int count, int threads, jpegarchive_batch_callback_t callback, void *user) {
+    if (!inputs || count < 0 || !callback) {
+        return JPEGARCHIVE_INVALID_INPUT;
+    }
+    if (count == 0) {
+        return JPEGARCHIVE_OK;
+    }
+
+    int workers = (threads > 0) ? threads : jpegarchive_cpu_count();
+    if (workers > count) {
+        workers = count;
+    }
+
+    batch_t batch = { inputs, callback, user, NULL, workers };
+    batch_worker_t *pool = calloc(workers, sizeof(batch_worker_t));
+    pthread_t *handles = calloc(workers, sizeof(pthread_t));
+    int *started = calloc(workers, sizeof(int));
+    batch.queues = calloc(workers, sizeof(batch_queue_t));
+    jpegarchive_error_code_t error = JPEGARCHIVE_OK;
+    int created = 0;
+
+    // Contiguous ranges to start with, so neighbouring inputs stay on one
+    // worker unless the load is uneven
+    while (pool && handles && started && batch.queues && created < workers) {
+        batch_queue_t *queue = &batch.queues[created];
+        pool[created].batch = &batch;
+        pool[created].id = created;
+        pool[created].ctx = jpegarchive_context_create(JPEGARCHIVE_CONTEXT_DEFAULT);
+        if (!pool[created].ctx) {
+            break;
+        }
+        pthread_mutex_init(&queue->lock, NULL);
+        queue->next = (int)((long long)count * created / workers);
+        queue->end = (int)((long long)count * (created + 1) / workers);
+        created++;
+    }
+
+    if (created < workers) {
+        error = JPEGARCHIVE_MEMORY_ERROR;
+    } else {
+        // libiqa picks its kernels on first use; do it before the workers
+        // race to. The calling thread is worker 0, and the jobs of a worker
+        // whose thread cannot be started are stolen by the others.
+        _iqa_simd();
+        for (int i = 1; i < workers; i++) {
+            started[i] = (pthread_create(&handles[i], NULL, batch_worker_run, &pool[i]) == 0);
+        }
+        batch_worker_run(&pool[0]);
+        for (int i = 1; i < workers; i++) {
+            if (started[i]) {
+                pthread_join(handles[i], NULL);
+            }
+        }
+    }
+
+    for (int i = 0; i < created; i++) {
+        jpegarchive_context_destroy(pool[i].ctx);
+        pthread_mutex_destroy(&batch.queues[i].lock);
+    }
+    free(batch.queues);
+    free(started);
+    free(handles);
+    free(pool);
+    return error;
+}
+
+static jpegarchive_error_code_t compare_run(jpegarchive_context_t *ctx, const jpegarchive_compare_input_t *input, jpegarchive_compare_output_t *output) {
+    codec_t *codec = &ctx->codecs[0];
+    jpegarchive_error_code_t decode_error;
+
+    // Validate input
+    if (!input->jpeg1 || !input->jpeg2 || input->length1 <= 0 || input->length2 <= 0) {
+        return JPEGARCHIVE_INVALID_INPUT;
+    }
+    
+    // Check if inputs are JPEG
+    if (!checkJpegMagic(input->jpeg1, input->length1) || !checkJpegMagic(input->jpeg2, input->length2)) {
+        return JPEGARCHIVE_NOT_JPEG;
+    }
     
     // Decode first image
     unsigned char *image1 = NULL;
     int width1, height1;
-    jpegarchive_error_code_t decode_error1;
-    long size1 = safeDecodeJpeg((unsigned char *)input.jpeg1, input.length1, &image1, &width1, &height1, JCS_GRAYSCALE, &decode_error1);
-    
-    if (!size1) {
-        output.error_code = decode_error1;
-        return output;
+    if (!safeDecodeJpeg(codec, &ctx->arena, (unsigned char *)input->jpeg1, input->length1, &image1, NULL, &width1, &height1, JCS_GRAYSCALE, &decode_error)) {
+        return decode_error;
     }
     
     // Decode second image
     unsigned char *image2 = NULL;
     int width2, height2;
-    jpegarchive_error_code_t decode_error2;
-    long size2 = safeDecodeJpeg((unsigned char *)input.jpeg2, input.length2, &image2, &width2, &height2, JCS_GRAYSCALE, &decode_error2);
-    
-    if (!size2) {
-        free(image1);
-        output.error_code = decode_error2;
-        return output;
+    if (!safeDecodeJpeg(codec, &ctx->arena, (unsigned char *)input->jpeg2, input->length2, &image2, NULL, &width2, &height2, JCS_GRAYSCALE, &decode_error)) {
+        return decode_error;
     }
     
     // Check dimensions match
     if (width1 != width2 || height1 != height2) {
-        free(image1);
-        free(image2);
-        output.error_code = JPEGARCHIVE_UNSUPPORTED;
-        return output;
+        return JPEGARCHIVE_UNSUPPORTED;
     }
     
     // Calculate metric
     double metric = 0;
-    if (input.method == JPEGARCHIVE_METHOD_SSIM) {
-        metric = iqa_ssim(image1, image2, width1, height1, width1, 0, 0);
+    if (input->method == JPEGARCHIVE_METHOD_SSIM) {
+        if (input->integer_ssim) {
+            metric = iqa_ssim_u8(image1, image2, width1, height1, width1, 0);
+        } else {
+            metric = iqa_ssim(image1, image2, width1, height1, width1, 0, 0);
+        }
         // Check for SSIM calculation failure (returns INFINITY on error)
         if (metric == INFINITY || metric != metric) {  // NaN check
-            free(image1);
-            free(image2);
-            output.error_code = JPEGARCHIVE_MEMORY_ERROR;
-            return output;
+            return JPEGARCHIVE_MEMORY_ERROR;
         }
     }
 
-    free(image1);
-    free(image2);
+    output->metric = metric;
+    return JPEGARCHIVE_OK;
+}
 
-    output.error_code = JPEGARCHIVE_OK;
-    output.metric = metric;
-    
+jpegarchive_compare_output_t jpegarchive_compare_ctx(jpegarchive_context_t *ctx, jpegarchive_compare_input_t input) {
+    jpegarchive_compare_output_t output;
+    memset(&output, 0, sizeof(output));
+
+    if (!ctx) {
+        output.error_code = JPEGARCHIVE_INVALID_INPUT;
+        return output;
+    }
+
+    output.error_code = compare_run(ctx, &input, &output);
+    arena_reset(&ctx->arena);
+    return output;
+}
+
+jpegarchive_compare_output_t jpegarchive_compare(jpegarchive_compare_input_t input) {
+    jpegarchive_compare_output_t output;
+    jpegarchive_context_t *ctx = jpegarchive_context_create(JPEGARCHIVE_CONTEXT_DEFAULT);
+
+    if (!ctx) {
+        memset(&output, 0, sizeof(output));
+        output.error_code = JPEGARCHIVE_MEMORY_ERROR;
+        return output;
+    }
+    output = jpegarchive_compare_ctx(ctx, input);
+    jpegarchive_context_destroy(ctx);
     return output;
 }
 
@@ -15,7 +15,8 @@ typedef enum {
     JPEGARCHIVE_UNSUPPORTED,
     JPEGARCHIVE_NOT_SUITABLE,
     JPEGARCHIVE_MEMORY_ERROR,
-    JPEGARCHIVE_UNKNOWN_ERROR
+    JPEGARCHIVE_UNKNOWN_ERROR,
+    JPEGARCHIVE_IO_ERROR        // A stream callback failed
 } jpegarchive_error_code_t;
 
 // Method enum
@@ -38,6 +39,21 @@ typedef enum {
     JPEGARCHIVE_SUBSAMPLE_444 = 2   // Force 4:4:4 (no subsampling)
 } jpegarchive_subsample_t;
 
+// Quality search strategy
+typedef enum {
+    JPEGARCHIVE_SEARCH_BISECT = 0,      // Binary search over [min, max]
+    JPEGARCHIVE_SEARCH_INTERPOLATE = 1  // Predict the target crossing from measured metrics
+} jpegarchive_search_t;
+
+// Candidate encoding engine
+typedef enum {
+    JPEGARCHIVE_ENGINE_PIXELS = 0,       // Decode to RGB and encode every candidate from pixels
+    JPEGARCHIVE_ENGINE_COEFFICIENTS = 1  // Requantize the source DCT coefficients (keeps the source's chroma layout)
+} jpegarchive_engine_t;
+
+// On-disk cache of recompression results, see jpegarchive_cache_open()
+typedef struct jpegarchive_cache jpegarchive_cache_t;
+
 // Input structure for jpegarchive_recompress
 typedef struct {
     const unsigned char *jpeg;
@@ -49,6 +65,12 @@ typedef struct {
     jpegarchive_method_t method;
     float target;  // Target metric value (0 = use quality preset)
     jpegarchive_subsample_t subsample;  // Subsampling method
+    int threads;  // Candidates encoded concurrently during the search (0 or 1 = serial)
+    jpegarchive_search_t search;  // Search strategy; loops is the maximum number of encodes
+    jpegarchive_engine_t engine;  // How candidates are encoded
+    int proxy;  // Measure early bisection steps on the image scaled down by up to 2, 4 or 8 (0 = off)
+    int tiles;  // Measure bisection steps on this many representative 64x64 tiles (0 = off)
+    jpegarchive_cache_t *cache;  // Answer inputs seen before from this cache (NULL = off)
 } jpegarchive_recompress_input_t;
 
 // Output structure for jpegarchive_recompress
@@ -67,6 +89,7 @@ typedef struct {
     int64_t length1;
     int64_t length2;
     jpegarchive_method_t method;
+    int integer_ssim;  // Compute SSIM in integers with iqa_ssim_u8() (0 = iqa_ssim())
 } jpegarchive_compare_input_t;
 
 // Output structure for jpegarchive_compare
@@ -75,11 +98,114 @@ typedef struct {
     double metric;
 } jpegarchive_compare_output_t;
 
+// Chroma layout reported by jpegarchive_probe()
+typedef enum {
+    JPEGARCHIVE_SAMPLING_NONE = 0,  // Not YCbCr: grayscale, RGB or CMYK
+    JPEGARCHIVE_SAMPLING_444,
+    JPEGARCHIVE_SAMPLING_422,
+    JPEGARCHIVE_SAMPLING_420,
+    JPEGARCHIVE_SAMPLING_411,
+    JPEGARCHIVE_SAMPLING_OTHER
+} jpegarchive_sampling_t;
+
+// A byte range of the input
+typedef struct {
+    int64_t offset;
+    int64_t length;
+} jpegarchive_span_t;
+
+// Output structure for jpegarchive_probe
+typedef struct {
+    jpegarchive_error_code_t error_code;
+    int width;
+    int height;
+    int components;
+    jpegarchive_sampling_t sampling;
+    int progressive;
+    int processed;  // Already has the comment jpegarchive_recompress() adds, so it would be rejected
+    int quality;  // Estimated IJG quality (1-100) the image was saved at, 0 if unknown
+    jpegarchive_span_t *metadata;  // APP1-APP15 and COM segments kept by recompression, in file order
+    int metadata_count;
+    int64_t metadata_size;  // Sum of the metadata span lengths
+} jpegarchive_probe_output_t;
+
+// Reusable state for processing many images: libjpeg objects and a
+// working-memory arena that is reset, not freed, between images. A context
+// may be used by one thread at a time.
+typedef struct jpegarchive_context jpegarchive_context_t;
+
+// Context creation flags
+typedef enum {
+    JPEGARCHIVE_CONTEXT_DEFAULT = 0,
+    JPEGARCHIVE_CONTEXT_HUGE_PAGES = 1  // Back large arena blocks with transparent huge pages (Linux)
+} jpegarchive_context_flags_t;
+
+// Cache creation flags
+typedef enum {
+    JPEGARCHIVE_CACHE_DEFAULT = 0,  // Keep quality and metric; a hit encodes once at that quality
+    JPEGARCHIVE_CACHE_OUTPUTS = 1   // Also keep the output, so a hit needs no encode at all
+} jpegarchive_cache_flags_t;
+
+// Streaming input and output for jpegarchive_recompress_stream(). 'read'
+// fills up to 'size' bytes of 'buffer' and returns the number of bytes
+// read, 0 at the end of the input or -1 on error. 'write' takes 'size'
+// bytes and returns the number of bytes written; anything short of 'size'
+// is an error.
+typedef struct {
+    int64_t (*read)(void *user, unsigned char *buffer, int64_t size);
+    void *user;
+} jpegarchive_source_t;
+
+typedef struct {
+    int64_t (*write)(void *user, const unsigned char *buffer, int64_t size);
+    void *user;
+} jpegarchive_dest_t;
+
 // Function declarations
+jpegarchive_context_t *jpegarchive_context_create(int flags);
+void jpegarchive_context_destroy(jpegarchive_context_t *ctx);
+
 jpegarchive_recompress_output_t jpegarchive_recompress(jpegarchive_recompress_input_t input);
+jpegarchive_recompress_output_t jpegarchive_recompress_ctx(jpegarchive_context_t *ctx, jpegarchive_recompress_input_t input);
+// Like jpegarchive_recompress_ctx, but reads the image from 'source' instead
+// of input.jpeg and input.length, and writes the result to 'dest' instead of
+// output.jpeg, which stays NULL. output.length is the number of bytes
+// written. Nothing is written before the search has finished, and only if
+// it succeeded.
+jpegarchive_recompress_output_t jpegarchive_recompress_stream(jpegarchive_context_t *ctx, jpegarchive_recompress_input_t input, jpegarchive_source_t source, jpegarchive_dest_t dest);
 void jpegarchive_free_recompress_output(jpegarchive_recompress_output_t *output);
 
+// Opens or creates the cache directory 'path'. Entries are keyed by a
+// hash of the input bytes and the search parameters, and may be shared by
+// any number of threads and processes. jpegarchive_recompress_stream()
+// doesn't use the cache. Returns NULL if the directory can't be created.
+jpegarchive_cache_t *jpegarchive_cache_open(const char *path, int flags);
+void jpegarchive_cache_close(jpegarchive_cache_t *cache);
+// Number of inputs answered from the cache since it was opened
+int64_t jpegarchive_cache_hits(jpegarchive_cache_t *cache);
+
+// Called once per batch input, from the worker thread that processed it;
+// calls may run concurrently. The callback owns 'output' and frees it with
+// jpegarchive_free_recompress_output().
+typedef void (*jpegarchive_batch_callback_t)(int index, jpegarchive_recompress_output_t *output, void *user);
+
+// Number of CPUs this process may use, honoring its affinity mask and
+// cgroup CPU quota on Linux
+int jpegarchive_cpu_count(void);
+
+// Recompresses every input on a pool of 'threads' workers (0 = one per
+// CPU). Idle workers steal jobs from busy ones, and each worker reuses a
+// context between its jobs. Returns once all callbacks have returned;
+// errors of single images are reported through the callback.
+jpegarchive_error_code_t jpegarchive_recompress_batch(const jpegarchive_recompress_input_t *inputs, int count, int threads, jpegarchive_batch_callback_t callback, void *user);
+
+// Reads only the header of a JPEG, without any entropy decoding. Fails
+// with JPEGARCHIVE_UNSUPPORTED for frames the library can't decode.
+jpegarchive_probe_output_t jpegarchive_probe(const unsigned char *jpeg, int64_t length);
+void jpegarchive_free_probe_output(jpegarchive_probe_output_t *output);
+
 jpegarchive_compare_output_t jpegarchive_compare(jpegarchive_compare_input_t input);
+jpegarchive_compare_output_t jpegarchive_compare_ctx(jpegarchive_context_t *ctx, jpegarchive_compare_input_t input);
 void jpegarchive_free_compare_output(jpegarchive_compare_output_t *output);
 
 #ifdef __cplusplus
@@ -63,23 +63,139 @@ void defish(const unsigned char *input, unsigned char *output, int width, int he
     }
 }
 
-long grayscale(const unsigned char *input, unsigned char **output, int width, int height) {
-    int stride = width * 3;
+// Both color conversions below are plain fixed-point loops that the
+// compiler vectorizes. They are built once more for AVX2 and SSSE3, whose
+// wider vectors and byte shuffles make the interleaved pixels cheaper to
+// load, and the fastest the CPU supports is picked at run time. They only
+// use integer math, so every build gives the same result.
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#define CONVERT_X86
+#define CONVERT_INLINE static inline __attribute__((always_inline))
+#else
+#define CONVERT_INLINE static inline
+#endif
+
+// Y = 0.299R + 0.587G + 0.114B in 16-bit fixed point, like libjpeg. The
+// weights add up to 1 << 16, so gray pixels keep their value.
+CONVERT_INLINE void grayscalePixels(const unsigned char *restrict input, unsigned char *restrict output, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        unsigned int r = input[i * 3];
+        unsigned int g = input[i * 3 + 1];
+        unsigned int b = input[i * 3 + 2];
+        output[i] = (r * 19595 + g * 38470 + b * 7471 + 32768) >> 16;
+    }
+}
+
+// The fixed-point factors and rounding of libjpeg's ycc_rgb_convert, so
+// the result matches decoding to RGB
+CONVERT_INLINE void yccToRgbPixels(const unsigned char *restrict input, unsigned char *restrict output, unsigned char *restrict luma, int width) {
+    for (int x = 0; x < width; x++) {
+        int y = input[x * 3];
+        int cb = input[x * 3 + 1] - 128;
+        int cr = input[x * 3 + 2] - 128;
+        int r = y + ((91881 * cr + 32768) >> 16);
+        int g = y + ((-22554 * cb - 46802 * cr + 32768) >> 16);
+        int b = y + ((116130 * cb + 32768) >> 16);
+
+        luma[x] = y;
+        output[x * 3] = (r < 0) ? 0 : ((r > 255) ? 255 : r);
+        output[x * 3 + 1] = (g < 0) ? 0 : ((g > 255) ? 255 : g);
+        output[x * 3 + 2] = (b < 0) ? 0 : ((b > 255) ? 255 : b);
+    }
+}
+
+#ifdef CONVERT_X86
+__attribute__((target("avx2"))) static void grayscaleAvx2(const unsigned char *input, unsigned char *output, size_t count) {
+    grayscalePixels(input, output, count);
+}
+
+__attribute__((target("ssse3"))) static void grayscaleSsse3(const unsigned char *input, unsigned char *output, size_t count) {
+    grayscalePixels(input, output, count);
+}
+
+__attribute__((target("avx2"))) static void yccToRgbAvx2(const unsigned char *input, unsigned char *output, unsigned char *luma, int width) {
+    yccToRgbPixels(input, output, luma, width);
+}
+
+__attribute__((target("ssse3"))) static void yccToRgbSsse3(const unsigned char *input, unsigned char *output, unsigned char *luma, int width) {
+    yccToRgbPixels(input, output, luma, width);
+}
+#endif
+
+struct convertKernels {
+    void (*grayscale)(const unsigned char *input, unsigned char *output, size_t count);
+    void (*yccToRgb)(const unsigned char *input, unsigned char *output, unsigned char *luma, int width);
+};
+
+static void grayscaleDefault(const unsigned char *input, unsigned char *output, size_t count) {
+    grayscalePixels(input, output, count);
+}
+
+static void yccToRgbDefault(const unsigned char *input, unsigned char *output, unsigned char *luma, int width) {
+    yccToRgbPixels(input, output, luma, width);
+}
 
+static const struct convertKernels convertDefault = { grayscaleDefault, yccToRgbDefault };
+#ifdef CONVERT_X86
+static const struct convertKernels convertAvx2 = { grayscaleAvx2, yccToRgbAvx2 };
+static const struct convertKernels convertSsse3 = { grayscaleSsse3, yccToRgbSsse3 };
+#endif
+
+// The kernels are picked on first use, as decodes call yccToRgb per row
+static const struct convertKernels *convertKernels(void) {
+    static const struct convertKernels *active;
+
+    if (!active) {
+#ifdef CONVERT_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            active = &convertAvx2;
+        else if (__builtin_cpu_supports("ssse3"))
+            active = &convertSsse3;
+        else
+            active = &convertDefault;
+#else
+        active = &convertDefault;
+#endif
+    }
+    return active;
+}
+
+void grayscaleInto(const unsigned char *restrict input, unsigned char *restrict output, int width, int height) {
+    convertKernels()->grayscale(input, output, (size_t) width * height);
+}
+
+void yccToRgb(const unsigned char *restrict input, unsigned char *restrict output, unsigned char *restrict luma, int width) {
+    convertKernels()->yccToRgb(input, output, luma, width);
+}
+
+long grayscale(const unsigned char *input, unsigned char **output, int width, int height) {
     *output = malloc(width * height);
     if (*output == NULL) {
         // Malloc failed
         return 0;
     }
 
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            // Y = 0.299R + 0.587G + 0.114B
-            (*output)[y * width + x] = input[y * stride + x * 3] * 0.299 +
-                                       input[y * stride + x * 3 + 1] * 0.587 +
-                                       input[y * stride + x * 3 + 2] * 0.114 + 0.5;
-        }
-    }
+    grayscaleInto(input, *output, width, height);
 
     return width * height;
 }
+
+void downscale(const unsigned char *input, unsigned char *output, int width, int height, int factor) {
+    int outWidth = (width + factor - 1) / factor;
+
+    for (int oy = 0; oy * factor < height; oy++) {
+        int y1 = ((oy + 1) * factor < height) ? (oy + 1) * factor : height;
+        for (int ox = 0; ox < outWidth; ox++) {
+            int x1 = ((ox + 1) * factor < width) ? (ox + 1) * factor : width;
+            int sum = 0;
+            for (int y = oy * factor; y < y1; y++) {
+                for (int x = ox * factor; x < x1; x++) {
+                    sum += input[y * width + x];
+                }
+            }
+            int count = (y1 - oy * factor) * (x1 - ox * factor);
+            output[oy * outWidth + ox] = (sum + count / 2) / count;
+        }
+    }
+}
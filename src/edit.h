@@ -33,4 +33,26 @@ void defish(const unsigned char *input, unsigned char *output, int width, int he
 */
 long grayscale(const unsigned char *input, unsigned char **output, int width, int height);
 
+/*
+    Same as grayscale, but writes into an existing buffer of at least
+    width * height bytes.
+*/
+void grayscaleInto(const unsigned char *restrict input, unsigned char *restrict output, int width, int height);
+
+/*
+    Convert a row of interleaved YCbCr pixels, as libjpeg decodes them
+    with out_color_space set to JCS_YCbCr, to RGB, and copy its Y into
+    luma. Decoding YCbCr through this gives the same RGB as decoding to
+    RGB, and the luma reference without a grayscale pass.
+*/
+void yccToRgb(const unsigned char *restrict input, unsigned char *restrict output, unsigned char *restrict luma, int width);
+
+/*
+    Shrink a grayscale image by an integer factor, averaging each
+    factor x factor block. The output holds ceil(width / factor) by
+    ceil(height / factor) pixels; blocks on the right and bottom edges
+    average just the pixels they cover.
+*/
+void downscale(const unsigned char *input, unsigned char *output, int width, int height, int factor);
+
 #endif
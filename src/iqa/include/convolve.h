@@ -54,6 +54,37 @@ struct _kernel {
     float bnd_const;        /**< If 'bnd_opt' is KBND_CONSTANT, this specifies the out-of-bounds value */
 };
 
+/**
+ * Checks whether every kernel value is the same (a box filter). Uniform
+ * kernels are convolved with running sums, so the cost per pixel does not
+ * depend on the kernel size.
+ * @return 1 if the kernel is uniform, 0 otherwise.
+ */
+int _iqa_kernel_is_uniform(const struct _kernel *k);
+
+/**
+ * Factors the kernel into a column vector 'ky' and a row vector 'kx' such
+ * that kernel[v*w + u] == ky[v]*kx[u] (a rank-1 kernel). 'kx' is the row
+ * through the largest value (the pivot) and 'ky' the column through it,
+ * divided by the pivot. Only kernels that are rank-1 to within the rounding
+ * of their float values (see IQA_SEPARABLE_TOL) are accepted; anything else,
+ * including tables rounded to a few decimal places, is left to the dense
+ * convolution.
+ *
+ * @param k The kernel to factor
+ * @param kx Buffer of k->w values to hold the row vector
+ * @param ky Buffer of k->h values to hold the column vector
+ * @return 1 if the kernel is separable, 0 otherwise.
+ */
+int _iqa_kernel_separate(const struct _kernel *k, float *kx, float *ky);
+
+/**
+ * Relative tolerance used by _iqa_kernel_separate(), about four float ulps:
+ * enough for a kernel built as float products ky[v]*kx[u], as the SSIM
+ * Gaussian window and the MS-SSIM low-pass filter are.
+ */
+#define IQA_SEPARABLE_TOL 5e-7
+
 /**
  * @brief Applies the specified kernel to the image.
  * The kernel will be applied to all areas where it fits completely within
@@ -72,6 +103,49 @@ struct _kernel {
  */
 void _iqa_convolve(float *img, int w, int h, const struct _kernel *k, float *result, int *rw, int *rh);
 
+/* Channels of _iqa_moments() */
+#define IQA_MOMENT_REF      1   /**< E[x], the local mean of 'ref' */
+#define IQA_MOMENT_CMP      2   /**< E[y], the local mean of 'cmp' */
+#define IQA_MOMENT_REF_SQD  4   /**< E[x^2] */
+#define IQA_MOMENT_CMP_SQD  8   /**< E[y^2] */
+#define IQA_MOMENT_BOTH     16  /**< E[x*y] */
+#define IQA_MOMENT_ALL      31
+
+/**
+ * Receives output row 'y' of _iqa_moments(). The rows of channels that weren't
+ * requested are 0. The rows are scratch buffers that are only valid during the
+ * call, so they may be modified in place (e.g. E[x^2] - E[x]^2 to get the
+ * variance).
+ * @return 0 to continue. Non-zero stops _iqa_moments().
+ */
+typedef int (*_iqa_moments_row)(int y, int w, float *ref_mu, float *cmp_mu,
+    float *ref_sqd, float *cmp_sqd, float *both, void *ctx);
+
+/**
+ * Calculates the local statistics used by SSIM (the means of x, y, x^2, y^2
+ * and x*y under the kernel) and hands them to 'row' one output row at a time,
+ * top to bottom. Nothing the size of the image is allocated: box kernels keep
+ * running column sums, separable kernels a ring of the last kh filtered rows
+ * and other kernels a ring of the last kh product rows.
+ *
+ * Every value is computed exactly as if the image (or product of images) had
+ * been run through _iqa_convolve().
+ *
+ * @param ref First image
+ * @param cmp Second image. May be 0 if no 'cmp' channel is requested.
+ * @param w Image width
+ * @param h Image height
+ * @param k The kernel to apply
+ * @param channels The IQA_MOMENT_* channels to calculate, or'ed together
+ * @param row Called for each output row
+ * @param ctx Passed through to 'row'
+ * @param rw Optional. The width of the resulting rows will be stored here.
+ * @param rh Optional. The number of resulting rows will be stored here.
+ * @return 0 if successful. Non-zero if out of memory or stopped by 'row'.
+ */
+int _iqa_moments(const float *ref, const float *cmp, int w, int h, const struct _kernel *k,
+    int channels, _iqa_moments_row row, void *ctx, int *rw, int *rh);
+
 /**
  * The same as _iqa_convolve() except the kernel is applied to the entire image.
  * In other words, the kernel is applied to all areas where the top-left corner
@@ -52,4 +52,23 @@
  */
 int _iqa_decimate(float *img, int w, int h, int factor, const struct _kernel *k, float *result, int *rw, int *rh);
 
+/**
+ * @brief Integer counterpart of _iqa_decimate() with a factor x factor box
+ * filter and KBND_SYMMETRIC borders.
+ *
+ * Each output is the exact sum (not the mean) of the same source pixels the
+ * float version averages, so it fits in an int for any practical factor.
+ *
+ * @param img Image to downsample
+ * @param w Image width
+ * @param h Image height
+ * @param stride The length (in bytes) of each horizontal line in the image.
+ * @param factor Decimation factor
+ * @param result Buffer to hold the resulting sums, sized as for _iqa_decimate()
+ * @param rw Optional. The width of the resulting image will be stored here.
+ * @param rh Optional. The height of the resulting image will be stored here.
+ * @return 0 on success.
+ */
+int _iqa_decimate_u8(const unsigned char *img, int w, int h, int stride, int factor, int *result, int *rw, int *rh);
+
 #endif /*_DECIMATE_H_*/
@@ -34,6 +34,7 @@
 #define _FAST_SSIM_H_
 
 #include "iqa.h"
+#include <stddef.h>
 
 /**
  * Opaque structure holding pre-computed data for the reference image
@@ -65,6 +66,53 @@ fast_ssim_model* fast_ssim_create_model(
     const struct iqa_ssim_args *args
 );
 
+/**
+ * Returns the number of bytes fast_ssim_init_model() needs for a model of a
+ * w x h reference image with the given window and arguments.
+ */
+size_t fast_ssim_model_size(
+    int w,
+    int h,
+    int gaussian,
+    const struct iqa_ssim_args *args
+);
+
+/**
+ * Builds a model like fast_ssim_create_model(), but in caller-provided memory
+ * of at least fast_ssim_model_size() bytes, so a long-running caller can reuse
+ * one block for every reference image. The returned model points into 'mem'
+ * and must not be passed to fast_ssim_destroy_model().
+ *
+ * @return The model handle (== mem), or NULL if error.
+ */
+fast_ssim_model* fast_ssim_init_model(
+    void *mem,
+    const unsigned char *ref,
+    int w,
+    int h,
+    int stride,
+    int gaussian,
+    const struct iqa_ssim_args *args
+);
+
+/**
+ * Returns the number of bytes of scratch memory fast_ssim_compare_scratch()
+ * needs for one comparison against 'model'.
+ */
+size_t fast_ssim_scratch_size(const fast_ssim_model *model);
+
+/**
+ * Same as fast_ssim_compare(), but converts the comparison image into
+ * caller-provided scratch memory of at least fast_ssim_scratch_size() bytes
+ * instead of allocating it. Concurrent comparisons need separate scratch.
+ */
+float fast_ssim_compare_scratch(
+    const fast_ssim_model *model,
+    const unsigned char *cmp,
+    int stride,
+    void *scratch
+);
+
 /**
  * Compares an image against the pre-computed reference model.
  * This function uses the pre-computed values from the model to speed up
@@ -108,6 +108,28 @@ float iqa_psnr(const unsigned char *ref, const unsigned char *cmp, int w, int h,
 float iqa_ssim(const unsigned char *ref, const unsigned char *cmp, int w, int h, int stride, 
     int gaussian, const struct iqa_ssim_args *args);
 
+/**
+ * Calculates the Structural SIMilarity between 2 equal-sized 8-bit images with
+ * the 8x8 square window, without converting them to floats.
+ *
+ * Window sums of the pixels, their squares and their product are accumulated
+ * exactly in integers; only the SSIM formula of each window is evaluated in
+ * floating point. The result matches iqa_ssim() with gaussian = 0 to within
+ * 1e-6, and is the more accurate of the two.
+ *
+ * @note The images must have the same width, height, and stride.
+ * @param ref Original reference image
+ * @param cmp Distorted image
+ * @param w Width of the images
+ * @param h Height of the images
+ * @param stride The length (in bytes) of each horizontal line in the image.
+ *               This may be different from the image width.
+ * @param args Optional SSIM arguments, as for iqa_ssim(). 0 for defaults.
+ * @return The mean SSIM over the entire image (MSSIM), or INFINITY if error.
+ */
+float iqa_ssim_u8(const unsigned char *ref, const unsigned char *cmp, int w, int h, int stride,
+    const struct iqa_ssim_args *args);
+
 /**
  * Calculates the Multi-Scale Structural SIMilarity between 2 equal-sized 8-bit
  * images. The default algorithm is MS-SSIM* proposed by Rouse/Hemami 2008.
@@ -131,4 +153,21 @@ float iqa_ssim(const unsigned char *ref, const unsigned char *cmp, int w, int h,
 float iqa_ms_ssim(const unsigned char *ref, const unsigned char *cmp, int w, int h, int stride, 
     const struct iqa_ms_ssim_args *args);
 
+/**
+ * Sets the number of threads iqa_ssim(), iqa_ms_ssim() and fast_ssim_compare()
+ * split each image across. The image is cut into the same row bands whatever
+ * the setting and the per-band sums are added in band order, so the results
+ * are bit-identical for any number of threads.
+ *
+ * The setting is process-wide and the worker threads are shared by every
+ * caller. The IQA_THREADS environment variable gives the initial value. Don't
+ * change it while a comparison is running.
+ *
+ * @param threads Number of threads, counting the calling thread. 1 (the
+ *                default) keeps all the work on the calling thread. 0 uses one
+ *                thread per online CPU.
+ * @return 0 on success, 1 if not all of the worker threads could be started.
+ */
+int iqa_set_threads(int threads);
+
 #endif /*_IQA_H_*/
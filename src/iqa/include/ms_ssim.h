@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2025
+ * Multi-scale SSIM with a pre-computed reference model for multiple comparisons
+ * 
+ * The BSD License
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice, 
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * - Neither the name of the contributors may be used to endorse or promote 
+ *   products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _MS_SSIM_H_
+#define _MS_SSIM_H_
+
+#include "iqa.h"
+
+/**
+ * Opaque structure holding the scaled reference image and its statistics
+ */
+typedef struct ms_ssim_model ms_ssim_model;
+
+/**
+ * Creates an MS-SSIM model from a reference image. The model holds every
+ * scale of the reference along with its local means and variances, in one
+ * allocation, so each comparison only has to scale down the comparison image.
+ *
+ * @param ref Original reference image
+ * @param w Width of the image
+ * @param h Height of the image
+ * @param stride The length (in bytes) of each horizontal line in the image.
+ *               This may be different from the image width.
+ * @param args Optional MS-SSIM arguments, as for iqa_ms_ssim(). 0 for
+ * defaults. Defaults are wang=0, scales=5, gaussian=1.
+ * @return The model handle, or NULL if error (including an image too small
+ * for the number of scales).
+ */
+ms_ssim_model* ms_ssim_create_model(
+    const unsigned char *ref,
+    int w,
+    int h,
+    int stride,
+    const struct iqa_ms_ssim_args *args
+);
+
+/**
+ * Compares an image against the reference model. The result is identical to
+ * iqa_ms_ssim() on the same images and arguments.
+ *
+ * @param model The model created by ms_ssim_create_model
+ * @param cmp Distorted image to compare, the same size as the reference
+ * @param stride The length (in bytes) of each horizontal line in the comparison image.
+ *               This may be different from the image width.
+ * @return The mean MS-SSIM over the entire image, or INFINITY if error.
+ */
+float ms_ssim_compare(
+    const ms_ssim_model *model,
+    const unsigned char *cmp,
+    int stride
+);
+
+/**
+ * Destroys an MS-SSIM model and frees all associated memory.
+ *
+ * @param model The model to destroy
+ */
+void ms_ssim_destroy_model(ms_ssim_model *model);
+
+#endif /* _MS_SSIM_H_ */
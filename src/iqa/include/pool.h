@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2025
+ * Worker threads shared by the image comparisons
+ *
+ * The BSD License
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * - Neither the name of the contributors may be used to endorse or promote
+ *   products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _POOL_H_
+#define _POOL_H_
+
+/** Runs job number 'job' of a task */
+typedef void (*_iqa_job)(int job, void *ctx);
+
+/**
+ * Runs fn(0, ctx) ... fn(jobs-1, ctx) on the worker threads and the calling
+ * thread, and returns once all of them have finished. Jobs run in any order
+ * and possibly at the same time, so each job must only write its own part of
+ * 'ctx'.
+ *
+ * Several threads may run tasks at once, and a job may itself call
+ * _iqa_pool_run(). The caller always works through its own task, so it never
+ * waits on workers that are busy elsewhere.
+ */
+void _iqa_pool_run(int jobs, _iqa_job fn, void *ctx);
+
+/**
+ * Splits 'rows' output rows into bands of '*band_rows' rows (the last band
+ * may be shorter). The split only depends on 'rows', so sums taken per band
+ * and added in band order come out the same for any number of threads.
+ *
+ * Bands are at least IQA_BAND_MIN_ROWS tall, to keep the halo rows each band
+ * recomputes cheap, and there are at most IQA_BAND_MAX of them.
+ *
+ * @return The number of bands.
+ */
+int _iqa_bands(int rows, int *band_rows);
+
+#define IQA_BAND_MIN_ROWS 64
+#define IQA_BAND_MAX      32
+
+#endif /*_POOL_H_*/
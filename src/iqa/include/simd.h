@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2025
+ * Runtime selection of vectorized inner loops
+ *
+ * The BSD License
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * - Neither the name of the contributors may be used to endorse or promote
+ *   products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SIMD_H_
+#define _SIMD_H_
+
+/**
+ * Inner loops with a scalar reference implementation and optional vector
+ * versions. Every vector version performs the same floating point operations
+ * in the same order as the scalar one, so all tables give bit-identical
+ * results and can be cross-checked against each other.
+ *
+ * The table is chosen on first use: the IQA_SIMD environment variable
+ * ("scalar", "sse2" or "avx2") forces a table if the CPU supports it,
+ * otherwise the best supported one is used.
+ */
+struct _iqa_simd {
+    const char *name;   /**< "scalar", "sse2" or "avx2" */
+
+    /** dst[i] = (float)src[i] */
+    void (*u8_to_float)(const unsigned char *src, float *dst, int len);
+
+    /** dst[x] = SUM(src[x+u] * k[u]) for u in [0,klen), summed in double */
+    void (*conv_row)(const float *src, const float *k, int klen, double *dst, int len);
+
+    /** acc[x] += row[x] * k */
+    void (*conv_col)(double *acc, const double *row, double k, int len);
+
+    /** acc[x] += row[x] * k, for single precision rows */
+    void (*conv_col_f)(double *acc, const float *row, double k, int len);
+
+    /**
+     * Adds the default (a=b=g=1) SSIM index of each pixel to 'sum', in pixel
+     * order, and returns the new sum.
+     */
+    double (*ssim_sum)(const float *ref_mu, const float *cmp_mu, const float *ref_sigma_sqd,
+        const float *cmp_sigma_sqd, const float *sigma_both, int len, float C1, float C2, double sum);
+
+    /** Returns SUM((a[i]-b[i])^2) */
+    unsigned long long (*sqr_err_u8)(const unsigned char *a, const unsigned char *b, int len);
+};
+
+/**
+ * Returns the active table, choosing one on the first call.
+ */
+const struct _iqa_simd *_iqa_simd(void);
+
+/**
+ * Returns the table with the given name, or 0 if it wasn't compiled in or
+ * the CPU doesn't support it.
+ */
+const struct _iqa_simd *_iqa_simd_find(const char *name);
+
+/**
+ * Makes the named table the active one. If 'name' is 0, the IQA_SIMD
+ * environment variable and then the CPU features decide.
+ * @return 0 on success, 1 if the table is not available (the active table
+ *         is left unchanged).
+ */
+int _iqa_simd_select(const char *name);
+
+/* Vector tables (simd_x86.c). Return 0 when unavailable. */
+const struct _iqa_simd *_iqa_simd_sse2(void);
+const struct _iqa_simd *_iqa_simd_avx2(void);
+
+#endif /*_SIMD_H_*/
@@ -35,25 +35,39 @@
 #define _SSIM_H_
 
 #include "convolve.h"
+#include <stddef.h>
 
 /*
  * Circular-symmetric Gaussian weighting.
  * h(x,y) = hg(x,y)/SUM(SUM(hg)) , for normalization to 1.0
  * hg(x,y) = e^( -0.5*( (x^2+y^2)/sigma^2 ) ) , where sigma was 1.5
+ * The window is built as the outer product of the 1-D Gaussian below, so
+ * it is exactly separable. The taps are scaled so the window sums to
+ * 0.999998, like the 6-decimal table it replaced: MS-SSIM (Rouse/Hemami)
+ * runs without stabilizing constants, and the missing weight is a small
+ * variance floor in flat areas that its scores have always included.
  */
 #define GAUSSIAN_LEN 11
+#define GAUSSIAN_TAP_0  0.001028379f
+#define GAUSSIAN_TAP_1  0.007598750f
+#define GAUSSIAN_TAP_2  0.036000736f
+#define GAUSSIAN_TAP_3  0.109360581f
+#define GAUSSIAN_TAP_4  0.213005325f
+#define GAUSSIAN_TAP_5  0.266011459f
+#define GAUSSIAN_TAP_6  GAUSSIAN_TAP_4
+#define GAUSSIAN_TAP_7  GAUSSIAN_TAP_3
+#define GAUSSIAN_TAP_8  GAUSSIAN_TAP_2
+#define GAUSSIAN_TAP_9  GAUSSIAN_TAP_1
+#define GAUSSIAN_TAP_10 GAUSSIAN_TAP_0
+#define GAUSSIAN_ROW(v) { \
+    GAUSSIAN_TAP_##v*GAUSSIAN_TAP_0, GAUSSIAN_TAP_##v*GAUSSIAN_TAP_1, GAUSSIAN_TAP_##v*GAUSSIAN_TAP_2, \
+    GAUSSIAN_TAP_##v*GAUSSIAN_TAP_3, GAUSSIAN_TAP_##v*GAUSSIAN_TAP_4, GAUSSIAN_TAP_##v*GAUSSIAN_TAP_5, \
+    GAUSSIAN_TAP_##v*GAUSSIAN_TAP_6, GAUSSIAN_TAP_##v*GAUSSIAN_TAP_7, GAUSSIAN_TAP_##v*GAUSSIAN_TAP_8, \
+    GAUSSIAN_TAP_##v*GAUSSIAN_TAP_9, GAUSSIAN_TAP_##v*GAUSSIAN_TAP_10 }
 static const float g_gaussian_window[GAUSSIAN_LEN][GAUSSIAN_LEN] = {
-    {0.000001f, 0.000008f, 0.000037f, 0.000112f, 0.000219f, 0.000274f, 0.000219f, 0.000112f, 0.000037f, 0.000008f, 0.000001f},
-    {0.000008f, 0.000058f, 0.000274f, 0.000831f, 0.001619f, 0.002021f, 0.001619f, 0.000831f, 0.000274f, 0.000058f, 0.000008f},
-    {0.000037f, 0.000274f, 0.001296f, 0.003937f, 0.007668f, 0.009577f, 0.007668f, 0.003937f, 0.001296f, 0.000274f, 0.000037f},
-    {0.000112f, 0.000831f, 0.003937f, 0.011960f, 0.023294f, 0.029091f, 0.023294f, 0.011960f, 0.003937f, 0.000831f, 0.000112f},
-    {0.000219f, 0.001619f, 0.007668f, 0.023294f, 0.045371f, 0.056662f, 0.045371f, 0.023294f, 0.007668f, 0.001619f, 0.000219f},
-    {0.000274f, 0.002021f, 0.009577f, 0.029091f, 0.056662f, 0.070762f, 0.056662f, 0.029091f, 0.009577f, 0.002021f, 0.000274f},
-    {0.000219f, 0.001619f, 0.007668f, 0.023294f, 0.045371f, 0.056662f, 0.045371f, 0.023294f, 0.007668f, 0.001619f, 0.000219f},
-    {0.000112f, 0.000831f, 0.003937f, 0.011960f, 0.023294f, 0.029091f, 0.023294f, 0.011960f, 0.003937f, 0.000831f, 0.000112f},
-    {0.000037f, 0.000274f, 0.001296f, 0.003937f, 0.007668f, 0.009577f, 0.007668f, 0.003937f, 0.001296f, 0.000274f, 0.000037f},
-    {0.000008f, 0.000058f, 0.000274f, 0.000831f, 0.001619f, 0.002021f, 0.001619f, 0.000831f, 0.000274f, 0.000058f, 0.000008f},
-    {0.000001f, 0.000008f, 0.000037f, 0.000112f, 0.000219f, 0.000274f, 0.000219f, 0.000112f, 0.000037f, 0.000008f, 0.000001f},
+    GAUSSIAN_ROW(0), GAUSSIAN_ROW(1), GAUSSIAN_ROW(2), GAUSSIAN_ROW(3),
+    GAUSSIAN_ROW(4), GAUSSIAN_ROW(5), GAUSSIAN_ROW(6), GAUSSIAN_ROW(7),
+    GAUSSIAN_ROW(8), GAUSSIAN_ROW(9), GAUSSIAN_ROW(10),
 };
 
 /*
@@ -82,12 +96,19 @@ struct _ssim_int {
 /* Defines the pointers to the map-reduce functions. */
 typedef int (*_map)(const struct _ssim_int *, void *);
 typedef float (*_reduce)(int, int, void *);
+typedef void (*_merge)(void *, const void *);
 
-/* Arguments for map-reduce. The 'context' is user-defined. */
+/*
+ * Arguments for map-reduce. The 'context' is user-defined. Each row band maps
+ * into its own copy of the context ('size' bytes, copied before any pixel is
+ * mapped), and 'merge' then adds each copy into 'context' in band order.
+ */
 struct _map_reduce {
     _map map;
     _reduce reduce;
     void *context;
+    size_t size;
+    _merge merge;
 };
 
 /**
@@ -99,7 +120,11 @@ struct _map_reduce {
  *
  * Map-reduce is used for doing the final SSIM calculation. The map function is
  * called for every pixel, and the reduce is called at the end. The context is
- * caller-defined and *not* modified by this method.
+ * caller-defined and *not* modified by this method, other than by 'merge'.
+ *
+ * The output rows are split into bands (see _iqa_bands()) that may run on
+ * several threads. Every band starts its window sums afresh, so the result is
+ * the same for any number of threads.
  *
  * @param ref Original reference image
  * @param cmp Distorted image
@@ -114,4 +139,28 @@ struct _map_reduce {
  */
 float _iqa_ssim(float *ref, float *cmp, int w, int h, const struct _kernel *k, const struct _map_reduce *mr, const struct iqa_ssim_args *args);
 
+/**
+ * Private method that calculates the local means and variances of a
+ * pre-processed reference image, as _iqa_ssim() would, so they can be reused
+ * by _iqa_ssim_ref() for any number of comparisons.
+ *
+ * @param ref Reference image (stride==width)
+ * @param w Width of the image
+ * @param h Height of the image
+ * @param k The kernel used as the window function
+ * @param mu Buffer of (w-kw+1)*(h-kh+1) floats to hold the means
+ * @param sigma_sqd Buffer of the same size to hold the variances
+ * @return 0 if successful, non-zero if out of memory.
+ */
+int _iqa_ssim_ref_stats(const float *ref, int w, int h, const struct _kernel *k, float *mu, float *sigma_sqd);
+
+/**
+ * Same as _iqa_ssim(), but takes the reference means and variances from
+ * _iqa_ssim_ref_stats() instead of recomputing them. The result is identical.
+ * Neither image is modified. 'ref_mu' and 'ref_sigma_sqd' may be 0, in which
+ * case this is _iqa_ssim().
+ */
+float _iqa_ssim_ref(const float *ref, const float *ref_mu, const float *ref_sigma_sqd, const float *cmp,
+    int w, int h, const struct _kernel *k, const struct _map_reduce *mr, const struct iqa_ssim_args *args);
+
 #endif /* _SSIM_H_ */
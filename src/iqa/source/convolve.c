@@ -32,7 +32,10 @@
  */
 
 #include "convolve.h"
+#include "simd.h"
+#include <math.h>
 #include <stdlib.h>
+#include <string.h>
 
 float KBND_SYMMETRIC(const float *img, int w, int h, int x, int y, float bnd_const)
 {
@@ -78,6 +81,164 @@ static float _calc_scale(const struct _kernel *k)
     }
 }
 
+int _iqa_kernel_is_uniform(const struct _kernel *k)
+{
+    int ii,k_len;
+
+    if (k->kernel[0] == 0.0f)
+        return 0;
+    k_len = k->w * k->h;
+    for (ii=1; ii<k_len; ++ii) {
+        if (k->kernel[ii] != k->kernel[0])
+            return 0;
+    }
+    return 1;
+}
+
+int _iqa_kernel_separate(const struct _kernel *k, float *kx, float *ky)
+{
+    int u,v,ii,r=0,c=0;
+    double peak=0.0, pivot, tol;
+
+    /* Pivot on the largest value */
+    for (ii=0; ii<k->w*k->h; ++ii) {
+        if (fabs(k->kernel[ii]) > peak) {
+            peak = fabs(k->kernel[ii]);
+            r = ii / k->w;
+            c = ii % k->w;
+        }
+    }
+    if (peak == 0.0)
+        return 0;
+    pivot = k->kernel[r*k->w + c];
+
+    /*
+     * Rank-1 means every value times the pivot equals the product of the
+     * values in its column on the pivot row and in its row on the pivot
+     * column. Products of two floats are exact in double, so the only slack
+     * is for the rounding of the stored values themselves.
+     */
+    tol = peak * peak * IQA_SEPARABLE_TOL;
+    for (v=0; v<k->h; ++v) {
+        for (u=0; u<k->w; ++u) {
+            if (fabs((double)k->kernel[v*k->w + u] * pivot -
+                (double)k->kernel[v*k->w + c] * k->kernel[r*k->w + u]) > tol)
+                return 0;
+        }
+    }
+
+    for (u=0; u<k->w; ++u)
+        kx[u] = k->kernel[r*k->w + u];
+    for (v=0; v<k->h; ++v)
+        ky[v] = (float)(k->kernel[v*k->w + c] / pivot);
+    return 1;
+}
+
+/*
+ * Box filter using running sums. Column sums over 'kh' rows are kept for the
+ * current output row and slid down one row at a time; each output row is then
+ * a horizontal sliding sum over 'kw' columns. Rows are staged in 'row' before
+ * being stored so the filter can be applied in-place.
+ */
+static int _box_convolve(float *img, int w, int h, const struct _kernel *k, float *dst)
+{
+    int x,y,v;
+    int dst_w = w - k->w + 1;
+    int dst_h = h - k->h + 1;
+    double *col;
+    float *row;
+    double sum, weight;
+    const float *add, *sub;
+
+    col = (double*)malloc(w*sizeof(double));
+    row = (float*)malloc(dst_w*sizeof(float));
+    if (!col || !row) {
+        if (col) free(col);
+        if (row) free(row);
+        return 1;
+    }
+
+    weight = (double)k->kernel[0] * _calc_scale(k);
+    for (x=0; x<w; ++x) {
+        col[x] = 0.0;
+        for (v=0; v<k->h; ++v)
+            col[x] += img[v*w + x];
+    }
+
+    for (y=0; y<dst_h; ++y) {
+        sum = 0.0;
+        for (x=0; x<k->w; ++x)
+            sum += col[x];
+        row[0] = (float)(sum * weight);
+        for (x=1; x<dst_w; ++x) {
+            sum += col[x+k->w-1] - col[x-1];
+            row[x] = (float)(sum * weight);
+        }
+
+        /* Slide the column sums before row 'y' can be overwritten */
+        if (y+1 < dst_h) {
+            add = img + (y+k->h)*w;
+            sub = img + y*w;
+            for (x=0; x<w; ++x)
+                col[x] += (double)add[x] - sub[x];
+        }
+        memcpy(dst + y*dst_w, row, dst_w*sizeof(float));
+    }
+
+    free(col);
+    free(row);
+    return 0;
+}
+
+/*
+ * Separable filter: each input row is filtered with 'kx' once, into a ring of
+ * the last 'kh' filtered rows, and each output row is a weighted sum of that
+ * ring with 'ky' (accumulated in the extra row after the ring). Input row
+ * y+kh-1 is read before output row y is written and output row y never
+ * reaches past it, so the filter can be applied in-place.
+ */
+static int _separable_convolve(float *img, int w, int h, const struct _kernel *k, float *dst)
+{
+    int x,y,v;
+    int dst_w = w - k->w + 1;
+    float *kx, *ky;
+    double *ring, *acc, *row;
+    float scale;
+    const struct _iqa_simd *simd = _iqa_simd();
+
+    kx = (float*)malloc((k->w + k->h)*sizeof(float));
+    ring = (double*)malloc((k->h+1)*dst_w*sizeof(double));
+    if (!kx || !ring || !_iqa_kernel_separate(k, kx, kx + k->w)) {
+        if (kx) free(kx);
+        if (ring) free(ring);
+        return 1;
+    }
+    ky = kx + k->w;
+    acc = ring + k->h*dst_w;
+
+    scale = _calc_scale(k);
+    for (y=0; y<h; ++y) {
+        /* Horizontal pass of input row 'y' */
+        simd->conv_row(img + y*w, kx, k->w, ring + (y % k->h)*dst_w, dst_w);
+        if (y < k->h-1)
+            continue;
+
+        /* Vertical pass for output row y-kh+1 */
+        for (x=0; x<dst_w; ++x)
+            acc[x] = 0.0;
+        for (v=0; v<k->h; ++v) {
+            row = ring + ((y - k->h + 1 + v) % k->h)*dst_w;
+            simd->conv_col(acc, row, ky[v], dst_w);
+        }
+        for (x=0; x<dst_w; ++x)
+            dst[(y - k->h + 1)*dst_w + x] = (float)(acc[x] * scale);
+    }
+
+    free(kx);
+    free(ring);
+    return 0;
+}
+
 void _iqa_convolve(float *img, int w, int h, const struct _kernel *k, float *result, int *rw, int *rh)
 {
     int x,y,kx,ky,u,v;
@@ -94,6 +255,22 @@ void _iqa_convolve(float *img, int w, int h, const struct _kernel *k, float *res
     if (!dst)
         dst = img; /* Convolve in-place */
 
+    /* Uniform kernels cost O(1) per pixel regardless of size */
+    if (dst_w > 0 && dst_h > 0 && _iqa_kernel_is_uniform(k) &&
+        !_box_convolve(img, w, h, k, dst)) {
+        if (rw) *rw = dst_w;
+        if (rh) *rh = dst_h;
+        return;
+    }
+
+    /* Rank-1 kernels cost kw+kh instead of kw*kh per pixel */
+    if (dst_w > 0 && dst_h > 0 && k->w > 1 && k->h > 1 &&
+        !_separable_convolve(img, w, h, k, dst)) {
+        if (rw) *rw = dst_w;
+        if (rh) *rh = dst_h;
+        return;
+    }
+
     /* Kernel is applied to all positions where the kernel is fully contained
      * in the image */
     scale = _calc_scale(k);
@@ -117,6 +294,270 @@ void _iqa_convolve(float *img, int w, int h, const struct _kernel *k, float *res
     if (rh) *rh = dst_h;
 }
 
+/* State shared by the _iqa_moments() sweeps */
+struct _moments {
+    const float *ref, *cmp;
+    int w, h, dst_w, dst_h;
+    const struct _kernel *k;
+    int n;              /* Number of requested channels */
+    int chan[5];        /* The requested channels, in IQA_MOMENT_* bit order */
+    float *out[5];      /* Output row of each channel (0 if not requested) */
+    _iqa_moments_row row;
+    void *ctx;
+};
+
+/*
+ * Returns input row 'y' of channel 'c': x, y, x^2, y^2 or x*y. The products
+ * are rounded to float in 'buf', exactly like a product plane would be.
+ */
+static const float *_moment_src(const struct _moments *m, int y, int c, float *buf)
+{
+    int x;
+    const float *a, *b;
+
+    a = (c == 1 || c == 3) ? m->cmp + y*m->w : m->ref + y*m->w;
+    if (c < 2)
+        return a;
+    b = (c == 4) ? m->cmp + y*m->w : a;
+    for (x=0; x<m->w; ++x)
+        buf[x] = a[x] * b[x];
+    return buf;
+}
+
+static int _emit_moments(const struct _moments *m, int y)
+{
+    return m->row(y, m->dst_w, m->out[0], m->out[1], m->out[2], m->out[3], m->out[4], m->ctx);
+}
+
+/* Box kernel: running column sums per channel, as in _box_convolve() */
+static int _box_moments(const struct _moments *m)
+{
+    int x,y,v,i,result=0;
+    int w = m->w, kw = m->k->w, kh = m->k->h;
+    double *col, *ci;
+    double sum, weight;
+    float *buf, *out;
+    const float *add, *sub;
+
+    col = (double*)malloc(m->n*w*sizeof(double));
+    buf = (float*)malloc(2*w*sizeof(float));
+    if (!col || !buf) {
+        if (col) free(col);
+        if (buf) free(buf);
+        return 2;
+    }
+
+    weight = (double)m->k->kernel[0] * _calc_scale(m->k);
+    for (i=0; i<m->n; ++i) {
+        ci = col + i*w;
+        for (x=0; x<w; ++x)
+            ci[x] = 0.0;
+        for (v=0; v<kh; ++v) {
+            add = _moment_src(m, v, m->chan[i], buf);
+            for (x=0; x<w; ++x)
+                ci[x] += add[x];
+        }
+    }
+
+    for (y=0; y<m->dst_h; ++y) {
+        for (i=0; i<m->n; ++i) {
+            ci = col + i*w;
+            out = m->out[m->chan[i]];
+            sum = 0.0;
+            for (x=0; x<kw; ++x)
+                sum += ci[x];
+            out[0] = (float)(sum * weight);
+            for (x=1; x<m->dst_w; ++x) {
+                sum += ci[x+kw-1] - ci[x-1];
+                out[x] = (float)(sum * weight);
+            }
+        }
+        if (_emit_moments(m, y)) {
+            result = 1;
+            break;
+        }
+
+        if (y+1 < m->dst_h) {
+            for (i=0; i<m->n; ++i) {
+                ci = col + i*w;
+                sub = _moment_src(m, y, m->chan[i], buf);
+                add = _moment_src(m, y+kh, m->chan[i], buf + w);
+                for (x=0; x<w; ++x)
+                    ci[x] += (double)add[x] - sub[x];
+            }
+        }
+    }
+
+    free(col);
+    free(buf);
+    return result;
+}
+
+/*
+ * Separable kernel: one ring of kh horizontally filtered rows (plus an
+ * accumulator row) per channel, as in _separable_convolve(). Returns -1 if the
+ * kernel isn't separable.
+ */
+static int _separable_moments(const struct _moments *m)
+{
+    int x,y,v,i,result=0;
+    int kw = m->k->w, kh = m->k->h, dst_w = m->dst_w;
+    float *kx, *ky, *buf, *out;
+    double *ring, *ri, *acc;
+    float scale;
+    const struct _iqa_simd *simd = _iqa_simd();
+
+    kx = (float*)malloc((kw + kh)*sizeof(float));
+    if (!kx)
+        return 2;
+    if (!_iqa_kernel_separate(m->k, kx, kx + kw)) {
+        free(kx);
+        return -1;
+    }
+    ky = kx + kw;
+    ring = (double*)malloc(m->n*(kh+1)*dst_w*sizeof(double));
+    buf = (float*)malloc(m->w*sizeof(float));
+    if (!ring || !buf) {
+        if (ring) free(ring);
+        if (buf) free(buf);
+        free(kx);
+        return 2;
+    }
+
+    scale = _calc_scale(m->k);
+    for (y=0; y<m->h; ++y) {
+        for (i=0; i<m->n; ++i) {
+            ri = ring + i*(kh+1)*dst_w;
+            simd->conv_row(_moment_src(m, y, m->chan[i], buf), kx, kw,
+                ri + (y % kh)*dst_w, dst_w);
+        }
+        if (y < kh-1)
+            continue;
+
+        for (i=0; i<m->n; ++i) {
+            ri = ring + i*(kh+1)*dst_w;
+            acc = ri + kh*dst_w;
+            out = m->out[m->chan[i]];
+            for (x=0; x<dst_w; ++x)
+                acc[x] = 0.0;
+            for (v=0; v<kh; ++v)
+                simd->conv_col(acc, ri + ((y - kh + 1 + v) % kh)*dst_w, ky[v], dst_w);
+            for (x=0; x<dst_w; ++x)
+                out[x] = (float)(acc[x] * scale);
+        }
+        if (_emit_moments(m, y - kh + 1)) {
+            result = 1;
+            break;
+        }
+    }
+
+    free(kx);
+    free(ring);
+    free(buf);
+    return result;
+}
+
+/* Any other kernel: a ring of the last kh input rows per channel */
+static int _dense_moments(const struct _moments *m)
+{
+    int x,y,u,v,i,k_offset,result=0;
+    int kw = m->k->w, kh = m->k->h;
+    float *ring, *out;
+    const float **rows, *src;
+    double sum;
+    float scale;
+
+    ring = (float*)malloc(m->n*kh*m->w*sizeof(float));
+    rows = (const float**)malloc(m->n*kh*sizeof(float*));
+    if (!ring || !rows) {
+        if (ring) free(ring);
+        if (rows) free((void*)rows);
+        return 2;
+    }
+
+    scale = _calc_scale(m->k);
+    for (y=0; y<m->h; ++y) {
+        for (i=0; i<m->n; ++i) {
+            v = i*kh + y % kh;
+            rows[v] = _moment_src(m, y, m->chan[i], ring + v*m->w);
+        }
+        if (y < kh-1)
+            continue;
+
+        /* Same summation order as the dense loop in _iqa_convolve() */
+        for (i=0; i<m->n; ++i) {
+            out = m->out[m->chan[i]];
+            for (x=0; x<m->dst_w; ++x) {
+                sum = 0.0;
+                k_offset = 0;
+                for (v=0; v<kh; ++v) {
+                    src = rows[i*kh + (y - kh + 1 + v) % kh] + x;
+                    for (u=0; u<kw; ++u, ++k_offset)
+                        sum += src[u] * m->k->kernel[k_offset];
+                }
+                out[x] = (float)(sum * scale);
+            }
+        }
+        if (_emit_moments(m, y - kh + 1)) {
+            result = 1;
+            break;
+        }
+    }
+
+    free(ring);
+    free((void*)rows);
+    return result;
+}
+
+int _iqa_moments(const float *ref, const float *cmp, int w, int h, const struct _kernel *k,
+    int channels, _iqa_moments_row row, void *ctx, int *rw, int *rh)
+{
+    struct _moments m;
+    float *out;
+    int c, result;
+
+    m.ref = ref;
+    m.cmp = cmp;
+    m.w = w;
+    m.h = h;
+    m.dst_w = w - k->w + 1;
+    m.dst_h = h - k->h + 1;
+    m.k = k;
+    m.row = row;
+    m.ctx = ctx;
+    if (rw) *rw = m.dst_w;
+    if (rh) *rh = m.dst_h;
+    if (m.dst_w <= 0 || m.dst_h <= 0)
+        return 0;
+
+    m.n = 0;
+    for (c=0; c<5; ++c) {
+        m.out[c] = 0;
+        if (channels & (1<<c))
+            m.chan[m.n++] = c;
+    }
+    if (!m.n)
+        return 0;
+    out = (float*)malloc(m.n*m.dst_w*sizeof(float));
+    if (!out)
+        return 2;
+    for (c=0; c<m.n; ++c)
+        m.out[m.chan[c]] = out + c*m.dst_w;
+
+    if (_iqa_kernel_is_uniform(k))
+        result = _box_moments(&m);
+    else {
+        result = -1;
+        if (k->w > 1 && k->h > 1)
+            result = _separable_moments(&m);
+        if (result < 0)
+            result = _dense_moments(&m);
+    }
+
+    free(out);
+    return result;
+}
+
 int _iqa_img_filter(float *img, int w, int h, const struct _kernel *k, float *result)
 {
     int x,y;
@@ -32,8 +32,150 @@
  */
 
 #include "decimate.h"
+#include "math_utils.h"
+#include "simd.h"
+#include "pool.h"
 #include <stdlib.h>
 
+/* Maps an out-of-bounds coordinate the same way 'bnd_opt' does along one axis */
+static int _bnd_index(int x, int n, _iqa_get_pixel bnd_opt)
+{
+    if (bnd_opt == KBND_SYMMETRIC) {
+        if (x<0) x=-1-x;
+        else if (x>=n) x=(n-(x-n))-1;
+    }
+    /* Clamp what a single reflection can't bring back into tiny images */
+    if (x<0) x=0;
+    if (x>=n) x=n-1;
+    return x;
+}
+
+/* Builds the source index of every tap for 'count' outputs spaced 'factor' apart */
+static int *_tap_indices(int count, int n, int factor, int klen, _iqa_get_pixel bnd_opt)
+{
+    int i,t;
+    int *idx = (int*)malloc(count*klen*sizeof(int));
+    if (!idx)
+        return 0;
+    for (i=0; i<count; ++i) {
+        for (t=0; t<klen; ++t)
+            idx[i*klen + t] = _bnd_index(i*factor + t - klen/2, n, bnd_opt);
+    }
+    return idx;
+}
+
+/* Shared by the band jobs of _decimate_separable() */
+struct _decimate_bands {
+    const float *img;
+    int w, h, sw, sh;
+    const struct _kernel *k;
+    const float *kx, *ky;
+    const int *xi, *yi;
+    float *tmp, *dst;
+    double *acc;            /* One row per vertical band */
+    int band_rows;
+};
+
+/* Horizontal pass over a band of input rows */
+static void _decimate_rows(int band, void *ctx)
+{
+    struct _decimate_bands *b = (struct _decimate_bands*)ctx;
+    int x,y,t;
+    int y1 = _min((band+1)*b->band_rows, b->h);
+    int kw = b->k->w;
+    double sum;
+    const float *src;
+
+    for (y=band*b->band_rows; y<y1; ++y) {
+        src = b->img + y*b->w;
+        for (x=0; x<b->sw; ++x) {
+            sum = 0.0;
+            for (t=0; t<kw; ++t)
+                sum += src[b->xi[x*kw + t]] * b->kx[t];
+            b->tmp[y*b->sw + x] = (float)sum;
+        }
+    }
+}
+
+/* Vertical pass over a band of output rows */
+static void _decimate_cols(int band, void *ctx)
+{
+    struct _decimate_bands *b = (struct _decimate_bands*)ctx;
+    int x,y,t;
+    int y1 = _min((band+1)*b->band_rows, b->sh);
+    int kh = b->k->h;
+    double *acc = b->acc + band*b->sw;
+    const struct _iqa_simd *simd = _iqa_simd();
+
+    for (y=band*b->band_rows; y<y1; ++y) {
+        for (x=0; x<b->sw; ++x)
+            acc[x] = 0.0;
+        for (t=0; t<kh; ++t)
+            simd->conv_col_f(acc, b->tmp + b->yi[y*kh + t]*b->sw, (double)b->ky[t], b->sw);
+        for (x=0; x<b->sw; ++x)
+            b->dst[y*b->sw + x] = (float)acc[x];
+    }
+}
+
+/*
+ * Separable low-pass and downsample. Only the columns that survive the
+ * decimation are filtered horizontally (every row), then only the surviving
+ * rows are filtered vertically. Each pass is split into row bands that may
+ * run on several threads; every value is computed on its own, so the result
+ * doesn't depend on the split. All of 'img' is read before 'dst' is written,
+ * so the result may overwrite the source.
+ */
+static int _decimate_separable(const float *img, int w, int h, int factor, const struct _kernel *k,
+    int sw, int sh, float *dst)
+{
+    struct _decimate_bands b;
+    float *kx=0, *tmp=0;
+    double *acc=0;
+    int *xi=0, *yi=0;
+    int row_bands, col_bands, col_rows;
+
+    kx = (float*)malloc((k->w + k->h)*sizeof(float));
+    tmp = (float*)malloc(h*sw*sizeof(float));
+    xi = _tap_indices(sw, w, factor, k->w, k->bnd_opt);
+    yi = _tap_indices(sh, h, factor, k->h, k->bnd_opt);
+    col_bands = _iqa_bands(sh, &col_rows);
+    acc = (double*)malloc(_max(col_bands,1)*sw*sizeof(double));
+    if (!kx || !tmp || !acc || !xi || !yi || !_iqa_kernel_separate(k, kx, kx + k->w)) {
+        if (kx) free(kx);
+        if (tmp) free(tmp);
+        if (acc) free(acc);
+        if (xi) free(xi);
+        if (yi) free(yi);
+        return 1;
+    }
+
+    b.img = img;
+    b.w = w;
+    b.h = h;
+    b.sw = sw;
+    b.sh = sh;
+    b.k = k;
+    b.kx = kx;
+    b.ky = kx + k->w;
+    b.xi = xi;
+    b.yi = yi;
+    b.tmp = tmp;
+    b.dst = dst;
+    b.acc = acc;
+
+    row_bands = _iqa_bands(h, &b.band_rows);
+    _iqa_pool_run(row_bands, _decimate_rows, &b);
+    b.band_rows = col_rows;
+    _iqa_pool_run(col_bands, _decimate_cols, &b);
+
+    free(kx);
+    free(tmp);
+    free(acc);
+    free(xi);
+    free(yi);
+    return 0;
+}
+
 int _iqa_decimate(float *img, int w, int h, int factor, const struct _kernel *k, float *result, int *rw, int *rh)
 {
     int x,y;
@@ -45,6 +187,15 @@ int _iqa_decimate(float *img, int w, int h, int factor, const struct _kernel *k,
     if (result)
         dst = result;
 
+    if (rw) *rw = sw;
+    if (rh) *rh = sh;
+
+    /* Rank-1 filters with per-axis borders are applied one axis at a time */
+    if (k && k->w > 1 && k->h > 1 &&
+        (k->bnd_opt == KBND_SYMMETRIC || k->bnd_opt == KBND_REPLICATE) &&
+        !_decimate_separable(img, w, h, factor, k, sw, sh, dst))
+        return 0;
+
     /* Downsample */
     for (y=0; y<sh; ++y) {
         dst_offset = y*sw;
@@ -52,8 +203,74 @@ int _iqa_decimate(float *img, int w, int h, int factor, const struct _kernel *k,
             dst[dst_offset] = _iqa_filter_pixel(img, w, h, x*factor, y*factor, k, 1.0f);
         }
     }
-    
-    if (rw) *rw = sw;
-    if (rh) *rh = sh;
+    return 0;
+}
+
+/* Shared by the band jobs of _iqa_decimate_u8() */
+struct _decimate_u8_bands {
+    const unsigned char *img;
+    int stride, sw, sh, factor;
+    const int *xi, *yi;
+    int *dst;
+    int band_rows;
+};
+
+/* Box sums for a band of output rows */
+static void _decimate_u8_rows(int band, void *ctx)
+{
+    struct _decimate_u8_bands *b = (struct _decimate_u8_bands*)ctx;
+    int x,y,t,u,sum;
+    int f = b->factor;
+    int y1 = _min((band+1)*b->band_rows, b->sh);
+    const unsigned char *src;
+    const int *xi;
+    int *dst;
+
+    for (y=band*b->band_rows; y<y1; ++y) {
+        dst = b->dst + y*b->sw;
+        for (x=0; x<b->sw; ++x)
+            dst[x] = 0;
+        for (t=0; t<f; ++t) {
+            src = b->img + b->yi[y*f + t]*b->stride;
+            for (x=0, xi=b->xi; x<b->sw; ++x, xi+=f) {
+                sum = 0;
+                for (u=0; u<f; ++u)
+                    sum += src[xi[u]];
+                dst[x] += sum;
+            }
+        }
+    }
+}
+
+int _iqa_decimate_u8(const unsigned char *img, int w, int h, int stride, int factor, int *result, int *rw, int *rh)
+{
+    struct _decimate_u8_bands b;
+    int *xi, *yi;
+    int bands;
+
+    b.sw = w/factor + (w&1);
+    b.sh = h/factor + (h&1);
+    if (rw) *rw = b.sw;
+    if (rh) *rh = b.sh;
+
+    xi = _tap_indices(b.sw, w, factor, factor, KBND_SYMMETRIC);
+    yi = _tap_indices(b.sh, h, factor, factor, KBND_SYMMETRIC);
+    if (!xi || !yi) {
+        if (xi) free(xi);
+        if (yi) free(yi);
+        return 1;
+    }
+
+    b.img = img;
+    b.stride = stride;
+    b.factor = factor;
+    b.xi = xi;
+    b.yi = yi;
+    b.dst = result;
+    bands = _iqa_bands(b.sh, &b.band_rows);
+    _iqa_pool_run(bands, _decimate_u8_rows, &b);
+
+    free(xi);
+    free(yi);
     return 0;
 }
@@ -35,6 +35,8 @@
 #include "decimate.h"
 #include "math_utils.h"
 #include "ssim.h"
+#include "simd.h"
+#include "pool.h"
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
@@ -70,7 +72,240 @@ struct fast_ssim_model {
     float *ref_sigma_sqd;   /* Variance of reference (convolved) */
 };
 
-fast_ssim_model* fast_ssim_create_model(
+/* One band of output rows, while building the model or comparing */
+struct _fast_band {
+    const fast_ssim_model *model;
+    int y;                  /* First output row of the band */
+    double ssim_sum;
+    int failed;
+};
+
+/* Shared by the band jobs */
+struct _fast_bands {
+    const fast_ssim_model *model;
+    const float *cmp_f;     /* 0 while building the model */
+    int band_rows;
+    struct _fast_band *bands;
+};
+
+/* Stores a row of reference statistics in the model */
+static int _model_row(int y, int w, float *ref_mu, float *cmp_mu, float *ref_sqd,
+    float *cmp_sqd, float *both, void *ctx)
+{
+    struct _fast_band *band = (struct _fast_band*)ctx;
+    float *mu = band->model->ref_mu + (band->y + y) * w;
+    float *sigma_sqd = band->model->ref_sigma_sqd + (band->y + y) * w;
+    int x;
+
+    for (x = 0; x < w; ++x) {
+        mu[x] = ref_mu[x];
+        sigma_sqd[x] = ref_sqd[x] - ref_mu[x] * ref_mu[x];
+    }
+    return 0;
+}
+
+/* Adds a row of SSIM indices, given the comparison image statistics */
+static int _compare_row(int y, int w, float *unused_ref_mu, float *cmp_mu, float *unused_ref_sqd,
+    float *cmp_sigma_sqd, float *sigma_both, void *ctx)
+{
+    struct _fast_band *band = (struct _fast_band*)ctx;
+    const fast_ssim_model *model = band->model;
+    const float *ref_mu = model->ref_mu + (band->y + y) * w;
+    const float *ref_sigma_sqd = model->ref_sigma_sqd + (band->y + y) * w;
+    double luminance_comp, contrast_comp, structure_comp, sigma_root;
+    int x;
+
+    for (x = 0; x < w; ++x) {
+        cmp_sigma_sqd[x] -= cmp_mu[x] * cmp_mu[x];
+        sigma_both[x] -= ref_mu[x] * cmp_mu[x];
+    }
+
+    if (model->alpha == 1.0f && model->beta == 1.0f && model->gamma == 1.0f) {
+        /* Default case - faster computation */
+        band->ssim_sum = _iqa_simd()->ssim_sum(ref_mu, cmp_mu, ref_sigma_sqd,
+            cmp_sigma_sqd, sigma_both, w, model->C1, model->C2, band->ssim_sum);
+        return 0;
+    }
+
+    /* Custom alpha, beta, gamma */
+    for (x = 0; x < w; ++x) {
+        /* Handle negative variance */
+        float ref_sigma_sqd_safe = ref_sigma_sqd[x];
+        float cmp_sigma_sqd_safe = cmp_sigma_sqd[x];
+        if (ref_sigma_sqd_safe < 0.0f)
+            ref_sigma_sqd_safe = 0.0f;
+        if (cmp_sigma_sqd_safe < 0.0f)
+            cmp_sigma_sqd_safe = 0.0f;
+        
+        sigma_root = sqrt(ref_sigma_sqd_safe * cmp_sigma_sqd_safe);
+        
+        /* Luminance */
+        if (model->C1 == 0 && ref_mu[x] * ref_mu[x] == 0 && 
+            cmp_mu[x] * cmp_mu[x] == 0) {
+            luminance_comp = 1.0;
+        } else {
+            double result = (2.0 * ref_mu[x] * cmp_mu[x] + model->C1) / 
+                           (ref_mu[x] * ref_mu[x] + 
+                            cmp_mu[x] * cmp_mu[x] + model->C1);
+            if (model->alpha == 1.0f) {
+                luminance_comp = result;
+            } else {
+                float sign = result < 0.0 ? -1.0f : 1.0f;
+                luminance_comp = sign * pow(fabs(result), (double)model->alpha);
+            }
+        }
+        
+        /* Contrast */
+        if (model->C2 == 0 && ref_sigma_sqd_safe + cmp_sigma_sqd_safe == 0) {
+            contrast_comp = 1.0;
+        } else {
+            double result = (2.0 * sigma_root + model->C2) / 
+                           (ref_sigma_sqd_safe + cmp_sigma_sqd_safe + model->C2);
+            if (model->beta == 1.0f) {
+                contrast_comp = result;
+            } else {
+                float sign = result < 0.0 ? -1.0f : 1.0f;
+                contrast_comp = sign * pow(fabs(result), (double)model->beta);
+            }
+        }
+        
+        /* Structure */
+        if (model->C3 == 0 && sigma_root == 0) {
+            structure_comp = 1.0;
+        } else {
+            double result = (sigma_both[x] + model->C3) / (sigma_root + model->C3);
+            if (model->gamma == 1.0f) {
+                structure_comp = result;
+            } else {
+                float sign = result < 0.0 ? -1.0f : 1.0f;
+                structure_comp = sign * pow(fabs(result), (double)model->gamma);
+            }
+        }
+        
+        band->ssim_sum += luminance_comp * contrast_comp * structure_comp;
+    }
+    return 0;
+}
+
+/* Runs one band, with the halo rows below it that the window covers */
+static void _fast_band(int idx, void *ctx)
+{
+    struct _fast_bands *b = (struct _fast_bands*)ctx;
+    struct _fast_band *band = &b->bands[idx];
+    const fast_ssim_model *model = b->model;
+    int w = model->scaled_width;
+    int y = idx * b->band_rows;
+    int h = _min(b->band_rows, model->convolved_height - y) + model->window.h - 1;
+
+    band->model = model;
+    band->y = y;
+    band->ssim_sum = 0.0;
+    if (b->cmp_f)
+        band->failed = _iqa_moments(model->ref_f + y * w, b->cmp_f + y * w, w, h, &model->window,
+            IQA_MOMENT_CMP | IQA_MOMENT_CMP_SQD | IQA_MOMENT_BOTH, _compare_row, band, 0, 0);
+    else
+        band->failed = _iqa_moments(model->ref_f + y * w, 0, w, h, &model->window,
+            IQA_MOMENT_REF | IQA_MOMENT_REF_SQD, _model_row, band, 0, 0);
+}
+
+/*
+ * Builds the model statistics (cmp_f == 0) or sums the SSIM of 'cmp_f' over
+ * the row bands. Sums are added in band order, so the result doesn't depend
+ * on the number of threads.
+ */
+static int _fast_run_bands(const fast_ssim_model *model, const float *cmp_f, double *ssim_sum)
+{
+    struct _fast_bands b;
+    int idx, nbands, failed = 0;
+
+    b.model = model;
+    b.cmp_f = cmp_f;
+    nbands = _iqa_bands(model->convolved_height, &b.band_rows);
+    b.bands = (struct _fast_band*)malloc(_max(nbands, 1) * sizeof(struct _fast_band));
+    if (!b.bands)
+        return 1;
+
+    _iqa_pool_run(nbands, _fast_band, &b);
+
+    *ssim_sum = 0.0;
+    for (idx = 0; idx < nbands; ++idx) {
+        failed |= b.bands[idx].failed;
+        *ssim_sum += b.bands[idx].ssim_sum;
+    }
+    free(b.bands);
+    return failed;
+}
+
+/* Offsets of the parts of a model laid out in one block of memory */
+struct _fast_layout {
+    size_t kernel;
+    size_t low_pass;
+    size_t ref_f;
+    size_t ref_mu;
+    size_t ref_sigma_sqd;
+    size_t size;
+};
+
+static size_t _fast_align(size_t n)
+{
+    return (n + 63) & ~(size_t)63;
+}
+
+static int _fast_scale(int w, int h, const struct iqa_ssim_args *args)
+{
+    if (args && args->f)
+        return args->f;
+    return _max(1, _round((float)_min(w, h) / 256.0f));
+}
+
+/* Scaled dimensions, as produced by _iqa_decimate() */
+static int _fast_scaled(int n, int scale)
+{
+    return (scale > 1) ? n / scale + (n & 1) : n;
+}
+
+static void _fast_layout(int w, int h, int gaussian, const struct iqa_ssim_args *args,
+    struct _fast_layout *l)
+{
+    int scale = _fast_scale(w, h, args);
+    int len = gaussian ? GAUSSIAN_LEN : SQUARE_LEN;
+    size_t scaled = (size_t)_fast_scaled(w, scale) * _fast_scaled(h, scale);
+
+    l->kernel = _fast_align(sizeof(fast_ssim_model));
+    l->low_pass = l->kernel + _fast_align(len * len * sizeof(float));
+    l->ref_f = l->low_pass + _fast_align(scale * scale * sizeof(float));
+    l->ref_mu = l->ref_f + _fast_align((size_t)w * h * sizeof(float));
+    l->ref_sigma_sqd = l->ref_mu + _fast_align(scaled * sizeof(float));
+    l->size = l->ref_sigma_sqd + _fast_align(scaled * sizeof(float));
+}
+
+/* Fills the box filter used to scale images down */
+static void _fast_low_pass(struct _kernel *low_pass, float *kernel, int scale)
+{
+    int offset;
+
+    low_pass->kernel = kernel;
+    low_pass->w = low_pass->h = scale;
+    low_pass->normalized = 0;
+    low_pass->bnd_opt = KBND_SYMMETRIC;
+    for (offset = 0; offset < scale * scale; ++offset)
+        kernel[offset] = 1.0f / (scale * scale);
+}
+
+size_t fast_ssim_model_size(
+    int w,
+    int h,
+    int gaussian,
+    const struct iqa_ssim_args *args)
+{
+    struct _fast_layout layout;
+
+    _fast_layout(w, h, gaussian, args, &layout);
+    return layout.size;
+}
+
+fast_ssim_model* fast_ssim_init_model(
+    void *mem,
     const unsigned char *ref,
     int w,
     int h,
@@ -78,17 +313,17 @@ fast_ssim_model* fast_ssim_create_model(
     int gaussian,
     const struct iqa_ssim_args *args)
 {
-    fast_ssim_model *model;
-    int scale;
-    int x, y, src_offset, offset;
+    fast_ssim_model *model = (fast_ssim_model*)mem;
+    struct _fast_layout layout;
     struct _kernel low_pass;
-    float *ref_sigma_sqd_tmp;
-    int kernel_size;
+    int scale;
+    int y;
+    double ssim_sum;
     
-    /* Allocate model structure */
-    model = (fast_ssim_model*)calloc(1, sizeof(fast_ssim_model));
-    if (!model)
+    if (!mem)
         return NULL;
+    _fast_layout(w, h, gaussian, args, &layout);
+    memset(model, 0, sizeof(fast_ssim_model));
     
     /* Store dimensions */
     model->width = w;
@@ -102,10 +337,8 @@ fast_ssim_model* fast_ssim_create_model(
     model->K1 = 0.01f;
     model->K2 = 0.03f;
     
-    scale = _max(1, _round((float)_min(w, h) / 256.0f));
+    scale = _fast_scale(w, h, args);
     if (args) {
-        if (args->f)
-            scale = args->f;
         model->alpha = args->alpha;
         model->beta = args->beta;
         model->gamma = args->gamma;
@@ -120,144 +353,86 @@ fast_ssim_model* fast_ssim_create_model(
     model->C3 = model->C2 / 2.0f;
     
     /* Setup window kernel */
+    model->kernel_data = (float*)((char*)mem + layout.kernel);
     if (gaussian) {
-        kernel_size = GAUSSIAN_LEN * GAUSSIAN_LEN;
-        model->kernel_data = (float*)malloc(kernel_size * sizeof(float));
-        if (!model->kernel_data) {
-            free(model);
-            return NULL;
-        }
-        memcpy(model->kernel_data, g_gaussian_window, kernel_size * sizeof(float));
-        model->window.kernel = model->kernel_data;
+        memcpy(model->kernel_data, g_gaussian_window, GAUSSIAN_LEN * GAUSSIAN_LEN * sizeof(float));
         model->window.w = model->window.h = GAUSSIAN_LEN;
     } else {
-        kernel_size = SQUARE_LEN * SQUARE_LEN;
-        model->kernel_data = (float*)malloc(kernel_size * sizeof(float));
-        if (!model->kernel_data) {
-            free(model);
-            return NULL;
-        }
-        memcpy(model->kernel_data, g_square_window, kernel_size * sizeof(float));
-        model->window.kernel = model->kernel_data;
+        memcpy(model->kernel_data, g_square_window, SQUARE_LEN * SQUARE_LEN * sizeof(float));
         model->window.w = model->window.h = SQUARE_LEN;
     }
+    model->window.kernel = model->kernel_data;
     model->window.normalized = 1;
     model->window.bnd_opt = KBND_SYMMETRIC;
     
     /* Convert reference image to float */
-    model->ref_f = (float*)malloc(w * h * sizeof(float));
-    if (!model->ref_f) {
-        free(model->kernel_data);
-        free(model);
-        return NULL;
-    }
-    
-    for (y = 0; y < h; ++y) {
-        src_offset = y * stride;
-        offset = y * w;
-        for (x = 0; x < w; ++x, ++offset, ++src_offset) {
-            model->ref_f[offset] = (float)ref[src_offset];
-        }
-    }
+    model->ref_f = (float*)((char*)mem + layout.ref_f);
+    for (y = 0; y < h; ++y)
+        _iqa_simd()->u8_to_float(ref + y * stride, model->ref_f + y * w, w);
     
     /* Scale the image down if required */
+    model->scaled_width = w;
+    model->scaled_height = h;
     if (scale > 1) {
-        /* Generate simple low-pass filter */
-        low_pass.kernel = (float*)malloc(scale * scale * sizeof(float));
-        if (!low_pass.kernel) {
-            free(model->ref_f);
-            free(model->kernel_data);
-            free(model);
-            return NULL;
-        }
-        low_pass.w = low_pass.h = scale;
-        low_pass.normalized = 0;
-        low_pass.bnd_opt = KBND_SYMMETRIC;
-        for (offset = 0; offset < scale * scale; ++offset)
-            low_pass.kernel[offset] = 1.0f / (scale * scale);
-        
-        /* Resample */
-        model->scaled_width = w;
-        model->scaled_height = h;
+        _fast_low_pass(&low_pass, (float*)((char*)mem + layout.low_pass), scale);
         if (_iqa_decimate(model->ref_f, w, h, scale, &low_pass, 0, 
-                         &model->scaled_width, &model->scaled_height)) {
-            free(low_pass.kernel);
-            free(model->ref_f);
-            free(model->kernel_data);
-            free(model);
+                         &model->scaled_width, &model->scaled_height))
             return NULL;
-        }
-        free(low_pass.kernel);
-    } else {
-        model->scaled_width = w;
-        model->scaled_height = h;
     }
     
     /* Pre-compute mean and variance for reference image */
     w = model->scaled_width;
     h = model->scaled_height;
-    
-    model->ref_mu = (float*)malloc(w * h * sizeof(float));
-    model->ref_sigma_sqd = (float*)malloc(w * h * sizeof(float));
-    ref_sigma_sqd_tmp = (float*)malloc(w * h * sizeof(float));
-    
-    if (!model->ref_mu || !model->ref_sigma_sqd || !ref_sigma_sqd_tmp) {
-        free(ref_sigma_sqd_tmp);
-        free(model->ref_sigma_sqd);
-        free(model->ref_mu);
-        free(model->ref_f);
-        free(model->kernel_data);
-        free(model);
-        return NULL;
-    }
-    
-    /* Calculate mean of reference */
-    _iqa_convolve(model->ref_f, w, h, &model->window, model->ref_mu, 0, 0);
-    
-    /* Calculate ref^2 for later use */
-    for (y = 0; y < h; ++y) {
-        offset = y * w;
-        for (x = 0; x < w; ++x, ++offset) {
-            ref_sigma_sqd_tmp[offset] = model->ref_f[offset] * model->ref_f[offset];
-        }
-    }
-    
-    /* Calculate variance of reference */
-    _iqa_convolve(ref_sigma_sqd_tmp, w, h, &model->window, model->ref_sigma_sqd, &w, &h);
+    model->ref_mu = (float*)((char*)mem + layout.ref_mu);
+    model->ref_sigma_sqd = (float*)((char*)mem + layout.ref_sigma_sqd);
     
     /* Store convolved dimensions */
-    model->convolved_width = w;
-    model->convolved_height = h;
-    
-    /* Compute final variance: E[X^2] - E[X]^2 */
-    for (y = 0; y < h; ++y) {
-        offset = y * w;
-        for (x = 0; x < w; ++x, ++offset) {
-            model->ref_sigma_sqd[offset] = model->ref_sigma_sqd[offset] - 
-                                          model->ref_mu[offset] * model->ref_mu[offset];
-        }
-    }
+    model->convolved_width = w - model->window.w + 1;
+    model->convolved_height = h - model->window.h + 1;
     
-    free(ref_sigma_sqd_tmp);
+    if (_fast_run_bands(model, 0, &ssim_sum))
+        return NULL;
     
     return model;
 }
 
-float fast_ssim_compare(
+fast_ssim_model* fast_ssim_create_model(
+    const unsigned char *ref,
+    int w,
+    int h,
+    int stride,
+    int gaussian,
+    const struct iqa_ssim_args *args)
+{
+    void *mem = malloc(fast_ssim_model_size(w, h, gaussian, args));
+    fast_ssim_model *model = fast_ssim_init_model(mem, ref, w, h, stride, gaussian, args);
+
+    if (!model)
+        free(mem);
+    return model;
+}
+
+size_t fast_ssim_scratch_size(const fast_ssim_model *model)
+{
+    if (!model)
+        return 0;
+    return _fast_align((size_t)model->width * model->height * sizeof(float)) +
+        model->scale * model->scale * sizeof(float);
+}
+
+float fast_ssim_compare_scratch(
     const fast_ssim_model *model,
     const unsigned char *cmp,
-    int stride)
+    int stride,
+    void *scratch)
 {
-    float *cmp_f, *cmp_mu, *cmp_sigma_sqd, *sigma_both;
-    float *cmp_sq;
+    float *cmp_f = (float*)scratch;
     struct _kernel low_pass;
     int w, h, scale;
-    int x, y, src_offset, offset;
-    double ssim_sum = 0.0;
-    double numerator, denominator;
-    double luminance_comp, contrast_comp, structure_comp, sigma_root;
+    int y;
+    double ssim_sum;
     
-    if (!model || !cmp)
+    if (!model || !cmp || !scratch)
         return INFINITY;
     
     w = model->width;
@@ -265,183 +440,45 @@ float fast_ssim_compare(
     scale = model->scale;
     
     /* Convert comparison image to float */
-    cmp_f = (float*)malloc(w * h * sizeof(float));
-    if (!cmp_f)
-        return INFINITY;
-    
-    for (y = 0; y < h; ++y) {
-        src_offset = y * stride;
-        offset = y * w;
-        for (x = 0; x < w; ++x, ++offset, ++src_offset) {
-            cmp_f[offset] = (float)cmp[src_offset];
-        }
-    }
+    for (y = 0; y < h; ++y)
+        _iqa_simd()->u8_to_float(cmp + y * stride, cmp_f + y * w, w);
     
     /* Scale the comparison image down if required */
     if (scale > 1) {
-        /* Generate simple low-pass filter */
-        low_pass.kernel = (float*)malloc(scale * scale * sizeof(float));
-        if (!low_pass.kernel) {
-            free(cmp_f);
-            return INFINITY;
-        }
-        low_pass.w = low_pass.h = scale;
-        low_pass.normalized = 0;
-        low_pass.bnd_opt = KBND_SYMMETRIC;
-        for (offset = 0; offset < scale * scale; ++offset)
-            low_pass.kernel[offset] = 1.0f / (scale * scale);
-        
-        /* Resample */
-        if (_iqa_decimate(cmp_f, w, h, scale, &low_pass, 0, 0, 0)) {
-            free(low_pass.kernel);
-            free(cmp_f);
+        _fast_low_pass(&low_pass, (float*)((char*)scratch +
+            _fast_align((size_t)w * h * sizeof(float))), scale);
+        if (_iqa_decimate(cmp_f, w, h, scale, &low_pass, 0, 0, 0))
             return INFINITY;
-        }
-        free(low_pass.kernel);
     }
     
-    /* Use scaled dimensions for allocation */
-    w = model->scaled_width;
-    h = model->scaled_height;
-    
-    /* Allocate memory for comparison image statistics */
-    cmp_mu = (float*)malloc(w * h * sizeof(float));
-    cmp_sigma_sqd = (float*)malloc(w * h * sizeof(float));
-    sigma_both = (float*)malloc(w * h * sizeof(float));
-    cmp_sq = (float*)malloc(w * h * sizeof(float));
-    
-    if (!cmp_mu || !cmp_sigma_sqd || !sigma_both || !cmp_sq) {
-        free(cmp_sq);
-        free(sigma_both);
-        free(cmp_sigma_sqd);
-        free(cmp_mu);
-        free(cmp_f);
+    /* Statistics of the comparison image are folded into the sum row by row */
+    if (_fast_run_bands(model, cmp_f, &ssim_sum))
         return INFINITY;
-    }
-    
-    /* Calculate mean of comparison - use scaled dimensions */
-    _iqa_convolve(cmp_f, model->scaled_width, model->scaled_height, &model->window, cmp_mu, 0, 0);
-    
-    /* Calculate cmp^2 and ref*cmp */
-    for (y = 0; y < model->scaled_height; ++y) {
-        offset = y * model->scaled_width;
-        for (x = 0; x < model->scaled_width; ++x, ++offset) {
-            cmp_sq[offset] = cmp_f[offset] * cmp_f[offset];
-            sigma_both[offset] = model->ref_f[offset] * cmp_f[offset];
-        }
-    }
     
-    /* Calculate variance and covariance */
-    _iqa_convolve(cmp_sq, model->scaled_width, model->scaled_height, &model->window, cmp_sigma_sqd, 0, 0);
-    _iqa_convolve(sigma_both, model->scaled_width, model->scaled_height, &model->window, 0, &w, &h);
-    
-    /* Compute final statistics */
-    for (y = 0; y < h; ++y) {
-        offset = y * w;
-        for (x = 0; x < w; ++x, ++offset) {
-            cmp_sigma_sqd[offset] -= cmp_mu[offset] * cmp_mu[offset];
-            sigma_both[offset] -= model->ref_mu[offset] * cmp_mu[offset];
-        }
-    }
-    
-    /* Use convolved dimensions for SSIM calculation */
     w = model->convolved_width;
     h = model->convolved_height;
+    return (float)(ssim_sum / (double)(w * h));
+}
+
+float fast_ssim_compare(
+    const fast_ssim_model *model,
+    const unsigned char *cmp,
+    int stride)
+{
+    void *scratch;
+    float result;
     
-    /* Calculate SSIM */
-    if (model->alpha == 1.0f && model->beta == 1.0f && model->gamma == 1.0f) {
-        /* Default case - faster computation */
-        for (y = 0; y < h; ++y) {
-            offset = y * w;
-            for (x = 0; x < w; ++x, ++offset) {
-                numerator = (2.0 * model->ref_mu[offset] * cmp_mu[offset] + model->C1) * 
-                           (2.0 * sigma_both[offset] + model->C2);
-                denominator = (model->ref_mu[offset] * model->ref_mu[offset] + 
-                              cmp_mu[offset] * cmp_mu[offset] + model->C1) * 
-                             (model->ref_sigma_sqd[offset] + cmp_sigma_sqd[offset] + model->C2);
-                ssim_sum += numerator / denominator;
-            }
-        }
-    } else {
-        /* Custom alpha, beta, gamma */
-        for (y = 0; y < h; ++y) {
-            offset = y * w;
-            for (x = 0; x < w; ++x, ++offset) {
-                /* Handle negative variance */
-                float ref_sigma_sqd_safe = model->ref_sigma_sqd[offset];
-                float cmp_sigma_sqd_safe = cmp_sigma_sqd[offset];
-                if (ref_sigma_sqd_safe < 0.0f)
-                    ref_sigma_sqd_safe = 0.0f;
-                if (cmp_sigma_sqd_safe < 0.0f)
-                    cmp_sigma_sqd_safe = 0.0f;
-                
-                sigma_root = sqrt(ref_sigma_sqd_safe * cmp_sigma_sqd_safe);
-                
-                /* Luminance */
-                if (model->C1 == 0 && model->ref_mu[offset] * model->ref_mu[offset] == 0 && 
-                    cmp_mu[offset] * cmp_mu[offset] == 0) {
-                    luminance_comp = 1.0;
-                } else {
-                    double result = (2.0 * model->ref_mu[offset] * cmp_mu[offset] + model->C1) / 
-                                   (model->ref_mu[offset] * model->ref_mu[offset] + 
-                                    cmp_mu[offset] * cmp_mu[offset] + model->C1);
-                    if (model->alpha == 1.0f) {
-                        luminance_comp = result;
-                    } else {
-                        float sign = result < 0.0 ? -1.0f : 1.0f;
-                        luminance_comp = sign * pow(fabs(result), (double)model->alpha);
-                    }
-                }
-                
-                /* Contrast */
-                if (model->C2 == 0 && ref_sigma_sqd_safe + cmp_sigma_sqd_safe == 0) {
-                    contrast_comp = 1.0;
-                } else {
-                    double result = (2.0 * sigma_root + model->C2) / 
-                                   (ref_sigma_sqd_safe + cmp_sigma_sqd_safe + model->C2);
-                    if (model->beta == 1.0f) {
-                        contrast_comp = result;
-                    } else {
-                        float sign = result < 0.0 ? -1.0f : 1.0f;
-                        contrast_comp = sign * pow(fabs(result), (double)model->beta);
-                    }
-                }
-                
-                /* Structure */
-                if (model->C3 == 0 && sigma_root == 0) {
-                    structure_comp = 1.0;
-                } else {
-                    double result = (sigma_both[offset] + model->C3) / (sigma_root + model->C3);
-                    if (model->gamma == 1.0f) {
-                        structure_comp = result;
-                    } else {
-                        float sign = result < 0.0 ? -1.0f : 1.0f;
-                        structure_comp = sign * pow(fabs(result), (double)model->gamma);
-                    }
-                }
-                
-                ssim_sum += luminance_comp * contrast_comp * structure_comp;
-            }
-        }
-    }
-    
-    /* Clean up */
-    free(cmp_sq);
-    free(sigma_both);
-    free(cmp_sigma_sqd);
-    free(cmp_mu);
-    free(cmp_f);
+    if (!model || !cmp)
+        return INFINITY;
     
-    return (float)(ssim_sum / (double)(w * h));
+    scratch = malloc(fast_ssim_scratch_size(model));
+    result = fast_ssim_compare_scratch(model, cmp, stride, scratch);
+    free(scratch);
+    return result;
 }
 
 void fast_ssim_destroy_model(fast_ssim_model *model)
 {
-    if (model) {
-        free(model->ref_sigma_sqd);
-        free(model->ref_mu);
-        free(model->ref_f);
-        free(model->kernel_data);
-        free(model);
-    }
+    /* The structure and all of its planes are one block */
+    free(model);
 }
\ No newline at end of file
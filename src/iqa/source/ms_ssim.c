@@ -32,8 +32,10 @@
  */
 
 #include "iqa.h"
+#include "ms_ssim.h"
 #include "ssim.h"
 #include "decimate.h"
+#include "simd.h"
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
@@ -41,18 +43,28 @@
 /* Default number of scales */
 #define SCALES  5
 
-/* Low-pass filter for down-sampling (9/7 biorthogonal wavelet filter) */
+/*
+ * Low-pass filter for down-sampling (9/7 biorthogonal wavelet filter). The
+ * window is the outer product of the 1-D analysis low-pass, so it is
+ * exactly separable.
+ */
 #define LPF_LEN 9
+#define LPF_TAP_0  0.026748757f
+#define LPF_TAP_1 -0.016864118f
+#define LPF_TAP_2 -0.078223267f
+#define LPF_TAP_3  0.266864118f
+#define LPF_TAP_4  0.602949018f
+#define LPF_TAP_5  LPF_TAP_3
+#define LPF_TAP_6  LPF_TAP_2
+#define LPF_TAP_7  LPF_TAP_1
+#define LPF_TAP_8  LPF_TAP_0
+#define LPF_ROW(v) { \
+    LPF_TAP_##v*LPF_TAP_0, LPF_TAP_##v*LPF_TAP_1, LPF_TAP_##v*LPF_TAP_2, \
+    LPF_TAP_##v*LPF_TAP_3, LPF_TAP_##v*LPF_TAP_4, LPF_TAP_##v*LPF_TAP_5, \
+    LPF_TAP_##v*LPF_TAP_6, LPF_TAP_##v*LPF_TAP_7, LPF_TAP_##v*LPF_TAP_8 }
 static const float g_lpf[LPF_LEN][LPF_LEN] = {
-   { 0.000714f,-0.000450f,-0.002090f, 0.007132f, 0.016114f, 0.007132f,-0.002090f,-0.000450f, 0.000714f},
-   {-0.000450f, 0.000283f, 0.001316f,-0.004490f,-0.010146f,-0.004490f, 0.001316f, 0.000283f,-0.000450f},
-   {-0.002090f, 0.001316f, 0.006115f,-0.020867f,-0.047149f,-0.020867f, 0.006115f, 0.001316f,-0.002090f},
-   { 0.007132f,-0.004490f,-0.020867f, 0.071207f, 0.160885f, 0.071207f,-0.020867f,-0.004490f, 0.007132f},
-   { 0.016114f,-0.010146f,-0.047149f, 0.160885f, 0.363505f, 0.160885f,-0.047149f,-0.010146f, 0.016114f},
-   { 0.007132f,-0.004490f,-0.020867f, 0.071207f, 0.160885f, 0.071207f,-0.020867f,-0.004490f, 0.007132f},
-   {-0.002090f, 0.001316f, 0.006115f,-0.020867f,-0.047149f,-0.020867f, 0.006115f, 0.001316f,-0.002090f},
-   {-0.000450f, 0.000283f, 0.001316f,-0.004490f,-0.010146f,-0.004490f, 0.001316f, 0.000283f,-0.000450f},
-   { 0.000714f,-0.000450f,-0.002090f, 0.007132f, 0.016114f, 0.007132f,-0.002090f,-0.000450f, 0.000714f},
+    LPF_ROW(0), LPF_ROW(1), LPF_ROW(2), LPF_ROW(3), LPF_ROW(4),
+    LPF_ROW(5), LPF_ROW(6), LPF_ROW(7), LPF_ROW(8),
 };
 
 /* Alpha, beta, and gamma values for each scale */
@@ -80,6 +92,16 @@ int _ms_ssim_map(const struct _ssim_int *si, void *ctx)
     return 0;
 }
 
+/* Called to add the sums of a band into the scale's context */
+void _ms_ssim_merge(void *ctx, const void *band)
+{
+    struct _context *ms_ctx = (struct _context*)ctx;
+    const struct _context *band_ctx = (const struct _context*)band;
+    ms_ctx->l += band_ctx->l;
+    ms_ctx->c += band_ctx->c;
+    ms_ctx->s += band_ctx->s;
+}
+
 /* Called to calculate the final result */
 float _ms_ssim_reduce(int w, int h, void *ctx)
 {
@@ -117,6 +139,107 @@ int _alloc_buffers(float **buf, int w, int h, int scales)
     return 0;
 }
 
+/* Returns 1 if no scale gets smaller than the filters, 0 otherwise */
+static int _ms_ssim_fits(int w, int h, int scales, int gauss)
+{
+    int idx;
+    for (idx=0; idx<scales; ++idx) {
+        if ( gauss ? w<GAUSSIAN_LEN || h<GAUSSIAN_LEN : w<LPF_LEN || h<LPF_LEN )
+            return 0;
+        w /= 2;
+        h /= 2;
+    }
+    return 1;
+}
+
+/* Sets up the window used at every scale */
+static void _ms_ssim_window(struct _kernel *window, int gauss)
+{
+    window->kernel = (float*)g_square_window;
+    window->w = window->h = SQUARE_LEN;
+    window->normalized = 1;
+    window->bnd_opt = KBND_SYMMETRIC;
+    if (gauss) {
+        window->kernel = (float*)g_gaussian_window;
+        window->w = window->h = GAUSSIAN_LEN;
+    }
+}
+
+/* Creates scales 1 to scales-1 of 'imgs' from scale 0 */
+static int _ms_ssim_pyramid(float **imgs, int w, int h, int scales)
+{
+    int idx;
+    struct _kernel lpf;
+
+    lpf.kernel = (float*)g_lpf;
+    lpf.w = lpf.h = LPF_LEN;
+    lpf.normalized = 1;
+    lpf.bnd_opt = KBND_SYMMETRIC;
+    for (idx=1; idx<scales; ++idx) {
+        if (_iqa_decimate(imgs[idx-1], w, h, 2, &lpf, imgs[idx], &w, &h))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Multiplies together the SSIM terms of every scale. 'ref_mu' and
+ * 'ref_sigma_sqd' hold the reference statistics of each scale, or are 0 to
+ * have them computed along with those of 'cmp_imgs'.
+ */
+static float _ms_ssim_scales(float **ref_imgs, float **ref_mu, float **ref_sigma_sqd, float **cmp_imgs,
+    int w, int h, int scales, int wang, const float *alphas, const float *betas, const float *gammas,
+    const struct _kernel *window)
+{
+    int idx;
+    float msssim;
+    struct iqa_ssim_args s_args;
+    struct _map_reduce mr;
+    struct _context ms_ctx;
+
+    mr.map     = _ms_ssim_map;
+    mr.reduce  = _ms_ssim_reduce;
+    mr.context = &ms_ctx;
+    mr.size    = sizeof(ms_ctx);
+    mr.merge   = _ms_ssim_merge;
+
+    s_args.alpha = 1.0f;
+    s_args.beta  = 1.0f;
+    s_args.gamma = 1.0f;
+    s_args.L  = 255;
+    s_args.f  = 1; /* Don't resize */
+    if (!wang) {
+        /* MS-SSIM* (Rouse/Hemami) */
+        s_args.K1 = 0.0f; /* Force stabilization constants to 0 */
+        s_args.K2 = 0.0f;
+    }
+    else {
+        /* MS-SSIM (Wang) */
+        s_args.K1 = 0.01f;
+        s_args.K2 = 0.03f;
+    }
+
+    msssim = 1.0;
+    for (idx=0; idx<scales; ++idx) {
+
+        ms_ctx.l = 0;
+        ms_ctx.c = 0;
+        ms_ctx.s = 0;
+        ms_ctx.alpha = alphas[idx];
+        ms_ctx.beta  = betas[idx];
+        ms_ctx.gamma = gammas[idx];
+
+        msssim *= _iqa_ssim_ref(ref_imgs[idx], ref_mu ? ref_mu[idx] : 0,
+            ref_sigma_sqd ? ref_sigma_sqd[idx] : 0, cmp_imgs[idx], w, h, window, &mr, &s_args);
+
+        if (msssim == INFINITY)
+            break;
+        w = w/2 + (w&1);
+        h = h/2 + (h&1);
+    }
+    return msssim;
+}
+
 /*
  * MS_SSIM(X,Y) = Lm(x,y)^aM * MULT[j=1->M]( Cj(x,y)^bj  *  Sj(x,y)^gj )
  * where,
@@ -133,14 +256,10 @@ float iqa_ms_ssim(const unsigned char *ref, const unsigned char *cmp, int w, int
     int scales=SCALES;
     int gauss=1;
     const float *alphas=g_alphas, *betas=g_betas, *gammas=g_gammas;
-    int idx,x,y,cur_w,cur_h;
-    int offset,src_offset;
+    int y;
     float **ref_imgs, **cmp_imgs; /* Array of pointers to scaled images */
     float msssim;
-    struct _kernel lpf, window;
-    struct iqa_ssim_args s_args;
-    struct _map_reduce mr;
-    struct _context ms_ctx;
+    struct _kernel window;
 
     if (args) {
         wang   = args->wang;
@@ -155,26 +274,10 @@ float iqa_ms_ssim(const unsigned char *ref, const unsigned char *cmp, int w, int
     }
 
     /* Make sure we won't scale below 1x1 */
-    cur_w = w;
-    cur_h = h;
-    for (idx=0; idx<scales; ++idx) {
-        if ( gauss ? cur_w<GAUSSIAN_LEN || cur_h<GAUSSIAN_LEN : cur_w<LPF_LEN || cur_h<LPF_LEN )
-            return INFINITY;
-        cur_w /= 2;
-        cur_h /= 2;
-    }
-
-    window.kernel = (float*)g_square_window;
-    window.w = window.h = SQUARE_LEN;
-    window.normalized = 1;
-    window.bnd_opt = KBND_SYMMETRIC;
-    if (gauss) {
-        window.kernel = (float*)g_gaussian_window;
-        window.w = window.h = GAUSSIAN_LEN;
-    }
+    if (!_ms_ssim_fits(w, h, scales, gauss))
+        return INFINITY;
 
-    mr.map     = _ms_ssim_map;
-    mr.reduce  = _ms_ssim_reduce;
+    _ms_ssim_window(&window, gauss);
 
     /* Allocate the scaled image buffers */
     ref_imgs = (float**)malloc(scales*sizeof(float*));
@@ -198,80 +301,217 @@ float iqa_ms_ssim(const unsigned char *ref, const unsigned char *cmp, int w, int
 
     /* Copy original images into first scale buffer, forcing stride = width. */
     for (y=0; y<h; ++y) {
-        src_offset = y*stride;
-        offset = y*w;
-        for (x=0; x<w; ++x, ++offset, ++src_offset) {
-            ref_imgs[0][offset] = (float)ref[src_offset];
-            cmp_imgs[0][offset] = (float)cmp[src_offset];
-        }
+        _iqa_simd()->u8_to_float(ref + y*stride, ref_imgs[0] + y*w, w);
+        _iqa_simd()->u8_to_float(cmp + y*stride, cmp_imgs[0] + y*w, w);
     }
 
     /* Create scaled versions of the images */
-    cur_w=w;
-    cur_h=h;
-    lpf.kernel = (float*)g_lpf;
-    lpf.w = lpf.h = LPF_LEN;
-    lpf.normalized = 1;
-    lpf.bnd_opt = KBND_SYMMETRIC;
-    for (idx=1; idx<scales; ++idx) {
-        if (_iqa_decimate(ref_imgs[idx-1], cur_w, cur_h, 2, &lpf, ref_imgs[idx], 0, 0) ||
-            _iqa_decimate(cmp_imgs[idx-1], cur_w, cur_h, 2, &lpf, cmp_imgs[idx], &cur_w, &cur_h))
-        {
-            _free_buffers(ref_imgs, scales);
-            _free_buffers(cmp_imgs, scales);
-            free(ref_imgs);
-            free(cmp_imgs);
-            return INFINITY;
-        }
+    if (_ms_ssim_pyramid(ref_imgs, w, h, scales) || _ms_ssim_pyramid(cmp_imgs, w, h, scales))
+        msssim = INFINITY;
+    else
+        msssim = _ms_ssim_scales(ref_imgs, 0, 0, cmp_imgs, w, h, scales, wang,
+            alphas, betas, gammas, &window);
+
+    _free_buffers(ref_imgs, scales);
+    _free_buffers(cmp_imgs, scales);
+    free(ref_imgs);
+    free(cmp_imgs);
+
+    return msssim;
+}
+
+
+struct ms_ssim_model {
+    int width;
+    int height;
+    int scales;
+    int wang;
+    struct _kernel window;
+
+    /* Exponents of each scale */
+    float *alphas;
+    float *betas;
+    float *gammas;
+
+    /* The reference image and its statistics at each scale */
+    float **ref_imgs;
+    float **ref_mu;         /* Local means (convolved) */
+    float **ref_sigma_sqd;  /* Local variances (convolved) */
+};
+
+static size_t _ms_align(size_t n)
+{
+    return (n + 63) & ~(size_t)63;
+}
+
+/* Bytes of the scaled planes of a w x h image, each padded to a cache line */
+static size_t _ms_planes_size(int w, int h, int scales)
+{
+    int idx;
+    size_t size = 0;
+    for (idx=0; idx<scales; ++idx) {
+        size += _ms_align((size_t)w * h * sizeof(float));
+        w = w/2 + (w&1);
+        h = h/2 + (h&1);
     }
+    return size;
+}
 
-    cur_w=w;
-    cur_h=h;
-    msssim = 1.0;
+/* Points imgs[0] to imgs[scales-1] at consecutive planes of 'mem' */
+static char *_ms_planes(float **imgs, char *mem, int w, int h, int scales)
+{
+    int idx;
     for (idx=0; idx<scales; ++idx) {
+        imgs[idx] = (float*)mem;
+        mem += _ms_align((size_t)w * h * sizeof(float));
+        w = w/2 + (w&1);
+        h = h/2 + (h&1);
+    }
+    return mem;
+}
 
-        ms_ctx.l = 0;
-        ms_ctx.c = 0;
-        ms_ctx.s = 0;
-        ms_ctx.alpha = alphas[idx];
-        ms_ctx.beta  = betas[idx];
-        ms_ctx.gamma = gammas[idx];
+ms_ssim_model* ms_ssim_create_model(
+    const unsigned char *ref,
+    int w,
+    int h,
+    int stride,
+    const struct iqa_ms_ssim_args *args)
+{
+    int wang=0;
+    int scales=SCALES;
+    int gauss=1;
+    const float *alphas=g_alphas, *betas=g_betas, *gammas=g_gammas;
+    int idx, y, cur_w, cur_h, win;
+    size_t head, stats;
+    char *mem;
+    ms_ssim_model *model;
 
-        if (!wang) {
-            /* MS-SSIM* (Rouse/Hemami) */
-            s_args.alpha = 1.0f;
-            s_args.beta  = 1.0f;
-            s_args.gamma = 1.0f;
-            s_args.K1 = 0.0f; /* Force stabilization constants to 0 */
-            s_args.K2 = 0.0f;
-            s_args.L  = 255;
-            s_args.f  = 1; /* Don't resize */
-            mr.context = &ms_ctx;
-            msssim *= _iqa_ssim(ref_imgs[idx], cmp_imgs[idx], cur_w, cur_h, &window, &mr, &s_args);
-        }
-        else {
-            /* MS-SSIM (Wang) */
-            s_args.alpha = 1.0f;
-            s_args.beta  = 1.0f;
-            s_args.gamma = 1.0f;
-            s_args.K1 = 0.01f;
-            s_args.K2 = 0.03f;
-            s_args.L  = 255;
-            s_args.f  = 1; /* Don't resize */
-            mr.context = &ms_ctx;
-            msssim *= _iqa_ssim(ref_imgs[idx], cmp_imgs[idx], cur_w, cur_h, &window, &mr, &s_args);
-        }
+    if (args) {
+        wang   = args->wang;
+        gauss  = args->gaussian;
+        scales = args->scales;
+        if (args->alphas)
+            alphas = args->alphas;
+        if (args->betas)
+            betas  = args->betas;
+        if (args->gammas)
+            gammas = args->gammas;
+    }
+    if (!ref || scales < 1 || !_ms_ssim_fits(w, h, scales, gauss))
+        return NULL;
 
-        if (msssim == INFINITY)
-            break;
+    /*
+     * The structure, its arrays and every plane are one block. The statistics
+     * of a scale are the size of its image less the window.
+     */
+    win = gauss ? GAUSSIAN_LEN : SQUARE_LEN;
+    head = _ms_align(sizeof(ms_ssim_model)) + _ms_align(3*scales*sizeof(float*)) +
+        _ms_align(3*scales*sizeof(float));
+    stats = 0;
+    cur_w = w;
+    cur_h = h;
+    for (idx=0; idx<scales; ++idx) {
+        stats += 2*_ms_align((size_t)(cur_w - win + 1) * (cur_h - win + 1) * sizeof(float));
         cur_w = cur_w/2 + (cur_w&1);
         cur_h = cur_h/2 + (cur_h&1);
     }
+    mem = (char*)malloc(head + _ms_planes_size(w, h, scales) + stats);
+    if (!mem)
+        return NULL;
 
-    _free_buffers(ref_imgs, scales);
-    _free_buffers(cmp_imgs, scales);
-    free(ref_imgs);
-    free(cmp_imgs);
+    model = (ms_ssim_model*)mem;
+    model->width = w;
+    model->height = h;
+    model->scales = scales;
+    model->wang = wang;
+    _ms_ssim_window(&model->window, gauss);
+
+    mem += _ms_align(sizeof(ms_ssim_model));
+    model->ref_imgs = (float**)mem;
+    model->ref_mu = model->ref_imgs + scales;
+    model->ref_sigma_sqd = model->ref_mu + scales;
+    mem += _ms_align(3*scales*sizeof(float*));
+    model->alphas = (float*)mem;
+    model->betas = model->alphas + scales;
+    model->gammas = model->betas + scales;
+    mem += _ms_align(3*scales*sizeof(float));
+    memcpy(model->alphas, alphas, scales*sizeof(float));
+    memcpy(model->betas, betas, scales*sizeof(float));
+    memcpy(model->gammas, gammas, scales*sizeof(float));
 
+    mem = _ms_planes(model->ref_imgs, mem, w, h, scales);
+    cur_w = w;
+    cur_h = h;
+    for (idx=0; idx<scales; ++idx) {
+        model->ref_mu[idx] = (float*)mem;
+        mem += _ms_align((size_t)(cur_w - win + 1) * (cur_h - win + 1) * sizeof(float));
+        model->ref_sigma_sqd[idx] = (float*)mem;
+        mem += _ms_align((size_t)(cur_w - win + 1) * (cur_h - win + 1) * sizeof(float));
+        cur_w = cur_w/2 + (cur_w&1);
+        cur_h = cur_h/2 + (cur_h&1);
+    }
+
+    for (y=0; y<h; ++y)
+        _iqa_simd()->u8_to_float(ref + y*stride, model->ref_imgs[0] + y*w, w);
+    if (_ms_ssim_pyramid(model->ref_imgs, w, h, scales)) {
+        free(model);
+        return NULL;
+    }
+
+    cur_w = w;
+    cur_h = h;
+    for (idx=0; idx<scales; ++idx) {
+        if (_iqa_ssim_ref_stats(model->ref_imgs[idx], cur_w, cur_h, &model->window,
+            model->ref_mu[idx], model->ref_sigma_sqd[idx])) {
+            free(model);
+            return NULL;
+        }
+        cur_w = cur_w/2 + (cur_w&1);
+        cur_h = cur_h/2 + (cur_h&1);
+    }
+
+    return model;
+}
+
+float ms_ssim_compare(
+    const ms_ssim_model *model,
+    const unsigned char *cmp,
+    int stride)
+{
+    float **cmp_imgs;
+    char *mem;
+    float msssim;
+    int y, w, h, scales;
+
+    if (!model || !cmp)
+        return INFINITY;
+
+    w = model->width;
+    h = model->height;
+    scales = model->scales;
+
+    /* Only the comparison image's pyramid is built */
+    mem = (char*)malloc(_ms_align(scales*sizeof(float*)) + _ms_planes_size(w, h, scales));
+    if (!mem)
+        return INFINITY;
+    cmp_imgs = (float**)mem;
+    _ms_planes(cmp_imgs, mem + _ms_align(scales*sizeof(float*)), w, h, scales);
+
+    for (y=0; y<h; ++y)
+        _iqa_simd()->u8_to_float(cmp + y*stride, cmp_imgs[0] + y*w, w);
+
+    if (_ms_ssim_pyramid(cmp_imgs, w, h, scales))
+        msssim = INFINITY;
+    else
+        msssim = _ms_ssim_scales(model->ref_imgs, model->ref_mu, model->ref_sigma_sqd, cmp_imgs,
+            w, h, scales, model->wang, model->alphas, model->betas, model->gammas, &model->window);
+
+    free(mem);
     return msssim;
 }
+
+void ms_ssim_destroy_model(ms_ssim_model *model)
+{
+    /* The structure and all of its planes are one block */
+    free(model);
+}
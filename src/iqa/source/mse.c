@@ -32,19 +32,15 @@
  */
 
 #include "iqa.h"
+#include "simd.h"
 
 /* MSE(a,b) = 1/N * SUM((a-b)^2) */
 float iqa_mse(const unsigned char *ref, const unsigned char *cmp, int w, int h, int stride)
 {
-    int error, offset;
     unsigned long long sum=0;
-    int ww,hh;
-    for (hh=0; hh<h; ++hh) {
-        offset = hh*stride;
-        for (ww=0; ww<w; ++ww, ++offset) {
-            error = ref[offset] - cmp[offset];
-            sum += error * error;
-        }
-    }
+    int hh;
+    const struct _iqa_simd *simd = _iqa_simd();
+    for (hh=0; hh<h; ++hh)
+        sum += simd->sqr_err_u8(ref + hh*stride, cmp + hh*stride, w);
     return (float)( (double)sum / (double)(w*h) );
 }
@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2025
+ * Worker threads shared by the image comparisons
+ *
+ * The BSD License
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * - Neither the name of the contributors may be used to endorse or promote
+ *   products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "iqa.h"
+#include "pool.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* A call to _iqa_pool_run(). Lives on the caller's stack. */
+struct _task {
+    _iqa_job fn;
+    void *ctx;
+    int jobs;
+    int next;               /* Next job to hand out */
+    int pending;            /* Jobs not finished yet */
+    struct _task *link;
+};
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_work = PTHREAD_COND_INITIALIZER;  /* Signaled when a task is queued */
+static pthread_cond_t g_done = PTHREAD_COND_INITIALIZER;  /* Signaled when a task finishes */
+static pthread_once_t g_once = PTHREAD_ONCE_INIT;
+static struct _task *g_queue = 0;   /* Tasks with jobs left to hand out */
+static pthread_t *g_workers = 0;
+static int g_nworkers = 0;
+static int g_quit = 0;
+
+/* Hands out the next job of 't'. Called with the lock held. */
+static int _take(struct _task *t)
+{
+    struct _task **p;
+    int job = t->next++;
+
+    if (t->next == t->jobs) {
+        for (p=&g_queue; *p != t; p=&(*p)->link)
+            ;
+        *p = t->link;
+    }
+    return job;
+}
+
+/* Called with the lock held */
+static void _finish(struct _task *t)
+{
+    if (--t->pending == 0)
+        pthread_cond_broadcast(&g_done);
+}
+
+static void *_worker(void *arg)
+{
+    struct _task *t;
+    int job;
+
+    pthread_mutex_lock(&g_lock);
+    for (;;) {
+        while (!g_quit && !g_queue)
+            pthread_cond_wait(&g_work, &g_lock);
+        if (g_quit)
+            break;
+        t = g_queue;
+        job = _take(t);
+        pthread_mutex_unlock(&g_lock);
+        t->fn(job, t->ctx);
+        pthread_mutex_lock(&g_lock);
+        _finish(t);
+    }
+    pthread_mutex_unlock(&g_lock);
+    return 0;
+}
+
+static int _set_threads(int threads)
+{
+    int idx;
+    long cpus;
+
+    if (threads <= 0) {
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (int)cpus : 1;
+    }
+
+    /* Stop the current workers */
+    pthread_mutex_lock(&g_lock);
+    g_quit = 1;
+    pthread_cond_broadcast(&g_work);
+    pthread_mutex_unlock(&g_lock);
+    for (idx=0; idx<g_nworkers; ++idx)
+        pthread_join(g_workers[idx], 0);
+    free(g_workers);
+    g_workers = 0;
+    g_nworkers = 0;
+    g_quit = 0;
+
+    /* The calling thread is one of the 'threads' */
+    if (threads == 1)
+        return 0;
+    g_workers = (pthread_t*)malloc((threads-1)*sizeof(pthread_t));
+    if (!g_workers)
+        return 1;
+    for (idx=0; idx<threads-1; ++idx) {
+        if (pthread_create(&g_workers[idx], 0, _worker, 0))
+            break;
+    }
+    pthread_mutex_lock(&g_lock);
+    g_nworkers = idx;
+    pthread_mutex_unlock(&g_lock);
+    return idx == threads-1 ? 0 : 1;
+}
+
+static void _init_threads(void)
+{
+    const char *env = getenv("IQA_THREADS");
+    if (env && *env)
+        _set_threads(atoi(env));
+}
+
+int iqa_set_threads(int threads)
+{
+    pthread_once(&g_once, _init_threads);
+    return _set_threads(threads);
+}
+
+void _iqa_pool_run(int jobs, _iqa_job fn, void *ctx)
+{
+    struct _task t, **p;
+    int job;
+
+    pthread_once(&g_once, _init_threads);
+    pthread_mutex_lock(&g_lock);
+    if (jobs <= 1 || !g_nworkers) {
+        pthread_mutex_unlock(&g_lock);
+        for (job=0; job<jobs; ++job)
+            fn(job, ctx);
+        return;
+    }
+
+    t.fn = fn;
+    t.ctx = ctx;
+    t.jobs = jobs;
+    t.next = 0;
+    t.pending = jobs;
+    t.link = 0;
+    for (p=&g_queue; *p; p=&(*p)->link)
+        ;
+    *p = &t;
+    pthread_cond_broadcast(&g_work);
+
+    while (t.next < t.jobs) {
+        job = _take(&t);
+        pthread_mutex_unlock(&g_lock);
+        fn(job, ctx);
+        pthread_mutex_lock(&g_lock);
+        _finish(&t);
+    }
+    while (t.pending)
+        pthread_cond_wait(&g_done, &g_lock);
+    pthread_mutex_unlock(&g_lock);
+}
+
+int _iqa_bands(int rows, int *band_rows)
+{
+    int n = (rows + IQA_BAND_MAX - 1) / IQA_BAND_MAX;
+    if (n < IQA_BAND_MIN_ROWS)
+        n = IQA_BAND_MIN_ROWS;
+    *band_rows = n;
+    return rows > 0 ? (rows + n - 1) / n : 0;
+}
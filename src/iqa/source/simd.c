@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2025
+ * Runtime selection of vectorized inner loops
+ *
+ * The BSD License
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * - Neither the name of the contributors may be used to endorse or promote
+ *   products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "simd.h"
+#include <stdlib.h>
+#include <string.h>
+
+static void _u8_to_float(const unsigned char *src, float *dst, int len)
+{
+    int i;
+    for (i=0; i<len; ++i)
+        dst[i] = (float)src[i];
+}
+
+static void _conv_row(const float *src, const float *k, int klen, double *dst, int len)
+{
+    int x,u;
+    double sum;
+    for (x=0; x<len; ++x) {
+        sum = 0.0;
+        for (u=0; u<klen; ++u)
+            sum += src[x+u] * k[u];
+        dst[x] = sum;
+    }
+}
+
+static void _conv_col(double *acc, const double *row, double k, int len)
+{
+    int x;
+    for (x=0; x<len; ++x)
+        acc[x] += row[x] * k;
+}
+
+static void _conv_col_f(double *acc, const float *row, double k, int len)
+{
+    int x;
+    for (x=0; x<len; ++x)
+        acc[x] += row[x] * k;
+}
+
+static double _ssim_sum(const float *ref_mu, const float *cmp_mu, const float *ref_sigma_sqd,
+    const float *cmp_sigma_sqd, const float *sigma_both, int len, float C1, float C2, double sum)
+{
+    int x;
+    double numerator, denominator;
+    for (x=0; x<len; ++x) {
+        numerator   = (2.0 * ref_mu[x] * cmp_mu[x] + C1) * (2.0 * sigma_both[x] + C2);
+        denominator = (ref_mu[x]*ref_mu[x] + cmp_mu[x]*cmp_mu[x] + C1) *
+            (ref_sigma_sqd[x] + cmp_sigma_sqd[x] + C2);
+        sum += numerator / denominator;
+    }
+    return sum;
+}
+
+static unsigned long long _sqr_err_u8(const unsigned char *a, const unsigned char *b, int len)
+{
+    int i, error;
+    unsigned long long sum=0;
+    for (i=0; i<len; ++i) {
+        error = a[i] - b[i];
+        sum += error * error;
+    }
+    return sum;
+}
+
+static const struct _iqa_simd g_scalar = {
+    "scalar",
+    _u8_to_float,
+    _conv_row,
+    _conv_col,
+    _conv_col_f,
+    _ssim_sum,
+    _sqr_err_u8
+};
+
+/*
+ * Set once on first use. Concurrent first calls all store the same table, so
+ * no locking is needed.
+ */
+static const struct _iqa_simd *g_active = 0;
+
+const struct _iqa_simd *_iqa_simd_find(const char *name)
+{
+    if (!name)
+        return 0;
+    if (!strcmp(name, "scalar"))
+        return &g_scalar;
+    if (!strcmp(name, "sse2"))
+        return _iqa_simd_sse2();
+    if (!strcmp(name, "avx2"))
+        return _iqa_simd_avx2();
+    return 0;
+}
+
+int _iqa_simd_select(const char *name)
+{
+    const struct _iqa_simd *table;
+
+    if (name) {
+        table = _iqa_simd_find(name);
+        if (!table)
+            return 1;
+        g_active = table;
+        return 0;
+    }
+
+    /* An unknown or unsupported override falls back to detection */
+    table = _iqa_simd_find(getenv("IQA_SIMD"));
+    if (!table)
+        table = _iqa_simd_avx2();
+    if (!table)
+        table = _iqa_simd_sse2();
+    if (!table)
+        table = &g_scalar;
+    g_active = table;
+    return 0;
+}
+
+const struct _iqa_simd *_iqa_simd(void)
+{
+    if (!g_active)
+        _iqa_simd_select(0);
+    return g_active;
+}
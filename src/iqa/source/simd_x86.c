@@ -0,0 +1,345 @@
+/*
+ * Copyright (c) 2025
+ * SSE2 and AVX2 versions of the inner loops in simd.h
+ *
+ * The BSD License
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * - Neither the name of the contributors may be used to endorse or promote
+ *   products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "simd.h"
+
+/*
+ * Built with the compiler's per-function target attribute so the rest of the
+ * library keeps the default flags and one binary runs on any x86-64 CPU.
+ * Only x86-64 is supported: 32-bit x87 builds round intermediates differently
+ * from SSE, so the scalar reference would not match. No FMA is enabled, as a
+ * fused multiply-add rounds differently from the scalar code as well.
+ */
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+
+#include <immintrin.h>
+
+#define SSE2 __attribute__((target("sse2")))
+#define AVX2 __attribute__((target("avx2")))
+
+/*----------------------------------------------------------------------------
+ * SSE2
+ *---------------------------------------------------------------------------*/
+SSE2 static void _u8_to_float_sse2(const unsigned char *src, float *dst, int len)
+{
+    int i=0;
+    __m128i v, lo, hi, zero = _mm_setzero_si128();
+    for (; i+16<=len; i+=16) {
+        v = _mm_loadu_si128((const __m128i*)(src+i));
+        lo = _mm_unpacklo_epi8(v, zero);
+        hi = _mm_unpackhi_epi8(v, zero);
+        _mm_storeu_ps(dst+i,    _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)));
+        _mm_storeu_ps(dst+i+4,  _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)));
+        _mm_storeu_ps(dst+i+8,  _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)));
+        _mm_storeu_ps(dst+i+12, _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)));
+    }
+    for (; i<len; ++i)
+        dst[i] = (float)src[i];
+}
+
+SSE2 static void _conv_row_sse2(const float *src, const float *k, int klen, double *dst, int len)
+{
+    int x=0,u;
+    double sum;
+    __m128 p;
+    __m128d lo, hi;
+    for (; x+4<=len; x+=4) {
+        lo = hi = _mm_setzero_pd();
+        for (u=0; u<klen; ++u) {
+            p = _mm_mul_ps(_mm_loadu_ps(src+x+u), _mm_set1_ps(k[u]));
+            lo = _mm_add_pd(lo, _mm_cvtps_pd(p));
+            hi = _mm_add_pd(hi, _mm_cvtps_pd(_mm_movehl_ps(p, p)));
+        }
+        _mm_storeu_pd(dst+x, lo);
+        _mm_storeu_pd(dst+x+2, hi);
+    }
+    for (; x<len; ++x) {
+        sum = 0.0;
+        for (u=0; u<klen; ++u)
+            sum += src[x+u] * k[u];
+        dst[x] = sum;
+    }
+}
+
+SSE2 static void _conv_col_sse2(double *acc, const double *row, double k, int len)
+{
+    int x=0;
+    __m128d kv = _mm_set1_pd(k);
+    for (; x+2<=len; x+=2)
+        _mm_storeu_pd(acc+x, _mm_add_pd(_mm_loadu_pd(acc+x), _mm_mul_pd(_mm_loadu_pd(row+x), kv)));
+    for (; x<len; ++x)
+        acc[x] += row[x] * k;
+}
+
+SSE2 static void _conv_col_f_sse2(double *acc, const float *row, double k, int len)
+{
+    int x=0;
+    __m128 r;
+    __m128d kv = _mm_set1_pd(k);
+    for (; x+4<=len; x+=4) {
+        r = _mm_loadu_ps(row+x);
+        _mm_storeu_pd(acc+x, _mm_add_pd(_mm_loadu_pd(acc+x), _mm_mul_pd(_mm_cvtps_pd(r), kv)));
+        _mm_storeu_pd(acc+x+2, _mm_add_pd(_mm_loadu_pd(acc+x+2),
+            _mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(r, r)), kv)));
+    }
+    for (; x<len; ++x)
+        acc[x] += row[x] * k;
+}
+
+SSE2 static double _ssim_sum_sse2(const float *ref_mu, const float *cmp_mu, const float *ref_sigma_sqd,
+    const float *cmp_sigma_sqd, const float *sigma_both, int len, float C1, float C2, double sum)
+{
+    int x=0,i;
+    double q[4];
+    double numerator, denominator;
+    __m128 mu1, mu2, sb, den;
+    __m128d two = _mm_set1_pd(2.0), c1 = _mm_set1_pd(C1), c2 = _mm_set1_pd(C2);
+    __m128d m1, m2, s12, num;
+    for (; x+4<=len; x+=4) {
+        /* The denominator is single precision, as in the scalar code */
+        mu1 = _mm_loadu_ps(ref_mu+x);
+        mu2 = _mm_loadu_ps(cmp_mu+x);
+        den = _mm_mul_ps(
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(mu1, mu1), _mm_mul_ps(mu2, mu2)), _mm_set1_ps(C1)),
+            _mm_add_ps(_mm_add_ps(_mm_loadu_ps(ref_sigma_sqd+x), _mm_loadu_ps(cmp_sigma_sqd+x)), _mm_set1_ps(C2)));
+        sb = _mm_loadu_ps(sigma_both+x);
+        s12 = _mm_cvtps_pd(sb);
+        m1 = _mm_cvtps_pd(mu1);
+        m2 = _mm_cvtps_pd(mu2);
+        num = _mm_mul_pd(_mm_add_pd(_mm_mul_pd(_mm_mul_pd(two, m1), m2), c1),
+            _mm_add_pd(_mm_mul_pd(two, s12), c2));
+        _mm_storeu_pd(q, _mm_div_pd(num, _mm_cvtps_pd(den)));
+
+        s12 = _mm_cvtps_pd(_mm_movehl_ps(sb, sb));
+        m1 = _mm_cvtps_pd(_mm_movehl_ps(mu1, mu1));
+        m2 = _mm_cvtps_pd(_mm_movehl_ps(mu2, mu2));
+        num = _mm_mul_pd(_mm_add_pd(_mm_mul_pd(_mm_mul_pd(two, m1), m2), c1),
+            _mm_add_pd(_mm_mul_pd(two, s12), c2));
+        _mm_storeu_pd(q+2, _mm_div_pd(num, _mm_cvtps_pd(_mm_movehl_ps(den, den))));
+
+        /* Summed in pixel order */
+        for (i=0; i<4; ++i)
+            sum += q[i];
+    }
+    for (; x<len; ++x) {
+        numerator   = (2.0 * ref_mu[x] * cmp_mu[x] + C1) * (2.0 * sigma_both[x] + C2);
+        denominator = (ref_mu[x]*ref_mu[x] + cmp_mu[x]*cmp_mu[x] + C1) *
+            (ref_sigma_sqd[x] + cmp_sigma_sqd[x] + C2);
+        sum += numerator / denominator;
+    }
+    return sum;
+}
+
+SSE2 static unsigned long long _sqr_err_u8_sse2(const unsigned char *a, const unsigned char *b, int len)
+{
+    int i=0, error;
+    unsigned long long lanes[2], sum;
+    __m128i va, vb, d, sq, zero = _mm_setzero_si128(), acc = _mm_setzero_si128();
+    for (; i+16<=len; i+=16) {
+        va = _mm_loadu_si128((const __m128i*)(a+i));
+        vb = _mm_loadu_si128((const __m128i*)(b+i));
+        d = _mm_sub_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero));
+        sq = _mm_madd_epi16(d, d);
+        d = _mm_sub_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero));
+        sq = _mm_add_epi32(sq, _mm_madd_epi16(d, d));
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(sq, zero));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(sq, zero));
+    }
+    _mm_storeu_si128((__m128i*)lanes, acc);
+    sum = lanes[0] + lanes[1];
+    for (; i<len; ++i) {
+        error = a[i] - b[i];
+        sum += error * error;
+    }
+    return sum;
+}
+
+static const struct _iqa_simd g_sse2 = {
+    "sse2",
+    _u8_to_float_sse2,
+    _conv_row_sse2,
+    _conv_col_sse2,
+    _conv_col_f_sse2,
+    _ssim_sum_sse2,
+    _sqr_err_u8_sse2
+};
+
+/*----------------------------------------------------------------------------
+ * AVX2
+ *---------------------------------------------------------------------------*/
+AVX2 static void _u8_to_float_avx2(const unsigned char *src, float *dst, int len)
+{
+    int i=0;
+    for (; i+8<=len; i+=8) {
+        _mm256_storeu_ps(dst+i, _mm256_cvtepi32_ps(
+            _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(src+i)))));
+    }
+    for (; i<len; ++i)
+        dst[i] = (float)src[i];
+}
+
+AVX2 static void _conv_row_avx2(const float *src, const float *k, int klen, double *dst, int len)
+{
+    int x=0,u;
+    double sum;
+    __m256 p;
+    __m256d lo, hi;
+    for (; x+8<=len; x+=8) {
+        lo = hi = _mm256_setzero_pd();
+        for (u=0; u<klen; ++u) {
+            p = _mm256_mul_ps(_mm256_loadu_ps(src+x+u), _mm256_set1_ps(k[u]));
+            lo = _mm256_add_pd(lo, _mm256_cvtps_pd(_mm256_castps256_ps128(p)));
+            hi = _mm256_add_pd(hi, _mm256_cvtps_pd(_mm256_extractf128_ps(p, 1)));
+        }
+        _mm256_storeu_pd(dst+x, lo);
+        _mm256_storeu_pd(dst+x+4, hi);
+    }
+    for (; x<len; ++x) {
+        sum = 0.0;
+        for (u=0; u<klen; ++u)
+            sum += src[x+u] * k[u];
+        dst[x] = sum;
+    }
+}
+
+AVX2 static void _conv_col_avx2(double *acc, const double *row, double k, int len)
+{
+    int x=0;
+    __m256d kv = _mm256_set1_pd(k);
+    for (; x+4<=len; x+=4)
+        _mm256_storeu_pd(acc+x, _mm256_add_pd(_mm256_loadu_pd(acc+x), _mm256_mul_pd(_mm256_loadu_pd(row+x), kv)));
+    for (; x<len; ++x)
+        acc[x] += row[x] * k;
+}
+
+AVX2 static void _conv_col_f_avx2(double *acc, const float *row, double k, int len)
+{
+    int x=0;
+    __m256d kv = _mm256_set1_pd(k);
+    for (; x+4<=len; x+=4) {
+        _mm256_storeu_pd(acc+x, _mm256_add_pd(_mm256_loadu_pd(acc+x),
+            _mm256_mul_pd(_mm256_cvtps_pd(_mm_loadu_ps(row+x)), kv)));
+    }
+    for (; x<len; ++x)
+        acc[x] += row[x] * k;
+}
+
+AVX2 static double _ssim_sum_avx2(const float *ref_mu, const float *cmp_mu, const float *ref_sigma_sqd,
+    const float *cmp_sigma_sqd, const float *sigma_both, int len, float C1, float C2, double sum)
+{
+    int x=0,i;
+    double q[4];
+    double numerator, denominator;
+    __m128 mu1, mu2, den;
+    __m256d two = _mm256_set1_pd(2.0), c1 = _mm256_set1_pd(C1), c2 = _mm256_set1_pd(C2);
+    __m256d num;
+    for (; x+4<=len; x+=4) {
+        /* The denominator is single precision, as in the scalar code */
+        mu1 = _mm_loadu_ps(ref_mu+x);
+        mu2 = _mm_loadu_ps(cmp_mu+x);
+        den = _mm_mul_ps(
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(mu1, mu1), _mm_mul_ps(mu2, mu2)), _mm_set1_ps(C1)),
+            _mm_add_ps(_mm_add_ps(_mm_loadu_ps(ref_sigma_sqd+x), _mm_loadu_ps(cmp_sigma_sqd+x)), _mm_set1_ps(C2)));
+        num = _mm256_mul_pd(
+            _mm256_add_pd(_mm256_mul_pd(_mm256_mul_pd(two, _mm256_cvtps_pd(mu1)), _mm256_cvtps_pd(mu2)), c1),
+            _mm256_add_pd(_mm256_mul_pd(two, _mm256_cvtps_pd(_mm_loadu_ps(sigma_both+x))), c2));
+        _mm256_storeu_pd(q, _mm256_div_pd(num, _mm256_cvtps_pd(den)));
+
+        /* Summed in pixel order */
+        for (i=0; i<4; ++i)
+            sum += q[i];
+    }
+    for (; x<len; ++x) {
+        numerator   = (2.0 * ref_mu[x] * cmp_mu[x] + C1) * (2.0 * sigma_both[x] + C2);
+        denominator = (ref_mu[x]*ref_mu[x] + cmp_mu[x]*cmp_mu[x] + C1) *
+            (ref_sigma_sqd[x] + cmp_sigma_sqd[x] + C2);
+        sum += numerator / denominator;
+    }
+    return sum;
+}
+
+AVX2 static unsigned long long _sqr_err_u8_avx2(const unsigned char *a, const unsigned char *b, int len)
+{
+    int i=0, error;
+    unsigned long long lanes[4], sum;
+    __m256i d, sq, acc = _mm256_setzero_si256();
+    for (; i+16<=len; i+=16) {
+        d = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(a+i))),
+            _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(b+i))));
+        sq = _mm256_madd_epi16(d, d);
+        acc = _mm256_add_epi64(acc, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(sq)));
+        acc = _mm256_add_epi64(acc, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(sq, 1)));
+    }
+    _mm256_storeu_si256((__m256i*)lanes, acc);
+    sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    for (; i<len; ++i) {
+        error = a[i] - b[i];
+        sum += error * error;
+    }
+    return sum;
+}
+
+static const struct _iqa_simd g_avx2 = {
+    "avx2",
+    _u8_to_float_avx2,
+    _conv_row_avx2,
+    _conv_col_avx2,
+    _conv_col_f_avx2,
+    _ssim_sum_avx2,
+    _sqr_err_u8_avx2
+};
+
+const struct _iqa_simd *_iqa_simd_sse2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2") ? &g_sse2 : 0;
+}
+
+const struct _iqa_simd *_iqa_simd_avx2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? &g_avx2 : 0;
+}
+
+#else
+
+const struct _iqa_simd *_iqa_simd_sse2(void)
+{
+    return 0;
+}
+
+const struct _iqa_simd *_iqa_simd_avx2(void)
+{
+    return 0;
+}
+
+#endif
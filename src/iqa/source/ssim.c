@@ -36,7 +36,10 @@
 #include "decimate.h"
 #include "math_utils.h"
 #include "ssim.h"
+#include "simd.h"
+#include "pool.h"
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
 
@@ -46,6 +49,7 @@ IQA_INLINE static double _calc_contrast(double, float, float, float, float);
 IQA_INLINE static double _calc_structure(float, double, float, float, float, float);
 static int _ssim_map(const struct _ssim_int *, void *);
 static float _ssim_reduce(int, int, void *);
+static void _ssim_merge(void *, const void *);
 
 /* 
  * SSIM(x,y)=(2*ux*uy + C1)*(2sxy + C2) / (ux^2 + uy^2 + C1)*(sx^2 + sy^2 + C2)
@@ -60,13 +64,14 @@ float iqa_ssim(const unsigned char *ref, const unsigned char *cmp, int w, int h,
     int gaussian, const struct iqa_ssim_args *args)
 {
     int scale;
-    int x,y,src_offset,offset;
+    int y,offset;
     float *ref_f,*cmp_f;
     struct _kernel low_pass;
     struct _kernel window;
     float result;
     double ssim_sum=0.0;
     struct _map_reduce mr;
+    const struct _iqa_simd *simd = _iqa_simd();
 
     /* Initialize algorithm parameters */
     scale = _max( 1, _round( (float)_min(w,h) / 256.0f ) );
@@ -76,6 +81,8 @@ float iqa_ssim(const unsigned char *ref, const unsigned char *cmp, int w, int h,
         mr.map     = _ssim_map;
         mr.reduce  = _ssim_reduce;
         mr.context = (void*)&ssim_sum;
+        mr.size    = sizeof(ssim_sum);
+        mr.merge   = _ssim_merge;
     }
     window.kernel = (float*)g_square_window;
     window.w = window.h = SQUARE_LEN;
@@ -95,12 +102,8 @@ float iqa_ssim(const unsigned char *ref, const unsigned char *cmp, int w, int h,
         return INFINITY;
     }
     for (y=0; y<h; ++y) {
-        src_offset = y*stride;
-        offset = y*w;
-        for (x=0; x<w; ++x, ++offset, ++src_offset) {
-            ref_f[offset] = (float)ref[src_offset];
-            cmp_f[offset] = (float)cmp[src_offset];
-        }
+        simd->u8_to_float(ref + y*stride, ref_f + y*w, w);
+        simd->u8_to_float(cmp + y*stride, cmp_f + y*w, w);
     }
 
     /* Scale the images down if required */
@@ -137,125 +140,482 @@ float iqa_ssim(const unsigned char *ref, const unsigned char *cmp, int w, int h,
     return result;
 }
 
+/* Shared by the band jobs of iqa_ssim_u8() */
+struct _ssim_u8_bands {
+    const unsigned char *ref8, *cmp8;   /* The planes at scale 1 */
+    const int *ref, *cmp;               /* Or their decimated sums */
+    int stride, w, h;
+    double c1, c2;                      /* C1, C2 in units of the window sums */
+    double q;                           /* Window sum per unit of the mean */
+    float C1, C2, C3;
+    float alpha, beta, gamma;
+    int tweaked;                        /* alpha, beta or gamma isn't 1 */
+    int band_rows;
+    double *sums;                       /* One per band */
+    int *failed;
+};
+
+/* Returns row 'y' of a plane as ints, widening u8 rows into 'buf' */
+static const int *_ssim_u8_line(const struct _ssim_u8_bands *b, const unsigned char *p8,
+    const int *p, int y, int *buf)
+{
+    int x;
+    if (!p8)
+        return p + y*b->w;
+    p8 += y*b->stride;
+    for (x=0; x<b->w; ++x)
+        buf[x] = p8[x];
+    return buf;
+}
 
-/* _iqa_ssim */
-float _iqa_ssim(float *ref, float *cmp, int w, int h, const struct _kernel *k, const struct _map_reduce *mr, const struct iqa_ssim_args *args)
+/* Adds (sign 1) or removes (sign -1) row 'y' from the column sums */
+static void _ssim_u8_cols(const struct _ssim_u8_bands *b, int y, int sign, int *buf,
+    int *sx, int *sy, long long *sxx, long long *syy, long long *sxy)
+{
+    int x;
+    const int *r = _ssim_u8_line(b, b->ref8, b->ref, y, buf);
+    const int *c = _ssim_u8_line(b, b->cmp8, b->cmp, y, buf + b->w);
+
+    for (x=0; x<b->w; ++x) {
+        sx[x]  += sign*r[x];
+        sy[x]  += sign*c[x];
+        sxx[x] += sign*(long long)r[x]*r[x];
+        syy[x] += sign*(long long)c[x]*c[x];
+        sxy[x] += sign*(long long)r[x]*c[x];
+    }
+}
+
+/* SSIM of one window from its exact sums, in the units iqa_ssim() uses */
+static double _ssim_u8_tweaked(const struct _ssim_u8_bands *b, long long sx, long long sy,
+    long long vx, long long vy, long long cov)
+{
+    double mu1 = sx / b->q, mu2 = sy / b->q;
+    double q2 = b->q * b->q;
+    float var1 = (float)(vx / q2), var2 = (float)(vy / q2);
+    double sigma_root = sqrt((double)var1 * var2);
+
+    return _calc_luminance((float)mu1, (float)mu2, b->C1, b->alpha) *
+        _calc_contrast(sigma_root, var1, var2, b->C2, b->beta) *
+        _calc_structure((float)(cov / q2), sigma_root, var1, var2, b->C3, b->gamma);
+}
+
+/* _ssim_u8_band */
+static void _ssim_u8_band(int band, void *ctx)
+{
+    struct _ssim_u8_bands *b = (struct _ssim_u8_bands*)ctx;
+    const long long n = SQUARE_LEN*SQUARE_LEN;
+    int y0 = band * b->band_rows;
+    int rows = _min(b->band_rows, b->h - SQUARE_LEN + 1 - y0);
+    int ow = b->w - SQUARE_LEN + 1;
+    int x, y, t;
+    int *ibuf, *sx, *sy;
+    long long *lbuf, *sxx, *syy, *sxy;
+    long long wx, wy, wxx, wyy, wxy, xy, vx, vy, cov;
+    double sum = 0.0;
+
+    ibuf = (int*)malloc(4*b->w*sizeof(int));
+    lbuf = (long long*)calloc(3*b->w, sizeof(long long));
+    if (!ibuf || !lbuf) {
+        if (ibuf) free(ibuf);
+        if (lbuf) free(lbuf);
+        b->failed[band] = 1;
+        return;
+    }
+    sx = ibuf + 2*b->w;
+    sy = sx + b->w;
+    sxx = lbuf;
+    syy = sxx + b->w;
+    sxy = syy + b->w;
+    memset(sx, 0, 2*b->w*sizeof(int));
+
+    for (t=0; t<SQUARE_LEN-1; ++t)
+        _ssim_u8_cols(b, y0 + t, 1, ibuf, sx, sy, sxx, syy, sxy);
+
+    for (y=y0; y<y0+rows; ++y) {
+        _ssim_u8_cols(b, y + SQUARE_LEN - 1, 1, ibuf, sx, sy, sxx, syy, sxy);
+
+        wx = wy = wxx = wyy = wxy = 0;
+        for (t=0; t<SQUARE_LEN-1; ++t) {
+            wx += sx[t]; wy += sy[t];
+            wxx += sxx[t]; wyy += syy[t]; wxy += sxy[t];
+        }
+        for (x=0; x<ow; ++x) {
+            t = x + SQUARE_LEN - 1;
+            wx += sx[t]; wy += sy[t];
+            wxx += sxx[t]; wyy += syy[t]; wxy += sxy[t];
+
+            /* n^2 times the variances and covariance, exactly */
+            xy = wx*wy;
+            vx = n*wxx - wx*wx;
+            vy = n*wyy - wy*wy;
+            cov = n*wxy - xy;
+            if (b->tweaked)
+                sum += _ssim_u8_tweaked(b, wx, wy, vx, vy, cov);
+            else
+                sum += ((2.0*xy + b->c1) * (2.0*cov + b->c2)) /
+                    (((double)(wx*wx) + (double)(wy*wy) + b->c1) * ((double)(vx + vy) + b->c2));
+
+            wx -= sx[x]; wy -= sy[x];
+            wxx -= sxx[x]; wyy -= syy[x]; wxy -= sxy[x];
+        }
+
+        _ssim_u8_cols(b, y, -1, ibuf, sx, sy, sxx, syy, sxy);
+    }
+
+    b->sums[band] = sum;
+    free(ibuf);
+    free(lbuf);
+}
+
+/*
+ * Same windows as iqa_ssim() with the square window, but the planes stay
+ * 8-bit. Window sums of the pixels (or of the decimated box sums), their
+ * squares and their product are exact integers; dividing both halves of the
+ * SSIM formula by the same power of the window size leaves it unchanged, so
+ * only C1 and C2 need scaling before the per-window ratio is taken.
+ */
+float iqa_ssim_u8(const unsigned char *ref, const unsigned char *cmp, int w, int h, int stride,
+    const struct iqa_ssim_args *args)
 {
-    float alpha=1.0f, beta=1.0f, gamma=1.0f;
     int L=255;
     float K1=0.01f, K2=0.03f;
-    float C1,C2,C3;
-    int x,y,offset;
-    float *ref_mu,*cmp_mu,*ref_sigma_sqd,*cmp_sigma_sqd,*sigma_both;
-    double ssim_sum, numerator, denominator;
-    double luminance_comp, contrast_comp, structure_comp, sigma_root;
-    struct _ssim_int sint;
+    int scale, idx, nbands, failed=0;
+    int *sums=0;
+    double n, ssim_sum=0.0;
+    struct _ssim_u8_bands b;
 
-    /* Initialize algorithm parameters */
+    scale = _max( 1, _round( (float)_min(w,h) / 256.0f ) );
+    b.alpha = b.beta = b.gamma = 1.0f;
     if (args) {
-        if (!mr)
+        if (args->f)
+            scale = args->f;
+        b.alpha = args->alpha;
+        b.beta  = args->beta;
+        b.gamma = args->gamma;
+        L       = args->L;
+        K1      = args->K1;
+        K2      = args->K2;
+    }
+    b.C1 = (K1*L)*(K1*L);
+    b.C2 = (K2*L)*(K2*L);
+    b.C3 = b.C2 / 2.0f;
+    b.tweaked = b.alpha != 1.0f || b.beta != 1.0f || b.gamma != 1.0f;
+
+    b.ref8 = ref;
+    b.cmp8 = cmp;
+    b.ref = b.cmp = 0;
+    b.stride = stride;
+    if (scale > 1) {
+        idx = (w/scale + (w&1)) * (h/scale + (h&1));
+        sums = (int*)malloc(2*idx*sizeof(int));
+        if (!sums)
+            return INFINITY;
+        if (_iqa_decimate_u8(ref, w, h, stride, scale, sums, 0, 0) ||
+            _iqa_decimate_u8(cmp, w, h, stride, scale, sums + idx, &w, &h)) {
+            free(sums);
             return INFINITY;
-        alpha = args->alpha;
-        beta  = args->beta;
-        gamma = args->gamma;
-        L     = args->L;
-        K1    = args->K1;
-        K2    = args->K2;
+        }
+        b.ref8 = b.cmp8 = 0;
+        b.ref = sums;
+        b.cmp = sums + idx;
     }
-    C1 = (K1*L)*(K1*L);
-    C2 = (K2*L)*(K2*L);
-    C3 = C2 / 2.0f;
-
-    ref_mu = (float*)malloc(w*h*sizeof(float));
-    cmp_mu = (float*)malloc(w*h*sizeof(float));
-    ref_sigma_sqd = (float*)malloc(w*h*sizeof(float));
-    cmp_sigma_sqd = (float*)malloc(w*h*sizeof(float));
-    sigma_both = (float*)malloc(w*h*sizeof(float));
-    if (!ref_mu || !cmp_mu || !ref_sigma_sqd || !cmp_sigma_sqd || !sigma_both) {
-        if (ref_mu) free(ref_mu);
-        if (cmp_mu) free(cmp_mu);
-        if (ref_sigma_sqd) free(ref_sigma_sqd);
-        if (cmp_sigma_sqd) free(cmp_sigma_sqd);
-        if (sigma_both) free(sigma_both);
+    b.w = w;
+    b.h = h;
+
+    n = SQUARE_LEN*SQUARE_LEN;
+    b.q = n * scale * scale;
+    b.c1 = b.C1 * b.q * b.q;
+    b.c2 = b.C2 * b.q * b.q;
+
+    nbands = _iqa_bands(h - SQUARE_LEN + 1, &b.band_rows);
+    b.sums = (double*)malloc(_max(nbands,1)*sizeof(double));
+    b.failed = (int*)calloc(_max(nbands,1), sizeof(int));
+    if (!b.sums || !b.failed) {
+        if (b.sums) free(b.sums);
+        if (b.failed) free(b.failed);
+        if (sums) free(sums);
         return INFINITY;
     }
 
-    /* Calculate mean */
-    _iqa_convolve(ref, w, h, k, ref_mu, 0, 0);
-    _iqa_convolve(cmp, w, h, k, cmp_mu, 0, 0);
+    _iqa_pool_run(nbands, _ssim_u8_band, &b);
 
-    for (y=0; y<h; ++y) {
-        offset = y*w;
-        for (x=0; x<w; ++x, ++offset) {
-            ref_sigma_sqd[offset] = ref[offset] * ref[offset];
-            cmp_sigma_sqd[offset] = cmp[offset] * cmp[offset];
-            sigma_both[offset] = ref[offset] * cmp[offset];
-        }
+    /* Reduce in band order, so the result doesn't depend on the threads */
+    for (idx=0; idx<nbands; ++idx) {
+        failed |= b.failed[idx];
+        ssim_sum += b.sums[idx];
     }
+    free(b.sums);
+    free(b.failed);
+    if (sums) free(sums);
+    if (failed)
+        return INFINITY;
 
-    /* Calculate sigma */
-    _iqa_convolve(ref_sigma_sqd, w, h, k, 0, 0, 0);
-    _iqa_convolve(cmp_sigma_sqd, w, h, k, 0, 0, 0);
-    _iqa_convolve(sigma_both, w, h, k, 0, &w, &h); /* Update the width and height */
+    w = w - SQUARE_LEN + 1;
+    h = h - SQUARE_LEN + 1;
+    return (float)(ssim_sum / (double)(w*h));
+}
 
-    /* The convolution results are smaller by the kernel width and height */
-    for (y=0; y<h; ++y) {
-        offset = y*w;
-        for (x=0; x<w; ++x, ++offset) {
-            ref_sigma_sqd[offset] -= ref_mu[offset] * ref_mu[offset];
-            cmp_sigma_sqd[offset] -= cmp_mu[offset] * cmp_mu[offset];
-            sigma_both[offset] -= ref_mu[offset] * cmp_mu[offset];
-        }
+
+/* Running state of one band of _iqa_ssim() */
+struct _ssim_rows {
+    float alpha, beta, gamma;
+    float C1, C2, C3;
+    _map map;
+    void *context;          /* The band's copy of the map-reduce context */
+    const struct iqa_ssim_args *args;
+    const struct _iqa_simd *simd;
+    const float *ref_mu;    /* Precomputed reference statistics, or 0 */
+    const float *ref_sigma_sqd;
+    int y;                  /* First output row of the band */
+    double ssim_sum;
+    int failed;
+};
+
+/* Shared by the band jobs of _iqa_ssim() */
+struct _ssim_bands {
+    const float *ref, *cmp;
+    int w, h;
+    const struct _kernel *k;
+    int band_rows;
+    struct _ssim_rows *bands;
+};
+
+/* _ssim_row */
+static int _ssim_row(int y, int w, float *ref_mu, float *cmp_mu, float *ref_sigma_sqd,
+    float *cmp_sigma_sqd, float *sigma_both, void *ctx)
+{
+    struct _ssim_rows *s = (struct _ssim_rows*)ctx;
+    int x;
+    double luminance_comp, contrast_comp, structure_comp, sigma_root;
+    float ref_sqd, cmp_sqd;
+    const float *mu1 = ref_mu, *sigma1_sqd = ref_sigma_sqd;
+    struct _ssim_int sint;
+
+    if (s->ref_mu) {
+        mu1 = s->ref_mu + (s->y + y)*w;
+        sigma1_sqd = s->ref_sigma_sqd + (s->y + y)*w;
+    }
+    else {
+        for (x=0; x<w; ++x)
+            ref_sigma_sqd[x] -= ref_mu[x] * ref_mu[x];
+    }
+    for (x=0; x<w; ++x) {
+        cmp_sigma_sqd[x] -= cmp_mu[x] * cmp_mu[x];
+        sigma_both[x] -= mu1[x] * cmp_mu[x];
     }
 
-    ssim_sum = 0.0;
-    for (y=0; y<h; ++y) {
-        offset = y*w;
-        for (x=0; x<w; ++x, ++offset) {
-
-            if (!args) {
-                /* The default case */
-                numerator   = (2.0 * ref_mu[offset] * cmp_mu[offset] + C1) * (2.0 * sigma_both[offset] + C2);
-                denominator = (ref_mu[offset]*ref_mu[offset] + cmp_mu[offset]*cmp_mu[offset] + C1) * 
-                    (ref_sigma_sqd[offset] + cmp_sigma_sqd[offset] + C2);
-                ssim_sum += numerator / denominator;
-            }
-            else {
-                /* User tweaked alpha, beta, or gamma */
-
-                /* passing a negative number to sqrt() cause a domain error */
-                if (ref_sigma_sqd[offset] < 0.0f)
-                    ref_sigma_sqd[offset] = 0.0f;
-                if (cmp_sigma_sqd[offset] < 0.0f)
-                    cmp_sigma_sqd[offset] = 0.0f;
-                sigma_root = sqrt(ref_sigma_sqd[offset] * cmp_sigma_sqd[offset]);
-
-                luminance_comp = _calc_luminance(ref_mu[offset], cmp_mu[offset], C1, alpha);
-                contrast_comp  = _calc_contrast(sigma_root, ref_sigma_sqd[offset], cmp_sigma_sqd[offset], C2, beta);
-                structure_comp = _calc_structure(sigma_both[offset], sigma_root, ref_sigma_sqd[offset], cmp_sigma_sqd[offset], C3, gamma);
-
-                sint.l = luminance_comp;
-                sint.c = contrast_comp;
-                sint.s = structure_comp;
-
-                if (mr->map(&sint, mr->context))
-                    return INFINITY;
-            }
+    if (!s->args) {
+        /* The default case */
+        s->ssim_sum = s->simd->ssim_sum(mu1, cmp_mu, sigma1_sqd, cmp_sigma_sqd,
+            sigma_both, w, s->C1, s->C2, s->ssim_sum);
+        return 0;
+    }
+    for (x=0; x<w; ++x) {
+        /* User tweaked alpha, beta, or gamma */
+
+        /* passing a negative number to sqrt() cause a domain error */
+        ref_sqd = sigma1_sqd[x] < 0.0f ? 0.0f : sigma1_sqd[x];
+        cmp_sqd = cmp_sigma_sqd[x] < 0.0f ? 0.0f : cmp_sigma_sqd[x];
+        sigma_root = sqrt(ref_sqd * cmp_sqd);
+
+        luminance_comp = _calc_luminance(mu1[x], cmp_mu[x], s->C1, s->alpha);
+        contrast_comp  = _calc_contrast(sigma_root, ref_sqd, cmp_sqd, s->C2, s->beta);
+        structure_comp = _calc_structure(sigma_both[x], sigma_root, ref_sqd, cmp_sqd, s->C3, s->gamma);
+
+        sint.l = luminance_comp;
+        sint.c = contrast_comp;
+        sint.s = structure_comp;
+
+        if (s->map(&sint, s->context))
+            return 1;
+    }
+    return 0;
+}
+
+/* _ssim_band */
+static void _ssim_band(int band, void *ctx)
+{
+    struct _ssim_bands *b = (struct _ssim_bands*)ctx;
+    int y = band * b->band_rows;
+    int rows = _min(b->band_rows, b->h - b->k->h + 1 - y);
+    int channels = IQA_MOMENT_ALL;
+
+    /* Precomputed reference statistics leave only the cross terms to do */
+    if (b->bands[band].ref_mu)
+        channels = IQA_MOMENT_CMP | IQA_MOMENT_CMP_SQD | IQA_MOMENT_BOTH;
+
+    /* The band's input rows, plus the halo below it covered by the window */
+    b->bands[band].y = y;
+    b->bands[band].failed = _iqa_moments(b->ref + y*b->w, b->cmp + y*b->w, b->w,
+        rows + b->k->h - 1, b->k, channels, _ssim_row, &b->bands[band], 0, 0);
+}
+
+/* _iqa_ssim */
+float _iqa_ssim(float *ref, float *cmp, int w, int h, const struct _kernel *k, const struct _map_reduce *mr, const struct iqa_ssim_args *args)
+{
+    return _iqa_ssim_ref(ref, 0, 0, cmp, w, h, k, mr, args);
+}
+
+/* _iqa_ssim_ref */
+float _iqa_ssim_ref(const float *ref, const float *ref_mu, const float *ref_sigma_sqd, const float *cmp,
+    int w, int h, const struct _kernel *k, const struct _map_reduce *mr, const struct iqa_ssim_args *args)
+{
+    int L=255;
+    float K1=0.01f, K2=0.03f;
+    struct _ssim_rows s;
+    struct _ssim_bands b;
+    char *contexts=0;
+    int idx, nbands, failed=0;
+    double ssim_sum=0.0;
+
+    /* Initialize algorithm parameters */
+    s.alpha = s.beta = s.gamma = 1.0f;
+    s.map = 0;
+    if (args) {
+        if (!mr)
+            return INFINITY;
+        s.alpha = args->alpha;
+        s.beta  = args->beta;
+        s.gamma = args->gamma;
+        s.map   = mr->map;
+        L       = args->L;
+        K1      = args->K1;
+        K2      = args->K2;
+    }
+    s.C1 = (K1*L)*(K1*L);
+    s.C2 = (K2*L)*(K2*L);
+    s.C3 = s.C2 / 2.0f;
+    s.args = args;
+    s.simd = _iqa_simd();
+    s.ref_mu = ref_mu;
+    s.ref_sigma_sqd = ref_sigma_sqd;
+    s.y = 0;
+    s.ssim_sum = 0.0;
+    s.failed = 0;
+
+    /*
+     * Means, variances and covariance are produced a row at a time and
+     * folded into the sum straight away, so the working set is a few rows
+     * rather than five full-size planes. Each band of rows keeps its own sum.
+     */
+    b.ref = ref;
+    b.cmp = cmp;
+    b.w = w;
+    b.h = h;
+    b.k = k;
+    nbands = _iqa_bands(h - k->h + 1, &b.band_rows);
+    b.bands = (struct _ssim_rows*)malloc(_max(nbands,1)*sizeof(struct _ssim_rows));
+    if (args)
+        contexts = (char*)malloc(_max(nbands,1)*mr->size);
+    if (!b.bands || (args && !contexts)) {
+        if (b.bands) free(b.bands);
+        if (contexts) free(contexts);
+        return INFINITY;
+    }
+    for (idx=0; idx<nbands; ++idx) {
+        b.bands[idx] = s;
+        if (args) {
+            b.bands[idx].context = contexts + idx*mr->size;
+            memcpy(b.bands[idx].context, mr->context, mr->size);
         }
     }
 
-    free(ref_mu);
-    free(cmp_mu);
-    free(ref_sigma_sqd);
-    free(cmp_sigma_sqd);
-    free(sigma_both);
+    _iqa_pool_run(nbands, _ssim_band, &b);
+
+    /* Reduce in band order, so the result doesn't depend on the threads */
+    for (idx=0; idx<nbands; ++idx) {
+        failed |= b.bands[idx].failed;
+        if (args)
+            mr->merge(mr->context, b.bands[idx].context);
+        else
+            ssim_sum += b.bands[idx].ssim_sum;
+    }
+    free(b.bands);
+    if (contexts) free(contexts);
+    if (failed)
+        return INFINITY;
 
+    w = w - k->w + 1;
+    h = h - k->h + 1;
     if (!args)
         return (float)(ssim_sum / (double)(w*h));
     return mr->reduce(w, h, mr->context);
 }
 
 
+/* One band of _iqa_ssim_ref_stats() */
+struct _ssim_stats_band {
+    const struct _ssim_stats_bands *all;
+    int y;                  /* First output row of the band */
+    int failed;
+};
+
+/* Shared by the band jobs of _iqa_ssim_ref_stats() */
+struct _ssim_stats_bands {
+    const float *ref;
+    int w, h;
+    const struct _kernel *k;
+    float *mu, *sigma_sqd;
+    int band_rows;
+    struct _ssim_stats_band *bands;
+};
+
+/* Stores a row of reference statistics */
+static int _ssim_stats_row(int y, int w, float *ref_mu, float *unused_cmp_mu, float *ref_sqd,
+    float *unused_cmp_sqd, float *unused_both, void *ctx)
+{
+    struct _ssim_stats_band *band = (struct _ssim_stats_band*)ctx;
+    float *mu = band->all->mu + (band->y + y)*w;
+    float *sigma_sqd = band->all->sigma_sqd + (band->y + y)*w;
+    int x;
+
+    for (x=0; x<w; ++x) {
+        mu[x] = ref_mu[x];
+        sigma_sqd[x] = ref_sqd[x] - ref_mu[x] * ref_mu[x];
+    }
+    return 0;
+}
+
+/* _ssim_stats_band */
+static void _ssim_stats_band(int idx, void *ctx)
+{
+    struct _ssim_stats_bands *b = (struct _ssim_stats_bands*)ctx;
+    struct _ssim_stats_band *band = &b->bands[idx];
+    int y = idx * b->band_rows;
+    int rows = _min(b->band_rows, b->h - b->k->h + 1 - y);
+
+    band->all = b;
+    band->y = y;
+    band->failed = _iqa_moments(b->ref + y*b->w, 0, b->w, rows + b->k->h - 1, b->k,
+        IQA_MOMENT_REF | IQA_MOMENT_REF_SQD, _ssim_stats_row, band, 0, 0);
+}
+
+/* _iqa_ssim_ref_stats */
+int _iqa_ssim_ref_stats(const float *ref, int w, int h, const struct _kernel *k, float *mu, float *sigma_sqd)
+{
+    struct _ssim_stats_bands b;
+    int idx, nbands, failed=0;
+
+    b.ref = ref;
+    b.w = w;
+    b.h = h;
+    b.k = k;
+    b.mu = mu;
+    b.sigma_sqd = sigma_sqd;
+    nbands = _iqa_bands(h - k->h + 1, &b.band_rows);
+    b.bands = (struct _ssim_stats_band*)malloc(_max(nbands,1)*sizeof(struct _ssim_stats_band));
+    if (!b.bands)
+        return 1;
+
+    _iqa_pool_run(nbands, _ssim_stats_band, &b);
+
+    for (idx=0; idx<nbands; ++idx)
+        failed |= b.bands[idx].failed;
+    free(b.bands);
+    return failed;
+}
+
+
 /* _ssim_map */
 int _ssim_map(const struct _ssim_int *si, void *ctx)
 {
@@ -271,6 +631,12 @@ float _ssim_reduce(int w, int h, void *ctx)
     return (float)(*ssim_sum / (double)(w*h));
 }
 
+/* _ssim_merge */
+void _ssim_merge(void *ctx, const void *band)
+{
+    *(double*)ctx += *(const double*)band;
+}
+
 
 /* _calc_luminance */
 IQA_INLINE static double _calc_luminance(float mu1, float mu2, float C1, float alpha)
@@ -38,6 +38,8 @@
 #include "test_ssim.h"
 #include "test_ms_ssim.h"
 #include "test_fast_ssim.h"
+#include "test_simd.h"
+#include "test_pool.h"
 #include <stdio.h>
 
 int main()
@@ -52,6 +54,8 @@ int main()
     failures += test_ssim();
     failures += test_ms_ssim();
     failures += test_fast_ssim();
+    failures += test_simd();
+    failures += test_pool();
 
     if (failures)
         printf("\n\nRESULT: *** FAIL (%i) ***\n\n", failures);
@@ -75,6 +75,48 @@ static int _test_convolve_3x3_kernel();
 static int _test_img_filter_1x1_kernel();
 static int _test_img_filter_2x2_kernel();
 static int _test_img_filter_3x3_kernel();
+static int _test_convolve_box_kernel();
+static int _test_moments();
+static int _test_convolve_separable_kernel();
+
+/* Deterministic pseudo-random 8-bit test image */
+#define BOX_W 37
+#define BOX_H 29
+static void _fill_box_img(float *img, unsigned int seed)
+{
+    int idx;
+    for (idx=0; idx<BOX_W*BOX_H; ++idx) {
+        seed = seed*1103515245u + 12345u;
+        img[idx] = (float)((seed >> 16) & 0xff);
+    }
+}
+
+/* Straightforward dense convolution used as the reference result */
+static void _ref_convolve(const float *img, int w, int h, const float *kernel, int kw, int kh, float scale, float *dst)
+{
+    int x,y,u,v;
+    double sum;
+    for (y=0; y<h-kh+1; ++y) {
+        for (x=0; x<w-kw+1; ++x) {
+            sum = 0.0;
+            for (v=0; v<kh; ++v)
+                for (u=0; u<kw; ++u)
+                    sum += img[(y+v)*w + x+u] * kernel[v*kw + u];
+            dst[y*(w-kw+1) + x] = (float)(sum * scale);
+        }
+    }
+}
+
+/* Separable results differ from the dense sum only by float rounding */
+static int _max_diff_within(const float *a, const float *b, int len, float tol)
+{
+    int idx;
+    for (idx=0; idx<len; ++idx) {
+        if (a[idx] - b[idx] > tol || b[idx] - a[idx] > tol)
+            return 0;
+    }
+    return 1;
+}
 
 /*----------------------------------------------------------------------------
  * TEST ENTRY POINT
@@ -87,6 +129,9 @@ int test_convolve()
     failure += _test_convolve_1x1_kernel();
     failure += _test_convolve_2x2_kernel();
     failure += _test_convolve_3x3_kernel();
+    failure += _test_convolve_box_kernel();
+    failure += _test_convolve_separable_kernel();
+    failure += _test_moments();
     printf("\nImage Filter:\n");
     failure += _test_img_filter_1x1_kernel();
     failure += _test_img_filter_2x2_kernel();
@@ -399,3 +444,282 @@ int _test_img_filter_3x3_kernel()
 
     return failures;
 }
+
+/*----------------------------------------------------------------------------
+ * _test_convolve_box_kernel
+ *---------------------------------------------------------------------------*/
+int _test_convolve_box_kernel()
+{
+    int idx, rw, rh, passed, failures=0;
+    struct _kernel k;
+    float kernel_8x8[64], kernel_5x3[15];
+    float img[BOX_W*BOX_H];
+    float img_tmp[BOX_W*BOX_H];
+    float expected[BOX_W*BOX_H];
+
+    for (idx=0; idx<64; ++idx)
+        kernel_8x8[idx] = 1.0f/64.0f;
+    for (idx=0; idx<15; ++idx)
+        kernel_5x3[idx] = 1.0f;
+    _fill_box_img(img, 7);
+
+    printf("\t37x29 image, 8x8 box kernel:\n");
+    k.w = k.h = 8;
+    k.kernel = kernel_8x8;
+    k.normalized = 1;
+
+    printf("\t  uniform detected:   ");
+    passed = _iqa_kernel_is_uniform(&k);
+    printf("\t%s\n", passed?"PASS":"FAILED");
+    failures += passed?0:1;
+
+    /* Exact for 8-bit data: the 1/64 weights are a power of two */
+    printf("\t  w/ result w/ rw/rh: ");
+    _ref_convolve(img, BOX_W, BOX_H, kernel_8x8, 8, 8, 1.0f, expected);
+    _iqa_convolve(img, BOX_W, BOX_H, &k, img_tmp, &rw, &rh);
+    passed = rw == BOX_W-7 && rh == BOX_H-7 &&
+        memcmp(img_tmp, expected, rw*rh*sizeof(float)) == 0;
+    printf("[%i,%i]\t%s\n", rw, rh, passed?"PASS":"FAILED");
+    failures += passed?0:1;
+
+    printf("\t  in-place  w/ rw/rh: ");
+    memcpy(img_tmp, img, sizeof(img));
+    _iqa_convolve(img_tmp, BOX_W, BOX_H, &k, 0, &rw, &rh);
+    passed = rw == BOX_W-7 && rh == BOX_H-7 &&
+        memcmp(img_tmp, expected, rw*rh*sizeof(float)) == 0;
+    printf("[%i,%i]\t%s\n", rw, rh, passed?"PASS":"FAILED");
+    failures += passed?0:1;
+
+    printf("\t37x29 image, 5x3 un-normalized box kernel:\n");
+    k.w = 5;
+    k.h = 3;
+    k.kernel = kernel_5x3;
+    k.normalized = 0;
+
+    printf("\t  in-place  w/ rw/rh: ");
+    _ref_convolve(img, BOX_W, BOX_H, kernel_5x3, 5, 3, 1.0f/15.0f, expected);
+    memcpy(img_tmp, img, sizeof(img));
+    _iqa_convolve(img_tmp, BOX_W, BOX_H, &k, 0, &rw, &rh);
+    passed = rw == BOX_W-4 && rh == BOX_H-2 &&
+        _matrix_cmp(img_tmp, expected, rw, rh, 4) == 0;
+    printf("[%i,%i]\t%s\n", rw, rh, passed?"PASS":"FAILED");
+    failures += passed?0:1;
+
+    printf("\t  non-uniform:        ");
+    kernel_5x3[7] = 2.0f;
+    passed = !_iqa_kernel_is_uniform(&k);
+    printf("\t%s\n", passed?"PASS":"FAILED");
+    failures += passed?0:1;
+
+    return failures;
+}
+
+/* Collects the rows streamed by _iqa_moments() into planes */
+struct _moment_planes {
+    float *plane[5];    /* 0 for channels that weren't requested */
+    int rows;           /* Rows received so far */
+    int stop_at;        /* Ask to stop after this many rows */
+    int bad;            /* Set on an out-of-order row or unexpected channel */
+};
+
+static int _collect_moments(int y, int w, float *ref_mu, float *cmp_mu, float *ref_sqd,
+    float *cmp_sqd, float *both, void *ctx)
+{
+    struct _moment_planes *p = (struct _moment_planes*)ctx;
+    float *rows[5];
+    int c;
+
+    rows[0] = ref_mu;
+    rows[1] = cmp_mu;
+    rows[2] = ref_sqd;
+    rows[3] = cmp_sqd;
+    rows[4] = both;
+    if (y != p->rows)
+        p->bad = 1;
+    for (c=0; c<5; ++c) {
+        if (!p->plane[c] != !rows[c])
+            p->bad = 1;
+        else if (rows[c])
+            memcpy(p->plane[c] + y*w, rows[c], w*sizeof(float));
+    }
+    ++p->rows;
+    return p->rows == p->stop_at;
+}
+
+/*
+ * Runs _iqa_moments() and checks every requested channel is bit-identical to
+ * running the matching x, y, x^2, y^2 or x*y plane through _iqa_convolve().
+ */
+static int _check_moments(const float *ref, const float *cmp, const struct _kernel *k, int channels)
+{
+    static float expected[5][BOX_W*BOX_H], actual[5][BOX_W*BOX_H];
+    float tmp[BOX_W*BOX_H], a, b;
+    struct _moment_planes planes;
+    int c, idx, rw, rh, passed;
+
+    for (c=0; c<5; ++c) {
+        planes.plane[c] = 0;
+        if (!(channels & (1<<c)))
+            continue;
+        planes.plane[c] = actual[c];
+        for (idx=0; idx<BOX_W*BOX_H; ++idx) {
+            a = (c == 1 || c == 3) ? cmp[idx] : ref[idx];
+            b = (c == 4) ? cmp[idx] : a;
+            tmp[idx] = c < 2 ? a : a*b;
+        }
+        _iqa_convolve(tmp, BOX_W, BOX_H, k, expected[c], 0, 0);
+    }
+    planes.rows = 0;
+    planes.stop_at = -1;
+    planes.bad = 0;
+
+    passed = !_iqa_moments(ref, cmp, BOX_W, BOX_H, k, channels, _collect_moments,
+        &planes, &rw, &rh);
+    passed = passed && !planes.bad && rw == BOX_W-k->w+1 && rh == BOX_H-k->h+1 &&
+        planes.rows == rh;
+    for (c=0; passed && c<5; ++c) {
+        if (planes.plane[c] && memcmp(actual[c], expected[c], rw*rh*sizeof(float)))
+            passed = 0;
+    }
+    printf("[%i,%i]\t%s\n", rw, rh, passed?"PASS":"FAILED");
+    return passed;
+}
+
+/*----------------------------------------------------------------------------
+ * _test_moments
+ *---------------------------------------------------------------------------*/
+int _test_moments()
+{
+    int u, v, idx, passed, failures=0;
+    struct _kernel k;
+    struct _moment_planes planes;
+    static const float gx[7] = { 0.05f, 0.1f, 0.2f, 0.3f, 0.2f, 0.1f, 0.05f };
+    static const float gy[5] = { 0.1f, 0.2f, 0.4f, 0.2f, 0.1f };
+    float kernel_8x8[64], kernel_7x5[35];
+    float ref[BOX_W*BOX_H], cmp[BOX_W*BOX_H];
+
+    for (idx=0; idx<64; ++idx)
+        kernel_8x8[idx] = 1.0f/64.0f;
+    for (v=0; v<5; ++v) {
+        for (u=0; u<7; ++u)
+            kernel_7x5[v*7 + u] = gy[v]*gx[u];
+    }
+    _fill_box_img(ref, 11);
+    _fill_box_img(cmp, 23);
+
+    printf("\nMoments:\n");
+    printf("\t37x29 images, 8x8 box kernel:\n");
+    k.w = k.h = 8;
+    k.kernel = kernel_8x8;
+    k.normalized = 1;
+
+    printf("\t  both images:        ");
+    failures += _check_moments(ref, cmp, &k, IQA_MOMENT_ALL)?0:1;
+
+    printf("\t  reference only:     ");
+    failures += _check_moments(ref, 0, &k, IQA_MOMENT_REF | IQA_MOMENT_REF_SQD)?0:1;
+
+    printf("\t  cmp and product:    ");
+    failures += _check_moments(ref, cmp, &k, IQA_MOMENT_CMP | IQA_MOMENT_CMP_SQD | IQA_MOMENT_BOTH)?0:1;
+
+    printf("\t37x29 images, 7x5 separable kernel:\n");
+    k.w = 7;
+    k.h = 5;
+    k.kernel = kernel_7x5;
+
+    printf("\t  both images:        ");
+    failures += _check_moments(ref, cmp, &k, IQA_MOMENT_ALL)?0:1;
+
+    printf("\t37x29 images, 7x5 non-separable kernel:\n");
+    kernel_7x5[9] = 0.5f;
+    k.normalized = 0;
+
+    printf("\t  both images:        ");
+    failures += _check_moments(ref, cmp, &k, IQA_MOMENT_ALL)?0:1;
+
+    printf("\t  stopped by callback:");
+    planes.plane[0] = cmp;
+    planes.plane[1] = planes.plane[2] = planes.plane[3] = planes.plane[4] = 0;
+    planes.rows = 0;
+    planes.stop_at = 3;
+    planes.bad = 0;
+    passed = _iqa_moments(ref, 0, BOX_W, BOX_H, &k, IQA_MOMENT_REF, _collect_moments,
+        &planes, 0, 0) && planes.rows == 3 && !planes.bad;
+    printf("\t%s\n", passed?"PASS":"FAILED");
+    failures += passed?0:1;
+
+    return failures;
+}
+
+/*----------------------------------------------------------------------------
+ * _test_convolve_separable_kernel
+ *---------------------------------------------------------------------------*/
+int _test_convolve_separable_kernel()
+{
+    int u, v, rw, rh, passed, failures=0;
+    struct _kernel k;
+    static const float gx[7] = { 0.05f, 0.1f, 0.2f, 0.3f, 0.2f, 0.1f, 0.05f };
+    static const float gy[5] = { 0.1f, 0.2f, 0.4f, 0.2f, 0.1f };
+    float kernel_7x5[35], kx[7], ky[5];
+    float img[BOX_W*BOX_H];
+    float img_tmp[BOX_W*BOX_H];
+    float expected[BOX_W*BOX_H];
+
+    for (v=0; v<5; ++v) {
+        for (u=0; u<7; ++u)
+            kernel_7x5[v*7 + u] = gy[v]*gx[u];
+    }
+    _fill_box_img(img, 11);
+
+    printf("\t37x29 image, 7x5 separable kernel:\n");
+    k.w = 7;
+    k.h = 5;
+    k.kernel = kernel_7x5;
+    k.normalized = 1;
+
+    printf("\t  separable detected: ");
+    passed = _iqa_kernel_separate(&k, kx, ky);
+    for (v=0; passed && v<5; ++v) {
+        for (u=0; u<7; ++u) {
+            if (_cmp_float(kx[u]*ky[v], kernel_7x5[v*7 + u], 6))
+                passed = 0;
+        }
+    }
+    printf("\t%s\n", passed?"PASS":"FAILED");
+    failures += passed?0:1;
+
+    printf("\t  w/ result w/ rw/rh: ");
+    _ref_convolve(img, BOX_W, BOX_H, kernel_7x5, 7, 5, 1.0f, expected);
+    _iqa_convolve(img, BOX_W, BOX_H, &k, img_tmp, &rw, &rh);
+    passed = rw == BOX_W-6 && rh == BOX_H-4 &&
+        _max_diff_within(img_tmp, expected, rw*rh, 0.001f);
+    printf("[%i,%i]\t%s\n", rw, rh, passed?"PASS":"FAILED");
+    failures += passed?0:1;
+
+    printf("\t  in-place  w/ rw/rh: ");
+    memcpy(img_tmp, img, sizeof(img));
+    _iqa_convolve(img_tmp, BOX_W, BOX_H, &k, 0, &rw, &rh);
+    passed = rw == BOX_W-6 && rh == BOX_H-4 &&
+        _max_diff_within(img_tmp, expected, rw*rh, 0.001f);
+    printf("[%i,%i]\t%s\n", rw, rh, passed?"PASS":"FAILED");
+    failures += passed?0:1;
+
+    /* A bump in the middle makes it rank-2: must use the dense path */
+    printf("\t7x5 non-separable kernel:\n");
+    kernel_7x5[2*7 + 3] += 0.05f;
+
+    printf("\t  separable rejected: ");
+    passed = !_iqa_kernel_separate(&k, kx, ky);
+    printf("\t%s\n", passed?"PASS":"FAILED");
+    failures += passed?0:1;
+
+    printf("\t  w/ result w/ rw/rh: ");
+    _ref_convolve(img, BOX_W, BOX_H, kernel_7x5, 7, 5, 1.0f, expected);
+    _iqa_convolve(img, BOX_W, BOX_H, &k, img_tmp, &rw, &rh);
+    passed = rw == BOX_W-6 && rh == BOX_H-4 &&
+        memcmp(img_tmp, expected, rw*rh*sizeof(float)) == 0;
+    printf("[%i,%i]\t%s\n", rw, rh, passed?"PASS":"FAILED");
+    failures += passed?0:1;
+
+    return failures;
+}
@@ -65,6 +65,7 @@ static float img_5x5[] = {
 static int _test_decimate_2x_4x4();
 static int _test_decimate_2x_5x5();
 static int _test_decimate_3x_5x5();
+static int _test_decimate_separable();
 
 
 /*----------------------------------------------------------------------------
@@ -78,6 +79,7 @@ int test_decimate()
     failure += _test_decimate_2x_4x4();
     failure += _test_decimate_2x_5x5();
     failure += _test_decimate_3x_5x5();
+    failure += _test_decimate_separable();
 
     return failure;
 }
@@ -284,3 +286,71 @@ int _test_decimate_3x_5x5()
 
     return failures;
 }
+
+/*----------------------------------------------------------------------------
+ * _test_decimate_separable
+ *---------------------------------------------------------------------------*/
+#define SEP_W 23
+#define SEP_H 17
+int _test_decimate_separable()
+{
+    int x, y, u, v, rw, rh, passed, failures=0;
+    unsigned int seed = 3;
+    struct _kernel k;
+    /* Low-pass with negative lobes, like the MS-SSIM 9/7 wavelet filter */
+    static const float lpf[9] = {
+        0.027f, -0.017f, -0.078f, 0.267f, 0.602f, 0.267f, -0.078f, -0.017f, 0.027f
+    };
+    float kernel_9x9[81];
+    float img[SEP_W*SEP_H];
+    float img_tmp[SEP_W*SEP_H];
+    float expected[SEP_W*SEP_H];
+    int sw = SEP_W/2 + 1;
+    int sh = SEP_H/2 + 1;
+
+    for (v=0; v<9; ++v) {
+        for (u=0; u<9; ++u)
+            kernel_9x9[v*9 + u] = lpf[v]*lpf[u];
+    }
+    for (x=0; x<SEP_W*SEP_H; ++x) {
+        seed = seed*1103515245u + 12345u;
+        img[x] = (float)((seed >> 16) & 0xff);
+    }
+
+    k.w = k.h = 9;
+    k.kernel = kernel_9x9;
+    k.normalized = 1;
+    k.bnd_opt = KBND_SYMMETRIC;
+
+    /* Direct 2D filtering (with mirrored borders) is the reference */
+    for (y=0; y<sh; ++y) {
+        for (x=0; x<sw; ++x)
+            expected[y*sw + x] = _iqa_filter_pixel(img, SEP_W, SEP_H, x*2, y*2, &k, 1.0f);
+    }
+
+    printf("\t23x17 image, 9x9 separable filter, 2x factor:\n");
+
+    printf("\t  w/ result w/ rw/rh: ");
+    memset(img_tmp,0,sizeof(img_tmp));
+    _iqa_decimate(img, SEP_W, SEP_H, 2, &k, img_tmp, &rw, &rh);
+    passed = rw == sw && rh == sh;
+    for (x=0; passed && x<sw*sh; ++x) {
+        if (img_tmp[x] - expected[x] > 0.001f || expected[x] - img_tmp[x] > 0.001f)
+            passed = 0;
+    }
+    printf("\t%s\n", passed?"PASS":"FAILED");
+    failures += passed?0:1;
+
+    printf("\t  in-place  w/ rw/rh: ");
+    memcpy(img_tmp,img,sizeof(img));
+    _iqa_decimate(img_tmp, SEP_W, SEP_H, 2, &k, 0, &rw, &rh);
+    passed = rw == sw && rh == sh;
+    for (x=0; passed && x<sw*sh; ++x) {
+        if (img_tmp[x] - expected[x] > 0.001f || expected[x] - img_tmp[x] > 0.001f)
+            passed = 0;
+    }
+    printf("\t%s\n", passed?"PASS":"FAILED");
+    failures += passed?0:1;
+
+    return failures;
+}
@@ -434,12 +434,16 @@ static const struct answer ans_key_22x15_args[] = {
     {0.67986f, 5}, /* 2x2 low-pass filter */
 };
 
+/*
+ * NOTE: The Gaussian window is now the outer product of its 1-D factor
+ * instead of a 6-decimal table, which moved some values in the last digit.
+ */
 static const struct answer ans_key_einstein_gauss[] = {
     {1.00000f, 5}, /* Identical */
     {0.69408f, 5}, /* Blur */
     {0.91327f, 5}, /* Contrast */
-    {0.28771f, 5}, /* Flip Vertical */
-    {0.83957f, 5}, /* Impulse */
+    {0.28772f, 5}, /* Flip Vertical */
+    {0.83958f, 5}, /* Impulse */
     {0.66246f, 5}, /* JPEG */
     {0.98836f, 5}, /* Mean Shift */
 };
@@ -457,9 +461,9 @@ static const struct answer ans_key_einstein_linear[] = {
 /* NOTE: Values verified. Different from Octave due to float precision. */
 static const struct answer ans_key_einstein_args[] = {
     {1.00000f, 5}, /* Identical */
-    {0.56509f, 5}, /* Blur */
+    {0.56510f, 5}, /* Blur */
     {0.94412f, 5}, /* Contrast */
-    {0.13106f, 5}, /* Flip Vertical */
+    {0.13107f, 5}, /* Flip Vertical */
     {0.81263f, 5}, /* Impulse */
     {0.50202f, 4}, /* JPEG (rounding error on 64-bit)*/
     {0.99542f, 5}, /* Mean Shift */
@@ -480,9 +484,19 @@ static const struct answer ans_key_courtright[] = {
 #define BMP_CR_ORIGINAL "Courtright.bmp"
 #define BMP_CR_NOISE "Courtright_Noise.bmp"
 
+static const char *einstein_files[] = {
+    BMP_ORIGINAL, BMP_BLUR, BMP_CONTRAST, BMP_FLIPVERT,
+    BMP_IMPULSE, BMP_JPG, BMP_MEANSHIFT
+};
+
+static const char *courtright_files[] = {
+    BMP_CR_ORIGINAL, BMP_CR_NOISE
+};
+
 static int _test_ssim_22x15(int gaussian, const struct answer *answers, const struct iqa_ssim_args *args);
 static int _test_ssim_einstein_bmp(int gaussian, const struct answer *answers, const struct iqa_ssim_args *args);
 static int _test_ssim_courtright_bmp(int gaussian, const struct answer *answers, const struct iqa_ssim_args *args);
+static int _test_ssim_model_reuse(const char *ref_file, const char **files, int count, int gaussian);
 
 /*----------------------------------------------------------------------------
  * Test wrapper function that provides iqa_ssim compatible interface
@@ -523,6 +537,9 @@ int test_fast_ssim()
     failure += _test_ssim_einstein_bmp(0, ans_key_einstein_linear, 0);
     failure += _test_ssim_einstein_bmp(1, ans_key_einstein_args, &ssim_args);
     failure += _test_ssim_courtright_bmp(1, ans_key_courtright, 0);
+    failure += _test_ssim_model_reuse(BMP_ORIGINAL, einstein_files, 7, 0);
+    failure += _test_ssim_model_reuse(BMP_ORIGINAL, einstein_files, 7, 1);
+    failure += _test_ssim_model_reuse(BMP_CR_ORIGINAL, courtright_files, 2, 0);
 
     return failure;
 }
@@ -818,3 +835,55 @@ int _test_ssim_courtright_bmp(int gaussian, const struct answer *answers, const
     free_bmp(&orig);
     return failures;
 }
+
+/*----------------------------------------------------------------------------
+ * _test_ssim_model_reuse
+ *
+ * A single model is compared against several distorted images, the way the
+ * recompress quality search uses it. Every score must be bit-identical to
+ * iqa_ssim() on the same pair.
+ *---------------------------------------------------------------------------*/
+int _test_ssim_model_reuse(const char *ref_file, const char **files, int count, int gaussian)
+{
+    struct bmp orig, cmp;
+    fast_ssim_model *model;
+    int idx, failures = 0;
+    float expected, result;
+
+    printf("\tModel reuse, %s (%s):\n", ref_file, gaussian ? "Gaussian" : "Linear");
+
+    if (load_bmp(ref_file, &orig))
+    {
+        printf("FAILED to load \'%s\'\n", ref_file);
+        return 1;
+    }
+
+    model = fast_ssim_create_model(orig.img, orig.w, orig.h, orig.stride, gaussian, 0);
+    if (!model)
+    {
+        printf("\t  FAILED to create model\n");
+        free_bmp(&orig);
+        return 1;
+    }
+
+    for (idx = 0; idx < count; ++idx)
+    {
+        printf("\t  %s: ", files[idx]);
+        if (load_bmp(files[idx], &cmp))
+        {
+            printf("FAILED to load \'%s\'\n", files[idx]);
+            failures++;
+            continue;
+        }
+        expected = iqa_ssim(orig.img, cmp.img, orig.w, orig.h, orig.stride, gaussian, 0);
+        result = fast_ssim_compare(model, cmp.img, cmp.stride);
+        printf("\t%.8f vs %.8f\t%s\n", result, expected,
+               result == expected ? "PASS" : "FAILED");
+        failures += result == expected ? 0 : 1;
+        free_bmp(&cmp);
+    }
+
+    fast_ssim_destroy_model(model);
+    free_bmp(&orig);
+    return failures;
+}
@@ -33,6 +33,7 @@
 
 #include "test_ms_ssim.h"
 #include "iqa.h"
+#include "ms_ssim.h"
 #include "convolve.h"
 #include "bmp.h"
 #include "hptime.h"
@@ -102,32 +103,37 @@ struct answer {
     int   precision;    /**< Digits of precision */
 };
 
+/*
+ * NOTE: The Gaussian window and the low-pass filter are now outer products
+ * of their 1-D factors instead of 6-decimal tables, which moved some values
+ * in the last digit.
+ */
 static const struct answer ans_key_einstein_def[] = {
     {1.00000f, 5},  /* Identical */
-    {0.85324f, 5},  /* Blur */
+    {0.85323f, 5},  /* Blur */
     {0.96787f, 5},  /* Contrast */
     {0.12226f, 5},  /* Flip Vertical */
     {0.92878f, 5},  /* Impulse */
-    {0.76612f, 5},  /* JPEG */
+    {0.76615f, 5},  /* JPEG */
     {0.99937f, 5},  /* Mean Shift */
 };
 
 static const struct answer ans_key_einstein_wang[] = {
     {1.00000f, 5},  /* Identical */
-    {0.91875f, 5},  /* Blur */
+    {0.91873f, 5},  /* Blur */
     {0.97275f, 5},  /* Contrast */
-    {0.25467f, 5},  /* Flip Vertical */
-    {0.95357f, 5},  /* Impulse */
-    {0.89226f, 4},  /* JPEG (rounding error on last digit) */
+    {0.25466f, 5},  /* Flip Vertical */
+    {0.95356f, 5},  /* Impulse */
+    {0.89224f, 4},  /* JPEG (rounding error on last digit) */
     {0.99938f, 5},  /* Mean Shift */
 };
 
 static const struct answer ans_key_einstein_linear[] = {
     {1.00000f, 5},  /* Identical */
-    {0.88482f, 5},  /* Blur */
+    {0.88481f, 5},  /* Blur */
     {0.96774f, 5},  /* Contrast */
     {0.13595f, 5},  /* Flip Vertical */
-    {0.93071f, 5},  /* Impulse */
+    {0.93070f, 5},  /* Impulse */
     {0.79850f, 2},  /* JPEG (rounding error on last digits) */
     {0.99926f, 5},  /* Mean Shift */
 };
@@ -136,7 +142,7 @@ static const struct answer ans_key_einstein_scale4[] = {
     {1.00000f, 5},  /* Identical */
     {0.72383f, 5},  /* Blur */
     {0.96678f, 5},  /* Contrast */
-    {0.09137f, 5},  /* Flip Vertical */
+    {0.09138f, 5},  /* Flip Vertical */
     {0.88489f, 5},  /* Impulse */
     {0.61626f, 4},  /* JPEG (rounding error on last digit) */
     {0.99863f, 5},  /* Mean Shift */
@@ -144,7 +150,7 @@ static const struct answer ans_key_einstein_scale4[] = {
 
 static const struct answer ans_key_courtright[] = {
     {1.00000f, 5},    /* Identical */
-    {0.59030f, 5},    /* Noise */
+    {0.59035f, 5},    /* Noise */
 };
 
 static const struct answer ans_key_skate[] = {
@@ -168,6 +174,12 @@ static int _test_einstein_bmp(const struct answer *answers, const struct iqa_ms_
 static int _test_courtright_bmp(const struct answer *answers, const struct iqa_ms_ssim_args *args, const char* str);
 static int _test_skate_bmp(const struct answer *answers, const struct iqa_ms_ssim_args *args, const char* str);
 static int _test_h_greater_than_w(const char* str); /* Regression test for bug 3349231 */
+static int _test_model_reuse(const char *ref_file, const char **files, int count, const struct iqa_ms_ssim_args *args, const char* str);
+
+static const char *einstein_files[] = {
+    BMP_ORIGINAL, BMP_BLUR, BMP_CONTRAST, BMP_FLIPVERT, BMP_IMPULSE, BMP_JPG, BMP_MEANSHIFT
+};
+static const char *courtright_files[] = { BMP_CR_ORIGINAL, BMP_CR_NOISE };
 
 /*----------------------------------------------------------------------------
  * TEST ENTRY POINT
@@ -185,6 +197,11 @@ int test_ms_ssim()
     failure += _test_courtright_bmp(ans_key_courtright, 0, "Rouse/Hemami");
     failure += _test_skate_bmp(ans_key_skate, 0, "Buffer overflow [#3288043]");
     failure += _test_h_greater_than_w("Height greater than width [#3349231]");
+    failure += _test_model_reuse(BMP_ORIGINAL, einstein_files, 7, 0, "Rouse/Hemami");
+    failure += _test_model_reuse(BMP_ORIGINAL, einstein_files, 7, &args_wang, "Wang");
+    failure += _test_model_reuse(BMP_ORIGINAL, einstein_files, 7, &args_linear, "Linear 8x8 Window");
+    failure += _test_model_reuse(BMP_ORIGINAL, einstein_files, 7, &args_scale4, "Custom scale = 4");
+    failure += _test_model_reuse(BMP_CR_ORIGINAL, courtright_files, 2, 0, "Rouse/Hemami");
 
     return failure;
 }
@@ -471,4 +488,56 @@ int _test_h_greater_than_w(const char* str)
 
     free_bmp(&orig);
     return failures;
-}
\ No newline at end of file
+}
+
+/*----------------------------------------------------------------------------
+ * _test_model_reuse
+ *---------------------------------------------------------------------------*/
+int _test_model_reuse(const char *ref_file, const char **files, int count, const struct iqa_ms_ssim_args *args, const char* str)
+{
+    struct bmp orig, cmp;
+    ms_ssim_model *model;
+    int idx, failures = 0;
+    float expected, result;
+    double model_ms, full_ms;
+    unsigned long long start, end;
+
+    printf("\tModel reuse, %s (%s):\n", ref_file, str);
+
+    if (load_bmp(ref_file, &orig)) {
+        printf("FAILED to load \'%s\'\n", ref_file);
+        return 1;
+    }
+
+    model = ms_ssim_create_model(orig.img, orig.w, orig.h, orig.stride, args);
+    if (!model) {
+        printf("\t  FAILED to create model\n");
+        free_bmp(&orig);
+        return 1;
+    }
+
+    for (idx = 0; idx < count; ++idx) {
+        printf("\t  %s: ", files[idx]);
+        if (load_bmp(files[idx], &cmp)) {
+            printf("FAILED to load \'%s\'\n", files[idx]);
+            failures++;
+            continue;
+        }
+        start = hpt_get_time();
+        expected = iqa_ms_ssim(orig.img, cmp.img, orig.w, orig.h, orig.stride, args);
+        end = hpt_get_time();
+        full_ms = hpt_elapsed_time(start,end,hpt_get_frequency()) * 1000.0;
+        start = hpt_get_time();
+        result = ms_ssim_compare(model, cmp.img, cmp.stride);
+        end = hpt_get_time();
+        model_ms = hpt_elapsed_time(start,end,hpt_get_frequency()) * 1000.0;
+        printf("\t%.8f vs %.8f  (%.3lf ms, full %.3lf ms)\t%s\n", result, expected,
+            model_ms, full_ms, result == expected ? "PASS" : "FAILED");
+        failures += result == expected ? 0 : 1;
+        free_bmp(&cmp);
+    }
+
+    ms_ssim_destroy_model(model);
+    free_bmp(&orig);
+    return failures;
+}
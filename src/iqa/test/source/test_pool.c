@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2011, Tom Distler (http://tdistler.com)
+ * All rights reserved.
+ *
+ * The BSD License
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice, 
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * - Neither the name of the tdistler.com nor the names of its contributors may
+ *   be used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "test_pool.h"
+#include "pool.h"
+#include "iqa.h"
+#include "fast_ssim.h"
+#include "bmp.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NUM_JOBS 100
+#define NUM_NESTED 10
+
+static int _test_pool_jobs();
+static int _test_pool_bands();
+static int _test_pool_metrics();
+
+/*----------------------------------------------------------------------------
+ * TEST ENTRY POINT
+ *---------------------------------------------------------------------------*/
+int test_pool()
+{
+    int failure = 0;
+
+    printf("\nThread Pool:\n");
+    failure += _test_pool_jobs();
+    failure += _test_pool_bands();
+    failure += _test_pool_metrics();
+
+    iqa_set_threads(1);
+    return failure;
+}
+
+/* Each job counts itself, and the nested jobs count themselves too */
+static int g_runs[NUM_JOBS][NUM_NESTED+1];
+
+static void _nested_job(int job, void *ctx)
+{
+    ++((int*)ctx)[job+1];
+}
+
+static void _count_job(int job, void *ctx)
+{
+    ++g_runs[job][0];
+    if (job % 10 == 0)
+        _iqa_pool_run(NUM_NESTED, _nested_job, g_runs[job]);
+}
+
+/*----------------------------------------------------------------------------
+ * _test_pool_jobs
+ *---------------------------------------------------------------------------*/
+int _test_pool_jobs()
+{
+    int job, idx, threads, passed, failures=0;
+    static const int counts[] = { 1, 4 };
+
+    for (idx=0; idx<2; ++idx) {
+        threads = counts[idx];
+        printf("\t  %i thread(s), nested: ", threads);
+        memset(g_runs, 0, sizeof(g_runs));
+        passed = iqa_set_threads(threads) == 0;
+        _iqa_pool_run(NUM_JOBS, _count_job, 0);
+        for (job=0; job<NUM_JOBS; ++job) {
+            if (g_runs[job][0] != 1)
+                passed = 0;
+            for (threads=1; threads<=NUM_NESTED; ++threads) {
+                if (g_runs[job][threads] != (job % 10 == 0 ? 1 : 0))
+                    passed = 0;
+            }
+        }
+        printf("\t%s\n", passed?"PASS":"FAILED");
+        failures += passed?0:1;
+    }
+    return failures;
+}
+
+/*----------------------------------------------------------------------------
+ * _test_pool_bands
+ *---------------------------------------------------------------------------*/
+int _test_pool_bands()
+{
+    int rows, passed;
+
+    printf("\t  row bands: ");
+    passed = _iqa_bands(0, &rows) == 0 &&
+        _iqa_bands(10, &rows) == 1 && rows == IQA_BAND_MIN_ROWS &&
+        _iqa_bands(IQA_BAND_MIN_ROWS+1, &rows) == 2 &&
+        _iqa_bands(100*IQA_BAND_MAX, &rows) == IQA_BAND_MAX && rows == 100 &&
+        _iqa_bands(100*IQA_BAND_MAX+1, &rows) == IQA_BAND_MAX && rows == 101;
+    printf("\t\t%s\n", passed?"PASS":"FAILED");
+    return passed?0:1;
+}
+
+/*----------------------------------------------------------------------------
+ * _test_pool_metrics
+ *---------------------------------------------------------------------------*/
+int _test_pool_metrics()
+{
+    struct bmp orig, cmp;
+    int idx, passed, failures=0;
+    float expected[5], result[5];
+    struct iqa_ssim_args args;
+    fast_ssim_model *model;
+    static const int counts[] = { 1, 3, 0 };
+
+    if (load_bmp("einstein.bmp", &orig)) {
+        printf("FAILED to load \'einstein.bmp\'\n");
+        return 1;
+    }
+    if (load_bmp("blur.bmp", &cmp)) {
+        printf("FAILED to load \'blur.bmp\'\n");
+        free_bmp(&orig);
+        return 1;
+    }
+    args.alpha = 1.0f;
+    args.beta = 0.5f;
+    args.gamma = 1.0f;
+    args.L = 255;
+    args.K1 = 0.01f;
+    args.K2 = 0.03f;
+    args.f = 1;
+
+    /* Whole metrics must match the single-threaded results bit for bit */
+    for (idx=0; idx<3; ++idx) {
+        float *out = idx ? result : expected;
+        iqa_set_threads(counts[idx]);
+        out[0] = iqa_ssim(orig.img, cmp.img, orig.w, orig.h, orig.stride, 1, 0);
+        out[1] = iqa_ssim(orig.img, cmp.img, orig.w, orig.h, orig.stride, 0, &args);
+        out[2] = iqa_ms_ssim(orig.img, cmp.img, orig.w, orig.h, orig.stride, 0);
+        out[3] = INFINITY;
+        out[4] = INFINITY;
+        model = fast_ssim_create_model(orig.img, orig.w, orig.h, orig.stride, 1, &args);
+        if (model) {
+            out[3] = fast_ssim_compare(model, cmp.img, orig.stride);
+            fast_ssim_destroy_model(model);
+        }
+        model = fast_ssim_create_model(orig.img, orig.w, orig.h, orig.stride, 0, 0);
+        if (model) {
+            out[4] = fast_ssim_compare(model, cmp.img, orig.stride);
+            fast_ssim_destroy_model(model);
+        }
+        if (!idx)
+            continue;
+
+        if (counts[idx])
+            printf("\t  einstein.bmp, %i threads: ", counts[idx]);
+        else
+            printf("\t  einstein.bmp, all CPUs: ");
+        passed = memcmp(expected, result, sizeof(result)) == 0;
+        printf("\t%s\n", passed?"PASS":"FAILED");
+        failures += passed?0:1;
+    }
+
+    free_bmp(&orig);
+    free_bmp(&cmp);
+    return failures;
+}
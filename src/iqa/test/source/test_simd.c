@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2011, Tom Distler (http://tdistler.com)
+ * All rights reserved.
+ *
+ * The BSD License
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice, 
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * - Neither the name of the tdistler.com nor the names of its contributors may
+ *   be used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "test_simd.h"
+#include "simd.h"
+#include "iqa.h"
+#include "fast_ssim.h"
+#include "bmp.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Lengths that exercise empty input, the scalar tails and several vectors */
+static const int g_lengths[] = { 0, 1, 3, 17, 67, 1000 };
+#define NUM_LENGTHS (int)(sizeof(g_lengths)/sizeof(g_lengths[0]))
+#define MAX_LEN 1000
+#define KLEN 11
+
+static const char *g_tables[] = { "sse2", "avx2" };
+#define NUM_TABLES (int)(sizeof(g_tables)/sizeof(g_tables[0]))
+
+static int _test_simd_kernels(const struct _iqa_simd *ref, const struct _iqa_simd *t);
+static int _test_simd_metrics(const char *name);
+static int _test_simd_override();
+
+static unsigned int _next(unsigned int *seed)
+{
+    *seed = *seed*1103515245u + 12345u;
+    return (*seed >> 16) & 0x7fff;
+}
+
+/*----------------------------------------------------------------------------
+ * TEST ENTRY POINT
+ *---------------------------------------------------------------------------*/
+int test_simd()
+{
+    int idx, failure = 0;
+    const struct _iqa_simd *active = _iqa_simd();
+    const struct _iqa_simd *scalar = _iqa_simd_find("scalar");
+    const struct _iqa_simd *table;
+
+    printf("\nSIMD (active: %s):\n", active->name);
+    for (idx=0; idx<NUM_TABLES; ++idx) {
+        table = _iqa_simd_find(g_tables[idx]);
+        if (!table) {
+            printf("\t%s: not supported, skipped\n", g_tables[idx]);
+            continue;
+        }
+        failure += _test_simd_kernels(scalar, table);
+        failure += _test_simd_metrics(g_tables[idx]);
+    }
+    failure += _test_simd_override();
+
+    _iqa_simd_select(active->name);
+    return failure;
+}
+
+/*----------------------------------------------------------------------------
+ * _test_simd_kernels
+ *---------------------------------------------------------------------------*/
+int _test_simd_kernels(const struct _iqa_simd *ref, const struct _iqa_simd *t)
+{
+    int idx, len, passed, failures=0;
+    unsigned int seed = 17;
+    static unsigned char a[MAX_LEN], b[MAX_LEN];
+    static float f[5][MAX_LEN+KLEN], f_ref[MAX_LEN], f_t[MAX_LEN];
+    static double d[MAX_LEN], d_ref[MAX_LEN], d_t[MAX_LEN];
+    float k[KLEN];
+
+    for (idx=0; idx<MAX_LEN; ++idx) {
+        a[idx] = (unsigned char)_next(&seed);
+        b[idx] = (unsigned char)_next(&seed);
+        d[idx] = _next(&seed) / 7.0;
+    }
+    for (idx=0; idx<MAX_LEN+KLEN; ++idx) {
+        f[0][idx] = _next(&seed) / 128.0f;                  /* means: 0-255 */
+        f[1][idx] = _next(&seed) / 128.0f;
+        f[2][idx] = _next(&seed) / 16.0f - 64.0f;           /* (co)variances, */
+        f[3][idx] = _next(&seed) / 16.0f - 64.0f;           /* a few negative */
+        f[4][idx] = _next(&seed) / 16.0f - 64.0f;
+    }
+    for (idx=0; idx<KLEN; ++idx)
+        k[idx] = _next(&seed) / 32768.0f - 0.25f;
+
+    printf("\t%s vs scalar:\n", t->name);
+
+    printf("\t  u8_to_float: ");
+    passed = 1;
+    for (idx=0; idx<NUM_LENGTHS; ++idx) {
+        len = g_lengths[idx];
+        ref->u8_to_float(a, f_ref, len);
+        t->u8_to_float(a, f_t, len);
+        passed = passed && memcmp(f_ref, f_t, len*sizeof(float)) == 0;
+    }
+    printf("\t\t%s\n", passed?"PASS":"FAILED");
+    failures += passed?0:1;
+
+    printf("\t  conv_row: ");
+    passed = 1;
+    for (idx=0; idx<NUM_LENGTHS; ++idx) {
+        len = g_lengths[idx];
+        ref->conv_row(f[0], k, KLEN, d_ref, len);
+        t->conv_row(f[0], k, KLEN, d_t, len);
+        passed = passed && memcmp(d_ref, d_t, len*sizeof(double)) == 0;
+    }
+    printf("\t\t%s\n", passed?"PASS":"FAILED");
+    failures += passed?0:1;
+
+    printf("\t  conv_col: ");
+    passed = 1;
+    for (idx=0; idx<NUM_LENGTHS; ++idx) {
+        len = g_lengths[idx];
+        memcpy(d_ref, d, sizeof(d));
+        memcpy(d_t, d, sizeof(d));
+        ref->conv_col(d_ref, d + MAX_LEN - len, k[0], len);
+        t->conv_col(d_t, d + MAX_LEN - len, k[0], len);
+        ref->conv_col_f(d_ref, f[2], k[1], len);
+        t->conv_col_f(d_t, f[2], k[1], len);
+        passed = passed && memcmp(d_ref, d_t, sizeof(d)) == 0;
+    }
+    printf("\t\t%s\n", passed?"PASS":"FAILED");
+    failures += passed?0:1;
+
+    printf("\t  ssim_sum: ");
+    passed = 1;
+    for (idx=0; idx<NUM_LENGTHS; ++idx) {
+        len = g_lengths[idx];
+        passed = passed &&
+            ref->ssim_sum(f[0], f[1], f[2], f[3], f[4], len, 6.5025f, 58.5225f, 0.5) ==
+            t->ssim_sum(f[0], f[1], f[2], f[3], f[4], len, 6.5025f, 58.5225f, 0.5);
+    }
+    printf("\t\t%s\n", passed?"PASS":"FAILED");
+    failures += passed?0:1;
+
+    printf("\t  sqr_err_u8: ");
+    passed = 1;
+    for (idx=0; idx<NUM_LENGTHS; ++idx) {
+        len = g_lengths[idx];
+        passed = passed && ref->sqr_err_u8(a, b, len) == t->sqr_err_u8(a, b, len);
+    }
+    printf("\t\t%s\n", passed?"PASS":"FAILED");
+    failures += passed?0:1;
+
+    return failures;
+}
+
+/*----------------------------------------------------------------------------
+ * _test_simd_metrics
+ *---------------------------------------------------------------------------*/
+int _test_simd_metrics(const char *name)
+{
+    struct bmp orig, cmp;
+    int idx, passed, failures=0;
+    float expected[5], result[5];
+    fast_ssim_model *model;
+    const char *tables[2];
+
+    if (load_bmp("einstein.bmp", &orig)) {
+        printf("FAILED to load \'einstein.bmp\'\n");
+        return 1;
+    }
+    if (load_bmp("jpg.bmp", &cmp)) {
+        printf("FAILED to load \'jpg.bmp\'\n");
+        free_bmp(&orig);
+        return 1;
+    }
+
+    /* Whole metrics must match the scalar build bit for bit */
+    tables[0] = "scalar";
+    tables[1] = name;
+    for (idx=0; idx<2; ++idx) {
+        float *out = idx ? result : expected;
+        _iqa_simd_select(tables[idx]);
+        out[0] = iqa_ssim(orig.img, cmp.img, orig.w, orig.h, orig.stride, 1, 0);
+        out[1] = iqa_ssim(orig.img, cmp.img, orig.w, orig.h, orig.stride, 0, 0);
+        out[2] = iqa_ms_ssim(orig.img, cmp.img, orig.w, orig.h, orig.stride, 0);
+        out[3] = iqa_mse(orig.img, cmp.img, orig.w, orig.h, orig.stride);
+        out[4] = INFINITY;
+        model = fast_ssim_create_model(orig.img, orig.w, orig.h, orig.stride, 1, 0);
+        if (model) {
+            out[4] = fast_ssim_compare(model, cmp.img, orig.stride);
+            fast_ssim_destroy_model(model);
+        }
+    }
+
+    printf("\t  einstein.bmp metrics: ");
+    passed = memcmp(expected, result, sizeof(result)) == 0;
+    printf("\t%s\n", passed?"PASS":"FAILED");
+    failures += passed?0:1;
+
+    free_bmp(&orig);
+    free_bmp(&cmp);
+    return failures;
+}
+
+/*----------------------------------------------------------------------------
+ * _test_simd_override
+ *---------------------------------------------------------------------------*/
+int _test_simd_override()
+{
+    int passed, failures=0;
+    static char env_scalar[] = "IQA_SIMD=scalar";
+    static char env_bogus[] = "IQA_SIMD=bogus";
+    static char env_clear[] = "IQA_SIMD=";
+
+    printf("\tIQA_SIMD override:\n");
+
+    printf("\t  scalar forced: ");
+    putenv(env_scalar);
+    passed = _iqa_simd_select(0) == 0 && strcmp(_iqa_simd()->name, "scalar") == 0;
+    printf("\t\t%s\n", passed?"PASS":"FAILED");
+    failures += passed?0:1;
+
+    printf("\t  unknown ignored: ");
+    putenv(env_bogus);
+    passed = _iqa_simd_select(0) == 0 && _iqa_simd_select("bogus") == 1 &&
+        _iqa_simd_find(_iqa_simd()->name) == _iqa_simd();
+    printf("\t\t%s\n", passed?"PASS":"FAILED");
+    failures += passed?0:1;
+
+    putenv(env_clear);
+    return failures;
+}
@@ -39,6 +39,7 @@
 #include "math_utils.h"
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
 
 static const int img_width = 22;
 static const int img_height = 15;
@@ -76,6 +77,11 @@ static const struct iqa_ssim_args ssim_args = {
     1           /* factor */
 };
 
+static const struct iqa_ssim_args ssim_args_f2 = {
+    1.0f, 1.0f, 1.0f, 255, 0.01f, 0.03f,
+    2           /* factor */
+};
+
 
 /* Defines the answer format */
 struct answer {
@@ -101,12 +107,16 @@ static const struct answer ans_key_22x15_args[] = {
     {0.67986f, 5},    /* 2x2 low-pass filter */
 };
 
+/*
+ * NOTE: The Gaussian window is now the outer product of its 1-D factor
+ * instead of a 6-decimal table, which moved some values in the last digit.
+ */
 static const struct answer ans_key_einstein_gauss[] = {
     {1.00000f, 5},  /* Identical */
     {0.69408f, 5},  /* Blur */
     {0.91327f, 5},  /* Contrast */
-    {0.28771f, 5},  /* Flip Vertical */
-    {0.83957f, 5},  /* Impulse */
+    {0.28772f, 5},  /* Flip Vertical */
+    {0.83958f, 5},  /* Impulse */
     {0.66246f, 5},  /* JPEG */
     {0.98836f, 5},  /* Mean Shift */
 };
@@ -124,9 +134,9 @@ static const struct answer ans_key_einstein_linear[] = {
 /* NOTE: Values verified. Different from Octave due to float precision. */
 static const struct answer ans_key_einstein_args[] = {
     {1.00000f, 5},    /* Identical */
-    {0.56509f, 5},    /* Blur */
+    {0.56510f, 5},    /* Blur */
     {0.94412f, 5},    /* Contrast */
-    {0.13106f, 5},    /* Flip Vertical */
+    {0.13107f, 5},    /* Flip Vertical */
     {0.81263f, 5},    /* Impulse */
     {0.50202f, 4},    /* JPEG (rounding error on 64-bit)*/
     {0.99542f, 5},    /* Mean Shift */
@@ -151,6 +161,7 @@ static const struct answer ans_key_courtright[] = {
 static int _test_ssim_22x15(int gaussian, const struct answer *answers, const struct iqa_ssim_args *args);
 static int _test_ssim_einstein_bmp(int gaussian, const struct answer *answers, const struct iqa_ssim_args *args);
 static int _test_ssim_courtright_bmp(int gaussian, const struct answer *answers, const struct iqa_ssim_args *args);
+static int _test_ssim_u8(const char *label, const char *bmp_ref, const char *bmp_cmp, const struct iqa_ssim_args *args);
 
 
 /*----------------------------------------------------------------------------
@@ -169,6 +180,13 @@ int test_ssim()
     failure += _test_ssim_einstein_bmp(1, ans_key_einstein_args, &ssim_args);
     failure += _test_ssim_courtright_bmp(1, ans_key_courtright, 0);
 
+    printf("\tInteger SSIM (iqa_ssim_u8 vs. iqa_ssim linear):\n");
+    failure += _test_ssim_u8("Einstein Jpeg", BMP_ORIGINAL, BMP_JPG, 0);
+    failure += _test_ssim_u8("Einstein Impulse", BMP_ORIGINAL, BMP_IMPULSE, 0);
+    failure += _test_ssim_u8("Einstein Blur 2x", BMP_ORIGINAL, BMP_BLUR, &ssim_args_f2);
+    failure += _test_ssim_u8("Einstein Args", BMP_ORIGINAL, BMP_JPG, &ssim_args);
+    failure += _test_ssim_u8("Courtright Noise", BMP_CR_ORIGINAL, BMP_CR_NOISE, 0);
+
     return failure;
 }
 
@@ -440,3 +458,45 @@ int _test_ssim_courtright_bmp(int gaussian, const struct answer *answers, const
     return failures;
 }
 
+/*----------------------------------------------------------------------------
+ * _test_ssim_u8
+ *---------------------------------------------------------------------------*/
+int _test_ssim_u8(const char *label, const char *bmp_ref, const char *bmp_cmp, const struct iqa_ssim_args *args)
+{
+    struct bmp orig, cmp;
+    int passed;
+    float expected, result;
+    double float_ms, u8_ms;
+    unsigned long long start, end;
+
+    printf("\t  %s: ", label);
+    if (load_bmp(bmp_ref, &orig)) {
+        printf("FAILED to load \'%s\'\n", bmp_ref);
+        return 1;
+    }
+    if (load_bmp(bmp_cmp, &cmp)) {
+        printf("FAILED to load \'%s\'\n", bmp_cmp);
+        free_bmp(&orig);
+        return 1;
+    }
+
+    start = hpt_get_time();
+    expected = iqa_ssim(orig.img, cmp.img, orig.w, orig.h, orig.stride, 0, args);
+    end = hpt_get_time();
+    float_ms = hpt_elapsed_time(start,end,hpt_get_frequency()) * 1000.0;
+
+    start = hpt_get_time();
+    result = iqa_ssim_u8(orig.img, cmp.img, orig.w, orig.h, orig.stride, args);
+    end = hpt_get_time();
+    u8_ms = hpt_elapsed_time(start,end,hpt_get_frequency()) * 1000.0;
+
+    passed = fabs((double)result - expected) <= 1e-6;
+    printf("\t%.7f  (%.3lf ms, float %.3lf ms)\t%s\n",
+        result, u8_ms, float_ms,
+        passed?"PASS":"FAILED");
+
+    free_bmp(&cmp);
+    free_bmp(&orig);
+    return passed?0:1;
+}
+
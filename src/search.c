@@ -0,0 +1,213 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "search.h"
+
+void qualitySearchInit(struct qualitySearch *search, int min, int max, float target, int lowerIsBetter) {
+    search->min = min;
+    search->max = max;
+    search->target = target;
+    search->lowerIsBetter = lowerIsBetter;
+    search->width = max - min;
+    search->predicted = 0;
+    search->bisect = 0;
+    search->fails = 0;
+    search->passes = 0;
+}
+
+/*
+    Get the lowest quality at or above where the line through a and b
+    meets the target, or 0 if the line can't be trusted (flat, or the
+    metric gets worse with higher quality).
+*/
+static int predict(const struct qualitySearch *search, const struct searchPoint *a, const struct searchPoint *b) {
+    double slope = (double) (b->metric - a->metric) / (b->quality - a->quality);
+    double crossing;
+
+    if (search->lowerIsBetter ? !(slope < 0) : !(slope > 0))
+        return 0;
+
+    crossing = a->quality + (search->target - a->metric) / slope;
+    if (!isfinite(crossing))
+        return 0;
+    if (crossing < search->min)
+        return search->min;
+    if (crossing > search->max)
+        return search->max;
+    return (int) ceil(crossing);
+}
+
+int qualitySearchNext(struct qualitySearch *search) {
+    int quality = 0;
+
+    if (search->min >= search->max)
+        return 0;
+
+    if (search->fails && search->passes) {
+        quality = predict(search, &search->fail[0], &search->pass[0]);
+
+        // The crossing is next to a measured quality. Like the last step
+        // of a bisection, what is left is at most one quality step, so
+        // take the prediction instead of measuring it.
+        if (quality <= search->min || quality >= search->max - 1) {
+            search->min = quality;
+            search->max = quality;
+            return 0;
+        }
+    } else if (search->fails == 2) {
+        quality = predict(search, &search->fail[1], &search->fail[0]);
+    } else if (search->passes == 2) {
+        quality = predict(search, &search->pass[0], &search->pass[1]);
+    }
+
+    search->predicted = quality && !search->bisect;
+    if (search->predicted) {
+        // Qualities at or above max are known to meet the target
+        if (quality > search->max - 1)
+            quality = search->max - 1;
+    } else {
+        quality = search->min + (search->max - 1 - search->min) / 2;
+    }
+
+    search->width = search->max - search->min;
+    return quality;
+}
+
+void qualitySearchUpdate(struct qualitySearch *search, int quality, float metric) {
+    int meets = search->lowerIsBetter ? metric < search->target : metric >= search->target;
+
+    if (meets) {
+        search->pass[1] = search->pass[0];
+        search->pass[0].quality = quality;
+        search->pass[0].metric = metric;
+        search->passes = (search->passes < 2) ? search->passes + 1 : 2;
+        search->max = quality;
+    } else {
+        search->fail[1] = search->fail[0];
+        search->fail[0].quality = quality;
+        search->fail[0].metric = metric;
+        search->fails = (search->fails < 2) ? search->fails + 1 : 2;
+        search->min = quality + 1;
+    }
+
+    // Safeguard: fall back to bisection when a prediction was poor
+    search->bisect = search->predicted && (search->max - search->min) * 2 > search->width;
+}
+
+int clampToSource(int min, int *max, int quality) {
+    int limit = quality + SOURCE_QUALITY_MARGIN;
+
+    if (!quality)
+        return 1;
+    if (limit < min)
+        return 0;
+    if (limit < *max)
+        *max = limit;
+
+    return 1;
+}
+
+int proxyFactor(int width, int height, int factor, int attempts) {
+    int size = (width < height) ? width : height;
+    int result = 1;
+
+    if (attempts < PROXY_FULL_STEPS + 2)
+        return 1;
+
+    while (result < 8 && result * 2 <= factor && size / (result * 2) >= PROXY_MIN_SIZE)
+        result *= 2;
+
+    return result;
+}
+
+int proxySsimScale(int width, int height, int factor) {
+    int size = (width < height) ? width : height;
+    int scale = (int)(size / 256.0f + 0.5f);
+    int proxyScale = (int)((float)scale / factor + 0.5f);
+
+    return (proxyScale > 1) ? proxyScale : 1;
+}
+
+float proxyTarget(float target, float metric, float proxyMetric) {
+    if (metric >= 1.0f || proxyMetric >= 1.0f)
+        return target;
+
+    return 1.0f - (1.0f - target) * (1.0f - proxyMetric) / (1.0f - metric);
+}
+
+int tileSize(int width, int height) {
+    int step = 16 * proxySsimScale(width, height, 1);
+    int size = step;
+
+    while (size < TILE_MIN_SIZE)
+        size += step;
+
+    return size;
+}
+
+static int compareVariance(const void *a, const void *b) {
+    const struct tile *ta = a;
+    const struct tile *tb = b;
+
+    if (ta->variance != tb->variance)
+        return (ta->variance < tb->variance) ? -1 : 1;
+    if (ta->y != tb->y)
+        return ta->y - tb->y;
+    return ta->x - tb->x;
+}
+
+static int compareRaster(const void *a, const void *b) {
+    const struct tile *ta = a;
+    const struct tile *tb = b;
+
+    if (ta->y != tb->y)
+        return ta->y - tb->y;
+    return ta->x - tb->x;
+}
+
+int tileSample(const unsigned char *gray, int width, int height, int size, int count, struct tile *tiles) {
+    int columns = width / size;
+    int rows = height / size;
+    int total = columns * rows;
+    int n = size * size;
+
+    if (count > total)
+        count = total;
+    if (count <= 0)
+        return 0;
+
+    for (int ty = 0; ty < rows; ty++) {
+        for (int tx = 0; tx < columns; tx++) {
+            struct tile *t = &tiles[ty * columns + tx];
+            long long sum = 0, sumSquares = 0;
+
+            for (int y = ty * size; y < (ty + 1) * size; y++) {
+                const unsigned char *row = gray + (long)y * width + tx * size;
+                for (int x = 0; x < size; x++) {
+                    sum += row[x];
+                    sumSquares += row[x] * row[x];
+                }
+            }
+            t->x = tx * size;
+            t->y = ty * size;
+            t->variance = (float)(sumSquares - sum * sum / (double)n) / n;
+        }
+    }
+
+    // The middle tile of each stratum. The source index grows faster than
+    // the destination, so the tiles can be moved in place.
+    qsort(tiles, total, sizeof(struct tile), compareVariance);
+    for (int i = 0; i < count; i++)
+        tiles[i] = tiles[(long)(2 * i + 1) * total / (2 * count)];
+
+    qsort(tiles, count, sizeof(struct tile), compareRaster);
+    return count;
+}
+
+void tileMosaic(const unsigned char *gray, int width, const struct tile *tiles, int count, int size, unsigned char *mosaic) {
+    for (int i = 0; i < count; i++) {
+        for (int y = 0; y < size; y++)
+            memcpy(mosaic + ((long)i * size + y) * size, gray + (long)(tiles[i].y + y) * width + tiles[i].x, size);
+    }
+}
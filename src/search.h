@@ -0,0 +1,155 @@
+/*
+    Quality search strategies
+*/
+#ifndef SEARCH_H
+#define SEARCH_H
+
+enum SEARCH_METHOD {
+    // Halve the quality interval after each encode
+    SEARCH_BISECT,
+    // Predict the quality where the metric crosses the target from
+    // the values measured so far
+    SEARCH_INTERPOLATE
+};
+
+struct searchPoint {
+    int quality;
+    float metric;
+};
+
+/*
+    State of an interpolating quality search. It looks for the lowest
+    quality whose metric meets the target, which lies in [min, max].
+    The two nearest measurements on each side of it are kept to fit the
+    metric curve.
+*/
+struct qualitySearch {
+    int min;
+    int max;
+    float target;
+    int lowerIsBetter;
+    int width;
+    int predicted;
+    int bisect;
+    int fails;
+    int passes;
+    struct searchPoint fail[2];
+    struct searchPoint pass[2];
+};
+
+/*
+    Start a search for the lowest quality in [min, max] that meets the
+    target. If lowerIsBetter is set, the metric is an error (like MPE)
+    and meets the target when below it, otherwise it is a similarity and
+    meets the target when at least equal to it.
+*/
+void qualitySearchInit(struct qualitySearch *search, int min, int max, float target, int lowerIsBetter);
+
+/*
+    Get the next quality to measure, or 0 once the search is done. The
+    answer is then search->max.
+
+    Once both sides of the answer have been measured, the next quality is
+    where the line through the nearest point on each side crosses the
+    target. With measurements on one side only, the line through the two
+    nearest is extended instead. Whenever a predicted step fails to at
+    least halve the interval, the next step is a plain bisection. The
+    search ends as soon as the line puts the crossing next to a measured
+    quality; the answer is then the predicted one, which can be a step
+    off, just like the last step of a bisection.
+*/
+int qualitySearchNext(struct qualitySearch *search);
+
+/*
+    Record the metric measured at a quality returned by qualitySearchNext.
+*/
+void qualitySearchUpdate(struct qualitySearch *search, int quality, float metric);
+
+/*
+    Source quality clamp. Encoding a JPEG again at a quality above the one
+    it was saved at (see estimateQuality in src/util.h) only spends bits on
+    its artifacts, and the output comes out larger than the source. The
+    margin leaves room for the differences between the tables of encoders
+    and for the savings of optimized coding.
+*/
+#define SOURCE_QUALITY_MARGIN 5
+
+/*
+    Lower *max to the highest quality worth trying for a source saved at
+    'quality' (0 = unknown, nothing changes). Returns 0 if that is below
+    min, so no candidate can get smaller than the source.
+*/
+int clampToSource(int min, int *max, int quality);
+
+/*
+    Reduced-resolution proxies. An SSIM bisection can measure its early
+    steps on the luma scaled down by a factor of 2, 4 or 8, which is
+    several times cheaper to encode, decode and compare. The first step
+    is measured at both resolutions to calibrate the proxy target; the
+    last PROXY_FULL_STEPS steps run at full resolution again to settle
+    the answer.
+*/
+#define PROXY_MIN_SIZE 256
+#define PROXY_FULL_STEPS 2
+
+/*
+    Get the factor to scale a width x height image down by for a search
+    of 'attempts' steps, at most 'factor', keeping the short side of the
+    proxy at least PROXY_MIN_SIZE pixels. Returns 1 when no proxy step
+    would be left between the calibration and the full resolution steps.
+*/
+int proxyFactor(int width, int height, int factor, int attempts);
+
+/*
+    Get the scale factor (iqa_ssim_args.f) for the SSIM model of a proxy,
+    so that it compares at the same resolution as the default model of
+    the full image, which scales by round(min(width, height) / 256).
+*/
+int proxySsimScale(int width, int height, int factor);
+
+/*
+    Get the target for the proxy steps from the SSIM of one quality at
+    full resolution and on the proxy. The losses (1 - SSIM) at the two
+    resolutions are roughly proportional, so the target loss is scaled
+    by their ratio.
+*/
+float proxyTarget(float target, float metric, float proxyMetric);
+
+/*
+    Tile sampling. Instead of the whole image, the intermediate search
+    steps can encode and measure a mosaic of tiles that represent it: the
+    image is cut into a grid of size x size tiles, the tiles are sorted by
+    the variance of their luma and one tile is taken from the middle of
+    each of 'count' equally large strata.
+*/
+#define TILE_MIN_SIZE 64
+
+struct tile {
+    int x;
+    int y;
+    float variance;
+};
+
+/*
+    Tile size for an image: a multiple of 16, so tiles start on MCU
+    boundaries, and of 16 pixels of the scale SSIM compares the image at
+    (see proxySsimScale), so a mosaic compared at that scale still has
+    room for its windows. At least TILE_MIN_SIZE.
+*/
+int tileSize(int width, int height);
+
+/*
+    Pick up to 'count' tiles. 'tiles' needs room for one entry per tile of
+    the grid, (width / size) * (height / size); the picked tiles end up in
+    front, in raster order. Partial tiles on the right and bottom edges
+    are never picked. Returns the number of tiles picked.
+*/
+int tileSample(const unsigned char *gray, int width, int height, int size, int count, struct tile *tiles);
+
+/*
+    Copy the picked tiles into a mosaic of size x (count * size) pixels,
+    stacked from top to bottom.
+*/
+void tileMosaic(const unsigned char *gray, int width, const struct tile *tiles, int count, int size, unsigned char *mosaic);
+
+#endif
@@ -1,13 +1,24 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE  // fileno() and madvise() under -std=c99
+#endif
+
 #include "util.h"
+#include "edit.h"
 
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #ifdef _WIN32
     #include <io.h>
     #include <fcntl.h>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <unistd.h>
 #endif
 
 #define INPUT_BUFFER_SIZE 102400
@@ -31,12 +42,35 @@ void error(const char *format, ...) {
     va_end(arglist);
 }
 
-long readFile(char *name, void **buffer) {
-    FILE *file;
+/* Read a stream into a buffer that doubles as it fills. */
+static long readStream(FILE *file, void **buffer) {
+    size_t capacity = INPUT_BUFFER_SIZE;
     size_t fileLen = 0;
-    size_t bytesRead = 0;
+    size_t bytesRead;
+    unsigned char *data = malloc(capacity);
+
+    while (data && (bytesRead = fread(data + fileLen, 1, capacity - fileLen, file)) > 0) {
+        fileLen += bytesRead;
+        if (fileLen == capacity) {
+            unsigned char *reallocated = realloc(data, capacity * 2);
+            if (!reallocated) {
+                error("only able to read %zu bytes!", fileLen);
+                free(data);
+                data = NULL;
+                break;
+            }
+            data = reallocated;
+            capacity *= 2;
+        }
+    }
 
-    unsigned char chunk[INPUT_BUFFER_SIZE];
+    *buffer = data;
+    return data ? fileLen : 0;
+}
+
+long readFile(char *name, void **buffer) {
+    FILE *file;
+    long fileLen;
 
     // Open file
     if (strcmp("-", name) == 0) {
@@ -58,172 +92,579 @@ long readFile(char *name, void **buffer) {
         }
     }
 
-    *buffer = malloc(sizeof chunk);
-    while ((bytesRead = fread(chunk, 1, sizeof chunk, file)) > 0) {
-        unsigned char *reallocated = realloc(*buffer, fileLen + bytesRead);
-        if (reallocated) {
-            *buffer = reallocated;
-            memmove((unsigned char *)(*buffer) + fileLen, chunk, bytesRead);
-            fileLen += bytesRead;
-        } else {
-            error("only able to read %zu bytes!", fileLen);
-            free(*buffer);
-            fclose(file);
+    fileLen = readStream(file, buffer);
+
+    if (file != stdin)
+        fclose(file);
+    return fileLen;
+}
+
+long mapFile(const char *name, struct inputFile *file) {
+    memset(file, 0, sizeof(*file));
+
+#ifndef _WIN32
+    if (strcmp("-", name) != 0) {
+        struct stat info;
+        int fd = open(name, O_RDONLY);
+
+        if (fd < 0) {
+            error("unable to open file: %s", name);
             return 0;
         }
+
+        // Pipes, devices and files that report no size are read instead
+        if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+            void *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+            if (data != MAP_FAILED) {
+                madvise(data, info.st_size, MADV_SEQUENTIAL);
+                close(fd);
+                file->data = data;
+                file->size = info.st_size;
+                file->mapped = 1;
+                return file->size;
+            }
+        }
+        close(fd);
     }
+#endif
 
-    fclose(file);
-    return fileLen;
+    file->size = readFile((char *)name, (void **)&file->data);
+    return file->size;
+}
+
+void unmapFile(struct inputFile *file) {
+#ifndef _WIN32
+    if (file->mapped) {
+        munmap(file->data, file->size);
+    } else
+#endif
+    free(file->data);
+
+    file->data = NULL;
+    file->size = 0;
+    file->mapped = 0;
+}
+
+int isSameFile(const char *name1, const char *name2) {
+#ifndef _WIN32
+    struct stat info1, info2;
+
+    if (stat(name1, &info1) == 0 && stat(name2, &info2) == 0)
+        return info1.st_dev == info2.st_dev && info1.st_ino == info2.st_ino;
+#endif
+    return strcmp(name1, name2) == 0;
 }
 
 int checkJpegMagic(const unsigned char *buf, unsigned long size) {
     return (size >= 2 && buf[0] == 0xff && buf[1] == 0xd8);
 }
 
-unsigned long decodeJpeg(unsigned char *buf, unsigned long bufSize, unsigned char **image, int *width, int *height, int pixelFormat) {
-    struct jpeg_decompress_struct cinfo;
-    struct jpeg_error_mgr jerr;
-    int row_stride;
-    JSAMPARRAY buffer;
+void codecInit(struct codec *codec) {
+    memset(codec, 0, sizeof(*codec));
+    codec->cinfo.err = jpeg_std_error(&codec->jerr);
+    codec->dinfo.err = &codec->jerr;
+    jpeg_create_compress(&codec->cinfo);
+    jpeg_create_decompress(&codec->dinfo);
+}
 
-    cinfo.err = jpeg_std_error(&jerr);
+void codecFree(struct codec *codec) {
+    jpeg_destroy_compress(&codec->cinfo);
+    jpeg_destroy_decompress(&codec->dinfo);
+    free(codec->image);
+    codec->image = NULL;
+    codec->imageSize = 0;
+}
 
-    jpeg_create_decompress(&cinfo);
+static unsigned long codecDecode(struct codec *codec, unsigned char *buf, unsigned long bufSize, unsigned char **image, unsigned char *luma, int *width, int *height, int pixelFormat) {
+    j_decompress_ptr cinfo = &codec->dinfo;
+    JSAMPROW row_pointer[1];
+    unsigned long row_stride, size;
+    unsigned char *row = NULL;
 
     // Set the source
-    jpeg_mem_src(&cinfo, buf, bufSize);
+    jpeg_mem_src(cinfo, buf, bufSize);
 
     // Read header and set custom parameters
-    jpeg_read_header(&cinfo, TRUE);
+    jpeg_read_header(cinfo, TRUE);
 
-    cinfo.out_color_space = pixelFormat;
+    // With a luma buffer, YCbCr is decoded as is into a scratch row, which
+    // is converted into the image
+    if (luma && cinfo->jpeg_color_space == JCS_YCbCr)
+        row = malloc((unsigned long) cinfo->image_width * 3);
+    cinfo->out_color_space = row ? JCS_YCbCr : pixelFormat;
 
     // Start decompression
-    jpeg_start_decompress(&cinfo);
-
-    *width = cinfo.output_width;
-    *height = cinfo.output_height;
-
-    // Allocate temporary row
-    row_stride = (*width) * cinfo.output_components;
-    buffer = (*cinfo.mem->alloc_sarray)
-        ((j_common_ptr) &cinfo, JPOOL_IMAGE, row_stride, 1);
+    jpeg_start_decompress(cinfo);
+
+    *width = cinfo->output_width;
+    *height = cinfo->output_height;
+
+    // Reuse the image buffer of the last decode if it is large enough
+    row_stride = (*width) * cinfo->output_components;
+    size = row_stride * (*height);
+    if (size > codec->imageSize) {
+        free(codec->image);
+        codec->image = malloc(size);
+        codec->imageSize = size;
+    }
+    *image = codec->image;
 
-    // Allocate image pixel buffer
-    *image = malloc(row_stride * (*height));
+    // Read image row by row, straight into the buffer
+    while (cinfo->output_scanline < cinfo->output_height) {
+        unsigned char *lumaRow = luma ? luma + (unsigned long) (*width) * cinfo->output_scanline : NULL;
+        unsigned char *imageRow = (*image) + row_stride * cinfo->output_scanline;
 
-    // Read image row by row
-    int row = 0;
-    while (cinfo.output_scanline < cinfo.output_height) {
-        (void) jpeg_read_scanlines(&cinfo, buffer, 1);
-        memcpy((void *)((*image) + row_stride * row), buffer[0], row_stride);
-        row++;
+        row_pointer[0] = row ? row : imageRow;
+        if (jpeg_read_scanlines(cinfo, row_pointer, 1) == 1 && row)
+            yccToRgb(row, imageRow, lumaRow, *width);
     }
 
-    jpeg_finish_decompress(&cinfo);
-    jpeg_destroy_decompress(&cinfo);
+    // Other images get their luma in one pass over the whole image
+    if (luma && !row)
+        grayscaleInto(*image, luma, *width, *height);
 
-    return row_stride * (*height);
-}
+    jpeg_finish_decompress(cinfo);
+    free(row);
 
-unsigned long encodeJpeg(unsigned char **jpeg, unsigned char *buf, int width, int height, int pixelFormat, int quality, int progressive, int optimize, int subsample) {
-    long unsigned int jpegSize = 0;
-    struct jpeg_compress_struct cinfo;
-    struct jpeg_error_mgr jerr;
-    JSAMPROW row_pointer[1];
-    int row_stride = width * (pixelFormat == JCS_RGB ? 3 : 1);
+    return size;
+}
 
-    cinfo.err = jpeg_std_error(&jerr);
+unsigned long codecDecodeJpeg(struct codec *codec, unsigned char *buf, unsigned long bufSize, unsigned char **image, int *width, int *height, int pixelFormat) {
+    return codecDecode(codec, buf, bufSize, image, NULL, width, height, pixelFormat);
+}
 
-    jpeg_create_compress(&cinfo);
+// Points the compressor at a new output buffer and sets up the encode
+// parameters shared by pixel and DCT block input. Returns the destination,
+// presized after the previous encode so it rarely has to grow; endEncode
+// frees it if libjpeg outgrew it.
+static unsigned char *startEncode(struct codec *codec, unsigned char **jpeg, unsigned long *jpegSize, int width, int height, int pixelFormat, int quality, int progressive, int optimize, int subsample) {
+    j_compress_ptr cinfo = &codec->cinfo;
+    unsigned char *presized = NULL;
 
     // Set destination
-    jpeg_mem_dest(&cinfo, jpeg, &jpegSize);
+    *jpegSize = codec->lastSize + codec->lastSize / 2;
+    if (*jpegSize)
+        presized = malloc(*jpegSize);
+    if (!presized)
+        *jpegSize = 0;
+    *jpeg = presized;
+    jpeg_mem_dest(cinfo, jpeg, jpegSize);
 
     // Set options
-    cinfo.image_width = width;
-    cinfo.image_height = height;
-    cinfo.input_components = pixelFormat == JCS_RGB ? 3 : 1;
-    cinfo.in_color_space = pixelFormat;
-
-    if (!optimize) {
-        // Not optimizing for space, so use a much faster compression
-        // profile. This is about twice as fast and can be used when
-        // testing visual quality *before* doing the final encoding.
-        // Note: This *must* be set before calling `jpeg_set_defaults`
-        // as it modifies how that call works.
-        if (jpeg_c_int_param_supported(&cinfo, JINT_COMPRESS_PROFILE)) {
-            jpeg_c_set_int_param(&cinfo, JINT_COMPRESS_PROFILE, JCP_FASTEST);
-        }
+    cinfo->image_width = width;
+    cinfo->image_height = height;
+    cinfo->input_components = pixelFormat == JCS_RGB ? 3 : 1;
+    cinfo->in_color_space = pixelFormat;
+
+    // Not optimizing for space, so use a much faster compression
+    // profile. This is about twice as fast and can be used when
+    // testing visual quality *before* doing the final encoding.
+    // Note: This *must* be set before calling `jpeg_set_defaults`
+    // as it modifies how that call works. The compressor is reused,
+    // so the profile is set either way.
+    if (jpeg_c_int_param_supported(cinfo, JINT_COMPRESS_PROFILE)) {
+        jpeg_c_set_int_param(cinfo, JINT_COMPRESS_PROFILE, optimize ? JCP_MAX_COMPRESSION : JCP_FASTEST);
     }
 
-    jpeg_set_defaults(&cinfo);
+    jpeg_set_defaults(cinfo);
 
     if (!optimize) {
         // Disable trellis quantization if we aren't optimizing. This saves
         // a little processing.
-        if (jpeg_c_bool_param_supported(&cinfo, JBOOLEAN_TRELLIS_QUANT)) {
-            jpeg_c_set_bool_param(&cinfo, JBOOLEAN_TRELLIS_QUANT, FALSE);
+        if (jpeg_c_bool_param_supported(cinfo, JBOOLEAN_TRELLIS_QUANT)) {
+            jpeg_c_set_bool_param(cinfo, JBOOLEAN_TRELLIS_QUANT, FALSE);
         }
-        if (jpeg_c_bool_param_supported(&cinfo, JBOOLEAN_TRELLIS_QUANT_DC)) {
-            jpeg_c_set_bool_param(&cinfo, JBOOLEAN_TRELLIS_QUANT_DC, FALSE);
+        if (jpeg_c_bool_param_supported(cinfo, JBOOLEAN_TRELLIS_QUANT_DC)) {
+            jpeg_c_set_bool_param(cinfo, JBOOLEAN_TRELLIS_QUANT_DC, FALSE);
         }
     }
 
     if (optimize && !progressive) {
         // Moz defaults, disable progressive
-        cinfo.scan_info = NULL;
-        cinfo.num_scans = 0;
-        if (jpeg_c_bool_param_supported(&cinfo, JBOOLEAN_OPTIMIZE_SCANS)) {
-            jpeg_c_set_bool_param(&cinfo, JBOOLEAN_OPTIMIZE_SCANS, FALSE);
+        cinfo->scan_info = NULL;
+        cinfo->num_scans = 0;
+        if (jpeg_c_bool_param_supported(cinfo, JBOOLEAN_OPTIMIZE_SCANS)) {
+            jpeg_c_set_bool_param(cinfo, JBOOLEAN_OPTIMIZE_SCANS, FALSE);
         }
     }
 
     if (!optimize && progressive) {
         // No moz defaults, set scan progression
-        jpeg_simple_progression(&cinfo);
+        jpeg_simple_progression(cinfo);
     }
 
     // Handle subsampling for color images
-    if (cinfo.input_components == 3 && cinfo.in_color_space == JCS_RGB) {
+    if (cinfo->input_components == 3 && cinfo->in_color_space == JCS_RGB) {
         if (subsample == SUBSAMPLE_444) {
             // 4:4:4 - no subsampling
-            cinfo.comp_info[0].h_samp_factor = 1;
-            cinfo.comp_info[0].v_samp_factor = 1;
-            cinfo.comp_info[1].h_samp_factor = 1;
-            cinfo.comp_info[1].v_samp_factor = 1;
-            cinfo.comp_info[2].h_samp_factor = 1;
-            cinfo.comp_info[2].v_samp_factor = 1;
+            cinfo->comp_info[0].h_samp_factor = 1;
+            cinfo->comp_info[0].v_samp_factor = 1;
+            cinfo->comp_info[1].h_samp_factor = 1;
+            cinfo->comp_info[1].v_samp_factor = 1;
+            cinfo->comp_info[2].h_samp_factor = 1;
+            cinfo->comp_info[2].v_samp_factor = 1;
         } else if (subsample == SUBSAMPLE_422) {
             // 4:2:2 - horizontal subsampling
-            cinfo.comp_info[0].h_samp_factor = 2;
-            cinfo.comp_info[0].v_samp_factor = 1;
-            cinfo.comp_info[1].h_samp_factor = 1;
-            cinfo.comp_info[1].v_samp_factor = 1;
-            cinfo.comp_info[2].h_samp_factor = 1;
-            cinfo.comp_info[2].v_samp_factor = 1;
+            cinfo->comp_info[0].h_samp_factor = 2;
+            cinfo->comp_info[0].v_samp_factor = 1;
+            cinfo->comp_info[1].h_samp_factor = 1;
+            cinfo->comp_info[1].v_samp_factor = 1;
+            cinfo->comp_info[2].h_samp_factor = 1;
+            cinfo->comp_info[2].v_samp_factor = 1;
         }
         // else SUBSAMPLE_DEFAULT (4:2:0) - use mozjpeg defaults
     }
 
-    jpeg_set_quality(&cinfo, quality, TRUE);
+    jpeg_set_quality(cinfo, quality, TRUE);
+
+    return presized;
+}
+
+static void endEncode(struct codec *codec, unsigned char *presized, unsigned char *jpeg, unsigned long jpegSize) {
+    // libjpeg switches to a buffer of its own when it outgrows ours
+    if (jpeg != presized)
+        free(presized);
+    codec->lastSize = jpegSize;
+}
+
+unsigned long codecEncodeJpeg(struct codec *codec, unsigned char **jpeg, unsigned char *buf, int width, int height, int pixelFormat, int quality, int progressive, int optimize, int subsample) {
+    unsigned long jpegSize = 0;
+    j_compress_ptr cinfo = &codec->cinfo;
+    unsigned char *presized;
+    JSAMPROW row_pointer[1];
+    int row_stride = width * (pixelFormat == JCS_RGB ? 3 : 1);
+
+    presized = startEncode(codec, jpeg, &jpegSize, width, height, pixelFormat, quality, progressive, optimize, subsample);
 
     // Start the compression
-    jpeg_start_compress(&cinfo, TRUE);
+    jpeg_start_compress(cinfo, TRUE);
 
     // Process scanlines one by one
-    while (cinfo.next_scanline < cinfo.image_height) {
-        row_pointer[0] = &buf[cinfo.next_scanline * row_stride];
-        (void) jpeg_write_scanlines(&cinfo, row_pointer, 1);
+    while (cinfo->next_scanline < cinfo->image_height) {
+        row_pointer[0] = &buf[cinfo->next_scanline * row_stride];
+        (void) jpeg_write_scanlines(cinfo, row_pointer, 1);
+    }
+
+    jpeg_finish_compress(cinfo);
+    endEncode(codec, presized, *jpeg, jpegSize);
+
+    return jpegSize;
+}
+
+// The DCT kernels below are built once more for AVX2, where their loops
+// over the eight columns of a block and the 64 coefficients vectorize.
+// They only use integer math, so every build gives the same result.
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#define DCT_X86
+#define DCT_INLINE static inline __attribute__((always_inline))
+#else
+#define DCT_INLINE static inline
+#endif
+
+// Fixed-point constants of libjpeg's jfdctint.c
+#define FDCT_CONST_BITS 13
+#define FDCT_PASS1_BITS 2
+#define FDCT_DESCALE(x, n) (((x) + (1 << ((n) - 1))) >> (n))
+
+#define FIX_0_298631336 2446
+#define FIX_0_390180644 3196
+#define FIX_0_541196100 4433
+#define FIX_0_765366865 6270
+#define FIX_0_899976223 7373
+#define FIX_1_175875602 9633
+#define FIX_1_501321110 12299
+#define FIX_1_847759065 15137
+#define FIX_1_961570560 16069
+#define FIX_2_053119869 16819
+#define FIX_2_562915447 20995
+#define FIX_3_072711026 25172
+
+// One 1-D pass of jfdctint.c down the eight columns of a block. Its row
+// pass scales the even outputs up by PASS1_BITS, its column pass scales
+// them down; the odd outputs are descaled by 'oddBits' either way.
+DCT_INLINE void fdctColumns(int32_t *d, int rowPass, int oddBits) {
+    for (int i = 0; i < DCTSIZE; i++) {
+        int32_t tmp0 = d[i] + d[7 * DCTSIZE + i], tmp7 = d[i] - d[7 * DCTSIZE + i];
+        int32_t tmp1 = d[DCTSIZE + i] + d[6 * DCTSIZE + i], tmp6 = d[DCTSIZE + i] - d[6 * DCTSIZE + i];
+        int32_t tmp2 = d[2 * DCTSIZE + i] + d[5 * DCTSIZE + i], tmp5 = d[2 * DCTSIZE + i] - d[5 * DCTSIZE + i];
+        int32_t tmp3 = d[3 * DCTSIZE + i] + d[4 * DCTSIZE + i], tmp4 = d[3 * DCTSIZE + i] - d[4 * DCTSIZE + i];
+        int32_t tmp10 = tmp0 + tmp3, tmp13 = tmp0 - tmp3;
+        int32_t tmp11 = tmp1 + tmp2, tmp12 = tmp1 - tmp2;
+        int32_t z1, z2, z3, z4, z5;
+
+        if (rowPass) {
+            d[i] = (tmp10 + tmp11) << FDCT_PASS1_BITS;
+            d[4 * DCTSIZE + i] = (tmp10 - tmp11) << FDCT_PASS1_BITS;
+        } else {
+            d[i] = FDCT_DESCALE(tmp10 + tmp11, FDCT_PASS1_BITS);
+            d[4 * DCTSIZE + i] = FDCT_DESCALE(tmp10 - tmp11, FDCT_PASS1_BITS);
+        }
+
+        z1 = (tmp12 + tmp13) * FIX_0_541196100;
+        d[2 * DCTSIZE + i] = FDCT_DESCALE(z1 + tmp13 * FIX_0_765366865, oddBits);
+        d[6 * DCTSIZE + i] = FDCT_DESCALE(z1 - tmp12 * FIX_1_847759065, oddBits);
+
+        z1 = tmp4 + tmp7;
+        z2 = tmp5 + tmp6;
+        z3 = tmp4 + tmp6;
+        z4 = tmp5 + tmp7;
+        z5 = (z3 + z4) * FIX_1_175875602;
+
+        tmp4 *= FIX_0_298631336;
+        tmp5 *= FIX_2_053119869;
+        tmp6 *= FIX_3_072711026;
+        tmp7 *= FIX_1_501321110;
+        z1 *= -FIX_0_899976223;
+        z2 *= -FIX_2_562915447;
+        z3 = z3 * -FIX_1_961570560 + z5;
+        z4 = z4 * -FIX_0_390180644 + z5;
+
+        d[7 * DCTSIZE + i] = FDCT_DESCALE(tmp4 + z1 + z3, oddBits);
+        d[5 * DCTSIZE + i] = FDCT_DESCALE(tmp5 + z2 + z4, oddBits);
+        d[3 * DCTSIZE + i] = FDCT_DESCALE(tmp6 + z2 + z3, oddBits);
+        d[DCTSIZE + i] = FDCT_DESCALE(tmp7 + z1 + z4, oddBits);
+    }
+}
+
+// Forward DCT of the blocks of one block row. Samples past the right and
+// bottom edges repeat the last column and row, which is how libjpeg pads
+// partial blocks. Each block is loaded transposed, so that its row pass
+// also runs down columns.
+DCT_INLINE void fdctRowPixels(const unsigned char *gray, int width, int height, JDIMENSION row, JDIMENSION blocks, JCOEF *out) {
+    const unsigned char *lines[DCTSIZE];
+
+    for (int y = 0; y < DCTSIZE; y++)
+        lines[y] = gray + (size_t) MIN((int) row * DCTSIZE + y, height - 1) * width;
+
+    for (JDIMENSION block = 0; block < blocks; block++, out += DCTSIZE2) {
+        int x0 = block * DCTSIZE;
+        int32_t d[DCTSIZE2], t[DCTSIZE2];
+
+        if (x0 + DCTSIZE <= width) {
+            for (int y = 0; y < DCTSIZE; y++)
+                for (int x = 0; x < DCTSIZE; x++)
+                    t[x * DCTSIZE + y] = lines[y][x0 + x] - CENTERJSAMPLE;
+        } else {
+            for (int y = 0; y < DCTSIZE; y++)
+                for (int x = 0; x < DCTSIZE; x++)
+                    t[x * DCTSIZE + y] = lines[y][MIN(x0 + x, width - 1)] - CENTERJSAMPLE;
+        }
+
+        fdctColumns(t, 1, FDCT_CONST_BITS - FDCT_PASS1_BITS);
+        for (int y = 0; y < DCTSIZE; y++)
+            for (int x = 0; x < DCTSIZE; x++)
+                d[y * DCTSIZE + x] = t[x * DCTSIZE + y];
+        fdctColumns(d, 0, FDCT_CONST_BITS + FDCT_PASS1_BITS);
+
+        for (int k = 0; k < DCTSIZE2; k++)
+            out[k] = (JCOEF) d[k];
+    }
+}
+
+// Quantizes blocks the way libjpeg does for its integer FDCT: divided by 8
+// times the table entry, rounded half away from zero. The FDCT output of
+// 8-bit samples stays below 2^14, so the division by 8 can come first and
+// leave n < 2^12, and then n / q == (n * ceil(2^20 / q)) >> 20 for every
+// table entry q, all in 32 bits.
+DCT_INLINE void quantizeRowBlocks(const JCOEF *restrict in, JBLOCKROW out, JDIMENSION blocks, const uint32_t *restrict bias, const uint32_t *restrict reciprocal) {
+    for (JDIMENSION block = 0; block < blocks; block++, in += DCTSIZE2) {
+        JCOEF *restrict coef = out[block];
+        for (int k = 0; k < DCTSIZE2; k++) {
+            int value = in[k];
+            uint32_t n = ((uint32_t) (value < 0 ? -value : value) + bias[k]) >> 3;
+            JCOEF q = (JCOEF) ((n * reciprocal[k]) >> 20);
+            coef[k] = value < 0 ? -q : q;
+        }
+    }
+}
+
+static void fdctRowDefault(const unsigned char *gray, int width, int height, JDIMENSION row, JDIMENSION blocks, JCOEF *out) {
+    fdctRowPixels(gray, width, height, row, blocks, out);
+}
+
+static void quantizeRowDefault(const JCOEF *in, JBLOCKROW out, JDIMENSION blocks, const uint32_t *bias, const uint32_t *reciprocal) {
+    quantizeRowBlocks(in, out, blocks, bias, reciprocal);
+}
+
+#ifdef DCT_X86
+__attribute__((target("avx2"))) static void fdctRowAvx2(const unsigned char *gray, int width, int height, JDIMENSION row, JDIMENSION blocks, JCOEF *out) {
+    fdctRowPixels(gray, width, height, row, blocks, out);
+}
+
+__attribute__((target("avx2"))) static void quantizeRowAvx2(const JCOEF *in, JBLOCKROW out, JDIMENSION blocks, const uint32_t *bias, const uint32_t *reciprocal) {
+    quantizeRowBlocks(in, out, blocks, bias, reciprocal);
+}
+#endif
+
+struct dctKernels {
+    void (*fdctRow)(const unsigned char *gray, int width, int height, JDIMENSION row, JDIMENSION blocks, JCOEF *out);
+    void (*quantizeRow)(const JCOEF *in, JBLOCKROW out, JDIMENSION blocks, const uint32_t *bias, const uint32_t *reciprocal);
+};
+
+static const struct dctKernels dctDefault = { fdctRowDefault, quantizeRowDefault };
+#ifdef DCT_X86
+static const struct dctKernels dctAvx2 = { fdctRowAvx2, quantizeRowAvx2 };
+#endif
+
+// The kernels for this CPU, picked on first use
+static const struct dctKernels *dctKernels(void) {
+    static const struct dctKernels *active;
+
+    if (!active) {
+#ifdef DCT_X86
+        __builtin_cpu_init();
+        active = __builtin_cpu_supports("avx2") ? &dctAvx2 : &dctDefault;
+#else
+        active = &dctDefault;
+#endif
+    }
+    return active;
+}
+
+int dctImageInit(struct dctImage *dct, const unsigned char *gray, int width, int height) {
+    const struct dctKernels *kernels = dctKernels();
+
+    dct->width = width;
+    dct->height = height;
+    dct->widthInBlocks = (width + DCTSIZE - 1) / DCTSIZE;
+    dct->heightInBlocks = (height + DCTSIZE - 1) / DCTSIZE;
+    dct->blocks = malloc((size_t) dct->widthInBlocks * dct->heightInBlocks * DCTSIZE2 * sizeof(JCOEF));
+    if (!dct->blocks)
+        return 0;
+
+    for (JDIMENSION row = 0; row < dct->heightInBlocks; row++)
+        kernels->fdctRow(gray, width, height, row, dct->widthInBlocks, dct->blocks + (size_t) row * dct->widthInBlocks * DCTSIZE2);
+
+    return 1;
+}
+
+void dctImageFree(struct dctImage *dct) {
+    free(dct->blocks);
+    dct->blocks = NULL;
+}
+
+// The blocks are handed to jpeg_write_coefficients as a virtual block
+// array whose rows are quantized when libjpeg asks for them, so the
+// quantized image is never held in full. The compressor's memory manager
+// gets an access_virt_barray that serves this array and passes any other
+// on; it stays installed and finds its state through client_data, which
+// is allocated with the compressor.
+struct dctRows {
+    JBLOCKARRAY (*access)(j_common_ptr cinfo, jvirt_barray_ptr array, JDIMENSION start, JDIMENSION count, boolean writable);
+    const struct dctImage *dct;  // NULL outside of an encode
+    const struct dctKernels *kernels;
+    uint32_t bias[DCTSIZE2];
+    uint32_t reciprocal[DCTSIZE2];
+    JBLOCKROW row;
+};
+
+static JBLOCKARRAY accessDctRows(j_common_ptr cinfo, jvirt_barray_ptr array, JDIMENSION start, JDIMENSION count, boolean writable) {
+    struct dctRows *rows = cinfo->client_data;
+
+    if (array != (jvirt_barray_ptr) rows || !rows->dct)
+        return rows->access(cinfo, array, start, count, writable);
+
+    // A grayscale image is one block row per iMCU row, so libjpeg asks
+    // for one row at a time
+    rows->kernels->quantizeRow(rows->dct->blocks + (size_t) start * rows->dct->widthInBlocks * DCTSIZE2, rows->row, rows->dct->widthInBlocks, rows->bias, rows->reciprocal);
+    return &rows->row;
+}
+
+void dctCompress(j_compress_ptr cinfo, const struct dctImage *dct) {
+    struct dctRows *rows = cinfo->client_data;
+    jvirt_barray_ptr *arrays;
+    const UINT16 *quantval;
+
+    if (!rows) {
+        rows = (*cinfo->mem->alloc_small)((j_common_ptr) cinfo, JPOOL_PERMANENT, sizeof(struct dctRows));
+        rows->access = cinfo->mem->access_virt_barray;
+        cinfo->mem->access_virt_barray = accessDctRows;
+        cinfo->client_data = rows;
+    }
+
+    // Half of 8 times the entry rounds, then the division by 8 comes first
+    quantval = cinfo->quant_tbl_ptrs[cinfo->comp_info[0].quant_tbl_no]->quantval;
+    for (int k = 0; k < DCTSIZE2; k++) {
+        rows->bias[k] = (uint32_t) quantval[k] << 2;
+        rows->reciprocal[k] = ((1U << 20) + quantval[k] - 1) / quantval[k];
     }
+    rows->kernels = dctKernels();
+    rows->row = (*cinfo->mem->alloc_large)((j_common_ptr) cinfo, JPOOL_IMAGE, dct->widthInBlocks * sizeof(JBLOCK));
+    rows->dct = dct;
+
+    // libjpeg reads the array list until jpeg_finish_compress, so it comes
+    // from the image pool rather than the stack
+    arrays = (*cinfo->mem->alloc_small)((j_common_ptr) cinfo, JPOOL_IMAGE, sizeof(jvirt_barray_ptr));
+    arrays[0] = (jvirt_barray_ptr) rows;
+
+    jpeg_write_coefficients(cinfo, arrays);
+    jpeg_finish_compress(cinfo);
+    rows->dct = NULL;
+}
 
-    jpeg_finish_compress(&cinfo);
-    jpeg_destroy_compress(&cinfo);
+unsigned long codecEncodeDct(struct codec *codec, unsigned char **jpeg, const struct dctImage *dct, int quality, int progressive, int optimize) {
+    unsigned long jpegSize = 0;
+    unsigned char *presized;
+
+    presized = startEncode(codec, jpeg, &jpegSize, dct->width, dct->height, JCS_GRAYSCALE, quality, progressive, optimize, SUBSAMPLE_DEFAULT);
+    dctCompress(&codec->cinfo, dct);
+    endEncode(codec, presized, *jpeg, jpegSize);
 
     return jpegSize;
 }
 
+unsigned long decodeJpeg(unsigned char *buf, unsigned long bufSize, unsigned char **image, int *width, int *height, int pixelFormat) {
+    struct codec codec;
+    unsigned long size;
+
+    codecInit(&codec);
+    size = codecDecodeJpeg(&codec, buf, bufSize, image, width, height, pixelFormat);
+
+    // The caller owns the image
+    codec.image = NULL;
+    codecFree(&codec);
+
+    return size;
+}
+
+unsigned long decodeJpegLuma(unsigned char *buf, unsigned long bufSize, unsigned char **image, unsigned char **luma, int *width, int *height) {
+    struct codec codec;
+    struct jpeg_decompress_struct *cinfo = &codec.dinfo;
+    unsigned long size;
+
+    codecInit(&codec);
+
+    // The luma buffer is sized from the header before decoding into it
+    jpeg_mem_src(cinfo, buf, bufSize);
+    jpeg_read_header(cinfo, TRUE);
+    *luma = malloc((unsigned long) cinfo->image_width * cinfo->image_height);
+    jpeg_abort_decompress(cinfo);
+    if (*luma == NULL) {
+        codecFree(&codec);
+        return 0;
+    }
+
+    size = codecDecode(&codec, buf, bufSize, image, *luma, width, height, JCS_RGB);
+
+    // The caller owns the image
+    codec.image = NULL;
+    codecFree(&codec);
+
+    return size;
+}
+
+unsigned long encodeJpeg(unsigned char **jpeg, unsigned char *buf, int width, int height, int pixelFormat, int quality, int progressive, int optimize, int subsample) {
+    struct codec codec;
+    unsigned long size;
+
+    codecInit(&codec);
+    size = codecEncodeJpeg(&codec, jpeg, buf, width, height, pixelFormat, quality, progressive, optimize, subsample);
+    codecFree(&codec);
+
+    return size;
+}
+
 int checkPpmMagic(const unsigned char *buf, unsigned long size) {
     return (size >= 2 && buf[0] == 'P' && buf[1] == '6');
 }
@@ -292,12 +733,19 @@ unsigned long decodePpm(unsigned char *buf, unsigned long bufSize, unsigned char
 }
 
 enum filetype detectFiletype(const char *filename) {
-    unsigned char *buf = NULL;
-    long bufSize = 0;
-    bufSize = readFile((char *)filename, (void **)&buf);
-    enum filetype ret = detectFiletypeFromBuffer(buf, bufSize);
-    free(buf);
-    return ret;
+    unsigned char magic[2];
+    long magicSize;
+    FILE *file = fopen(filename, "rb");
+
+    // Both magic numbers are two bytes long
+    if (!file) {
+        error("unable to open file: %s", filename);
+        return FILETYPE_UNKNOWN;
+    }
+    magicSize = fread(magic, 1, sizeof magic, file);
+    fclose(file);
+
+    return detectFiletypeFromBuffer(magic, magicSize);
 }
 
 enum filetype detectFiletypeFromBuffer(unsigned char *buf, long bufSize) {
@@ -311,11 +759,10 @@ enum filetype detectFiletypeFromBuffer(unsigned char *buf, long bufSize) {
 }
 
 unsigned long decodeFile(const char *filename, unsigned char **image, enum filetype type, int *width, int *height, int pixelFormat) {
-    unsigned char *buf = NULL;
-    long bufSize = 0;
-    bufSize = readFile((char *)filename, (void **)&buf);
-    unsigned long ret = decodeFileFromBuffer(buf, bufSize, image, type, width, height, pixelFormat);
-    free(buf);
+    struct inputFile file;
+    mapFile(filename, &file);
+    unsigned long ret = decodeFileFromBuffer(file.data, file.size, image, type, width, height, pixelFormat);
+    unmapFile(&file);
     return ret;
 }
 
@@ -330,76 +777,297 @@ unsigned long decodeFileFromBuffer(unsigned char *buf, long bufSize, unsigned ch
     }
 }
 
-int getMetadata(const unsigned char *buf, unsigned int bufSize, unsigned char **meta, unsigned int *metaSize, const char *comment) {
-    unsigned int pos = 0;
-    unsigned int totalSize = 0;
-    unsigned int offsets[20];
-    unsigned int sizes[20];
-    unsigned int count = 0;
-
-    // Read through all the file markers
-    while (pos < bufSize && count < 20) {
-        // Ensure we have at least 2 bytes for marker
-        if (pos + 1 >= bufSize) {
+static int addSegment(struct jpegMarkers *markers, unsigned char marker, unsigned long offset, unsigned long length) {
+    if (markers->count == markers->capacity) {
+        int capacity = markers->capacity ? markers->capacity * 2 : 16;
+        struct jpegSegment *segments = realloc(markers->segments, capacity * sizeof(*segments));
+
+        if (!segments)
+            return 0;
+        markers->segments = segments;
+        markers->capacity = capacity;
+    }
+
+    markers->segments[markers->count].marker = marker;
+    markers->segments[markers->count].offset = offset;
+    markers->segments[markers->count].length = length;
+    markers->count++;
+    return 1;
+}
+
+static void parseFrame(struct jpegMarkers *markers, int marker, const unsigned char *data, unsigned long size) {
+    if (size < 6)
+        return;
+
+    markers->frameMarker = marker;
+    markers->precision = data[0];
+    markers->height = (data[1] << 8) + data[2];
+    markers->width = (data[3] << 8) + data[4];
+    markers->components = data[5];
+
+    for (int i = 0; i < markers->components && i < 4 && 6 + i * 3 + 2 < size; i++) {
+        markers->component[i].id = data[6 + i * 3];
+        markers->component[i].h = data[7 + i * 3] >> 4;
+        markers->component[i].v = data[7 + i * 3] & 15;
+        markers->component[i].quantTable = data[8 + i * 3];
+    }
+}
+
+static void parseQuantTables(struct jpegMarkers *markers, const unsigned char *data, unsigned long size) {
+    unsigned long pos = 0;
+
+    while (pos < size) {
+        int precision = data[pos] >> 4;
+        int id = data[pos] & 15;
+        unsigned long tableSize = 1 + 64 * (precision ? 2 : 1);
+
+        if (pos + tableSize > size || id > 3)
             break;
+
+        struct jpegQuantTable *table = &markers->quant[id];
+        table->present = 1;
+        table->precision = precision;
+        for (int i = 0; i < 64; i++) {
+            table->values[i] = precision ? (data[pos + 1 + i * 2] << 8) + data[pos + 2 + i * 2] : data[pos + 1 + i];
         }
-        unsigned int marker = (buf[pos] << 8) + buf[pos + 1];
+        pos += tableSize;
+    }
+}
 
-        //printf("Marker %x at %u\n", marker, pos);
+static void parseHuffmanTables(struct jpegMarkers *markers, const unsigned char *data, unsigned long size) {
+    unsigned long pos = 0;
 
-        if (marker == 0xffda /* SOS */) {
-            // This is the end, so stop!
+    while (pos + 17 <= size) {
+        int tableClass = data[pos] >> 4;
+        int id = data[pos] & 15;
+        int symbols = 0;
+
+        for (int i = 1; i <= 16; i++)
+            symbols += data[pos + i];
+        if (tableClass > 1 || id > 3 || pos + 17 + symbols > size)
             break;
-        } else if (marker == 0xffdd /* DRI */) {
-            pos += 2 + 4;
-        } else if (marker >= 0xffd0 && marker <= 0xffd9 /* RST0+x */) {
+
+        markers->huffman[tableClass][id] = symbols;
+        pos += 17 + symbols;
+    }
+}
+
+int indexMarkers(const unsigned char *buf, unsigned long bufSize, const char *comment, struct jpegMarkers *markers) {
+    size_t commentLen = comment ? strlen(comment) : 0;
+    unsigned long pos = 2;
+
+    memset(markers, 0, sizeof(*markers));
+    markers->adobeTransform = -1;
+    markers->scanOffset = bufSize;
+
+    if (!checkJpegMagic(buf, bufSize) || !addSegment(markers, 0xd8, 0, 2)) {
+        freeMarkers(markers);
+        return 0;
+    }
+
+    // Walk the segments up to the first scan; anything malformed ends it
+    while (pos + 1 < bufSize && buf[pos] == 0xff) {
+        int marker = buf[pos + 1];
+
+        if (marker == 0xff) {
+            // Fill byte
+            pos++;
+            continue;
+        }
+
+        if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd9)) {
+            // TEM, RSTn, SOI and EOI have no length
+            if (!addSegment(markers, marker, pos, 2)) {
+                freeMarkers(markers);
+                return 0;
+            }
             pos += 2;
-        } else {
-            // Ensure we have at least 4 bytes for marker + size
-            if (pos + 3 >= bufSize) {
+            if (marker == 0xd9)
                 break;
-            }
-            // Marker has a custom size, read it in
-            int size = (buf[pos + 2] << 8) + buf[pos + 3];
-            //printf("Size is %i (%x)\n", size, size);
-
-            // Save APP0+x and COM markers
-            if ((marker >= 0xffe1 && marker <= 0xffef) || marker == 0xfffe) {
-                // Check if we have enough bytes to read the comment
-                size_t comment_len = comment ? strlen(comment) : 0;
-                if (marker == 0xfffe && comment != NULL && pos + 4 + comment_len <= bufSize &&
-                    !strncmp(comment, (char *) buf + pos + 4, comment_len)) {
-                    // Initialize output parameters before early return
-                    *meta = NULL;
-                    *metaSize = 0;
-                    return 1;
-                }
-
-                totalSize += size + 2;
-                offsets[count] = pos;
-                sizes[count] = size + 2;
-                count++;
-            }
+            continue;
+        }
 
-            pos += 2 + size;
+        if (pos + 3 >= bufSize)
+            break;
+        unsigned long size = (buf[pos + 2] << 8) + buf[pos + 3];
+        if (size < 2 || pos + 2 + size > bufSize)
+            break;
+        if (!addSegment(markers, marker, pos, size + 2)) {
+            freeMarkers(markers);
+            return 0;
         }
+
+        const unsigned char *data = buf + pos + 4;
+        size -= 2;
+
+        if (marker == 0xda) {
+            markers->scanOffset = pos;
+            break;
+        } else if (marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc) {
+            if (!markers->frameMarker)
+                parseFrame(markers, marker, data, size);
+        } else if (marker == 0xc4) {
+            parseHuffmanTables(markers, data, size);
+        } else if (marker == 0xdb) {
+            parseQuantTables(markers, data, size);
+        } else if (marker == 0xdd) {
+            if (size >= 2)
+                markers->restartInterval = (data[0] << 8) + data[1];
+        } else if (marker == 0xe0) {
+            if (size >= 5 && !memcmp(data, "JFIF", 5))
+                markers->jfif = 1;
+        } else if (marker == 0xee) {
+            if (size >= 12 && !memcmp(data, "Adobe", 5))
+                markers->adobeTransform = data[11];
+        } else if (marker == 0xfe) {
+            if (commentLen && size >= commentLen && !strncmp(comment, (const char *) data, commentLen))
+                markers->processed = 1;
+        }
+
+        pos += 4 + size;
+    }
+
+    return 1;
+}
+
+void freeMarkers(struct jpegMarkers *markers) {
+    free(markers->segments);
+    markers->segments = NULL;
+    markers->count = 0;
+    markers->capacity = 0;
+}
+
+int isMetadataSegment(const struct jpegSegment *segment) {
+    return (segment->marker >= 0xe1 && segment->marker <= 0xef) || segment->marker == 0xfe;
+}
+
+unsigned long copyMarkerMetadata(const struct jpegMarkers *markers, const unsigned char *buf, unsigned char *meta) {
+    unsigned long size = 0;
+
+    for (int i = 0; i < markers->count; i++) {
+        const struct jpegSegment *segment = &markers->segments[i];
+
+        if (isMetadataSegment(segment)) {
+            if (meta)
+                memcpy(meta + size, buf + segment->offset, segment->length);
+            size += segment->length;
+        }
+    }
+
+    return size;
+}
+
+// Base tables of the IJG library (Annex K of the JPEG standard), in the
+// zigzag order of DQT segments
+static const unsigned char ijgTables[2][64] = {
+    {
+        16, 11, 12, 14, 12, 10, 16, 14, 13, 14, 18, 17, 16, 19, 24, 40,
+        26, 24, 22, 22, 24, 49, 35, 37, 29, 40, 58, 51, 61, 60, 57, 51,
+        56, 55, 64, 72, 92, 78, 64, 68, 87, 69, 55, 56, 80, 109, 81, 87,
+        95, 98, 103, 104, 103, 62, 77, 113, 121, 112, 100, 120, 92, 101, 103, 99
+    },
+    {
+        17, 18, 18, 24, 21, 24, 47, 26, 26, 47, 99, 66, 56, 66, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99
+    }
+};
+
+// Distance between a table and an IJG base table scaled to a quality,
+// as the sum of the relative differences of its values
+static double quantTableDistance(const struct jpegQuantTable *table, const unsigned char *base, int quality) {
+    long scale = (quality < 50) ? 5000 / quality : 200 - quality * 2;
+    long limit = table->precision ? 32767 : 255;
+    double distance = 0;
+
+    for (int i = 0; i < 64; i++) {
+        long value = (base[i] * scale + 50) / 100;
+        long actual = table->values[i] ? table->values[i] : 1;
+
+        if (value < 1)
+            value = 1;
+        if (value > limit)
+            value = limit;
+        distance += (double) labs(actual - value) / ((actual < value) ? actual : value);
+    }
+
+    return distance;
+}
+
+int estimateQuality(const struct jpegMarkers *markers) {
+    const struct jpegQuantTable *tables[2] = { NULL, NULL };
+    double best = 0;
+    int quality = 0;
+
+    if (markers->components < 1)
+        return 0;
+
+    tables[0] = &markers->quant[markers->component[0].quantTable & 3];
+    if (!tables[0]->present)
+        return 0;
+    if (markers->components >= 3) {
+        tables[1] = &markers->quant[markers->component[1].quantTable & 3];
+        if (!tables[1]->present || tables[1] == tables[0])
+            tables[1] = NULL;
+    }
+
+    // Ties go to the higher quality, where the clamped values of very low
+    // qualities leave a range of them equally close
+    for (int q = 1; q <= 100; q++) {
+        double distance = quantTableDistance(tables[0], ijgTables[0], q);
+
+        if (tables[1])
+            distance += quantTableDistance(tables[1], ijgTables[1], q);
+        if (!quality || distance <= best) {
+            best = distance;
+            quality = q;
+        }
+    }
+
+    return quality;
+}
+
+int copyMetadata(const unsigned char *buf, unsigned int bufSize, unsigned char *meta, unsigned int *metaSize, const char *comment) {
+    struct jpegMarkers markers;
+    int processed;
+
+    *metaSize = 0;
+    if (!indexMarkers(buf, bufSize, comment, &markers))
+        return 0;
+
+    processed = markers.processed;
+    if (!processed)
+        *metaSize = copyMarkerMetadata(&markers, buf, meta);
+
+    freeMarkers(&markers);
+    return processed;
+}
+
+int getMetadata(const unsigned char *buf, unsigned int bufSize, unsigned char **meta, unsigned int *metaSize, const char *comment) {
+    struct jpegMarkers markers;
+
+    *meta = NULL;
+    *metaSize = 0;
+    if (!indexMarkers(buf, bufSize, comment, &markers))
+        return 0;
+
+    if (markers.processed) {
+        freeMarkers(&markers);
+        return 1;
     }
 
     // Allocate the metadata buffer
-    *meta = malloc(totalSize);
-    if (*meta == NULL && totalSize > 0) {
+    *metaSize = copyMarkerMetadata(&markers, buf, NULL);
+    *meta = malloc(*metaSize);
+    if (*meta == NULL && *metaSize > 0) {
         // Malloc failed
         *metaSize = 0;
+        freeMarkers(&markers);
         return -1;  // Return error code for allocation failure
     }
-    *metaSize = totalSize;
-
-    // Copy over all the metadata into the new buffer
-    pos = 0;
-    for (int x = 0; x < count; x++) {
-        memcpy(((*meta) + pos), (buf + offsets[x]), sizes[x]);
-        pos += sizes[x];
-    }
 
+    copyMarkerMetadata(&markers, buf, *meta);
+    freeMarkers(&markers);
     return 0;
 }
@@ -46,10 +46,51 @@ void version(void);
 void error(const char *format, ...);
 
 /*
-    Read a file into a buffer and return the length.
+    Read a file into a buffer and return the length. The name "-" reads
+    stdin. The buffer belongs to the caller.
 */
 long readFile(char *name, void **buffer);
 
+/*
+    A read-only view of an input file. Regular files are memory-mapped,
+    so their pages come straight from the page cache; stdin, pipes and
+    devices are read into a heap buffer instead.
+*/
+struct inputFile {
+    unsigned char *data;
+    long size;
+    int mapped;
+};
+
+/*
+    Open a file for reading and return its length, or 0 on error. Release
+    it with unmapFile, and don't truncate the file while it is open.
+*/
+long mapFile(const char *name, struct inputFile *file);
+void unmapFile(struct inputFile *file);
+
+/* Whether two paths name the same file. */
+int isSameFile(const char *name1, const char *name2);
+
+/*
+    A compressor and decompressor that are kept alive between images, so
+    repeated encodes and decodes skip libjpeg's setup and teardown. Each
+    encode's output buffer is presized from the previous one, and decoded
+    images are kept in a buffer that the next decode reuses. Use one codec
+    per thread.
+*/
+struct codec {
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_decompress_struct dinfo;
+    struct jpeg_error_mgr jerr;
+    unsigned char *image;
+    unsigned long imageSize;
+    unsigned long lastSize;
+};
+
+void codecInit(struct codec *codec);
+void codecFree(struct codec *codec);
+
 /*
     Decode a buffer into a JPEG image with the given pixel format.
     Returns the size of the image pixel array.
@@ -58,6 +99,20 @@ long readFile(char *name, void **buffer);
 int checkJpegMagic(const unsigned char *buf, unsigned long size);
 unsigned long decodeJpeg(unsigned char *buf, unsigned long bufSize, unsigned char **image, int *width, int *height, int pixelFormat);
 
+/*
+    Same as decodeJpeg, but the image belongs to the codec and is only
+    valid until its next decode.
+*/
+unsigned long codecDecodeJpeg(struct codec *codec, unsigned char *buf, unsigned long bufSize, unsigned char **image, int *width, int *height, int pixelFormat);
+
+/*
+    Decode a JPEG into RGB and its 8-bit luma in one pass over the
+    scanlines. YCbCr images are decoded without color conversion, so the
+    luma is their Y as stored; other images get it from grayscale. The
+    caller owns both buffers.
+*/
+unsigned long decodeJpegLuma(unsigned char *buf, unsigned long bufSize, unsigned char **image, unsigned char **luma, int *width, int *height);
+
 /*
     Decode buffer into a PPM image.
     Returns the size of the image pixel array.
@@ -69,6 +124,39 @@ unsigned long decodePpm(unsigned char *buf, unsigned long bufSize, unsigned char
     Encode a buffer of image pixels into a JPEG.
 */
 unsigned long encodeJpeg(unsigned char **jpeg, unsigned char *buf, int width, int height, int pixelFormat, int quality, int progressive, int optimize, int subsample);
+unsigned long codecEncodeJpeg(struct codec *codec, unsigned char **jpeg, unsigned char *buf, int width, int height, int pixelFormat, int quality, int progressive, int optimize, int subsample);
+
+/*
+    Forward DCT of a grayscale image, computed once so that encoding it at
+    several qualities only costs quantization and entropy coding. Blocks
+    are stored one after another, row by row, unquantized and scaled up by
+    8 the way libjpeg's integer FDCT leaves them. The edges are padded as
+    libjpeg pads them, so encodes match codecEncodeJpeg's byte for byte as
+    long as no trellis quantization is involved.
+*/
+struct dctImage {
+    int width;
+    int height;
+    JDIMENSION widthInBlocks;
+    JDIMENSION heightInBlocks;
+    JCOEF *blocks;
+};
+
+/* Returns 0 when out of memory. */
+int dctImageInit(struct dctImage *dct, const unsigned char *gray, int width, int height);
+void dctImageFree(struct dctImage *dct);
+
+/*
+    Compress the blocks, quantized with the luma table, on a grayscale
+    compressor whose parameters and destination are set. Rows are
+    quantized as libjpeg writes them, through an access_virt_barray
+    installed in the compressor's memory manager, whose state takes the
+    compressor's client_data.
+*/
+void dctCompress(j_compress_ptr cinfo, const struct dctImage *dct);
+
+/* Same as a grayscale codecEncodeJpeg of the image the blocks came from. */
+unsigned long codecEncodeDct(struct codec *codec, unsigned char **jpeg, const struct dctImage *dct, int quality, int progressive, int optimize);
 
 /* Automatically detect the file type of a given file. */
 enum filetype detectFiletype(const char *filename);
@@ -78,11 +166,79 @@ enum filetype detectFiletypeFromBuffer(unsigned char *buf, long bufSize);
 unsigned long decodeFile(const char *filename, unsigned char **image, enum filetype type, int *width, int *height, int pixelFormat);
 unsigned long decodeFileFromBuffer(unsigned char *buf, long bufSize, unsigned char **image, enum filetype type, int *width, int *height, int pixelFormat);
 
+/*
+    Index of the segments of a JPEG header, from SOI up to the first SOS,
+    built in a single pass without any entropy decoding. Offsets point at
+    the 0xff of a marker and lengths include the two marker bytes.
+    Segments that are cut off by the end of the buffer are left out.
+*/
+struct jpegSegment {
+    unsigned char marker;  // second marker byte, e.g. 0xe1 for APP1
+    unsigned long offset;
+    unsigned long length;
+};
+
+struct jpegQuantTable {
+    int present;
+    int precision;              // 0 for 8-bit, 1 for 16-bit values
+    unsigned short values[64];  // in zigzag order
+};
+
+struct jpegMarkers {
+    struct jpegSegment *segments;
+    int count;
+    int capacity;
+
+    // Frame header (SOFn); frameMarker is 0 if there is none
+    int frameMarker;
+    int precision;
+    int width;
+    int height;
+    int components;
+    struct {
+        int id;
+        int h;
+        int v;
+        int quantTable;
+    } component[4];
+
+    struct jpegQuantTable quant[4];
+    int huffman[2][4];         // symbols in each DC (0) and AC (1) table, 0 if absent
+    int restartInterval;
+    int jfif;                  // has a JFIF APP0 segment
+    int adobeTransform;        // color transform of an Adobe APP14 segment, or -1
+    int processed;             // a COM segment starts with the given comment
+    unsigned long scanOffset;  // offset of the first SOS, or the buffer size
+};
+
+/*
+    Index the header of a JPEG. Returns 0 if the buffer doesn't start with
+    SOI or memory runs out. Free the index with freeMarkers.
+*/
+int indexMarkers(const unsigned char *buf, unsigned long bufSize, const char *comment, struct jpegMarkers *markers);
+void freeMarkers(struct jpegMarkers *markers);
+
+/*
+    Copy the metadata segments (APP1-APP15 and COM) of an indexed JPEG
+    into 'meta' and return their size. With meta set to NULL only the size
+    is returned.
+*/
+int isMetadataSegment(const struct jpegSegment *segment);
+unsigned long copyMarkerMetadata(const struct jpegMarkers *markers, const unsigned char *buf, unsigned char *meta);
+
+/*
+    Estimate the quality an indexed JPEG was saved at, on the 1-100 scale
+    of the IJG library, from the quantization tables of its luma and first
+    chroma component. Tables of other encoders, like those of cameras and
+    Photoshop, get the IJG quality whose tables are closest to them.
+    Returns 0 if the tables are missing.
+*/
+int estimateQuality(const struct jpegMarkers *markers);
+
 /*
     Get JPEG metadata (EXIF, IPTC, XMP, etc) and return a buffer
     with just this data, suitable for writing out to a new file.
-    Reads in all APP0-APP15 markers as well as COM markers.
-    Reads up to 20 markers.
+    Reads in all APP1-APP15 markers as well as COM markers.
 
     If comment is not NULL, then returns 1 if the comment is
     encountered, allowing scripts to detect if they have previously
@@ -90,4 +246,11 @@ unsigned long decodeFileFromBuffer(unsigned char *buf, long bufSize, unsigned ch
 */
 int getMetadata(const unsigned char *buf, unsigned int bufSize, unsigned char **meta, unsigned int *metaSize, const char *comment);
 
+/*
+    Same as getMetadata, but copies into a caller-provided buffer. With
+    meta set to NULL only the size is returned, so the buffer can be
+    sized by a first call.
+*/
+int copyMetadata(const unsigned char *buf, unsigned int bufSize, unsigned char *meta, unsigned int *metaSize, const char *comment);
+
 #endif
@@ -37,6 +37,50 @@ typedef struct {
     int loops;
 } quality_case_t;
 
+// Outputs collected by a batch callback, one slot per input
+typedef struct {
+    jpegarchive_recompress_output_t *outputs;
+    int *calls;
+} batch_results_t;
+
+static void collect_batch_output(int index, jpegarchive_recompress_output_t *output, void *user) {
+    batch_results_t *results = user;
+    results->outputs[index] = *output;
+    results->calls[index]++;
+}
+
+// Stream callbacks: reads come from a file in short pieces, writes go to
+// a growing buffer
+typedef struct {
+    FILE *file;
+    int fail;  // make reads fail
+} stream_reader_t;
+
+typedef struct {
+    unsigned char *data;
+    int64_t size;
+} stream_writer_t;
+
+static int64_t read_stream(void *user, unsigned char *buffer, int64_t size) {
+    stream_reader_t *reader = user;
+    if (reader->fail) {
+        return -1;
+    }
+    return (int64_t)fread(buffer, 1, (size_t)(size < 1000 ? size : 1000), reader->file);
+}
+
+static int64_t write_stream(void *user, const unsigned char *buffer, int64_t size) {
+    stream_writer_t *writer = user;
+    unsigned char *grown = realloc(writer->data, writer->size + size);
+    if (!grown) {
+        return 0;
+    }
+    memcpy(grown + writer->size, buffer, size);
+    writer->data = grown;
+    writer->size += size;
+    return size;
+}
+
 // Error handler for libjpeg
 struct my_error_mgr {
     struct jpeg_error_mgr pub;
@@ -432,6 +476,16 @@ static int test_compare(const char *file1, const char *file2) {
         printf("  ERROR: SSIM values differ by %f\n", diff);
     }
 
+    // The integer SSIM is opt-in and agrees with the default one
+    lib_input.integer_ssim = 1;
+    jpegarchive_compare_output_t int_output = jpegarchive_compare(lib_input);
+    printf("  Integer: ssim=%f\n", int_output.metric);
+    if (int_output.error_code != JPEGARCHIVE_OK || fabs(int_output.metric - lib_output.metric) > 1e-6) {
+        printf("  ERROR: Integer SSIM differs by %g\n", fabs(int_output.metric - lib_output.metric));
+        passed = 0;
+    }
+    jpegarchive_free_compare_output(&int_output);
+
     double speedup = (lib_time > 0) ? ((double)cli_time / (double)lib_time) : 0.0;
     double speedup_percent = (lib_time > 0) ? ((speedup - 1.0) * 100.0) : 0.0;
     printf("  Time - CLI: %.2fms, Library: %.2fms\n", cli_time / 1000.0, lib_time / 1000.0);
@@ -785,6 +839,697 @@ int main(int argc, char **argv) {
         }
     }
 
+    printf("\n=== Testing jpegarchive_recompress with threads ===\n");
+    for (int i = 0; i < num_files && i < 3; i++) {
+        unsigned char *input_buffer;
+        long input_size = read_file(test_files[i], &input_buffer);
+        if (!input_size) {
+            printf("  ERROR: Failed to read test file %s\n", test_files[i]);
+            total_errors++;
+            continue;
+        }
+
+        jpegarchive_recompress_input_t serial_input = {
+            .jpeg = input_buffer,
+            .length = input_size,
+            .min = 40,
+            .max = 95,
+            .loops = 6,
+            .quality = JPEGARCHIVE_QUALITY_MEDIUM,
+            .method = JPEGARCHIVE_METHOD_SSIM,
+            .target = 0
+        };
+        jpegarchive_recompress_output_t serial_output = jpegarchive_recompress(serial_input);
+
+        // The parallel search must take the same steps as the serial one
+        int mismatches = 0;
+        const int thread_counts[] = {2, 3, 4, 8};
+        for (int t = 0; t < (int)(sizeof(thread_counts) / sizeof(thread_counts[0])); t++) {
+            jpegarchive_recompress_input_t threaded_input = serial_input;
+            threaded_input.threads = thread_counts[t];
+            jpegarchive_recompress_output_t threaded_output = jpegarchive_recompress(threaded_input);
+
+            if (threaded_output.error_code != serial_output.error_code ||
+                threaded_output.quality != serial_output.quality ||
+                threaded_output.metric != serial_output.metric ||
+                threaded_output.length != serial_output.length ||
+                (threaded_output.length > 0 &&
+                 memcmp(threaded_output.jpeg, serial_output.jpeg, threaded_output.length) != 0)) {
+                printf("  ERROR: %d threads: quality=%d, ssim=%f, size=%lld differs from serial quality=%d, ssim=%f, size=%lld for %s\n",
+                       thread_counts[t], threaded_output.quality, threaded_output.metric, (long long)threaded_output.length,
+                       serial_output.quality, serial_output.metric, (long long)serial_output.length, test_files[i]);
+                mismatches++;
+            }
+            jpegarchive_free_recompress_output(&threaded_output);
+        }
+        if (mismatches == 0) {
+            printf("  OK: %s quality=%d matches serial search\n", test_files[i], serial_output.quality);
+        }
+        total_errors += mismatches;
+
+        jpegarchive_free_recompress_output(&serial_output);
+        free(input_buffer);
+    }
+
+    printf("\n=== Testing jpegarchive_recompress with interpolating search ===\n");
+    for (int i = 0; i < num_files && i < 3; i++) {
+        unsigned char *input_buffer;
+        long input_size = read_file(test_files[i], &input_buffer);
+        if (!input_size) {
+            printf("  ERROR: Failed to read test file %s\n", test_files[i]);
+            total_errors++;
+            continue;
+        }
+
+        jpegarchive_recompress_input_t bisect_input = {
+            .jpeg = input_buffer,
+            .length = input_size,
+            .min = 40,
+            .max = 95,
+            .loops = 6,
+            .quality = JPEGARCHIVE_QUALITY_MEDIUM,
+            .method = JPEGARCHIVE_METHOD_SSIM,
+            .target = 0
+        };
+        jpegarchive_recompress_input_t interpolate_input = bisect_input;
+        interpolate_input.search = JPEGARCHIVE_SEARCH_INTERPOLATE;
+
+        jpegarchive_recompress_output_t bisect_output = jpegarchive_recompress(bisect_input);
+        jpegarchive_recompress_output_t interpolate_output = jpegarchive_recompress(interpolate_input);
+
+        if (interpolate_output.error_code != bisect_output.error_code) {
+            printf("  ERROR: Interpolating search returned error code %d, bisection %d for %s\n",
+                   interpolate_output.error_code, bisect_output.error_code, test_files[i]);
+            total_errors++;
+        } else if (interpolate_output.error_code == JPEGARCHIVE_OK) {
+            printf("  Bisection:     quality=%d, ssim=%f, size=%lld\n",
+                   bisect_output.quality, bisect_output.metric, (long long)bisect_output.length);
+            printf("  Interpolation: quality=%d, ssim=%f, size=%lld\n",
+                   interpolate_output.quality, interpolate_output.metric, (long long)interpolate_output.length);
+
+            if (interpolate_output.quality < 40 || interpolate_output.quality > 95) {
+                printf("  ERROR: Interpolating search quality %d outside of [40, 95]\n", interpolate_output.quality);
+                total_errors++;
+            } else if (abs(interpolate_output.quality - bisect_output.quality) > 5) {
+                printf("  WARNING: Interpolating search quality differs from bisection by more than 5\n");
+            }
+        }
+
+        jpegarchive_free_recompress_output(&bisect_output);
+        jpegarchive_free_recompress_output(&interpolate_output);
+        free(input_buffer);
+    }
+
+    printf("\n=== Testing jpegarchive_recompress with proxy search ===\n");
+    for (int i = 0; i < num_files && i < 3; i++) {
+        unsigned char *input_buffer;
+        long input_size = read_file(test_files[i], &input_buffer);
+        if (!input_size) {
+            printf("  ERROR: Failed to read test file %s\n", test_files[i]);
+            total_errors++;
+            continue;
+        }
+
+        jpegarchive_recompress_input_t full_input = {
+            .jpeg = input_buffer,
+            .length = input_size,
+            .min = 40,
+            .max = 95,
+            .loops = 6,
+            .quality = JPEGARCHIVE_QUALITY_MEDIUM,
+            .method = JPEGARCHIVE_METHOD_SSIM,
+            .target = 0
+        };
+        jpegarchive_recompress_input_t proxy_input = full_input;
+        proxy_input.proxy = 2;
+
+        jpegarchive_recompress_output_t full_output = jpegarchive_recompress(full_input);
+        jpegarchive_recompress_output_t proxy_output = jpegarchive_recompress(proxy_input);
+
+        if (proxy_output.error_code != full_output.error_code) {
+            printf("  ERROR: Proxy search returned error code %d, full resolution %d for %s\n",
+                   proxy_output.error_code, full_output.error_code, test_files[i]);
+            total_errors++;
+        } else if (proxy_output.error_code == JPEGARCHIVE_OK) {
+            printf("  Full resolution: quality=%d, ssim=%f, size=%lld\n",
+                   full_output.quality, full_output.metric, (long long)full_output.length);
+            printf("  Proxy:           quality=%d, ssim=%f, size=%lld\n",
+                   proxy_output.quality, proxy_output.metric, (long long)proxy_output.length);
+
+            if (proxy_output.quality < 40 || proxy_output.quality > 95) {
+                printf("  ERROR: Proxy search quality %d outside of [40, 95]\n", proxy_output.quality);
+                total_errors++;
+            } else if (abs(proxy_output.quality - full_output.quality) > 5) {
+                printf("  WARNING: Proxy search quality differs from full resolution by more than 5\n");
+            }
+
+            // The CLI takes the same steps
+            char cli_command[512];
+            char cli_output[4096];
+#ifdef _WIN32
+            snprintf(cli_command, sizeof(cli_command), "jpeg-recompress.exe -q medium -P 2 %s ./test_proxy.jpg 2>&1", test_files[i]);
+#else
+            snprintf(cli_command, sizeof(cli_command), "../jpeg-recompress -q medium -P 2 %s /tmp/test_proxy.jpg 2>&1", test_files[i]);
+#endif
+            if (run_command_and_get_output(cli_command, cli_output, sizeof(cli_output)) != 0) {
+                printf("  ERROR: CLI command failed: %s\n", cli_command);
+                total_errors++;
+            } else if (parse_quality_from_recompress(cli_output) != proxy_output.quality) {
+                printf("  ERROR: CLI proxy search chose quality %d, library %d\n",
+                       parse_quality_from_recompress(cli_output), proxy_output.quality);
+                total_errors++;
+            }
+        }
+
+        jpegarchive_free_recompress_output(&full_output);
+        jpegarchive_free_recompress_output(&proxy_output);
+        free(input_buffer);
+    }
+
+    printf("\n=== Testing jpegarchive_recompress with tile search ===\n");
+    for (int i = 0; i < num_files && i < 3; i++) {
+        unsigned char *input_buffer;
+        long input_size = read_file(test_files[i], &input_buffer);
+        if (!input_size) {
+            printf("  ERROR: Failed to read test file %s\n", test_files[i]);
+            total_errors++;
+            continue;
+        }
+
+        jpegarchive_recompress_input_t full_input = {
+            .jpeg = input_buffer,
+            .length = input_size,
+            .min = 40,
+            .max = 95,
+            .loops = 6,
+            .quality = JPEGARCHIVE_QUALITY_MEDIUM,
+            .method = JPEGARCHIVE_METHOD_SSIM,
+            .target = 0
+        };
+        jpegarchive_recompress_input_t tiles_input = full_input;
+        tiles_input.tiles = 8;
+
+        jpegarchive_recompress_output_t full_output = jpegarchive_recompress(full_input);
+        jpegarchive_recompress_output_t tiles_output = jpegarchive_recompress(tiles_input);
+
+        if (tiles_output.error_code == JPEGARCHIVE_NOT_SUITABLE && full_output.error_code == JPEGARCHIVE_OK) {
+            // A step too high can make the output larger than the input
+            printf("  WARNING: Tile search output not smaller than the input for %s\n", test_files[i]);
+        } else if (tiles_output.error_code != full_output.error_code) {
+            printf("  ERROR: Tile search returned error code %d, full search %d for %s\n",
+                   tiles_output.error_code, full_output.error_code, test_files[i]);
+            total_errors++;
+        } else if (tiles_output.error_code == JPEGARCHIVE_OK) {
+            printf("  Full search: quality=%d, ssim=%f, size=%lld\n",
+                   full_output.quality, full_output.metric, (long long)full_output.length);
+            printf("  Tiles:       quality=%d, ssim=%f, size=%lld\n",
+                   tiles_output.quality, tiles_output.metric, (long long)tiles_output.length);
+
+            if (tiles_output.quality < 40 || tiles_output.quality > 95) {
+                printf("  ERROR: Tile search quality %d outside of [40, 95]\n", tiles_output.quality);
+                total_errors++;
+            } else if (abs(tiles_output.quality - full_output.quality) > 5) {
+                printf("  WARNING: Tile search quality differs from the full search by more than 5\n");
+            }
+        }
+
+        jpegarchive_free_recompress_output(&full_output);
+        jpegarchive_free_recompress_output(&tiles_output);
+        free(input_buffer);
+    }
+
+    printf("\n=== Testing jpegarchive_recompress with coefficient engine ===\n");
+    for (int i = 0; i < num_files && i < 3; i++) {
+        unsigned char *input_buffer;
+        long input_size = read_file(test_files[i], &input_buffer);
+        if (!input_size) {
+            printf("  ERROR: Failed to read test file %s\n", test_files[i]);
+            total_errors++;
+            continue;
+        }
+
+        // KEEP requantizes in place, 4:4:4 falls back to pixels unless the
+        // source already is 4:4:4
+        jpegarchive_subsample_t subsamples[] = {JPEGARCHIVE_SUBSAMPLE_KEEP, JPEGARCHIVE_SUBSAMPLE_444};
+        for (int s = 0; s < 2; s++) {
+            jpegarchive_recompress_input_t pixels_input = {
+                .jpeg = input_buffer,
+                .length = input_size,
+                .min = 40,
+                .max = 95,
+                .loops = 6,
+                .quality = JPEGARCHIVE_QUALITY_MEDIUM,
+                .method = JPEGARCHIVE_METHOD_SSIM,
+                .target = 0,
+                .subsample = subsamples[s]
+            };
+            jpegarchive_recompress_input_t coefficients_input = pixels_input;
+            coefficients_input.engine = JPEGARCHIVE_ENGINE_COEFFICIENTS;
+
+            jpegarchive_recompress_output_t pixels_output = jpegarchive_recompress(pixels_input);
+            jpegarchive_recompress_output_t coefficients_output = jpegarchive_recompress(coefficients_input);
+
+            if (coefficients_output.error_code != pixels_output.error_code) {
+                printf("  ERROR: Coefficient engine returned error code %d, pixel engine %d for %s\n",
+                       coefficients_output.error_code, pixels_output.error_code, test_files[i]);
+                total_errors++;
+            } else if (coefficients_output.error_code == JPEGARCHIVE_OK) {
+                printf("  Pixels:       quality=%d, ssim=%f, size=%lld\n",
+                       pixels_output.quality, pixels_output.metric, (long long)pixels_output.length);
+                printf("  Coefficients: quality=%d, ssim=%f, size=%lld\n",
+                       coefficients_output.quality, coefficients_output.metric, (long long)coefficients_output.length);
+
+                if (coefficients_output.quality < 40 || coefficients_output.quality > 95) {
+                    printf("  ERROR: Coefficient engine quality %d outside of [40, 95]\n", coefficients_output.quality);
+                    total_errors++;
+                } else if (coefficients_output.length >= input_size) {
+                    printf("  ERROR: Coefficient engine output is not smaller than the input\n");
+                    total_errors++;
+                }
+            }
+
+            jpegarchive_free_recompress_output(&pixels_output);
+            jpegarchive_free_recompress_output(&coefficients_output);
+        }
+        free(input_buffer);
+    }
+
+    printf("\n=== Testing jpegarchive_recompress with a reused context ===\n");
+    int context_errors = total_errors;
+    jpegarchive_context_t *ctx = jpegarchive_context_create(JPEGARCHIVE_CONTEXT_HUGE_PAGES);
+    if (!ctx) {
+        printf("  ERROR: Failed to create context\n");
+        total_errors++;
+    }
+    // Two passes, so the second one runs on a context that has already
+    // grown to the largest image
+    for (int pass = 0; ctx && pass < 2; pass++) {
+        for (int i = 0; i < num_files; i++) {
+            unsigned char *input_buffer;
+            long input_size = read_file(test_files[i], &input_buffer);
+            if (!input_size) {
+                printf("  ERROR: Failed to read test file %s\n", test_files[i]);
+                total_errors++;
+                continue;
+            }
+
+            jpegarchive_recompress_input_t input = {
+                .jpeg = input_buffer,
+                .length = input_size,
+                .min = 40,
+                .max = 95,
+                .loops = 6,
+                .quality = JPEGARCHIVE_QUALITY_MEDIUM,
+                .method = JPEGARCHIVE_METHOD_SSIM,
+                .target = 0,
+                .threads = 1 + (i % 2) * 3
+            };
+
+            jpegarchive_recompress_output_t expected = jpegarchive_recompress(input);
+            jpegarchive_recompress_output_t reused = jpegarchive_recompress_ctx(ctx, input);
+
+            if (reused.error_code != expected.error_code) {
+                printf("  ERROR: Context returned error code %d, expected %d for %s\n",
+                       reused.error_code, expected.error_code, test_files[i]);
+                total_errors++;
+            } else if (reused.error_code == JPEGARCHIVE_OK &&
+                       (reused.length != expected.length || reused.quality != expected.quality ||
+                        memcmp(reused.jpeg, expected.jpeg, reused.length) != 0)) {
+                printf("  ERROR: Context output differs for %s (quality %d vs %d)\n",
+                       test_files[i], reused.quality, expected.quality);
+                total_errors++;
+            }
+
+            jpegarchive_free_recompress_output(&expected);
+            jpegarchive_free_recompress_output(&reused);
+
+            if (pass == 1 && i + 1 < num_files) {
+                unsigned char *other_buffer;
+                long other_size = read_file(test_files[i + 1], &other_buffer);
+                if (other_size) {
+                    jpegarchive_compare_input_t compare_input = {
+                        .jpeg1 = input_buffer,
+                        .jpeg2 = other_buffer,
+                        .length1 = input_size,
+                        .length2 = other_size,
+                        .method = JPEGARCHIVE_METHOD_SSIM
+                    };
+                    jpegarchive_compare_output_t expected_compare = jpegarchive_compare(compare_input);
+                    jpegarchive_compare_output_t reused_compare = jpegarchive_compare_ctx(ctx, compare_input);
+                    if (reused_compare.error_code != expected_compare.error_code ||
+                        reused_compare.metric != expected_compare.metric) {
+                        printf("  ERROR: Context compare differs for %s\n", test_files[i]);
+                        total_errors++;
+                    }
+                    free(other_buffer);
+                }
+            }
+            free(input_buffer);
+        }
+    }
+    if (ctx && total_errors == context_errors) {
+        printf("  OK: Reused context matches jpegarchive_recompress for %d files\n", num_files);
+    }
+    jpegarchive_context_destroy(ctx);
+
+    printf("\n=== Testing jpegarchive_recompress_stream ===\n");
+    ctx = jpegarchive_context_create(JPEGARCHIVE_CONTEXT_DEFAULT);
+    int stream_errors = total_errors;
+    for (int i = 0; ctx && i < num_files; i++) {
+        unsigned char *input_buffer;
+        long input_size = read_file(test_files[i], &input_buffer);
+        if (!input_size) {
+            printf("  ERROR: Failed to read test file %s\n", test_files[i]);
+            total_errors++;
+            continue;
+        }
+
+        jpegarchive_recompress_input_t input = {
+            .jpeg = input_buffer,
+            .length = input_size,
+            .min = 40,
+            .max = 95,
+            .loops = 6,
+            .quality = JPEGARCHIVE_QUALITY_MEDIUM,
+            .method = JPEGARCHIVE_METHOD_SSIM,
+            .target = 0,
+            .engine = (i % 2) ? JPEGARCHIVE_ENGINE_COEFFICIENTS : JPEGARCHIVE_ENGINE_PIXELS
+        };
+        jpegarchive_recompress_output_t expected = jpegarchive_recompress(input);
+
+        // The stream replaces the buffer
+        stream_reader_t reader = { fopen(test_files[i], "rb"), 0 };
+        stream_writer_t writer = { NULL, 0 };
+        jpegarchive_source_t source = { read_stream, &reader };
+        jpegarchive_dest_t dest = { write_stream, &writer };
+        input.jpeg = NULL;
+        input.length = 0;
+        jpegarchive_recompress_output_t streamed = jpegarchive_recompress_stream(ctx, input, source, dest);
+
+        if (streamed.error_code != expected.error_code) {
+            printf("  ERROR: Stream returned error code %d, expected %d for %s\n",
+                   streamed.error_code, expected.error_code, test_files[i]);
+            total_errors++;
+        } else if (streamed.error_code == JPEGARCHIVE_OK &&
+                   (streamed.jpeg != NULL || streamed.length != writer.size ||
+                    writer.size != expected.length || memcmp(writer.data, expected.jpeg, writer.size) != 0)) {
+            printf("  ERROR: Streamed output differs for %s\n", test_files[i]);
+            total_errors++;
+        } else if (streamed.error_code != JPEGARCHIVE_OK && writer.size != 0) {
+            printf("  ERROR: Stream wrote output for a failed recompression of %s\n", test_files[i]);
+            total_errors++;
+        }
+
+        if (reader.file) {
+            fclose(reader.file);
+        }
+        free(writer.data);
+        jpegarchive_free_recompress_output(&expected);
+        free(input_buffer);
+    }
+
+    // Failing reads and input that is not a JPEG
+    if (ctx && num_files > 0) {
+        jpegarchive_recompress_input_t input = { .method = JPEGARCHIVE_METHOD_SSIM };
+        stream_reader_t reader = { fopen(test_files[0], "rb"), 1 };
+        stream_writer_t writer = { NULL, 0 };
+        jpegarchive_source_t source = { read_stream, &reader };
+        jpegarchive_dest_t dest = { write_stream, &writer };
+
+        jpegarchive_recompress_output_t failed = jpegarchive_recompress_stream(ctx, input, source, dest);
+        if (failed.error_code != JPEGARCHIVE_IO_ERROR) {
+            printf("  ERROR: Failing read returned error code %d\n", failed.error_code);
+            total_errors++;
+        }
+        if (reader.file) {
+            fclose(reader.file);
+        }
+
+        reader.file = fopen("test.c", "rb");
+        reader.fail = 0;
+        jpegarchive_recompress_output_t not_jpeg = jpegarchive_recompress_stream(ctx, input, source, dest);
+        if (reader.file && not_jpeg.error_code != JPEGARCHIVE_NOT_JPEG) {
+            printf("  ERROR: Stream that is not a JPEG returned error code %d\n", not_jpeg.error_code);
+            total_errors++;
+        }
+        if (reader.file) {
+            fclose(reader.file);
+        }
+        free(writer.data);
+    }
+    if (ctx && total_errors == stream_errors) {
+        printf("  OK: Streams match jpegarchive_recompress for %d files\n", num_files);
+    }
+    jpegarchive_context_destroy(ctx);
+
+    printf("\n=== Testing jpegarchive_recompress_batch ===\n");
+    printf("  CPUs available: %d\n", jpegarchive_cpu_count());
+    if (jpegarchive_cpu_count() < 1) {
+        printf("  ERROR: No CPU available\n");
+        total_errors++;
+    }
+    if (num_files > 0) {
+        // Every file twice, so workers run out at different times and steal
+        int batch_count = num_files * 2;
+        jpegarchive_recompress_input_t *batch_inputs = calloc(batch_count, sizeof(jpegarchive_recompress_input_t));
+        unsigned char **batch_buffers = calloc(num_files, sizeof(unsigned char *));
+        long *batch_sizes = calloc(num_files, sizeof(long));
+        batch_results_t results = {
+            calloc(batch_count, sizeof(jpegarchive_recompress_output_t)),
+            calloc(batch_count, sizeof(int))
+        };
+        int batch_errors = total_errors;
+
+        for (int i = 0; i < batch_count; i++) {
+            int file = i % num_files;
+            if (!batch_buffers[file]) {
+                batch_sizes[file] = read_file(test_files[file], &batch_buffers[file]);
+            }
+            jpegarchive_recompress_input_t input = {
+                .jpeg = batch_buffers[file],
+                .length = batch_sizes[file],
+                .min = 40,
+                .max = 95,
+                .loops = 6,
+                .quality = JPEGARCHIVE_QUALITY_MEDIUM,
+                .method = JPEGARCHIVE_METHOD_SSIM,
+                .target = 0
+            };
+            batch_inputs[i] = input;
+        }
+
+        // Three workers even on one CPU, then one per CPU
+        for (int round = 0; round < 2; round++) {
+            memset(results.calls, 0, batch_count * sizeof(int));
+            jpegarchive_error_code_t batch_error = jpegarchive_recompress_batch(batch_inputs, batch_count, round ? 0 : 3, collect_batch_output, &results);
+            if (batch_error != JPEGARCHIVE_OK) {
+                printf("  ERROR: Batch returned error code %d\n", batch_error);
+                total_errors++;
+                continue;
+            }
+
+            for (int i = 0; i < batch_count; i++) {
+                if (results.calls[i] != 1) {
+                    printf("  ERROR: Callback ran %d times for input %d\n", results.calls[i], i);
+                    total_errors++;
+                    continue;
+                }
+
+                jpegarchive_recompress_output_t expected = jpegarchive_recompress(batch_inputs[i]);
+                jpegarchive_recompress_output_t *batched = &results.outputs[i];
+                if (batched->error_code != expected.error_code) {
+                    printf("  ERROR: Batch returned error code %d, expected %d for %s\n",
+                           batched->error_code, expected.error_code, test_files[i % num_files]);
+                    total_errors++;
+                } else if (batched->error_code == JPEGARCHIVE_OK &&
+                           (batched->length != expected.length ||
+                            memcmp(batched->jpeg, expected.jpeg, batched->length) != 0)) {
+                    printf("  ERROR: Batch output differs for %s\n", test_files[i % num_files]);
+                    total_errors++;
+                }
+                jpegarchive_free_recompress_output(&expected);
+                jpegarchive_free_recompress_output(batched);
+            }
+        }
+
+        if (jpegarchive_recompress_batch(NULL, 1, 1, collect_batch_output, &results) != JPEGARCHIVE_INVALID_INPUT) {
+            printf("  ERROR: Batch accepted NULL inputs\n");
+            total_errors++;
+        }
+        if (total_errors == batch_errors) {
+            printf("  OK: Batch matches jpegarchive_recompress for %d inputs\n", batch_count);
+        }
+
+        for (int i = 0; i < num_files; i++) {
+            free(batch_buffers[i]);
+        }
+        free(batch_buffers);
+        free(batch_sizes);
+        free(batch_inputs);
+        free(results.outputs);
+        free(results.calls);
+    }
+
+    printf("\n=== Testing jpegarchive_probe ===\n");
+    {
+        int probe_errors = total_errors;
+
+        for (int i = 0; i < num_files; i++) {
+            unsigned char *input_buffer;
+            long input_size = read_file(test_files[i], &input_buffer);
+            if (!input_size) {
+                continue;
+            }
+
+            jpegarchive_probe_output_t probe = jpegarchive_probe(input_buffer, input_size);
+            if (probe.error_code != JPEGARCHIVE_OK || probe.width <= 0 || probe.height <= 0 || probe.processed) {
+                printf("  ERROR: Probe returned error code %d, %dx%d for %s\n",
+                       probe.error_code, probe.width, probe.height, test_files[i]);
+                total_errors++;
+            } else if ((probe.sampling == JPEGARCHIVE_SAMPLING_444) != (detect_jpeg_subsampling(test_files[i]) == 1)) {
+                printf("  ERROR: Probe reported sampling %d for %s\n", probe.sampling, test_files[i]);
+                total_errors++;
+            } else if (probe.quality < 1 || probe.quality > 100) {
+                printf("  ERROR: Probe estimated quality %d for %s\n", probe.quality, test_files[i]);
+                total_errors++;
+            }
+            for (int j = 0; j < probe.metadata_count; j++) {
+                if (input_buffer[probe.metadata[j].offset] != 0xff ||
+                    probe.metadata[j].offset + probe.metadata[j].length > input_size) {
+                    printf("  ERROR: Bad metadata span in %s\n", test_files[i]);
+                    total_errors++;
+                }
+            }
+            int width = probe.width;
+            int source_quality = probe.quality;
+            jpegarchive_free_probe_output(&probe);
+
+            // Outputs are marked, and rejected before decoding
+            jpegarchive_recompress_input_t input = {
+                .jpeg = input_buffer,
+                .length = input_size,
+                .quality = JPEGARCHIVE_QUALITY_MEDIUM,
+                .method = JPEGARCHIVE_METHOD_SSIM
+            };
+            jpegarchive_recompress_output_t output = jpegarchive_recompress(input);
+            if (output.error_code == JPEGARCHIVE_OK) {
+                // The search stays within 5 of the source's quality
+                if (output.quality > source_quality + 5) {
+                    printf("  ERROR: Quality %d is above source quality %d for %s\n", output.quality, source_quality, test_files[i]);
+                    total_errors++;
+                }
+
+                probe = jpegarchive_probe(output.jpeg, output.length);
+                if (!probe.processed || probe.width != width) {
+                    printf("  ERROR: Probe did not find the marker in the output of %s\n", test_files[i]);
+                    total_errors++;
+                }
+                jpegarchive_free_probe_output(&probe);
+
+                input.jpeg = output.jpeg;
+                input.length = output.length;
+                jpegarchive_recompress_output_t again = jpegarchive_recompress(input);
+                if (again.error_code != JPEGARCHIVE_NOT_SUITABLE) {
+                    printf("  ERROR: Recompressing the output of %s returned error code %d\n", test_files[i], again.error_code);
+                    total_errors++;
+                }
+                jpegarchive_free_recompress_output(&again);
+            }
+            jpegarchive_free_recompress_output(&output);
+
+            // A minimum above the source's quality leaves nothing to search
+            if (source_quality + 5 < 100) {
+                input.jpeg = input_buffer;
+                input.length = input_size;
+                input.min = source_quality + 6;
+                input.max = 100;
+                output = jpegarchive_recompress(input);
+                if (output.error_code != JPEGARCHIVE_NOT_SUITABLE) {
+                    printf("  ERROR: Minimum quality %d returned error code %d for %s\n", input.min, output.error_code, test_files[i]);
+                    total_errors++;
+                }
+                jpegarchive_free_recompress_output(&output);
+            }
+            free(input_buffer);
+        }
+
+        jpegarchive_probe_output_t probe = jpegarchive_probe((const unsigned char *)"P6\n1 1\n255\n", 11);
+        if (probe.error_code != JPEGARCHIVE_NOT_JPEG) {
+            printf("  ERROR: Probe returned error code %d for a PPM\n", probe.error_code);
+            total_errors++;
+        }
+        if (total_errors == probe_errors) {
+            printf("  OK: Probed %d files\n", num_files);
+        }
+    }
+
+    printf("\n=== Testing jpegarchive_cache ===\n");
+    {
+        // Entries may be left from earlier runs, so only the second round is
+        // known to hit; every answer must match an uncached recompression
+        const char *cache_paths[2] = { "test-output/cache-quality", "test-output/cache-outputs" };
+        int cache_errors = total_errors;
+        jpegarchive_context_t *ctx = jpegarchive_context_create(JPEGARCHIVE_CONTEXT_DEFAULT);
+
+        for (int mode = 0; mode < 2; mode++) {
+            jpegarchive_cache_t *cache = jpegarchive_cache_open(cache_paths[mode], mode ? JPEGARCHIVE_CACHE_OUTPUTS : JPEGARCHIVE_CACHE_DEFAULT);
+            if (!cache) {
+                printf("  ERROR: Could not open cache %s\n", cache_paths[mode]);
+                total_errors++;
+                continue;
+            }
+
+            for (int round = 0; round < 2; round++) {
+                for (int i = 0; i < num_files; i++) {
+                    unsigned char *input_buffer;
+                    long input_size = read_file(test_files[i], &input_buffer);
+                    if (!input_size) {
+                        continue;
+                    }
+                    jpegarchive_recompress_input_t input = {
+                        .jpeg = input_buffer,
+                        .length = input_size,
+                        .min = 40,
+                        .max = 95,
+                        .loops = 6,
+                        .quality = JPEGARCHIVE_QUALITY_MEDIUM,
+                        .method = JPEGARCHIVE_METHOD_SSIM,
+                        .target = 0
+                    };
+                    jpegarchive_recompress_output_t expected = jpegarchive_recompress(input);
+                    input.cache = cache;
+                    jpegarchive_recompress_output_t cached = jpegarchive_recompress_ctx(ctx, input);
+
+                    if (cached.error_code != expected.error_code) {
+                        printf("  ERROR: Cache returned error code %d, expected %d for %s\n",
+                               cached.error_code, expected.error_code, test_files[i]);
+                        total_errors++;
+                    } else if (cached.error_code == JPEGARCHIVE_OK &&
+                               (cached.length != expected.length || cached.quality != expected.quality ||
+                                memcmp(cached.jpeg, expected.jpeg, cached.length) != 0)) {
+                        printf("  ERROR: Cached output differs for %s\n", test_files[i]);
+                        total_errors++;
+                    }
+                    jpegarchive_free_recompress_output(&expected);
+                    jpegarchive_free_recompress_output(&cached);
+                    free(input_buffer);
+                }
+            }
+
+            if (jpegarchive_cache_hits(cache) < num_files) {
+                printf("  ERROR: Only %lld of %d repeated inputs hit %s\n",
+                       (long long)jpegarchive_cache_hits(cache), num_files, cache_paths[mode]);
+                total_errors++;
+            }
+            jpegarchive_cache_close(cache);
+        }
+        jpegarchive_context_destroy(ctx);
+
+        if (total_errors == cache_errors) {
+            printf("  OK: Cached results match jpegarchive_recompress for %d files\n", num_files);
+        }
+    }
+
     printf("\n=== Testing jpegarchive_compare ===\n");
     for (int i = 0; i < num_files && i < 3; i++) {
         unsigned char *input_buffer;
@@ -1,9 +1,75 @@
 #include "../src/edit.h"
 #include "../src/hash.h"
+#include "../src/search.h"
 #include "../src/util.h"
 
 #include "../src/test/describe.h"
 
+static float linearSimilarity(int quality) {
+    return quality / 100.0f;
+}
+
+static float linearError(int quality) {
+    return (100 - quality) / 10.0f;
+}
+
+static float stepSimilarity(int quality) {
+    return quality >= 77 ? 1.0f : 0.0f;
+}
+
+/* Run a quality search against a metric curve and return the answer. */
+static int runSearch(struct qualitySearch *search, float (*curve)(int), int *steps) {
+    int quality;
+
+    *steps = 0;
+    while ((quality = qualitySearchNext(search)) && *steps < 100) {
+        assert_ok(quality >= search->min && quality < search->max);
+        qualitySearchUpdate(search, quality, curve(quality));
+        (*steps)++;
+    }
+    return search->max;
+}
+
+/* Append a marker segment with the given payload. */
+static unsigned long putSegment(unsigned char *buf, unsigned long pos, int marker, const unsigned char *data, int size) {
+    buf[pos] = 0xff;
+    buf[pos + 1] = marker;
+    buf[pos + 2] = (size + 2) >> 8;
+    buf[pos + 3] = (size + 2) & 0xff;
+    memcpy(buf + pos + 4, data, size);
+    return pos + 4 + size;
+}
+
+/*
+    A JPEG header with a 16x8 4:2:0 frame, an 8-bit and a 16-bit
+    quantization table, one DC Huffman table, 'comments' COM segments and a
+    final comment, up to and including SOS.
+*/
+static unsigned long buildHeader(unsigned char *buf, int comments, const char *comment) {
+    static const unsigned char exif[] = "Exif\0\0test";
+    static const unsigned char frame[] = { 8, 0, 8, 0, 16, 3, 1, 0x22, 0, 2, 0x11, 1, 3, 0x11, 1 };
+    static const unsigned char huffman[] = { 0x00, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 5 };
+    static const unsigned char scan[] = { 1, 1, 0, 0, 63, 0 };
+    unsigned char quant[1 + 64 + 1 + 128];
+    unsigned long pos = 2;
+
+    buf[0] = 0xff;
+    buf[1] = 0xd8;
+    pos = putSegment(buf, pos, 0xe1, exif, sizeof(exif) - 1);
+    for (int i = 0; i < 65; i++)
+        quant[i] = i;
+    quant[65] = 0x11;
+    for (int i = 0; i < 128; i++)
+        quant[66 + i] = (i % 2) ? i : 1;
+    pos = putSegment(buf, pos, 0xdb, quant, sizeof(quant));
+    pos = putSegment(buf, pos, 0xc0, frame, sizeof(frame));
+    pos = putSegment(buf, pos, 0xc4, huffman, sizeof(huffman));
+    for (int i = 0; i < comments; i++)
+        pos = putSegment(buf, pos, 0xfe, (const unsigned char *) "note", 4);
+    pos = putSegment(buf, pos, 0xfe, (const unsigned char *) comment, strlen(comment));
+    return putSegment(buf, pos, 0xda, scan, sizeof(scan));
+}
+
 describe ("Unit Tests", {
     it ("Should clamp values", {
         assert_equal_float(0.0, clamp(0.0, -10.0, 100.0));
@@ -59,6 +125,155 @@ describe ("Unit Tests", {
         free(image);
     });
 
+    it ("Should downscale an image", {
+        unsigned char image[15];
+        unsigned char scaled[6];
+
+        /*
+        [  0  1  2  3  4
+           5  6  7  8  9
+          10 11 12 13 14 ]
+        */
+        for (int x = 0; x < 15; x++) {
+            image[x] = (unsigned char) x;
+        }
+
+        /*
+        [  3  5  7
+          11 13 14 ]
+        */
+        downscale(image, scaled, 5, 3, 2);
+
+        assert_equal(3, scaled[0]);
+        assert_equal(7, scaled[2]);
+        assert_equal(11, scaled[3]);
+    });
+
+    it ("Should convert RGB to grayscale", {
+        unsigned char rgb[12];
+        unsigned char gray[4];
+
+        // White, pure red, gray and blue
+        memset(rgb, 0, sizeof(rgb));
+        rgb[0] = rgb[1] = rgb[2] = 255;
+        rgb[3] = 255;
+        rgb[6] = rgb[7] = rgb[8] = 77;
+        rgb[11] = 255;
+
+        grayscaleInto(rgb, gray, 2, 2);
+
+        assert_equal(255, gray[0]);
+        assert_equal(76, gray[1]);
+        assert_equal(77, gray[2]);
+        assert_equal(29, gray[3]);
+    });
+
+    it ("Should convert colors like the scalar formulas", {
+        // An odd length, so the vector loops and their tails both run
+        int count = 1031;
+        unsigned char *input = malloc(count * 3);
+        unsigned char *rgb = malloc(count * 3);
+        unsigned char *gray = malloc(count);
+        unsigned char *luma = malloc(count);
+        unsigned int seed = 1;
+        int grayMismatches = 0;
+        int rgbMismatches = 0;
+
+        for (int i = 0; i < count * 3; i++) {
+            seed = seed * 1103515245 + 12345;
+            input[i] = i < 6 ? (i < 3 ? 0 : 255) : seed >> 24;
+        }
+
+        grayscaleInto(input, gray, count, 1);
+        yccToRgb(input, rgb, luma, count);
+
+        for (int i = 0; i < count; i++) {
+            int y = input[i * 3];
+            int cb = input[i * 3 + 1] - 128;
+            int cr = input[i * 3 + 2] - 128;
+            int r = MIN(255, MAX(0, y + ((91881 * cr + 32768) >> 16)));
+            int g = MIN(255, MAX(0, y + ((-22554 * cb - 46802 * cr + 32768) >> 16)));
+            int b = MIN(255, MAX(0, y + ((116130 * cb + 32768) >> 16)));
+
+            grayMismatches += gray[i] != ((input[i * 3] * 19595 + input[i * 3 + 1] * 38470 + input[i * 3 + 2] * 7471 + 32768) >> 16);
+            rgbMismatches += luma[i] != y || rgb[i * 3] != r || rgb[i * 3 + 1] != g || rgb[i * 3 + 2] != b;
+        }
+
+        assert_equal(0, grayMismatches);
+        assert_equal(0, rgbMismatches);
+
+        free(input);
+        free(rgb);
+        free(gray);
+        free(luma);
+    });
+
+    it ("Should decode the luma in the same pass", {
+        unsigned char *image = malloc(48 * 32 * 3);
+        unsigned char *jpeg = NULL;
+        unsigned char *rgb;
+        unsigned char *gray;
+        unsigned char *oneRgb;
+        unsigned char *oneGray;
+        unsigned long size;
+        int width;
+        int height;
+
+        for (int i = 0; i < 48 * 32 * 3; i++)
+            image[i] = (i * 13 + i / 144 * 7) & 255;
+        size = encodeJpeg(&jpeg, image, 48, 32, JCS_RGB, 80, 0, 0, SUBSAMPLE_DEFAULT);
+
+        decodeJpeg(jpeg, size, &rgb, &width, &height, JCS_RGB);
+        decodeJpeg(jpeg, size, &gray, &width, &height, JCS_GRAYSCALE);
+        assert_ok(decodeJpegLuma(jpeg, size, &oneRgb, &oneGray, &width, &height) == 48 * 32 * 3);
+
+        // The RGB of a plain decode, and the Y the candidates are compared by
+        assert_equal(0, memcmp(rgb, oneRgb, 48 * 32 * 3));
+        assert_equal(0, memcmp(gray, oneGray, 48 * 32));
+
+        free(image);
+        free(jpeg);
+        free(rgb);
+        free(gray);
+        free(oneRgb);
+        free(oneGray);
+    });
+
+    it ("Should encode cached DCT blocks like the pixels", {
+        unsigned char *gray = malloc(37 * 21);
+        struct codec codec;
+
+        for (int i = 0; i < 37 * 21; i++)
+            gray[i] = (i * 29 + i / 37 * 11) & 255;
+        codecInit(&codec);
+
+        // Partial blocks at both edges, whole blocks, and a single pixel
+        for (int s = 0; s < 3; s++) {
+            int width = (s == 0) ? 37 : ((s == 1) ? 16 : 1);
+            int height = (s == 0) ? 21 : ((s == 1) ? 8 : 1);
+            struct dctImage dct;
+            assert_equal(1, dctImageInit(&dct, gray, width, height));
+
+            for (int quality = 5; quality <= 100; quality += 19) {
+                for (int progressive = 0; progressive < 2; progressive++) {
+                    unsigned char *pixels = NULL;
+                    unsigned char *cached = NULL;
+                    unsigned long pixelsSize = codecEncodeJpeg(&codec, &pixels, gray, width, height, JCS_GRAYSCALE, quality, progressive, 0, SUBSAMPLE_DEFAULT);
+                    unsigned long cachedSize = codecEncodeDct(&codec, &cached, &dct, quality, progressive, 0);
+
+                    assert_ok(pixelsSize == cachedSize);
+                    assert_equal(0, memcmp(pixels, cached, pixelsSize));
+                    free(pixels);
+                    free(cached);
+                }
+            }
+            dctImageFree(&dct);
+        }
+
+        codecFree(&codec);
+        free(gray);
+    });
+
     it ("Should generate an image hash", {
         unsigned char *image;
         unsigned char *hash;
@@ -93,6 +308,190 @@ describe ("Unit Tests", {
         assert_equal(2, dist);
     });
 
+    it ("Should interpolate the quality search", {
+        struct qualitySearch search;
+        int steps;
+
+        // Bisection needs six steps for this range
+        qualitySearchInit(&search, 40, 95, 0.615, 0);
+        assert_equal(62, runSearch(&search, linearSimilarity, &steps));
+        assert_equal(3, steps);
+
+        // Lower is better for error metrics like MPE
+        qualitySearchInit(&search, 40, 95, 3.05, 1);
+        assert_equal(70, runSearch(&search, linearError, &steps));
+        assert_ok(steps <= 3);
+
+        // No quality meets the target
+        qualitySearchInit(&search, 40, 95, 2.0, 0);
+        assert_equal(95, runSearch(&search, linearSimilarity, &steps));
+    });
+
+    it ("Should fall back to bisection in the quality search", {
+        struct qualitySearch search;
+        int steps;
+
+        qualitySearchInit(&search, 40, 95, 0.5, 0);
+        assert_equal(77, runSearch(&search, stepSimilarity, &steps));
+        assert_ok(steps <= 8);
+    });
+
+    it ("Should pick a proxy for the quality search", {
+        // Short side kept at PROXY_MIN_SIZE or more
+        assert_equal(4, proxyFactor(6000, 4000, 4, 6));
+        assert_equal(2, proxyFactor(1600, 600, 8, 6));
+        assert_equal(1, proxyFactor(480, 360, 2, 6));
+
+        // No proxy step left between calibration and the full size steps
+        assert_equal(1, proxyFactor(6000, 4000, 4, 3));
+
+        // Same SSIM resolution as the full image (scale 16)
+        assert_equal(4, proxySsimScale(6000, 4000, 4));
+
+        // Loss at the target scaled like the measured losses
+        float calibrated = proxyTarget(0.999, 0.998, 0.98);
+        assert_ok(calibrated > 0.9899 && calibrated < 0.9901);
+    });
+
+    it ("Should pick representative tiles", {
+        int width = 256;
+        int height = 128;
+        unsigned char *gray = malloc(width * height);
+        unsigned char mosaic[64 * 64 * 2];
+        struct tile tiles[8];
+
+        // Activity grows from left to right: flat, then stripes of
+        // increasing contrast
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++)
+                gray[y * width + x] = 128 + ((x / 64) * 30) * ((x & 1) ? 1 : -1);
+        }
+
+        // MCU aligned, and a multiple of the SSIM scale in 16 pixel units
+        assert_equal(64, tileSize(480, 360));
+        assert_equal(96, tileSize(1024, 768));
+        assert_equal(256, tileSize(6000, 4000));
+
+        // One tile from each half of the variance order, in raster order
+        assert_equal(2, tileSample(gray, width, height, 64, 2, tiles));
+        assert_equal(64, tiles[0].x);
+        assert_equal(0, tiles[0].y);
+        assert_equal(192, tiles[1].x);
+        assert_equal(0, tiles[1].y);
+
+        tileMosaic(gray, width, tiles, 2, 64, mosaic);
+        assert_equal(gray[64], mosaic[0]);
+        assert_equal(gray[63 * width + 192 + 63], mosaic[127 * 64 + 63]);
+
+        // No more tiles than the grid has
+        assert_equal(8, tileSample(gray, width, height, 64, 20, tiles));
+
+        free(gray);
+    });
+
+    it ("Should map a file", {
+        struct inputFile file;
+        unsigned char *buf;
+        long size = readFile("test-files/skate.jpg", (void **) &buf);
+
+        assert_ok(size == mapFile("test-files/skate.jpg", &file));
+        assert_equal(1, file.mapped);
+        assert_equal(0, memcmp(buf, file.data, size));
+        unmapFile(&file);
+        assert_ok(file.data == NULL);
+
+        assert_equal(FILETYPE_JPEG, detectFiletype("test-files/skate.jpg"));
+        assert_equal(FILETYPE_UNKNOWN, detectFiletype("test.c"));
+        assert_ok(isSameFile("test-files/skate.jpg", "./test-files/skate.jpg"));
+
+        free(buf);
+    });
+
+    it ("Should index JPEG markers", {
+        unsigned char *buf = malloc(4096);
+        unsigned char *meta = malloc(4096);
+        struct jpegMarkers markers;
+        unsigned long size = buildHeader(buf, 2, "Hello");
+
+        assert_equal(1, indexMarkers(buf, size, "Compressed by", &markers));
+        assert_equal(0, markers.processed);
+        assert_equal(0xc0, markers.frameMarker);
+        assert_equal(16, markers.width);
+        assert_equal(8, markers.height);
+        assert_equal(3, markers.components);
+        assert_equal(2, markers.component[0].h);
+        assert_equal(2, markers.component[0].v);
+        assert_equal(1, markers.component[2].quantTable);
+        assert_equal(1, markers.quant[0].present);
+        assert_equal(63, markers.quant[0].values[62]);
+        assert_equal(257, markers.quant[1].values[0]);
+        assert_equal(0, markers.quant[2].present);
+        assert_equal(1, markers.huffman[0][0]);
+        assert_equal(0, markers.huffman[1][0]);
+        assert_ok(markers.scanOffset == size - 10);
+        assert_equal(0xda, markers.segments[markers.count - 1].marker);
+
+        // Exif and three comments
+        assert_ok(copyMarkerMetadata(&markers, buf, NULL) == 14 + 3 * 8 + 1);
+        freeMarkers(&markers);
+
+        // The comment is found behind more segments than the old cap of 20
+        size = buildHeader(buf, 30, "Compressed by jpeg-recompress");
+        assert_equal(1, indexMarkers(buf, size, "Compressed by", &markers));
+        assert_equal(1, markers.processed);
+        freeMarkers(&markers);
+
+        unsigned int metaSize;
+        assert_equal(1, getMetadata(buf, size, &meta, &metaSize, "Compressed by"));
+        assert_equal(0, metaSize);
+
+        // A header cut off in a segment keeps the segments before it
+        assert_equal(1, indexMarkers(buf, 200, NULL, &markers));
+        assert_equal(2, markers.count);
+        assert_equal(0, markers.quant[0].present);
+        assert_equal(0, markers.frameMarker);
+        freeMarkers(&markers);
+
+        assert_equal(0, indexMarkers((unsigned char *) "P6", 2, NULL, &markers));
+
+        free(buf);
+        free(meta);
+    });
+
+    it ("Should estimate the source quality", {
+        unsigned char *image = malloc(32 * 32 * 3);
+        unsigned char *jpeg = NULL;
+        unsigned long size;
+        struct jpegMarkers markers;
+        int max = 95;
+
+        for (int i = 0; i < 32 * 32 * 3; i++)
+            image[i] = (i * 7) & 255;
+
+        for (int quality = 20; quality <= 100; quality += 20) {
+            size = encodeJpeg(&jpeg, image, 32, 32, JCS_RGB, quality, 0, 0, SUBSAMPLE_DEFAULT);
+            assert_equal(1, indexMarkers(jpeg, size, NULL, &markers));
+            assert_equal(quality, estimateQuality(&markers));
+            freeMarkers(&markers);
+            free(jpeg);
+            jpeg = NULL;
+        }
+
+        // Without tables there is no estimate
+        memset(&markers, 0, sizeof(markers));
+        assert_equal(0, estimateQuality(&markers));
+
+        assert_equal(1, clampToSource(40, &max, 0));
+        assert_equal(95, max);
+        assert_equal(1, clampToSource(40, &max, 70));
+        assert_equal(70 + SOURCE_QUALITY_MARGIN, max);
+        assert_equal(1, clampToSource(40, &max, 40 - SOURCE_QUALITY_MARGIN));
+        assert_equal(40, max);
+        assert_equal(0, clampToSource(40, &max, 30));
+
+        free(image);
+    });
+
     it ("Should decode a PPM", {
         char *image = "P6\n2 2\n255\n\x1\x2\x3\x4\x5\x6\x7\x8\x9\xa\xb\xc";
         unsigned char *imageData;
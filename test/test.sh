@@ -56,6 +56,26 @@ for file in test-files/*; do
     esac
 done
 
+# Run jpeg-archive tests
+echo ""
+echo "=== Running jpeg-archive tests ==="
+
+JPEG_ARCHIVE="../jpeg-archive"
+if [ -f "../jpeg-archive.exe" ]; then
+    JPEG_ARCHIVE="../jpeg-archive.exe"
+fi
+
+rm -rf test-output/archive
+"$JPEG_ARCHIVE" -j 2 test-files test-output/archive
+
+# Every JPEG in the tree gets an output at the same relative path
+for file in test-files/*.jpg; do
+    if [ ! -s "test-output/archive/$(basename "$file")" ]; then
+        echo "ERROR: jpeg-archive did not write $file"
+        exit 1
+    fi
+done
+
 # Run libjpegarchive tests
 echo ""
 echo "=== Running libjpegarchive tests ==="